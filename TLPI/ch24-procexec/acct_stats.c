@@ -0,0 +1,412 @@
+/*************************************************************************\
+*                  Copyright (C) Michael Kerrisk, 2020.                   *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU General Public License as published by the   *
+* Free Software Foundation, either version 3 or (at your option) any      *
+* later version. This program is distributed without any warranty.  See   *
+* the file COPYING.gpl-v3 for details.                                    *
+\*************************************************************************/
+
+/* Supplementary program for Chapter 28 */
+
+/* acct_stats.c
+
+   Summarize a (possibly very large) process accounting file: the number
+   of processes and the CPU time that they used, in total, per user (-u),
+   and per command (-c), optionally only for processes that started in a
+   given time window (-s and -e). With -l, the matching records are
+   listed instead, in the manner of acct_view.c.
+
+   Where acct_view.c and acct_v3_view.c read() one record at a time, and
+   look up the user name and format the time for every record, this
+   program maps the file with rmOpen() (see rec_map.c), scans it with
+   'nthreads' threads (-j), each of which accumulates its own totals, and
+   looks up user names only for the totals that it prints. With -i, a
+   time index is kept in the file 'file.idx', so that a scan of a time
+   window reads only the parts of the file that can hold records in that
+   window. With -R, the file is instead read with read(), one record at a
+   time, as acct_view.c does, for comparison. The per-user and
+   per-command totals are kept in rmTable hash tables (also from
+   rec_map.c).
+
+   Both the Version 2 (struct acct) and Version 3 (struct acct_v3)
+   formats are understood; the format is determined from the 'ac_version'
+   field of the first record.
+
+   The time taken, and the number of records scanned per second, are
+   written to stderr.
+
+   This program is Linux-specific.
+*/
+#define _GNU_SOURCE
+#include <sys/acct.h>
+#include <fcntl.h>
+#include <time.h>
+#include "curr_time.h"                  /* Declaration of timeNow() */
+#include "rec_map.h"
+#include "ugid_functions.h"             /* Declaration of userNameFromId() */
+#include "tlpi_hdr.h"
+
+#define TIME_BUF_SIZE 100
+
+struct threadAgg {              /* Totals accumulated by one thread */
+    struct rmTable users;       /* Keyed by UID; 'sum' is CPU ticks */
+    struct rmTable cmds;        /* Keyed by command name; likewise */
+    long long count;
+    long long ticks;
+    char pad[64];               /* Keep threads' totals in separate
+                                   cache lines */
+};
+
+static int v3;                  /* Is the file in Version 3 format? */
+static int byUser, byCmd;
+
+static long long                /* Convert comp_t value into long long */
+comptToLL(comp_t ct)
+{
+    const int EXP_SIZE = 3;             /* 3-bit, base-8 exponent */
+    const int MANTISSA_SIZE = 13;       /* Followed by 13-bit mantissa */
+    const int MANTISSA_MASK = (1 << MANTISSA_SIZE) - 1;
+    long long mantissa, exp;
+
+    mantissa = ct & MANTISSA_MASK;
+    exp = (ct >> MANTISSA_SIZE) & ((1 << EXP_SIZE) - 1);
+    return mantissa << (exp * 3);       /* Power of 8 = left shift 3 bits */
+}
+
+/* Fields of a record, in either format */
+
+static long long
+startTime(const void *rec)
+{
+    return v3 ? ((const struct acct_v3 *) rec)->ac_btime :
+                ((const struct acct *) rec)->ac_btime;
+}
+
+static uid_t
+recUid(const void *rec)
+{
+    return v3 ? ((const struct acct_v3 *) rec)->ac_uid :
+                ((const struct acct *) rec)->ac_uid;
+}
+
+static const char *
+recComm(const void *rec)
+{
+    return v3 ? ((const struct acct_v3 *) rec)->ac_comm :
+                ((const struct acct *) rec)->ac_comm;
+}
+
+static long long
+recTicks(const void *rec)
+{
+    if (v3)
+        return comptToLL(((const struct acct_v3 *) rec)->ac_utime) +
+               comptToLL(((const struct acct_v3 *) rec)->ac_stime);
+    else
+        return comptToLL(((const struct acct *) rec)->ac_utime) +
+               comptToLL(((const struct acct *) rec)->ac_stime);
+}
+
+/* ---------------------------------------------------------------- */
+/* Accumulating totals */
+
+/* Add record 'rec' to the totals of thread 'thread' (an rmRecordFunc) */
+
+static void
+addRecord(const void *rec, int thread, void *arg)
+{
+    struct threadAgg *ta = (struct threadAgg *) arg + thread;
+    struct rmEntry *e;
+    long long ticks;
+    uid_t uid;
+    const char *comm;
+
+    ticks = recTicks(rec);
+    ta->count++;
+    ta->ticks += ticks;
+
+    if (byUser) {
+        uid = recUid(rec);
+        e = rmTableFind(&ta->users, &uid, sizeof(uid));
+        if (e == NULL)
+            errExit("rmTableFind");
+        e->count++;
+        e->sum += ticks;
+    }
+    if (byCmd) {
+        comm = recComm(rec);            /* Not necessarily terminated */
+        e = rmTableFind(&ta->cmds, comm, strnlen(comm, ACCT_COMM));
+        if (e == NULL)
+            errExit("rmTableFind");
+        e->count++;
+        e->sum += ticks;
+    }
+}
+
+/* ---------------------------------------------------------------- */
+/* Output */
+
+static int
+cmpTicks(const void *a, const void *b)
+{
+    const struct rmEntry *e1 = a, *e2 = b;
+
+    return (e2->sum > e1->sum) - (e2->sum < e1->sum);
+}
+
+static int
+cmpCount(const void *a, const void *b)
+{
+    const struct rmEntry *e1 = a, *e2 = b;
+
+    return (e2->count > e1->count) - (e2->count < e1->count);
+}
+
+/* Print up to 'max' entries of 't', sorted with 'cmp' */
+
+static void
+printTable(struct rmTable *t, int isUser, int max,
+           int (*cmp)(const void *, const void *))
+{
+    size_t n, j;
+    uid_t uid;
+    char *s;
+    long clk = sysconf(_SC_CLK_TCK);
+
+    n = rmTableSort(t, cmp);
+
+    printf("%-16s %10s %12s\n", isUser ? "user" : "command", "procs",
+           "CPU secs");
+    for (j = 0; j < n && (max == 0 || j < (size_t) max); j++) {
+        if (isUser) {
+            memcpy(&uid, t->ents[j].key, sizeof(uid));
+            s = userNameFromId(uid);
+            if (s == NULL)
+                printf("%-16ld ", (long) uid);
+            else
+                printf("%-16.16s ", s);
+        } else {
+            printf("%-16.16s ", t->ents[j].key);
+        }
+        printf("%10lld %12.2f\n", t->ents[j].count,
+               (double) t->ents[j].sum / clk);
+    }
+    if (j < n)
+        printf("(%zu more)\n", n - j);
+}
+
+/* List record 'rec' (an rmRecordFunc, used with a single thread) */
+
+static void
+listRecord(const void *rec, int thread, void *arg)
+{
+    static uid_t lastUid = (uid_t) -1;
+    static char lastName[32];
+    static time_t lastTime = -1;
+    static char timeBuf[TIME_BUF_SIZE];
+    struct tm *loc;
+    time_t t;
+    uid_t uid;
+    char *s;
+    long clk = sysconf(_SC_CLK_TCK);
+
+    /* Consecutive records often have the same user, and the same start
+       time, so remember the last name and time that we formatted */
+
+    uid = recUid(rec);
+    if (uid != lastUid) {
+        s = userNameFromId(uid);
+        if (s == NULL)
+            snprintf(lastName, sizeof(lastName), "%ld", (long) uid);
+        else
+            snprintf(lastName, sizeof(lastName), "%s", s);
+        lastUid = uid;
+    }
+
+    t = startTime(rec);
+    if (t != lastTime) {
+        loc = localtime(&t);
+        if (loc == NULL)
+            snprintf(timeBuf, TIME_BUF_SIZE, "???Unknown time???");
+        else
+            strftime(timeBuf, TIME_BUF_SIZE, "%Y-%m-%d %T", loc);
+        lastTime = t;
+    }
+
+    printf("%-16.16s %-8.8s %s %8.2f\n", recComm(rec), lastName, timeBuf,
+           (double) recTicks(rec) / clk);
+}
+
+/* ---------------------------------------------------------------- */
+
+/* Read the file with read(), as acct_view.c does, adding each record in
+   [tmin, tmax] with 'fn'. Returns the number of records read. */
+
+static long long
+readScan(const char *path, long long tmin, long long tmax,
+         rmRecordFunc fn, void *arg)
+{
+    struct acct_v3 ac;                  /* Same size as struct acct */
+    ssize_t numRead;
+    long long nrecs;
+    int fd;
+    long long t;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        errExit("open");
+
+    nrecs = 0;
+    while ((numRead = read(fd, &ac, sizeof(ac))) == sizeof(ac)) {
+        nrecs++;
+        t = startTime(&ac);
+        if (t >= tmin && t <= tmax)
+            fn(&ac, 0, arg);
+    }
+    if (numRead == -1)
+        errExit("read");
+
+    close(fd);
+    return nrecs;
+}
+
+static void
+usageError(const char *progName, const char *msg)
+{
+    if (msg != NULL)
+        fprintf(stderr, "%s\n", msg);
+    fprintf(stderr, "Usage: %s [-u] [-c] [-l] [-s start] [-e end] "
+            "[-j nthreads] [-i] [-n num] [-R] file\n", progName);
+    fprintf(stderr, "\t-u Show totals per user\n");
+    fprintf(stderr, "\t-c Show totals per command\n");
+    fprintf(stderr, "\t-l List the records, rather than totals\n");
+    fputs(RM_USAGE_OPTIONS, stderr);
+    fprintf(stderr, "\t   (a record's time is when its process started)\n");
+    fprintf(stderr, "\t-n Show at most 'num' users or commands "
+            "(default: 20; 0 means all)\n");
+    fprintf(stderr, "\t-R Read the file with read(), for comparison\n");
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct recMap *rm;
+    struct threadAgg *aggs, total;
+    struct rmStats stats;
+    long long tmin, tmax, nrecs;
+    int opt, nthreads, useIndex, list, useRead, max;
+    const char *path;
+    char *idxPath;
+    double elapsed;
+
+    tmin = RM_TIME_MIN;
+    tmax = RM_TIME_MAX;
+    nthreads = 1;
+    useIndex = list = useRead = 0;
+    max = 20;
+
+    while ((opt = getopt(argc, argv, "ucls:e:j:in:R")) != -1) {
+        switch (opt) {
+        case 'u': byUser = 1;                                   break;
+        case 'c': byCmd = 1;                                    break;
+        case 'l': list = 1;                                     break;
+        case 's':
+            if (rmParseTime(optarg, &tmin) == -1)
+                cmdLineErr("start: bad time: %s\n", optarg);
+            break;
+        case 'e':
+            if (rmParseTime(optarg, &tmax) == -1)
+                cmdLineErr("end: bad time: %s\n", optarg);
+            break;
+        case 'j': nthreads = getInt(optarg, GN_NONNEG, "nthreads"); break;
+        case 'i': useIndex = 1;                                 break;
+        case 'n': max = getInt(optarg, GN_NONNEG, "num");       break;
+        case 'R': useRead = 1;                                  break;
+        default:  usageError(argv[0], NULL);
+        }
+    }
+
+    if (optind != argc - 1)
+        usageError(argv[0], "Missing file argument");
+    path = argv[optind];
+
+    rm = rmOpen(path, sizeof(struct acct), startTime);
+    if (rm == NULL)
+        errExit("rmOpen: %s", path);
+
+    /* All records in a file have the same format; the low 4 bits of the
+       second byte hold the version (the top bit marks the byte order) */
+
+    if (rmCount(rm) > 0)
+        v3 = (((const char *) rmRecord(rm, 0))[1] & 0x0f) == 3;
+
+    if (useIndex && !useRead) {
+        if (asprintf(&idxPath, "%s.idx", path) == -1)
+            fatal("asprintf");
+        if (rmIndex(rm, idxPath, 0) == -1)
+            errMsg("rmIndex: %s", idxPath);     /* Carry on regardless */
+        free(idxPath);
+    }
+
+    if (list) {
+        if (useRead)
+            readScan(path, tmin, tmax, listRecord, NULL);
+        else if (rmScan(rm, tmin, tmax, 1, listRecord, NULL, NULL) == -1)
+            errExit("rmScan");
+        rmClose(rm);
+        exit(EXIT_SUCCESS);
+    }
+
+    if (nthreads == 0 || useRead)
+        nthreads = useRead ? 1 : sysconf(_SC_NPROCESSORS_ONLN);
+
+    aggs = calloc(nthreads, sizeof(struct threadAgg));
+    if (aggs == NULL)
+        errExit("calloc");
+
+    memset(&stats, 0, sizeof(stats));
+    elapsed = timeNow();
+    if (useRead) {
+        nrecs = readScan(path, tmin, tmax, addRecord, aggs);
+    } else {
+        if (rmScan(rm, tmin, tmax, nthreads, addRecord, aggs, &stats) == -1)
+            errExit("rmScan");
+        nrecs = stats.examined;
+    }
+
+    /* Merge the threads' totals */
+
+    memset(&total, 0, sizeof(total));
+    for (int j = 0; j < nthreads; j++) {
+        total.count += aggs[j].count;
+        total.ticks += aggs[j].ticks;
+        if (rmTableMerge(&total.users, &aggs[j].users) == -1 ||
+                rmTableMerge(&total.cmds, &aggs[j].cmds) == -1)
+            errExit("rmTableMerge");
+    }
+    elapsed = timeNow() - elapsed;
+
+    printf("%lld processes, %.2f CPU secs\n", total.count,
+           (double) total.ticks / sysconf(_SC_CLK_TCK));
+    if (byUser) {
+        printf("\n");
+        printTable(&total.users, 1, max, cmpTicks);
+    }
+    if (byCmd) {
+        printf("\n");
+        printTable(&total.cmds, 0, max, cmpCount);
+    }
+
+    fprintf(stderr, "%lld records scanned in %.3f secs (%.0f records/sec)",
+            nrecs, elapsed, (elapsed > 0) ? nrecs / elapsed : 0.0);
+    if (!useRead && stats.blocksSkipped > 0)
+        fprintf(stderr, "; %ld of %ld blocks skipped by index",
+                stats.blocksSkipped, stats.blocksSkipped + stats.blocksRead);
+    fprintf(stderr, "\n");
+
+    rmClose(rm);
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,207 @@
+/*************************************************************************\
+*                  Copyright (C) Michael Kerrisk, 2020.                   *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU General Public License as published by the   *
+* Free Software Foundation, either version 3 or (at your option) any      *
+* later version. This program is distributed without any warranty.  See   *
+* the file COPYING.gpl-v3 for details.                                    *
+\*************************************************************************/
+
+/* Supplementary program for Chapter 29 */
+
+/* prnts_bench.cpp
+
+   Measure PrnTs() with several threads logging at once, in the default
+   (sync) mode and in async mode (PrnTs_start_async()).
+
+   Usage: prnts_bench [-t max-threads] [-n calls] [-o file]
+
+   For 1, 2, 4, ... up to max-threads (default: 8) threads, each thread
+   calls PrnTs() 'calls' times (default: 200000). The output goes to 'file'
+   (default: /dev/null). For each run, we show the calls per second (as
+   seen by the callers), the mean and 99th percentile time per call
+   (sampled every 16th call), and, for async mode, the time that
+   PrnTs_stop_async() then took to write out what was still queued.
+*/
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include "tlpi_hdr.h"
+#include "PrnTs.h"
+
+#define SAMPLE_EVERY 16
+
+struct ThreadArg
+{
+    pthread_t tid;
+    int num;
+    long long *samples; // sampled call times (ns)
+    int nsamples;
+};
+
+static int g_calls = 200000;
+static pthread_barrier_t g_barrier;
+
+static long long
+nsNow()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void*
+threadFunc(void* arg)
+{
+    ThreadArg *ta = (ThreadArg*)arg;
+
+    int err = pthread_barrier_wait(&g_barrier);
+    if (err != 0 && err != PTHREAD_BARRIER_SERIAL_THREAD)
+        errExitEN(err, "pthread_barrier_wait");
+
+    for (int j = 0; j < g_calls; j++)
+    {
+        if (j % SAMPLE_EVERY == 0)
+        {
+            long long t0 = nsNow();
+            PrnTs("thread %d: message %d, value %f", ta->num, j, j * 0.5);
+            ta->samples[ta->nsamples++] = nsNow() - t0;
+        }
+        else
+        {
+            PrnTs("thread %d: message %d, value %f", ta->num, j, j * 0.5);
+        }
+    }
+    return nullptr;
+}
+
+static int
+cmpLongLong(const void *a, const void *b)
+{
+    long long x = *(const long long*)a, y = *(const long long*)b;
+    return (x > y) - (x < y);
+}
+
+static void
+runOne(bool async, int nthreads, int outFd, int resultFd)
+{
+    ThreadArg *ta = (ThreadArg*)calloc(nthreads, sizeof(ThreadArg));
+    if (!ta)
+        errExit("calloc");
+
+    int err = pthread_barrier_init(&g_barrier, NULL, nthreads + 1);
+    if (err != 0)
+        errExitEN(err, "pthread_barrier_init");
+
+    if (async && PrnTs_start_async(outFd) == -1)
+        errExit("PrnTs_start_async");
+
+    for (int j = 0; j < nthreads; j++)
+    {
+        ta[j].num = j;
+        ta[j].samples = (long long*)malloc((g_calls / SAMPLE_EVERY + 1) * sizeof(long long));
+        if (!ta[j].samples)
+            errExit("malloc");
+        err = pthread_create(&ta[j].tid, NULL, threadFunc, &ta[j]);
+        if (err != 0)
+            errExitEN(err, "pthread_create");
+    }
+
+    long long start = nsNow();
+    err = pthread_barrier_wait(&g_barrier);
+    if (err != 0 && err != PTHREAD_BARRIER_SERIAL_THREAD)
+        errExitEN(err, "pthread_barrier_wait");
+
+    for (int j = 0; j < nthreads; j++)
+    {
+        err = pthread_join(ta[j].tid, NULL);
+        if (err != 0)
+            errExitEN(err, "pthread_join");
+    }
+    long long end = nsNow();
+
+    if (async)
+        PrnTs_stop_async();
+    else
+        fflush(stdout);
+    long long drained = nsNow();
+
+    // Merge the samples
+    int total = 0;
+    for (int j = 0; j < nthreads; j++)
+        total += ta[j].nsamples;
+    long long *all = (long long*)malloc(total * sizeof(long long));
+    if (!all)
+        errExit("malloc");
+
+    long long sum = 0;
+    for (int j = 0, k = 0; j < nthreads; j++)
+    {
+        for (int i = 0; i < ta[j].nsamples; i++, k++)
+        {
+            all[k] = ta[j].samples[i];
+            sum += all[k];
+        }
+        free(ta[j].samples);
+    }
+    qsort(all, total, sizeof(long long), cmpLongLong);
+
+    double secs = (end - start) / 1e9;
+    dprintf(resultFd, "%-6s %7d %12.0f %10.0f %10lld %10.3f\n",
+        async ? "async" : "sync", nthreads,
+        (double)nthreads * g_calls / secs,
+        (double)sum / total, all[(int)(total * 0.99)],
+        (drained - end) / 1e9);
+
+    free(all);
+    free(ta);
+    err = pthread_barrier_destroy(&g_barrier);
+    if (err != 0)
+        errExitEN(err, "pthread_barrier_destroy");
+}
+
+int
+main(int argc, char *argv[])
+{
+    int maxThreads = 8;
+    const char *outPath = "/dev/null";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:n:o:")) != -1)
+    {
+        switch (opt)
+        {
+        case 't': maxThreads = getInt(optarg, GN_GT_0, "max-threads"); break;
+        case 'n': g_calls = getInt(optarg, GN_GT_0, "calls"); break;
+        case 'o': outPath = optarg; break;
+        default:  usageErr("%s [-t max-threads] [-n calls] [-o file]\n", argv[0]);
+        }
+    }
+
+    // PrnTs() output goes to stdout, so point stdout at the output file,
+    // and print our results on a copy of the original stdout.
+
+    int resultFd = dup(STDOUT_FILENO);
+    if (resultFd == -1)
+        errExit("dup");
+
+    int outFd = open(outPath, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (outFd == -1)
+        errExit("open-%s", outPath);
+    if (dup2(outFd, STDOUT_FILENO) == -1)
+        errExit("dup2");
+    close(outFd);
+
+    dprintf(resultFd, "%-6s %7s %12s %10s %10s %10s\n",
+        "Mode", "Threads", "Calls/s", "Mean-ns", "p99-ns", "Drain-s");
+
+    for (int async = 0; async <= 1; async++)
+    {
+        for (int n = 1; n <= maxThreads; n *= 2)
+            runOne(async, n, STDOUT_FILENO, resultFd);
+    }
+
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,111 @@
+/*************************************************************************\
+*                  Copyright (C) Michael Kerrisk, 2020.                   *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU Lesser General Public License as published   *
+* by the Free Software Foundation, either version 3 or (at your option)   *
+* any later version. This program is distributed without any warranty.    *
+* See the files COPYING.lgpl-v3 and COPYING.gpl-v3 for details.           *
+\*************************************************************************/
+
+/* striped_counter.c
+
+   A counter that many threads can increment without all of them fighting
+   over one cache line. The count is split across several stripes, each
+   in its own cache line (see SC_STRIPE_SIZE); scAdd() adds to one
+   stripe, and scRead() sums all of them.
+
+   By default, each thread uses its own stripe: threads are numbered in
+   the order in which they first call scAdd(), and thread N uses stripe
+   N % nstripes. With SC_PER_CPU, scAdd() instead uses the stripe of the
+   CPU on which the caller is running, as given by sched_getcpu(); this
+   suits a process with many more threads than CPUs. Either way, two
+   threads may share a stripe, so stripes are updated with atomic adds,
+   but these are cheap when the cache line is not contended.
+
+   scRead() doesn't stop concurrent updates, so while other threads are
+   adding, it returns a value that the counter held at some point during
+   the call, give or take the updates that were in progress.
+*/
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "striped_counter.h"
+
+static int nextThreadNum;               /* Next number to give a thread */
+static __thread int threadNum = -1;     /* This thread's number */
+
+/* Initialize 'sc' with 'nstripes' stripes; if 'nstripes' is 0, use one
+   stripe for each configured CPU. 'flags' is 0 or SC_PER_CPU. Returns 0
+   on success, or -1 on error. */
+
+int
+scInit(struct stripedCounter *sc, int nstripes, int flags)
+{
+    if (nstripes < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (nstripes == 0) {
+        nstripes = sysconf(_SC_NPROCESSORS_CONF);
+        if (nstripes < 1)
+            nstripes = 1;
+    }
+
+    if (posix_memalign((void **) &sc->stripes, SC_STRIPE_SIZE,
+                       nstripes * sizeof(struct scStripe)) != 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(sc->stripes, 0, nstripes * sizeof(struct scStripe));
+
+    sc->nstripes = nstripes;
+    sc->flags = flags;
+    return 0;
+}
+
+void
+scDestroy(struct stripedCounter *sc)
+{
+    free(sc->stripes);
+    sc->stripes = NULL;
+}
+
+/* Add 'n' to the counter */
+
+void
+scAdd(struct stripedCounter *sc, long long n)
+{
+    int idx;
+
+    if (sc->flags & SC_PER_CPU) {
+        idx = sched_getcpu();
+        if (idx < 0)                    /* Shouldn't happen */
+            idx = 0;
+    } else {
+        if (threadNum == -1)
+            threadNum = __atomic_fetch_add(&nextThreadNum, 1,
+                                           __ATOMIC_RELAXED);
+        idx = threadNum;
+    }
+
+    __atomic_fetch_add(&sc->stripes[idx % sc->nstripes].value, n,
+                       __ATOMIC_RELAXED);
+}
+
+/* Return the value of the counter */
+
+long long
+scRead(struct stripedCounter *sc)
+{
+    long long sum = 0;
+
+    for (int j = 0; j < sc->nstripes; j++)
+        sum += __atomic_load_n(&sc->stripes[j].value, __ATOMIC_RELAXED);
+
+    return sum;
+}
@@ -0,0 +1,45 @@
+/*************************************************************************\
+*                  Copyright (C) Michael Kerrisk, 2020.                   *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU Lesser General Public License as published   *
+* by the Free Software Foundation, either version 3 or (at your option)   *
+* any later version. This program is distributed without any warranty.    *
+* See the files COPYING.lgpl-v3 and COPYING.gpl-v3 for details.           *
+\*************************************************************************/
+
+/* striped_counter.h
+
+   Header file for striped_counter.c.
+*/
+#ifndef STRIPED_COUNTER_H
+#define STRIPED_COUNTER_H       /* Prevent accidental double inclusion */
+
+/* Each stripe is padded to this size, so that no two stripes share a
+   cache line. This is two 64-byte lines, because some CPUs (e.g., recent
+   x86) fetch lines in adjacent pairs. */
+
+#define SC_STRIPE_SIZE 128
+
+#define SC_PER_CPU      01      /* Choose stripe by CPU, not by thread */
+
+struct scStripe {
+    long long value;
+    char pad[SC_STRIPE_SIZE - sizeof(long long)];
+};
+
+struct stripedCounter {
+    int nstripes;
+    int flags;
+    struct scStripe *stripes;
+};
+
+int scInit(struct stripedCounter *sc, int nstripes, int flags);
+
+void scDestroy(struct stripedCounter *sc);
+
+void scAdd(struct stripedCounter *sc, long long n);
+
+long long scRead(struct stripedCounter *sc);
+
+#endif
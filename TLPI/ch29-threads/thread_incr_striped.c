@@ -0,0 +1,230 @@
+/*************************************************************************\
+*                  Copyright (C) Michael Kerrisk, 2020.                   *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU General Public License as published by the   *
+* Free Software Foundation, either version 3 or (at your option) any      *
+* later version. This program is distributed without any warranty.  See   *
+* the file COPYING.gpl-v3 for details.                                    *
+\*************************************************************************/
+
+/* Supplementary program for Chapter 30 */
+
+/* thread_incr_striped.c
+
+   Compare ways for several threads to increment a shared counter: the
+   approach of thread_incr_mutex.c (a mutex around a single variable),
+   atomic adds to a single variable, and the striped counter in
+   striped_counter.c (by thread, and by CPU). To show the cost of false
+   sharing, there is also an "unpadded" variant, in which each thread adds
+   to its own element of an array of counters, but the elements share
+   cache lines.
+
+   Usage: thread_incr_striped [-t max-threads] [num-loops]
+
+   Each approach is run with 1, 2, 4, ... threads, up to 'max-threads'
+   (default: the number of online CPUs, but at least 4), with each thread
+   incrementing the counter 'num-loops' times (default: 10000000). The
+   table shows millions of increments per second.
+*/
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <time.h>
+#include "striped_counter.h"
+#include "tlpi_hdr.h"
+
+enum approach { A_MUTEX, A_ATOMIC, A_UNPADDED, A_STRIPED, A_PERCPU,
+                A_NUM_APPROACHES };
+
+static const char *approachNames[A_NUM_APPROACHES] = {
+    "mutex", "atomic", "unpadded", "striped", "percpu"
+};
+
+struct threadArg {
+    int num;                    /* Thread number: 0, 1, ... */
+    enum approach how;
+};
+
+static long long glob;
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+static long long *unpadded;     /* One element per thread, no padding */
+static struct stripedCounter sc;
+static pthread_barrier_t startBarrier;
+static int numLoops;
+
+static double
+timeNow(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        errExit("clock_gettime");
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *
+threadFunc(void *arg)
+{
+    struct threadArg *ta = arg;
+    int s;
+
+    s = pthread_barrier_wait(&startBarrier);
+    if (s != 0 && s != PTHREAD_BARRIER_SERIAL_THREAD)
+        errExitEN(s, "pthread_barrier_wait");
+
+    switch (ta->how) {
+    case A_MUTEX:
+        for (int j = 0; j < numLoops; j++) {
+            s = pthread_mutex_lock(&mtx);
+            if (s != 0)
+                errExitEN(s, "pthread_mutex_lock");
+            glob++;
+            s = pthread_mutex_unlock(&mtx);
+            if (s != 0)
+                errExitEN(s, "pthread_mutex_unlock");
+        }
+        break;
+
+    case A_ATOMIC:
+        for (int j = 0; j < numLoops; j++)
+            __atomic_fetch_add(&glob, 1, __ATOMIC_RELAXED);
+        break;
+
+    case A_UNPADDED:
+
+        /* Same atomic add as a stripe of 'sc', but neighboring threads'
+           elements are in the same cache line */
+
+        for (int j = 0; j < numLoops; j++)
+            __atomic_fetch_add(&unpadded[ta->num], 1, __ATOMIC_RELAXED);
+        break;
+
+    case A_STRIPED:
+    case A_PERCPU:
+        for (int j = 0; j < numLoops; j++)
+            scAdd(&sc, 1);
+        break;
+
+    default:
+        break;
+    }
+
+    return NULL;
+}
+
+/* Run 'numThreads' threads using approach 'how', and return the number of
+   increments per second */
+
+static double
+runOne(enum approach how, int numThreads)
+{
+    pthread_t *thread;
+    struct threadArg *ta;
+    long long total;
+    double start, secs;
+    int s;
+
+    thread = calloc(numThreads, sizeof(pthread_t));
+    ta = calloc(numThreads, sizeof(struct threadArg));
+    unpadded = calloc(numThreads, sizeof(long long));
+    if (thread == NULL || ta == NULL || unpadded == NULL)
+        errExit("calloc");
+
+    glob = 0;
+
+    /* Per-CPU stripes are indexed by CPU number, so we need one stripe
+       per CPU (nstripes == 0), however many threads there are */
+
+    if (how == A_PERCPU)
+        s = scInit(&sc, 0, SC_PER_CPU);
+    else
+        s = scInit(&sc, numThreads, 0);
+    if (s == -1)
+        errExit("scInit");
+
+    s = pthread_barrier_init(&startBarrier, NULL, numThreads + 1);
+    if (s != 0)
+        errExitEN(s, "pthread_barrier_init");
+
+    for (int j = 0; j < numThreads; j++) {
+        ta[j].num = j;
+        ta[j].how = how;
+        s = pthread_create(&thread[j], NULL, threadFunc, &ta[j]);
+        if (s != 0)
+            errExitEN(s, "pthread_create");
+    }
+
+    start = timeNow();
+    s = pthread_barrier_wait(&startBarrier);
+    if (s != 0 && s != PTHREAD_BARRIER_SERIAL_THREAD)
+        errExitEN(s, "pthread_barrier_wait");
+
+    for (int j = 0; j < numThreads; j++) {
+        s = pthread_join(thread[j], NULL);
+        if (s != 0)
+            errExitEN(s, "pthread_join");
+    }
+    secs = timeNow() - start;
+
+    /* Check that no increments were lost */
+
+    if (how == A_UNPADDED) {
+        total = 0;
+        for (int j = 0; j < numThreads; j++)
+            total += unpadded[j];
+    } else if (how == A_STRIPED || how == A_PERCPU) {
+        total = scRead(&sc);
+    } else {
+        total = glob;
+    }
+
+    if (total != (long long) numThreads * numLoops)
+        fatal("%s: count = %lld, expected %lld", approachNames[how], total,
+              (long long) numThreads * numLoops);
+
+    s = pthread_barrier_destroy(&startBarrier);
+    if (s != 0)
+        errExitEN(s, "pthread_barrier_destroy");
+    scDestroy(&sc);
+    free(unpadded);
+    free(ta);
+    free(thread);
+
+    return total / secs;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int opt, maxThreads, n;
+
+    maxThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (maxThreads < 4)
+        maxThreads = 4;
+
+    while ((opt = getopt(argc, argv, "t:")) != -1) {
+        switch (opt) {
+        case 't': maxThreads = getInt(optarg, GN_GT_0, "max-threads");  break;
+        default:  usageErr("%s [-t max-threads] [num-loops]\n", argv[0]);
+        }
+    }
+
+    numLoops = (optind < argc) ?
+            getInt(argv[optind], GN_GT_0, "num-loops") : 10000000;
+
+    printf("%-10s", "Threads");
+    for (n = 1; n <= maxThreads; n *= 2)
+        printf(" %8d", n);
+    printf("   (M incr/s)\n");
+
+    for (int a = 0; a < A_NUM_APPROACHES; a++) {
+        printf("%-10s", approachNames[a]);
+        for (n = 1; n <= maxThreads; n *= 2) {
+            printf(" %8.1f", runOne(a, n) / 1e6);
+            fflush(stdout);
+        }
+        printf("\n");
+    }
+
+    exit(EXIT_SUCCESS);
+}
@@ -13,102 +13,708 @@
 /* thread_lock_speed.c
 
    This program employs POSIX threads that increment the same global
-   variable, synchronizing their access using either a mutex or a spinlock.
+   variable, synchronizing their access using one of several kinds of lock.
    Command-line arguments allow the user to specify:
 
    * The number of threads that will increment the global variable.
    * The number of "outer loops" that each thread will execute using
-	 the lock/unlock APIs (either mutexes or spin locks).
+	 the lock/unlock APIs.
    * The number "inner loops" executed for each "outer loop" step.
 	 Each inner loop iteration increments the global variable by 1.
 
-   By default, the threads use mutexes to synchronize their access to
-   the global variable. Specifying the "-s" option causes spin locks
-   to be employed instead.
+   The number of threads and the number of inner loops may each be given
+   as a comma-separated list (e.g., "1,2,4,8"), in which case every
+   combination is measured.
 
-   The idea is to vary the number of threads and number of inner loops
-   while using time(1) to measure the real and CPU time consumed by the
-   program. In some scenarios (e.g., many threads, large "inner loop"
-   values), mutexes will perform better, while in others (few threads,
-   small "inner loop" value), spin locks are likely to be better.
+   The kinds of lock ("-l" option, also a comma-separated list, or "all")
+   are:
+
+	 mutex      pthread mutex (the default)
+	 spin       pthread spin lock ("-s" is the same as "-l spin")
+	 rwlock     pthread read-write lock, always locked for writing
+	 ticket     ticket lock: FIFO order, but all waiters spin on the
+				same cache line
+	 mcs        MCS queue lock: FIFO order, and each waiter spins on its
+				own queue node
+	 futex      mutex built directly on futex(), as in Drepper's paper
+				"Futexes Are Tricky"
+	 adaptive   the futex mutex, but spinning for a while before
+				sleeping in the kernel
+	 atomic     no lock; each increment is an atomic add
+
+   Each thread stops when it has done its outer loops, or when any other
+   thread has done so, or when the "-d" time limit (default: 5 seconds)
+   expires. Since the threads stop together, the spread of the number of
+   locks that each thread acquired shows how fair the lock is.
+
+   Unless "-P" is given, thread N is pinned to the Nth CPU (modulo the
+   number of CPUs) on which the program is allowed to run.
+
+   The program times itself, and prints one CSV line for each combination
+   of lock, number of threads, and number of inner loops, with these
+   fields:
+
+	 lock, threads, inner    The combination measured
+	 acquisitions, secs      Total locks acquired, and the time taken
+	 acq_per_sec             Locks acquired per second
+	 min_thread, max_thread  Least and most locks acquired by one thread
+	 fairness                min_thread / max_thread (1 is perfectly fair)
+	 wait_p50_ns ...         Percentiles and maximum of the time taken to
+							 acquire the lock, sampled every 16th acquisition
+
+   The idea is to vary the number of threads and number of inner loops.
+   In some scenarios (e.g., many threads, large "inner loop" values),
+   locks that sleep will perform better, while in others (few threads,
+   small "inner loop" value), spin locks are likely to be better. Spin
+   locks do very badly when there are more threads than CPUs, since a
+   thread may then spin for its whole time slice waiting for a lock that
+   is held by a thread that isn't running; the FIFO locks (ticket and mcs)
+   do worst of all, since the lock can't be passed to a running waiter.
 */
+#ifndef _GNU_SOURCE            /* g++ defines it already */
+#define _GNU_SOURCE
+#endif
 #include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include "tlpi_hdr.h"
 
-static volatile int glob = 0;
-static pthread_spinlock_t splock;
-static pthread_mutex_t mtx;
-static int useMutex = 0;
-static int numOuterLoops;
+#define CACHE_LINE 64
+#define SAMPLE_EVERY 16         /* Time every 16th lock acquisition */
+#define ADAPTIVE_SPINS 100      /* Tries before an adaptive lock sleeps */
+#define MAX_LIST 64             /* Maximum entries in a command-line list */
+
+/* Lock wait times are recorded in a histogram that has HIST_SUB buckets
+   for each power of two, giving about 12% resolution */
+
+#define HIST_SUB 8
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+struct mcsNode {                /* A waiter in the MCS lock's queue */
+	struct mcsNode *next;
+	int locked;
+};
+
+struct threadInfo {             /* Per-thread state and results */
+	pthread_t thread;
+	int cpu;                    /* CPU to pin to, or -1 */
+	long long count;            /* Locks acquired */
+	uint64_t startTime;         /* When this thread started (ns) */
+	uint64_t endTime;           /* When this thread stopped (ns) */
+	uint64_t maxWait;           /* Longest sampled wait (ns) */
+	struct mcsNode node;
+	unsigned long hist[HIST_BUCKETS];
+} __attribute__((aligned(CACHE_LINE)));
+
+struct lockType {
+	const char *name;
+	void (*init)(void);
+	void (*lock)(struct threadInfo *);
+	void (*unlock)(struct threadInfo *);
+};
+
+static volatile long long glob = 0;
+static pthread_barrier_t startBarrier;
+static int stop;                /* Set to tell all threads to stop */
+
+static const struct lockType *curLock;
+static long long numOuterLoops;
 static int numInnerLoops;
 
+static inline void
+cpuRelax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__asm__ __volatile__("pause");
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+static uint64_t
+nsNow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* pthread mutex, spin lock, and read-write lock */
+
+static pthread_mutex_t mtx;
+static pthread_spinlock_t splock;
+static pthread_rwlock_t rwlock;
+
+static void
+mutexInit(void)
+{
+	int s = pthread_mutex_init(&mtx, NULL);
+	if (s != 0)
+		errExitEN(s, "pthread_mutex_init");
+}
+
+static void
+mutexLock(struct threadInfo *ti)
+{
+	int s = pthread_mutex_lock(&mtx);
+	if (s != 0)
+		errExitEN(s, "pthread_mutex_lock");
+}
+
+static void
+mutexUnlock(struct threadInfo *ti)
+{
+	int s = pthread_mutex_unlock(&mtx);
+	if (s != 0)
+		errExitEN(s, "pthread_mutex_unlock");
+}
+
+static void
+spinInit(void)
+{
+	int s = pthread_spin_init(&splock, 0);
+	if (s != 0)
+		errExitEN(s, "pthread_spin_init");
+}
+
+static void
+spinLock(struct threadInfo *ti)
+{
+	int s = pthread_spin_lock(&splock);
+	if (s != 0)
+		errExitEN(s, "pthread_spin_lock");
+}
+
+static void
+spinUnlock(struct threadInfo *ti)
+{
+	int s = pthread_spin_unlock(&splock);
+	if (s != 0)
+		errExitEN(s, "pthread_spin_unlock");
+}
+
+static void
+rwlockInit(void)
+{
+	int s = pthread_rwlock_init(&rwlock, NULL);
+	if (s != 0)
+		errExitEN(s, "pthread_rwlock_init");
+}
+
+static void
+rwlockLock(struct threadInfo *ti)
+{
+	int s = pthread_rwlock_wrlock(&rwlock);
+	if (s != 0)
+		errExitEN(s, "pthread_rwlock_wrlock");
+}
+
+static void
+rwlockUnlock(struct threadInfo *ti)
+{
+	int s = pthread_rwlock_unlock(&rwlock);
+	if (s != 0)
+		errExitEN(s, "pthread_rwlock_unlock");
+}
+
+/* Ticket lock: a thread takes the next ticket, and waits until that
+   ticket is being served. The two counters are on separate cache lines,
+   so that taking a ticket doesn't disturb the thread holding the lock. */
+
+static struct {
+	unsigned int next __attribute__((aligned(CACHE_LINE)));
+	unsigned int serving __attribute__((aligned(CACHE_LINE)));
+} ticket;
+
+static void
+ticketInit(void)
+{
+	ticket.next = ticket.serving = 0;
+}
+
+static void
+ticketLock(struct threadInfo *ti)
+{
+	unsigned int my = __atomic_fetch_add(&ticket.next, 1, __ATOMIC_RELAXED);
+
+	while (__atomic_load_n(&ticket.serving, __ATOMIC_ACQUIRE) != my)
+		cpuRelax();
+}
+
+static void
+ticketUnlock(struct threadInfo *ti)
+{
+	__atomic_store_n(&ticket.serving, ticket.serving + 1, __ATOMIC_RELEASE);
+}
+
+/* MCS lock: waiters form a queue through their own nodes; each waiter
+   spins on the 'locked' flag in its own node, which its predecessor
+   clears when handing over the lock */
+
+static struct mcsNode *mcsTail __attribute__((aligned(CACHE_LINE)));
+
+static void
+mcsInit(void)
+{
+	mcsTail = NULL;
+}
+
+static void
+mcsLock(struct threadInfo *ti)
+{
+	struct mcsNode *node = &ti->node;
+	struct mcsNode *pred;
+
+	node->next = NULL;
+	node->locked = 1;
+
+	pred = __atomic_exchange_n(&mcsTail, node, __ATOMIC_ACQ_REL);
+	if (pred == NULL)                   /* Lock was free */
+		return;
+
+	__atomic_store_n(&pred->next, node, __ATOMIC_RELEASE);
+	while (__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE))
+		cpuRelax();
+}
+
+static void
+mcsUnlock(struct threadInfo *ti)
+{
+	struct mcsNode *node = &ti->node;
+	struct mcsNode *succ, *expected;
+
+	succ = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+	if (succ == NULL) {
+
+		/* If we are still the tail, there is no waiter */
+
+		expected = node;
+		if (__atomic_compare_exchange_n(&mcsTail, &expected, NULL, 0,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			return;
+
+		/* A waiter has swapped itself in as the tail, but hasn't yet
+		   linked itself to our node */
+
+		while ((succ = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)) == NULL)
+			cpuRelax();
+	}
+
+	__atomic_store_n(&succ->locked, 0, __ATOMIC_RELEASE);
+}
+
+/* Futex mutex. The lock word is 0 if unlocked, 1 if locked, and 2 if
+   locked and there may be waiters, so that unlock needs to make a system
+   call only if someone may be asleep. */
+
+static int futexWord __attribute__((aligned(CACHE_LINE)));
+
+static void
+futexInit(void)
+{
+	futexWord = 0;
+}
+
+static void
+futexSlowLock(int c)
+{
+	if (c != 2)
+		c = __atomic_exchange_n(&futexWord, 2, __ATOMIC_ACQUIRE);
+
+	while (c != 0) {
+		if (syscall(SYS_futex, &futexWord, FUTEX_WAIT_PRIVATE, 2,
+					NULL, NULL, 0) == -1 && errno != EAGAIN && errno != EINTR)
+			errExit("futex-FUTEX_WAIT");
+		c = __atomic_exchange_n(&futexWord, 2, __ATOMIC_ACQUIRE);
+	}
+}
+
+static void
+futexLock(struct threadInfo *ti)
+{
+	int c = 0;
+
+	if (!__atomic_compare_exchange_n(&futexWord, &c, 1, 0,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		futexSlowLock(c);
+}
+
+static void
+futexUnlock(struct threadInfo *ti)
+{
+	if (__atomic_fetch_sub(&futexWord, 1, __ATOMIC_RELEASE) != 1) {
+		__atomic_store_n(&futexWord, 0, __ATOMIC_RELEASE);
+		if (syscall(SYS_futex, &futexWord, FUTEX_WAKE_PRIVATE, 1,
+					NULL, NULL, 0) == -1)
+			errExit("futex-FUTEX_WAKE");
+	}
+}
+
+/* Adaptive mutex: the futex mutex, but first spin for a while in the
+   hope that the holder releases the lock soon */
+
+static void
+adaptiveLock(struct threadInfo *ti)
+{
+	int c;
+
+	for (int j = 0; j < ADAPTIVE_SPINS; j++) {
+		c = 0;
+		if (__atomic_load_n(&futexWord, __ATOMIC_RELAXED) == 0 &&
+				__atomic_compare_exchange_n(&futexWord, &c, 1, 0,
+					__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return;
+		cpuRelax();
+	}
+
+	c = 0;
+	if (!__atomic_compare_exchange_n(&futexWord, &c, 1, 0,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		futexSlowLock(c);
+}
+
+/* For "atomic", 'lock' is NULL, and the increments are atomic adds */
+
+static const struct lockType lockTypes[] = {
+	{ "mutex",    mutexInit,  mutexLock,    mutexUnlock  },
+	{ "spin",     spinInit,   spinLock,     spinUnlock   },
+	{ "rwlock",   rwlockInit, rwlockLock,   rwlockUnlock },
+	{ "ticket",   ticketInit, ticketLock,   ticketUnlock },
+	{ "mcs",      mcsInit,    mcsLock,      mcsUnlock    },
+	{ "futex",    futexInit,  futexLock,    futexUnlock  },
+	{ "adaptive", futexInit,  adaptiveLock, futexUnlock  },
+	{ "atomic",   NULL,       NULL,         NULL         },
+};
+
+#define NUM_LOCK_TYPES ((int) (sizeof(lockTypes) / sizeof(lockTypes[0])))
+
+static int
+histIndex(uint64_t ns)
+{
+	int e;
+
+	if (ns < HIST_SUB)
+		return ns;
+	e = 63 - __builtin_clzll(ns);               /* e >= 3 */
+	return (e - 2) * HIST_SUB + ((ns >> (e - 3)) & (HIST_SUB - 1));
+}
+
+static uint64_t                 /* Smallest value counted in bucket 'idx' */
+histValue(int idx)
+{
+	if (idx < HIST_SUB)
+		return idx;
+	return (uint64_t) (HIST_SUB + idx % HIST_SUB) << (idx / HIST_SUB - 1);
+}
+
+/* Return the 'pct' percentile of the 'total' values in 'hist' */
+
+static uint64_t
+histPercentile(const unsigned long *hist, unsigned long total, double pct)
+{
+	unsigned long want, sum;
+
+	want = total * pct / 100;
+	sum = 0;
+	for (int j = 0; j < HIST_BUCKETS; j++) {
+		sum += hist[j];
+		if (sum > want)
+			return histValue(j);
+	}
+	return 0;
+}
+
 static void *
 threadFunc(void *arg)
 {
+	struct threadInfo *ti = (struct threadInfo *) arg;
+	const struct lockType *lt = curLock;
+	uint64_t t0, wait;
+	cpu_set_t set;
+	long long n;
 	int s;
 
-	for (int j = 0; j < numOuterLoops; j++) {
-		if (useMutex) {
-			s = pthread_mutex_lock(&mtx);
-			if (s != 0)
-				errExitEN(s, "pthread_mutex_lock");
-		} else {
-			s = pthread_spin_lock(&splock);
-			if (s != 0)
-				errExitEN(s, "pthread_spin_lock");
-		}
+	if (ti->cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(ti->cpu, &set);
+		s = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (s != 0)
+			errExitEN(s, "pthread_setaffinity_np");
+	}
 
-		for (int k = 0; k < numInnerLoops; k++)
-			glob++;
+	s = pthread_barrier_wait(&startBarrier);
+	if (s != 0 && s != PTHREAD_BARRIER_SERIAL_THREAD)
+		errExitEN(s, "pthread_barrier_wait");
+	ti->startTime = nsNow();
+
+	t0 = 0;
+	for (n = 0; n < numOuterLoops; n++) {
+		if (__atomic_load_n(&stop, __ATOMIC_RELAXED))
+			break;
 
-		if (useMutex) {
-			s = pthread_mutex_unlock(&mtx);
-			if (s != 0)
-				errExitEN(s, "pthread_mutex_unlock");
+		if (n % SAMPLE_EVERY == 0)
+			t0 = nsNow();
+
+		if (lt->lock == NULL) {
+			for (int k = 0; k < numInnerLoops; k++)
+				__atomic_fetch_add(&glob, 1, __ATOMIC_RELAXED);
 		} else {
-			s = pthread_spin_unlock(&splock);
-			if (s != 0)
-				errExitEN(s, "pthread_spin_unlock");
+			lt->lock(ti);
+			if (n % SAMPLE_EVERY == 0) {
+				wait = nsNow() - t0;
+				ti->hist[histIndex(wait)]++;
+				if (wait > ti->maxWait)
+					ti->maxWait = wait;
+			}
+
+			for (int k = 0; k < numInnerLoops; k++)
+				glob++;
+
+			lt->unlock(ti);
 		}
 	}
 
+	ti->count = n;
+	ti->endTime = nsNow();
+
+	if (n == numOuterLoops)             /* Tell the others to stop */
+		__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+
 	return NULL;
 }
 
+/* Run one measurement, and print its CSV line */
+
+static void
+runOne(const struct lockType *lt, int numThreads, int innerLoops,
+		double maxSecs, const int *cpus, int numCpus)
+{
+	struct threadInfo *ti;
+	struct timespec tick = { 0, 10000000 };
+	unsigned long hist[HIST_BUCKETS], samples;
+	uint64_t limitStart, start, end, maxWait;
+	long long total, minCount, maxCount;
+	double secs;
+	int s;
+
+	s = posix_memalign((void **) &ti, CACHE_LINE,
+			numThreads * sizeof(struct threadInfo));
+	if (s != 0)
+		errExitEN(s, "posix_memalign");
+	memset(ti, 0, numThreads * sizeof(struct threadInfo));
+
+	curLock = lt;
+	numInnerLoops = innerLoops;
+	glob = 0;
+	stop = 0;
+	if (lt->init != NULL)
+		lt->init();
+
+	s = pthread_barrier_init(&startBarrier, NULL, numThreads + 1);
+	if (s != 0)
+		errExitEN(s, "pthread_barrier_init");
+
+	for (int j = 0; j < numThreads; j++) {
+		ti[j].cpu = (numCpus > 0) ? cpus[j % numCpus] : -1;
+		s = pthread_create(&ti[j].thread, NULL, threadFunc, &ti[j]);
+		if (s != 0)
+			errExitEN(s, "pthread_create");
+	}
+
+	s = pthread_barrier_wait(&startBarrier);
+	if (s != 0 && s != PTHREAD_BARRIER_SERIAL_THREAD)
+		errExitEN(s, "pthread_barrier_wait");
+	limitStart = nsNow();
+
+	/* Enforce the time limit */
+
+	while (!__atomic_load_n(&stop, __ATOMIC_RELAXED) &&
+			(nsNow() - limitStart) / 1e9 < maxSecs)
+		nanosleep(&tick, NULL);
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+
+	for (int j = 0; j < numThreads; j++) {
+		s = pthread_join(ti[j].thread, NULL);
+		if (s != 0)
+			errExitEN(s, "pthread_join");
+	}
+
+	s = pthread_barrier_destroy(&startBarrier);
+	if (s != 0)
+		errExitEN(s, "pthread_barrier_destroy");
+
+	/* Gather the results. The elapsed time runs from when the first
+	   thread started until the last one stopped; we can't simply time
+	   this from here, since we may not be scheduled while the threads
+	   run. */
+
+	memset(hist, 0, sizeof(hist));
+	total = 0;
+	minCount = maxCount = ti[0].count;
+	start = ti[0].startTime;
+	end = ti[0].endTime;
+	maxWait = 0;
+	for (int j = 0; j < numThreads; j++) {
+		total += ti[j].count;
+		if (ti[j].count < minCount)
+			minCount = ti[j].count;
+		if (ti[j].count > maxCount)
+			maxCount = ti[j].count;
+		if (ti[j].startTime < start)
+			start = ti[j].startTime;
+		if (ti[j].endTime > end)
+			end = ti[j].endTime;
+		if (ti[j].maxWait > maxWait)
+			maxWait = ti[j].maxWait;
+		for (int k = 0; k < HIST_BUCKETS; k++)
+			hist[k] += ti[j].hist[k];
+	}
+
+	if (glob != total * innerLoops)
+		fatal("%s: glob = %lld, expected %lld", lt->name, glob,
+				total * innerLoops);
+
+	samples = 0;
+	for (int k = 0; k < HIST_BUCKETS; k++)
+		samples += hist[k];
+
+	secs = (end - start) / 1e9;
+	printf("%s,%d,%d,%lld,%.3f,%.0f,%lld,%lld,%.3f,"
+			"%llu,%llu,%llu,%llu\n",
+			lt->name, numThreads, innerLoops, total, secs,
+			(secs > 0) ? total / secs : 0.0, minCount, maxCount,
+			(maxCount > 0) ? (double) minCount / maxCount : 0.0,
+			(unsigned long long) histPercentile(hist, samples, 50),
+			(unsigned long long) histPercentile(hist, samples, 99),
+			(unsigned long long) histPercentile(hist, samples, 99.9),
+			(unsigned long long) maxWait);
+	fflush(stdout);
+
+	free(ti);
+}
+
+/* Parse a comma-separated list of integers into 'vals', returning the
+   number of integers */
+
+static int
+parseList(const char *arg, int flags, const char *name, int *vals)
+{
+	char *copy, *tok, *saveptr;
+	int n;
+
+	copy = strdup(arg);
+	if (copy == NULL)
+		errExit("strdup");
+
+	n = 0;
+	for (tok = strtok_r(copy, ",", &saveptr); tok != NULL;
+			tok = strtok_r(NULL, ",", &saveptr)) {
+		if (n == MAX_LIST)
+			cmdLineErr("Too many values for %s\n", name);
+		vals[n++] = getInt(tok, flags, name);
+	}
+
+	free(copy);
+	if (n == 0)
+		cmdLineErr("Empty list for %s\n", name);
+	return n;
+}
+
+/* Parse a comma-separated list of lock names (or "all") into 'locks',
+   returning the number of locks */
+
+static int
+parseLocks(const char *arg, const struct lockType **locks)
+{
+	char *copy, *tok, *saveptr;
+	int n, j;
+
+	if (strcmp(arg, "all") == 0) {
+		for (j = 0; j < NUM_LOCK_TYPES; j++)
+			locks[j] = &lockTypes[j];
+		return NUM_LOCK_TYPES;
+	}
+
+	copy = strdup(arg);
+	if (copy == NULL)
+		errExit("strdup");
+
+	n = 0;
+	for (tok = strtok_r(copy, ",", &saveptr); tok != NULL;
+			tok = strtok_r(NULL, ",", &saveptr)) {
+		for (j = 0; j < NUM_LOCK_TYPES; j++)
+			if (strcmp(tok, lockTypes[j].name) == 0)
+				break;
+		if (j == NUM_LOCK_TYPES)
+			cmdLineErr("Unknown lock type: %s\n", tok);
+		if (n == MAX_LIST)
+			cmdLineErr("Too many lock types\n");
+		locks[n++] = &lockTypes[j];
+	}
+
+	free(copy);
+	return n;
+}
+
 static void
 usageError(char *pname)
 {
 	fprintf(stderr,
-			"Usage: %s [-s] num-threads "
+			"Usage: %s [-q] [-s] [-l locks] [-d secs] [-P] num-threads "
 			"[num-inner-loops [num-outer-loops]]\n", pname);
 	fprintf(stderr,
-			"    -q   Don't print verbose messages\n");
+			"    -q        Don't print the CSV header line\n");
+	fprintf(stderr,
+			"    -s        Use spin locks (same as \"-l spin\")\n");
+	fprintf(stderr,
+			"    -l locks  Comma-separated list of lock types, or \"all\":\n"
+			"              mutex (default), spin, rwlock, ticket, mcs,\n"
+			"              futex, adaptive, atomic\n");
+	fprintf(stderr,
+			"    -d secs   Time limit for each measurement (default: 5)\n");
 	fprintf(stderr,
-			"    -s   Use spin locks (instead of the default mutexes)\n");
+			"    -P        Don't pin threads to CPUs\n");
+	fprintf(stderr,
+			"num-threads and num-inner-loops may be comma-separated lists\n");
 	exit(EXIT_FAILURE);
 }
 
 int
 main(int argc, char *argv[])
 {
-	int opt, s;
-	int numThreads;
-	pthread_t *thread;
-	int verbose;
-
-	/* Prevent runaway/forgotten process from burning up CPU time forever */
+	const struct lockType *locks[MAX_LIST];
+	int threadList[MAX_LIST], innerList[MAX_LIST];
+	int numLocks, numThreadVals, numInnerVals;
+	int opt, verbose, pin, numCpus;
+	int cpus[CPU_SETSIZE];
+	cpu_set_t set;
+	double maxSecs;
 
-	alarm(120);         /* Unhandled SIGALRM will kill process */
-
-	useMutex = 1;
+	locks[0] = &lockTypes[0];                   /* mutex */
+	numLocks = 1;
 	verbose = 1;
-	while ((opt = getopt(argc, argv, "qs")) != -1) {
+	pin = 1;
+	maxSecs = 5;
+	while ((opt = getopt(argc, argv, "qsl:d:P")) != -1) {
 		switch (opt) {
 		case 'q':
 			verbose = 0;
 			break;
 		case 's':
-			useMutex = 0;
+			numLocks = parseLocks("spin", locks);
+			break;
+		case 'l':
+			numLocks = parseLocks(optarg, locks);
+			break;
+		case 'd':
+			maxSecs = getInt(optarg, GN_GT_0, "secs");
+			break;
+		case 'P':
+			pin = 0;
 			break;
 		default:
 			usageError(argv[0]);
@@ -118,43 +724,39 @@ main(int argc, char *argv[])
 	if (optind >= argc)
 		usageError(argv[0]);
 
-	numThreads = atoi(argv[optind]);
-	numInnerLoops = (optind + 1 < argc) ? atoi(argv[optind + 1]) : 1;
-	numOuterLoops = (optind + 2 < argc) ? atoi(argv[optind + 2]) : 10000000;
-
-	if (verbose) {
-		printf("Using %s\n", useMutex ? "mutexes" : "spin locks");
-		printf("\tthreads: %d; outer loops: %d; inner loops: %d\n",
-				numThreads, numOuterLoops, numInnerLoops);
-	}
-
-	thread = (pthread_t*) calloc(numThreads, sizeof(pthread_t));
-	if (thread == NULL)
-		errExit("calloc");
-
-	if (useMutex) {
-		s = pthread_mutex_init(&mtx, NULL);
-		if (s != 0)
-			errExitEN(s, "pthread_mutex_init");
+	numThreadVals = parseList(argv[optind], GN_GT_0, "num-threads",
+			threadList);
+	if (optind + 1 < argc) {
+		numInnerVals = parseList(argv[optind + 1], GN_NONNEG,
+				"num-inner-loops", innerList);
 	} else {
-		s = pthread_spin_init(&splock, 0);
-		if (s != 0)
-			errExitEN(s, "pthread_spin_init");
+		innerList[0] = 1;
+		numInnerVals = 1;
 	}
+	numOuterLoops = (optind + 2 < argc) ?
+			getLong(argv[optind + 2], GN_GT_0, "num-outer-loops") : 10000000;
 
-	for (int j = 0; j < numThreads; j++) {
-		s = pthread_create(&thread[j], NULL, threadFunc, NULL);
-		if (s != 0)
-			errExitEN(s, "pthread_create");
-	}
+	/* Find the CPUs that we may run on */
 
-	for (int j = 0; j < numThreads; j++) {
-		s = pthread_join(thread[j], NULL);
-		if (s != 0)
-			errExitEN(s, "pthread_join");
+	numCpus = 0;
+	if (pin) {
+		if (sched_getaffinity(0, sizeof(set), &set) == -1)
+			errExit("sched_getaffinity");
+		for (int j = 0; j < CPU_SETSIZE; j++)
+			if (CPU_ISSET(j, &set))
+				cpus[numCpus++] = j;
 	}
 
 	if (verbose)
-		printf("glob = %d\n", glob);
+		printf("lock,threads,inner,acquisitions,secs,acq_per_sec,"
+				"min_thread,max_thread,fairness,"
+				"wait_p50_ns,wait_p99_ns,wait_p999_ns,wait_max_ns\n");
+
+	for (int l = 0; l < numLocks; l++)
+		for (int t = 0; t < numThreadVals; t++)
+			for (int i = 0; i < numInnerVals; i++)
+				runOne(locks[l], threadList[t], innerList[i], maxSecs,
+						cpus, numCpus);
+
 	exit(EXIT_SUCCESS);
 }
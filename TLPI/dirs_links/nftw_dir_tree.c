@@ -21,6 +21,18 @@
         as "ls -l"), as obtained using stat(2);
       * a string indicating the file type, as supplied by nftw(); and
       * the file's i-node number.
+
+   With "-j nthreads", the tree is instead walked by 'nthreads' threads
+   using treeWalk() (see tree_walk.c); 'nthreads' of 0 means one per
+   online CPU. The file type then comes from the 'd_type' field returned
+   by getdents64(), and the i-node number from 'd_ino', so that no file
+   needs to be stat()ed (unless the filesystem doesn't supply 'd_type').
+   treeWalk() doesn't follow symbolic links, so "-j" implies "-p". Since
+   the threads report files in no particular order, the full pathname of
+   each file is displayed, rather than an indented basename.
+
+   In either case, the number of files per second is shown on stderr at
+   the end of the walk.
 */
 #if defined(__sun)
 #define _XOPEN_SOURCE 500       /* Solaris 8 needs it this way */
@@ -30,17 +42,25 @@
 #endif
 #endif
 #include <ftw.h>
+#include <dirent.h>
+#include <time.h>
+#include "tree_walk.h"
 #include "tlpi_hdr.h"
 
+static long numFiles;           /* Files reported by nftw() */
+
 static void
 usageError(const char *progName, const char *msg)
 {
     if (msg != NULL)
         fprintf(stderr, "%s\n", msg);
-    fprintf(stderr, "Usage: %s [-d] [-m] [-p] [directory-path]\n", progName);
+    fprintf(stderr, "Usage: %s [-d] [-m] [-p] [-j nthreads] "
+            "[directory-path]\n", progName);
     fprintf(stderr, "\t-d Use FTW_DEPTH flag\n");
     fprintf(stderr, "\t-m Use FTW_MOUNT flag\n");
     fprintf(stderr, "\t-p Use FTW_PHYS flag\n");
+    fprintf(stderr, "\t-j Walk tree with treeWalk(), using 'nthreads' "
+            "threads\n");
     exit(EXIT_FAILURE);
 }
 
@@ -48,6 +68,8 @@ static int                      /* Function called by nftw() */
 dirTree(const char *pathname, const struct stat *sbuf, int type,
         struct FTW *ftwb)
 {
+    numFiles++;
+
     if (type == FTW_NS) {                  /* Could not stat() file */
         printf("?");
     } else {
@@ -78,17 +100,60 @@ dirTree(const char *pathname, const struct stat *sbuf, int type,
     return 0;                                   /* Tell nftw() to continue */
 }
 
+static int                      /* Function called by treeWalk() */
+dirTreeParallel(const struct twEntry *ent, void *arg)
+{
+    char ftype;
+
+    switch (ent->type) {
+    case DT_REG:  ftype = '-'; break;
+    case DT_DIR:  ftype = 'd'; break;
+    case DT_CHR:  ftype = 'c'; break;
+    case DT_BLK:  ftype = 'b'; break;
+    case DT_LNK:  ftype = 'l'; break;
+    case DT_FIFO: ftype = 'p'; break;
+    case DT_SOCK: ftype = 's'; break;
+    default:      ftype = '?'; break;
+    }
+
+    /* Print the line with a single call, so that lines from different
+       threads are not mixed up */
+
+    printf("%c %s  %7ld  %s\n", ftype,
+            (ent->info == TW_D)  ? "D  " : (ent->info == TW_DNR) ? "DNR" :
+            (ent->info == TW_DP) ? "DP " : (ent->info == TW_F)   ? "F  " :
+            (ent->info == TW_SL) ? "SL " : (ent->info == TW_NS)  ? "NS " :
+            "  ", (long) ent->ino, ent->path);
+    return 0;
+}
+
+static double
+timeNow(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        errExit("clock_gettime");
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 int
 main(int argc, char *argv[])
 {
-    int flags, opt;
+    int flags, twFlags, opt, nthreads;
+    struct twStats stats;
+    const char *dirPath;
+    double start, elapsed;
 
     flags = 0;
-    while ((opt = getopt(argc, argv, "dmp")) != -1) {
+    twFlags = 0;
+    nthreads = -1;                      /* Use nftw() */
+    while ((opt = getopt(argc, argv, "dmpj:")) != -1) {
         switch (opt) {
-        case 'd': flags |= FTW_DEPTH;   break;
-        case 'm': flags |= FTW_MOUNT;   break;
+        case 'd': flags |= FTW_DEPTH;   twFlags |= TW_DEPTH;    break;
+        case 'm': flags |= FTW_MOUNT;   twFlags |= TW_MOUNT;    break;
         case 'p': flags |= FTW_PHYS;    break;
+        case 'j': nthreads = getInt(optarg, GN_NONNEG, "nthreads"); break;
         default:  usageError(argv[0], NULL);
         }
     }
@@ -96,9 +161,24 @@ main(int argc, char *argv[])
     if (argc > optind + 1)
         usageError(argv[0], NULL);
 
-    if (nftw((argc > optind) ? argv[optind] : ".", dirTree, 10, flags) == -1) {
-        perror("nftw");
-        exit(EXIT_FAILURE);
+    dirPath = (argc > optind) ? argv[optind] : ".";
+    start = timeNow();
+
+    if (nthreads < 0) {
+        if (nftw(dirPath, dirTree, 10, flags) == -1) {
+            perror("nftw");
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        if (treeWalk(dirPath, nthreads, 0, twFlags, dirTreeParallel, NULL,
+                     &stats) == -1)
+            errExit("treeWalk");
+        numFiles = stats.entries;
     }
+
+    elapsed = timeNow() - start;
+    fflush(stdout);
+    fprintf(stderr, "%ld files in %.3f secs (%.0f files/sec)\n",
+            numFiles, elapsed, numFiles / elapsed);
     exit(EXIT_SUCCESS);
 }
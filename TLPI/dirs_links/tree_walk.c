@@ -0,0 +1,667 @@
+/*************************************************************************\
+*                  Copyright (C) Michael Kerrisk, 2020.                   *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU Lesser General Public License as published   *
+* by the Free Software Foundation, either version 3 or (at your option)   *
+* any later version. This program is distributed without any warranty.    *
+* See the files COPYING.lgpl-v3 and COPYING.gpl-v3 for details.           *
+\*************************************************************************/
+
+/* Supplementary program for Chapter 18 */
+
+/* tree_walk.c
+
+   A parallel directory tree walker, for use in place of nftw() on large
+   trees.
+
+   treeWalk(root, nthreads, statxMask, flags, fn, arg, stats) calls
+   fn(ent, arg) for each file in the tree under 'root', including 'root'
+   itself, much as nftw() does with FTW_PHYS: symbolic links are not
+   followed. 'flags' may include TW_DEPTH and TW_MOUNT, which correspond
+   to FTW_DEPTH and FTW_MOUNT. The walk stops early if 'fn' returns a
+   nonzero value, which treeWalk() then returns; otherwise treeWalk()
+   returns 0 when the walk is complete, or -1 on error (including a
+   failure of getdents64() while reading a directory, which, as with
+   nftw(), ends the walk).
+
+   Unlike nftw(), which stat()s every file, treeWalk() reads directories
+   with getdents64() into a large buffer and takes the file type from
+   'd_type'. It calls statx() (relative to the directory's file
+   descriptor) only for files whose type the filesystem doesn't report
+   (DT_UNKNOWN), or if the caller asks for the fields in 'statxMask' (a
+   mask of STATX_* values), in which case 'ent->stx' points to the result.
+   The i-node number always comes from 'd_ino'. (For a mount point, this
+   is the number of the directory underneath the mount, not the root of
+   the mounted filesystem.)
+
+   The tree is walked by 'nthreads' threads (the caller, plus 'nthreads'
+   - 1 helpers; if 'nthreads' is 0, one per online CPU). Each directory
+   still to be read is a work item, and each thread has its own deque of
+   items. A thread takes items from the tail of its own deque, so that it
+   walks its part of the tree depth-first; when the deque is empty, it
+   steals from the head of another thread's deque, where the items nearer
+   the top of the tree, and so likely to represent the most work, are
+   found. This is the same scheme as the walker in inotify_dtree.c. A
+   thread that finds no work anywhere sleeps on a condition variable
+   until more is queued, or the walk is complete.
+
+   Within a directory, 'fn' sees a directory (TW_D) before its contents,
+   and with TW_DEPTH, a directory (TW_DP) after all of its contents.
+   Otherwise, there is no ordering between calls: different threads call
+   'fn' at the same time for files in different parts of the tree, so
+   'fn' must do its own locking, or keep per-thread results indexed by
+   'ent->thread'.
+
+   Each directory is opened with openat() relative to its parent's file
+   descriptor, which is kept open until all of the parent's
+   subdirectories have been opened, so the depth of the tree isn't
+   limited by PATH_MAX. ('ent->path' is nevertheless the full pathname.)
+   At most, one descriptor is open for each directory that has
+   subdirectories still waiting in a deque.
+*/
+#define _GNU_SOURCE
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "tree_walk.h"
+
+/* A directory entry, as returned by getdents64() */
+
+struct linux_dirent64 {
+    ino64_t        d_ino;
+    off64_t        d_off;
+    unsigned short d_reclen;
+    unsigned char  d_type;
+    char           d_name[];
+};
+
+/* A directory that is queued to be read, or whose subdirectories are
+   still being walked */
+
+struct twDir {
+    struct twDir *parent;
+    int refs;                   /* 1 until this directory has been read,
+                                   plus 1 for each subdirectory not yet
+                                   finished */
+    int level;
+    int base;
+    int skip;                   /* Don't report as TW_DP */
+    int fd;                     /* Open while being read, and until all
+                                   subdirectories have been opened */
+    int fdRefs;                 /* 1 until this directory has been read,
+                                   plus 1 for each subdirectory not yet
+                                   opened */
+    ino_t ino;
+    int haveStx;                /* 'stx' is valid */
+    struct statx stx;
+    char path[];
+};
+
+struct walk;
+
+struct walkThread {
+    pthread_t thread;
+    struct walk *w;
+    int idx;                    /* Index of this thread in 'w->threads' */
+    pthread_mutex_t mtx;        /* Protects the deque */
+    struct twDir **items;       /* Deque of items: items[head..tail-1] */
+    int head;
+    int tail;
+    int size;                   /* Allocated size of 'items' */
+    char *buf;                  /* getdents64() buffer */
+    char *pathBuf;              /* For building pathnames of files */
+    size_t pathBufSize;
+    struct twStats stats;
+};
+
+struct walk {
+    int nthreads;
+    struct walkThread *threads;
+    unsigned int statxMask;
+    int flags;
+    dev_t rootDev;              /* For TW_MOUNT */
+    twCallback fn;
+    void *arg;
+    int pending;                /* Number of directories queued or being
+                                   read; the walk is complete when this
+                                   drops to 0 */
+    int queued;                 /* Number of directories in the deques */
+    pthread_mutex_t idleMtx;    /* Protects 'idle', for 'idleCond' */
+    pthread_cond_t idleCond;    /* Signaled when work is queued, or the
+                                   walk is complete */
+    int idle;                   /* Threads waiting on 'idleCond' */
+    int result;                 /* First nonzero return from 'fn' */
+    int error;                  /* errno value, if walk failed */
+};
+
+/* Stop the walk, with 'fn' result 'result' or errno value 'error' */
+
+static void
+stopWalk(struct walk *w, int result, int error)
+{
+    int zero = 0;
+
+    if (result != 0)
+        __atomic_compare_exchange_n(&w->result, &zero, result, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    zero = 0;
+    if (error != 0)
+        __atomic_compare_exchange_n(&w->error, &zero, error, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+static int
+stopped(struct walk *w)
+{
+    return __atomic_load_n(&w->result, __ATOMIC_ACQUIRE) != 0 ||
+           __atomic_load_n(&w->error, __ATOMIC_ACQUIRE) != 0;
+}
+
+static void
+report(struct walkThread *wt, const char *path, int base, int level,
+       int info, unsigned char type, ino_t ino, const struct statx *stx)
+{
+    struct walk *w = wt->w;
+    struct twEntry ent;
+    int s;
+
+    if (stopped(w))
+        return;
+
+    ent.path = path;
+    ent.base = base;
+    ent.level = level;
+    ent.info = info;
+    ent.type = type;
+    ent.ino = ino;
+    ent.stx = (w->statxMask != 0) ? stx : NULL;
+    ent.thread = wt->idx;
+
+    wt->stats.entries++;
+    s = w->fn(&ent, w->arg);
+    if (s != 0)
+        stopWalk(w, s, 0);
+}
+
+static struct twDir *
+newDir(struct twDir *parent, const char *path, size_t plen,
+       const char *name, int level, ino_t ino, const struct statx *stx)
+{
+    struct twDir *d;
+    size_t nlen;
+    int sep;
+
+    nlen = (name != NULL) ? strlen(name) : 0;
+    sep = name != NULL && plen > 0 && path[plen - 1] != '/';
+
+    d = malloc(sizeof(struct twDir) + plen + sep + nlen + 1);
+    if (d == NULL)
+        return NULL;
+
+    d->parent = parent;
+    d->refs = 1;
+    d->level = level;
+    d->skip = 0;
+    d->fd = -1;
+    d->fdRefs = 1;
+    d->ino = ino;
+    d->haveStx = stx != NULL;
+    if (stx != NULL)
+        d->stx = *stx;
+
+    memcpy(d->path, path, plen);
+    if (sep)
+        d->path[plen] = '/';
+    if (name != NULL)
+        memcpy(d->path + plen + sep, name, nlen);
+    d->path[plen + sep + nlen] = '\0';
+
+    if (name != NULL) {
+        d->base = plen + sep;
+    } else {                    /* The root; 'base' is as for nftw() */
+        d->base = plen;
+        while (d->base > 0 && d->path[d->base - 1] == '/')
+            d->base--;
+        while (d->base > 0 && d->path[d->base - 1] != '/')
+            d->base--;
+    }
+
+    if (parent != NULL) {
+        __atomic_add_fetch(&parent->refs, 1, __ATOMIC_ACQ_REL);
+        __atomic_add_fetch(&parent->fdRefs, 1, __ATOMIC_ACQ_REL);
+    }
+
+    return d;
+}
+
+/* Drop a reference to the file descriptor of 'd', closing it when 'd'
+   has been read and all of its subdirectories have been opened */
+
+static void
+releaseFd(struct twDir *d)
+{
+    if (__atomic_sub_fetch(&d->fdRefs, 1, __ATOMIC_ACQ_REL) == 0 &&
+            d->fd != -1) {
+        close(d->fd);
+        d->fd = -1;
+    }
+}
+
+/* Drop a reference to 'd'; when a directory and all of its
+   subdirectories are finished, report it (with TW_DEPTH), and drop its
+   reference to its parent */
+
+static void
+releaseDir(struct walkThread *wt, struct twDir *d)
+{
+    struct twDir *parent;
+
+    while (d != NULL &&
+            __atomic_sub_fetch(&d->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        if ((wt->w->flags & TW_DEPTH) && !d->skip)
+            report(wt, d->path, d->base, d->level, TW_DP, DT_DIR, d->ino,
+                   d->haveStx ? &d->stx : NULL);
+        parent = d->parent;
+        free(d);
+        d = parent;
+    }
+}
+
+/* Add a directory to the tail of the deque of thread 'wt' */
+
+static int
+pushWork(struct walkThread *wt, struct twDir *d)
+{
+    struct twDir **items;
+    int newSize;
+
+    pthread_mutex_lock(&wt->mtx);
+
+    if (wt->tail == wt->size) {
+        if (wt->head > 0) {             /* Reclaim space at head */
+            memmove(wt->items, wt->items + wt->head,
+                    (wt->tail - wt->head) * sizeof(struct twDir *));
+            wt->tail -= wt->head;
+            wt->head = 0;
+        }
+
+        if (wt->tail == wt->size) {
+            newSize = (wt->size == 0) ? 256 : wt->size * 2;
+            items = realloc(wt->items, newSize * sizeof(struct twDir *));
+            if (items == NULL) {
+                pthread_mutex_unlock(&wt->mtx);
+                return -1;
+            }
+            wt->items = items;
+            wt->size = newSize;
+        }
+    }
+
+    __atomic_add_fetch(&wt->w->pending, 1, __ATOMIC_ACQ_REL);
+    wt->items[wt->tail++] = d;
+    __atomic_add_fetch(&wt->w->queued, 1, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_unlock(&wt->mtx);
+
+    /* Wake a thread that has run out of work, if there is one. This
+       pairs with the check of 'queued' in waitForWork(): either that
+       check sees our item, or we see the waiter's 'idle' count. */
+
+    if (__atomic_load_n(&wt->w->idle, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&wt->w->idleMtx);
+        pthread_cond_signal(&wt->w->idleCond);
+        pthread_mutex_unlock(&wt->w->idleMtx);
+    }
+    return 0;
+}
+
+/* Take an item from the tail ('fromTail' true) or the head of the deque
+   of thread 'wt'. Returns NULL if the deque is empty. */
+
+static struct twDir *
+takeWork(struct walkThread *wt, int fromTail)
+{
+    struct twDir *d = NULL;
+
+    pthread_mutex_lock(&wt->mtx);
+
+    if (wt->head < wt->tail) {
+        if (fromTail)
+            d = wt->items[--wt->tail];
+        else
+            d = wt->items[wt->head++];
+
+        if (wt->head == wt->tail)
+            wt->head = wt->tail = 0;
+        __atomic_sub_fetch(&wt->w->queued, 1, __ATOMIC_SEQ_CST);
+    }
+
+    pthread_mutex_unlock(&wt->mtx);
+    return d;
+}
+
+/* Report the file 'name' in directory 'd' (which is open on 'fd'); if
+   it is a directory, queue it */
+
+static void
+doEntry(struct walkThread *wt, struct twDir *d, int fd,
+        struct linux_dirent64 *de)
+{
+    struct walk *w = wt->w;
+    struct statx stx;
+    struct twDir *sub;
+    unsigned char type;
+    size_t plen, nlen;
+    int info, sep, haveStx;
+
+    type = de->d_type;
+    info = 0;
+    haveStx = 0;
+
+    if (w->statxMask != 0 || type == DT_UNKNOWN) {
+        wt->stats.statxCalls++;
+        if (statx(fd, de->d_name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT,
+                  w->statxMask | STATX_TYPE, &stx) == -1) {
+            if (type == DT_UNKNOWN)
+                info = TW_NS;
+        } else {
+            type = IFTODT(stx.stx_mode);
+            haveStx = 1;
+        }
+    }
+
+    plen = strlen(d->path);
+
+    if (type == DT_DIR) {
+        sub = newDir(d, d->path, plen, de->d_name, d->level + 1,
+                     de->d_ino, haveStx ? &stx : NULL);
+        if (sub == NULL) {
+            stopWalk(w, 0, ENOMEM);
+            return;
+        }
+        if (pushWork(wt, sub) == -1) {
+            stopWalk(w, 0, ENOMEM);
+            sub->skip = 1;
+            releaseFd(d);               /* 'sub' won't be opened */
+            releaseDir(wt, sub);
+        }
+        return;
+    }
+
+    if (info == 0)
+        info = (type == DT_LNK) ? TW_SL : TW_F;
+
+    /* Build the pathname in this thread's buffer */
+
+    nlen = strlen(de->d_name);
+    sep = plen > 0 && d->path[plen - 1] != '/';
+    if (plen + sep + nlen + 1 > wt->pathBufSize) {
+        free(wt->pathBuf);
+        wt->pathBufSize = (plen + sep + nlen + 1) * 2;
+        wt->pathBuf = malloc(wt->pathBufSize);
+        if (wt->pathBuf == NULL) {
+            wt->pathBufSize = 0;
+            stopWalk(w, 0, ENOMEM);
+            return;
+        }
+    }
+    memcpy(wt->pathBuf, d->path, plen);
+    if (sep)
+        wt->pathBuf[plen] = '/';
+    memcpy(wt->pathBuf + plen + sep, de->d_name, nlen + 1);
+
+    report(wt, wt->pathBuf, plen + sep, d->level + 1, info,
+           (info == TW_NS) ? DT_UNKNOWN : type, de->d_ino,
+           haveStx ? &stx : NULL);
+}
+
+/* Report the directory 'd' and its contents, queueing its
+   subdirectories */
+
+static void
+scanDir(struct walkThread *wt, struct twDir *d)
+{
+    struct walk *w = wt->w;
+    struct linux_dirent64 *de;
+    struct stat sb;
+    ssize_t nread;
+
+    if (!stopped(w)) {
+        if (d->parent != NULL)
+            d->fd = openat(d->parent->fd, d->path + d->base,
+                           O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        else
+            d->fd = open(d->path,
+                         O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    }
+    if (d->parent != NULL)
+        releaseFd(d->parent);
+
+    if (d->fd == -1) {
+        d->skip = 1;
+        if (!stopped(w))
+            report(wt, d->path, d->base, d->level, TW_DNR, DT_DIR, d->ino,
+                   d->haveStx ? &d->stx : NULL);
+        releaseFd(d);
+        return;
+    }
+
+    if ((w->flags & TW_MOUNT) &&
+            (fstat(d->fd, &sb) == -1 || sb.st_dev != w->rootDev)) {
+        d->skip = 1;                    /* On another filesystem */
+        releaseFd(d);
+        return;
+    }
+
+    if (!(w->flags & TW_DEPTH))
+        report(wt, d->path, d->base, d->level, TW_D, DT_DIR, d->ino,
+               d->haveStx ? &d->stx : NULL);
+
+    wt->stats.dirs++;
+
+    while (!stopped(w)) {
+        wt->stats.getdentsCalls++;
+        nread = syscall(SYS_getdents64, d->fd, wt->buf, TW_BUF_SIZE);
+        if (nread == -1)
+            stopWalk(w, 0, errno);
+        if (nread <= 0)                 /* End of directory, or error */
+            break;
+
+        for (char *p = wt->buf; p < wt->buf + nread; p += de->d_reclen) {
+            de = (struct linux_dirent64 *) p;
+
+            if (strcmp(de->d_name, ".") == 0 ||
+                    strcmp(de->d_name, "..") == 0)
+                continue;
+
+            doEntry(wt, d, d->fd, de);
+        }
+    }
+
+    releaseFd(d);
+}
+
+/* Called by a thread that found all of the deques empty. Returns 0 when
+   there may be work to take, or -1 when the walk is complete. */
+
+static int
+waitForWork(struct walk *w)
+{
+    int done;
+
+    pthread_mutex_lock(&w->idleMtx);
+    __atomic_add_fetch(&w->idle, 1, __ATOMIC_SEQ_CST);
+
+    done = 0;
+    while (__atomic_load_n(&w->queued, __ATOMIC_SEQ_CST) == 0) {
+        if (__atomic_load_n(&w->pending, __ATOMIC_ACQUIRE) == 0) {
+            done = 1;
+            break;
+        }
+        pthread_cond_wait(&w->idleCond, &w->idleMtx);
+    }
+
+    __atomic_sub_fetch(&w->idle, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&w->idleMtx);
+    return done ? -1 : 0;
+}
+
+/* Read directories until the walk is complete */
+
+static void *
+walkWorker(void *arg)
+{
+    struct walkThread *wt = arg;
+    struct walk *w = wt->w;
+    struct twDir *d;
+
+    for (;;) {
+        d = takeWork(wt, 1);
+
+        for (int k = 1; d == NULL && k < w->nthreads; k++)
+            d = takeWork(&w->threads[(wt->idx + k) % w->nthreads], 0);
+
+        if (d == NULL) {
+            if (waitForWork(w) == -1)
+                break;
+            continue;
+        }
+
+        scanDir(wt, d);
+        releaseDir(wt, d);
+
+        /* 'pending' counts this directory until now, and its
+           subdirectories from when they were queued; so it reaches 0
+           only at the end of the walk, when any sleeping threads must
+           be woken to return */
+
+        if (__atomic_sub_fetch(&w->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+            pthread_mutex_lock(&w->idleMtx);
+            pthread_cond_broadcast(&w->idleCond);
+            pthread_mutex_unlock(&w->idleMtx);
+        }
+    }
+
+    return NULL;
+}
+
+int
+treeWalk(const char *root, int nthreads, unsigned int statxMask,
+         int flags, twCallback fn, void *arg, struct twStats *stats)
+{
+    struct walk w;
+    struct walkThread wt0;
+    struct statx stx;
+    struct twDir *d;
+    unsigned char type;
+    int s, started;
+
+    if (nthreads <= 0) {
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (nthreads < 1)
+            nthreads = 1;
+    }
+
+    w.nthreads = nthreads;
+    w.statxMask = statxMask;
+    w.flags = flags;
+    w.fn = fn;
+    w.arg = arg;
+    w.pending = 0;
+    w.queued = 0;
+    w.idle = 0;
+    w.result = 0;
+    w.error = 0;
+
+    if (stats != NULL)
+        memset(stats, 0, sizeof(struct twStats));
+
+    /* The root is always stat()ed, to find its type */
+
+    if (statx(AT_FDCWD, root, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT,
+              statxMask | STATX_TYPE | STATX_INO, &stx) == -1)
+        return -1;
+    w.rootDev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+    type = IFTODT(stx.stx_mode);
+
+    if (type != DT_DIR) {               /* Just report the root */
+        memset(&wt0, 0, sizeof(wt0));
+        wt0.w = &w;
+        report(&wt0, root, 0, 0, (type == DT_LNK) ? TW_SL : TW_F, type,
+               stx.stx_ino, &stx);
+        if (stats != NULL)
+            *stats = wt0.stats;
+        return w.result;
+    }
+
+    w.threads = calloc(nthreads, sizeof(struct walkThread));
+    if (w.threads == NULL)
+        return -1;
+    pthread_mutex_init(&w.idleMtx, NULL);
+    pthread_cond_init(&w.idleCond, NULL);
+
+    for (int j = 0; j < nthreads; j++) {
+        w.threads[j].w = &w;
+        w.threads[j].idx = j;
+        pthread_mutex_init(&w.threads[j].mtx, NULL);
+        w.threads[j].buf = malloc(TW_BUF_SIZE);
+        if (w.threads[j].buf == NULL)
+            w.error = ENOMEM;
+    }
+
+    d = newDir(NULL, root, strlen(root), NULL, 0, stx.stx_ino, &stx);
+    if (d == NULL)
+        w.error = ENOMEM;
+
+    if (w.error == 0 && pushWork(&w.threads[0], d) == -1) {
+        free(d);
+        w.error = ENOMEM;
+    }
+
+    /* The calling thread serves as the first walker */
+
+    started = 1;
+    if (w.error == 0) {
+        for (; started < nthreads; started++) {
+            s = pthread_create(&w.threads[started].thread, NULL, walkWorker,
+                               &w.threads[started]);
+            if (s != 0)             /* Carry on with the threads we have */
+                break;
+        }
+
+        walkWorker(&w.threads[0]);
+    }
+
+    for (int j = 1; j < started; j++)
+        pthread_join(w.threads[j].thread, NULL);
+
+    for (int j = 0; j < nthreads; j++) {
+        if (stats != NULL && j < started) {
+            stats->entries += w.threads[j].stats.entries;
+            stats->dirs += w.threads[j].stats.dirs;
+            stats->getdentsCalls += w.threads[j].stats.getdentsCalls;
+            stats->statxCalls += w.threads[j].stats.statxCalls;
+        }
+        free(w.threads[j].items);
+        free(w.threads[j].buf);
+        free(w.threads[j].pathBuf);
+        pthread_mutex_destroy(&w.threads[j].mtx);
+    }
+    free(w.threads);
+    pthread_cond_destroy(&w.idleCond);
+    pthread_mutex_destroy(&w.idleMtx);
+
+    if (w.error != 0) {
+        errno = w.error;
+        return -1;
+    }
+    return w.result;
+}
@@ -0,0 +1,68 @@
+/*************************************************************************\
+*                  Copyright (C) Michael Kerrisk, 2020.                   *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU Lesser General Public License as published   *
+* by the Free Software Foundation, either version 3 or (at your option)   *
+* any later version. This program is distributed without any warranty.    *
+* See the files COPYING.lgpl-v3 and COPYING.gpl-v3 for details.           *
+\*************************************************************************/
+
+/* tree_walk.h
+
+   Header file for tree_walk.c.
+*/
+#ifndef TREE_WALK_H
+#define TREE_WALK_H             /* Prevent accidental double inclusion */
+
+#include <sys/types.h>
+
+struct statx;                   /* Declared in <sys/stat.h> with
+                                   _GNU_SOURCE */
+
+/* Values for 'flags' argument of treeWalk() */
+
+#define TW_DEPTH        01      /* Report directories after their contents */
+#define TW_MOUNT        02      /* Don't cross mount points */
+
+/* Values for 'info' field of struct twEntry, with the same meanings as
+   the FTW_* values used by nftw() */
+
+#define TW_F            1       /* Not a directory or symbolic link */
+#define TW_D            2       /* Directory, before its contents */
+#define TW_DNR          3       /* Directory that can't be read */
+#define TW_DP           4       /* Directory, after its contents */
+#define TW_SL           5       /* Symbolic link */
+#define TW_NS           6       /* Type unknown, and statx() failed */
+
+#define TW_BUF_SIZE (256 * 1024)        /* getdents64() buffer size */
+
+struct twEntry {
+    const char *path;           /* Pathname, starting with the root */
+    int base;                   /* Offset of the last component in 'path' */
+    int level;                  /* Depth in the tree; the root is 0 */
+    int info;                   /* TW_* value (see above) */
+    unsigned char type;         /* DT_* value; DT_UNKNOWN for TW_NS */
+    ino_t ino;                  /* I-node number */
+    const struct statx *stx;    /* NULL unless treeWalk() was asked for
+                                   statx() fields */
+    int thread;                 /* Number of walker thread that made the
+                                   call (0 to nthreads - 1) */
+};
+
+/* Called for each file in the tree, by any of the walker threads; a
+   nonzero return stops the walk */
+
+typedef int (*twCallback)(const struct twEntry *ent, void *arg);
+
+struct twStats {
+    long entries;               /* Callbacks made */
+    long dirs;                  /* Directories read */
+    long getdentsCalls;
+    long statxCalls;
+};
+
+int treeWalk(const char *root, int nthreads, unsigned int statxMask,
+             int flags, twCallback fn, void *arg, struct twStats *stats);
+
+#endif
@@ -0,0 +1,264 @@
+/*************************************************************************\
+*                  Copyright (C) Michael Kerrisk, 2020.                   *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU General Public License as published by the   *
+* Free Software Foundation, either version 3 or (at your option) any      *
+* later version. This program is distributed without any warranty.  See   *
+* the file COPYING.gpl-v3 for details.                                    *
+\*************************************************************************/
+
+/* Supplementary program for Chapter 4 */
+
+/* copy_bench.c
+
+   Compare the throughput of the strategies offered by copy_engine.c.
+
+   Usage: copy_bench [-d src-dir] [-D dst-dir] [-M max-MiB] [-t total-MiB]
+
+   For each of a range of file sizes from 4 KiB up to 'max-MiB' (default:
+   1024), a file of that size is created in 'src-dir' (default: /tmp), and
+   is then copied to 'dst-dir' (default: 'src-dir') with each strategy,
+   repeatedly, until about 'total-MiB' (default: 256) have been copied (but
+   at least once, and at most 1000 times). The throughput in MB/s is shown
+   for each combination, along with the strategy that CS_AUTO chose. Using
+   a 'dst-dir' on a different filesystem shows how the strategies behave
+   when the data can't stay inside one filesystem.
+
+   The source file is in the page cache after it is created, so that these
+   figures mostly measure the cost of moving data, not of reading the disk.
+
+   A final row copies a sparse file (64 MiB in size, with 1 MiB of data
+   every 8 MiB), and shows the space allocated to the copy, to confirm that
+   each strategy preserves the holes.
+*/
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include "copy_engine.h"
+#include "tlpi_hdr.h"
+
+#define SPARSE_SIZE     (64 * 1024 * 1024)
+#define SPARSE_STRIDE   (8 * 1024 * 1024)
+#define SPARSE_DATA     (1024 * 1024)
+
+static const char *colNames[CS_NUM_STRATEGIES] = {
+    "auto", "rw", "cfr", "sendfile", "splice", "mmap", "direct"
+};
+
+static double
+timeNow(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        errExit("clock_gettime");
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Create a file of 'size' bytes. If 'sparse' is nonzero, only the first
+   SPARSE_DATA bytes of each SPARSE_STRIDE bytes are written. */
+
+static void
+createFile(const char *path, long long size, int sparse)
+{
+    char buf[65536];
+    long long done;
+    size_t n;
+    int fd;
+
+    for (size_t j = 0; j < sizeof(buf); j++)
+        buf[j] = 'a' + j % 26;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd == -1)
+        errExit("open-%s", path);
+
+    for (done = 0; done < size; done += n) {
+        if (sparse && done % SPARSE_STRIDE >= SPARSE_DATA) {
+            done += SPARSE_STRIDE - done % SPARSE_STRIDE;
+            n = 0;
+            continue;
+        }
+
+        n = (size - done < (long long) sizeof(buf)) ?
+                size - done : sizeof(buf);
+        if (pwrite(fd, buf, n, done) != (ssize_t) n)
+            fatal("write to %s failed", path);
+    }
+
+    if (ftruncate(fd, size) == -1)
+        errExit("ftruncate");
+    if (close(fd) == -1)
+        errExit("close");
+}
+
+/* Copy 'src' to 'dst' 'reps' times with strategy 's'. Returns the elapsed
+   time, or -1 if a copy failed. The statistics of the last copy are
+   returned in 'stats'. */
+
+static double
+timeCopies(const char *src, const char *dst, enum copyStrategy s, int reps,
+           struct copyStats *stats)
+{
+    double start;
+
+    start = timeNow();
+    for (int j = 0; j < reps; j++)
+        if (copyFile(src, dst, s, stats) == -1)
+            return -1;
+
+    return timeNow() - start;
+}
+
+/* Return nonzero if the files 'a' and 'b' have the same contents */
+
+static int
+sameContents(const char *a, const char *b)
+{
+    char bufA[65536], bufB[65536];
+    ssize_t na, nb;
+    int fdA, fdB, same;
+
+    fdA = open(a, O_RDONLY);
+    fdB = open(b, O_RDONLY);
+    if (fdA == -1 || fdB == -1)
+        errExit("open");
+
+    for (same = 1; same; ) {
+        na = read(fdA, bufA, sizeof(bufA));
+        nb = read(fdB, bufB, sizeof(bufB));
+        if (na == -1 || nb == -1)
+            errExit("read");
+        if (na != nb || memcmp(bufA, bufB, na) != 0)
+            same = 0;
+        if (na == 0)
+            break;
+    }
+
+    close(fdA);
+    close(fdB);
+    return same;
+}
+
+static void
+printSize(long long size)
+{
+    if (size < 1024 * 1024)
+        printf("%8lldKB", size / 1024);
+    else
+        printf("%8lldMB", size / (1024 * 1024));
+}
+
+static void
+printHeader(const char *what)
+{
+    printf("%10s %5s", "Size", "Reps");
+    for (int s = CS_RW; s < CS_NUM_STRATEGIES; s++)
+        printf(" %9s", colNames[s]);
+    printf(" %9s   %s\n", colNames[CS_AUTO], what);
+}
+
+int
+main(int argc, char *argv[])
+{
+    char src[PATH_MAX], dst[PATH_MAX];
+    const char *srcDir, *dstDir;
+    struct copyStats stats;
+    struct stat sb;
+    long long size, maxSize, total;
+    int opt, reps, s, autoChoice;
+    double secs;
+
+    srcDir = "/tmp";
+    dstDir = NULL;
+    maxSize = 1024LL * 1024 * 1024;
+    total = 256LL * 1024 * 1024;
+
+    while ((opt = getopt(argc, argv, "d:D:M:t:")) != -1) {
+        switch (opt) {
+        case 'd': srcDir = optarg;                                      break;
+        case 'D': dstDir = optarg;                                      break;
+        case 'M': maxSize = getLong(optarg, GN_GT_0, "max-MiB") << 20;  break;
+        case 't': total = getLong(optarg, GN_GT_0, "total-MiB") << 20;  break;
+        default:  usageErr("%s [-d src-dir] [-D dst-dir] [-M max-MiB] "
+                           "[-t total-MiB]\n", argv[0]);
+        }
+    }
+
+    if (dstDir == NULL)
+        dstDir = srcDir;
+
+    snprintf(src, sizeof(src), "%s/copy_bench_src.%ld", srcDir,
+             (long) getpid());
+    snprintf(dst, sizeof(dst), "%s/copy_bench_dst.%ld", dstDir,
+             (long) getpid());
+
+    printHeader("(MB/s)");
+
+    for (size = 4096; size <= maxSize; size *= 16) {
+        createFile(src, size, 0);
+
+        reps = total / size;
+        reps = (reps < 1) ? 1 : (reps > 1000) ? 1000 : reps;
+
+        printSize(size);
+        printf(" %5d", reps);
+
+        autoChoice = CS_AUTO;
+        for (s = CS_RW; s <= CS_NUM_STRATEGIES; s++) {
+            enum copyStrategy strat = (s == CS_NUM_STRATEGIES) ? CS_AUTO : s;
+
+            secs = timeCopies(src, dst, strat, reps, &stats);
+            if (secs < 0)
+                printf(" %9s", "failed");
+            else if (!sameContents(src, dst))
+                printf(" %9s", "BAD");
+            else
+                printf(" %8.0f%s", size * reps / secs / 1e6,
+                       stats.fellBack ? "*" : " ");
+            fflush(stdout);
+
+            if (strat == CS_AUTO)
+                autoChoice = stats.used;
+        }
+        printf("   %s\n", copyStrategyName(autoChoice));
+    }
+
+    /* Sparse file: show the space allocated to each copy */
+
+    printf("\n");
+    printHeader("(KiB allocated)");
+
+    createFile(src, SPARSE_SIZE, 1);
+    if (stat(src, &sb) == -1)
+        errExit("stat");
+    printSize(SPARSE_SIZE);
+    printf(" %5s", "src");
+    printf(" %8lld\n", (long long) sb.st_blocks / 2);
+
+    printSize(SPARSE_SIZE);
+    printf(" %5s", "dst");
+    for (s = CS_RW; s <= CS_NUM_STRATEGIES; s++) {
+        enum copyStrategy strat = (s == CS_NUM_STRATEGIES) ? CS_AUTO : s;
+
+        if (copyFile(src, dst, strat, &stats) == -1) {
+            printf(" %9s", "failed");
+        } else if (!sameContents(src, dst)) {
+            printf(" %9s", "BAD");
+        } else {
+            if (stat(dst, &sb) == -1)
+                errExit("stat");
+            printf(" %8lld%s", (long long) sb.st_blocks / 2,
+                   stats.fellBack ? "*" : " ");
+        }
+        fflush(stdout);
+    }
+    printf("\n\n* = strategy not supported here; fell back to rw\n");
+
+    if (unlink(src) == -1 || unlink(dst) == -1)
+        errExit("unlink");
+
+    exit(EXIT_SUCCESS);
+}
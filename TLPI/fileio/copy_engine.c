@@ -0,0 +1,620 @@
+/*************************************************************************\
+*                  Copyright (C) Michael Kerrisk, 2020.                   *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU Lesser General Public License as published   *
+* by the Free Software Foundation, either version 3 or (at your option)   *
+* any later version. This program is distributed without any warranty.    *
+* See the files COPYING.lgpl-v3 and COPYING.gpl-v3 for details.           *
+\*************************************************************************/
+
+/* copy_engine.c
+
+   A file copy engine with a choice of strategies for moving the data:
+
+   CS_RW               pread()/pwrite() with a 1 MiB buffer (copy.c uses
+                       read()/write() with a 1 KiB buffer)
+   CS_COPY_FILE_RANGE  copy_file_range(); the data need not pass through
+                       user space, and some filesystems can share extents
+                       (reflink) or copy on the server (NFS)
+   CS_SENDFILE         sendfile(), which on Linux (since 2.6.33) can write
+                       to a regular file
+   CS_SPLICE           splice() from the source to a pipe, and from the
+                       pipe to the destination
+   CS_MMAP             write() from a mapping of the source, mapped in
+                       64 MiB chunks with MADV_SEQUENTIAL (mmcopy.c maps the
+                       whole of both files, and then uses msync(MS_SYNC))
+   CS_DIRECT           O_DIRECT I/O with an aligned 4 MiB buffer, which
+                       bypasses the page cache
+
+   With CS_AUTO, copyChooseStrategy() picks a strategy based on the file
+   size and on the filesystems involved.
+
+   Holes in a sparse source file are preserved: SEEK_DATA and SEEK_HOLE
+   are used to find the data segments, and only those are copied. The
+   destination is then extended to the size of the source with
+   ftruncate(), so that any trailing hole is preserved too.
+
+   If a strategy is not supported for the files at hand (e.g., O_DIRECT
+   on tmpfs before Linux 6.6, or copy_file_range() between filesystems of
+   different types), the rest of the copy is done with CS_RW.
+
+   Since CS_MMAP maps the source, the caller gets SIGBUS if the source is
+   truncated during the copy.
+*/
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "copy_engine.h"
+
+#define RW_BUF_SIZE     (1024 * 1024)
+#define DIRECT_BUF_SIZE (4 * 1024 * 1024)
+#define DIRECT_ALIGN    4096            /* Alignment for O_DIRECT */
+#define MMAP_CHUNK      (64 * 1024 * 1024)
+#define PIPE_SIZE       (1024 * 1024)
+#define MAX_XFER        0x7ffff000      /* Most bytes that Linux moves
+                                           in one system call */
+
+/* Files smaller than this are copied with CS_RW, since the setup costs
+   of the other strategies outweigh any gain */
+
+#define SMALL_FILE      (64 * 1024)
+
+static const char *strategyNames[CS_NUM_STRATEGIES] = {
+    "auto", "rw", "copy_file_range", "sendfile", "splice", "mmap", "direct"
+};
+
+struct copyCtx {                /* State used during a single copy */
+    int inFd;
+    int outFd;
+    char *buf;                  /* Buffer for CS_RW and CS_DIRECT */
+    size_t bufSize;
+    int pipeFd[2];              /* Pipe for CS_SPLICE */
+};
+
+const char *
+copyStrategyName(enum copyStrategy s)
+{
+    return (s >= 0 && s < CS_NUM_STRATEGIES) ? strategyNames[s] : "?";
+}
+
+/* Return the strategy called 'name', or -1 if there is no such strategy */
+
+int
+copyStrategyFromName(const char *name)
+{
+    for (int j = 0; j < CS_NUM_STRATEGIES; j++)
+        if (strcmp(name, strategyNames[j]) == 0)
+            return j;
+    return -1;
+}
+
+/* Choose a strategy for copying 'inFd' to 'outFd' */
+
+enum copyStrategy
+copyChooseStrategy(int inFd, int outFd)
+{
+    struct stat inSb, outSb;
+    struct statfs outFs;
+
+    if (fstat(inFd, &inSb) == -1 || fstat(outFd, &outSb) == -1)
+        return CS_RW;
+
+    if (!S_ISREG(inSb.st_mode) || inSb.st_size < SMALL_FILE)
+        return CS_RW;
+
+    /* Within a filesystem, copy_file_range() may avoid copying the data
+       at all (reflinks on Btrfs and XFS), and otherwise it is still an
+       in-kernel copy. On NFS, the server can do the copy. */
+
+    if (inSb.st_dev == outSb.st_dev)
+        return CS_COPY_FILE_RANGE;
+    if (fstatfs(outFd, &outFs) == 0 && outFs.f_type == NFS_SUPER_MAGIC)
+        return CS_COPY_FILE_RANGE;
+
+    /* Between filesystems, recent kernels refuse copy_file_range() unless
+       both are of the same type, and sendfile() was the fastest of the
+       other strategies in copy_bench.c. (CS_DIRECT was the slowest, since
+       the source is then read from disk even when it is cached, so it is
+       used only on request.) */
+
+    return CS_SENDFILE;
+}
+
+/* Write all of 'len' bytes of 'buf' at offset 'off' of 'fd' */
+
+static int
+pwriteAll(int fd, const char *buf, size_t len, off_t off)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = pwrite(fd, buf, len, off);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        off += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/* Each of the following functions copies the '*len' bytes at offset
+   '*off' of the source to the same offset in the destination. '*off' and
+   '*len' are updated as bytes are copied, so that if the function fails,
+   they describe the part of the range that remains to be copied. If the
+   source turns out to be shorter than expected, '*len' is set to 0. The
+   functions return 0 on success, or -1 on error. */
+
+static int
+rwRange(struct copyCtx *cx, off_t *off, off_t *len)
+{
+    ssize_t n;
+
+    while (*len > 0) {
+        n = pread(cx->inFd, cx->buf,
+                  (*len < (off_t) cx->bufSize) ? *len : (off_t) cx->bufSize,
+                  *off);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0) {                   /* Source has shrunk */
+            *len = 0;
+            break;
+        }
+
+        if (pwriteAll(cx->outFd, cx->buf, n, *off) == -1)
+            return -1;
+
+        *off += n;
+        *len -= n;
+    }
+
+    return 0;
+}
+
+static int
+copyFileRangeRange(struct copyCtx *cx, off_t *off, off_t *len)
+{
+    loff_t inOff, outOff;
+    ssize_t n;
+
+    while (*len > 0) {
+        inOff = outOff = *off;
+        n = copy_file_range(cx->inFd, &inOff, cx->outFd, &outOff,
+                            (*len < MAX_XFER) ? *len : MAX_XFER, 0);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0) {
+            *len = 0;
+            break;
+        }
+
+        *off += n;
+        *len -= n;
+    }
+
+    return 0;
+}
+
+static int
+sendfileRange(struct copyCtx *cx, off_t *off, off_t *len)
+{
+    off_t inOff;
+    ssize_t n;
+
+    /* sendfile() writes at the destination's file offset */
+
+    if (lseek(cx->outFd, *off, SEEK_SET) == -1)
+        return -1;
+
+    while (*len > 0) {
+        inOff = *off;
+        n = sendfile(cx->outFd, cx->inFd, &inOff,
+                     (*len < MAX_XFER) ? *len : MAX_XFER);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0) {
+            *len = 0;
+            break;
+        }
+
+        *off += n;
+        *len -= n;
+    }
+
+    return 0;
+}
+
+static int
+spliceRange(struct copyCtx *cx, off_t *off, off_t *len)
+{
+    loff_t inOff, outOff;
+    ssize_t n, m;
+
+    if (cx->pipeFd[0] == -1) {
+        if (pipe(cx->pipeFd) == -1)
+            return -1;
+
+        /* A bigger pipe means fewer splice() calls; failure to resize
+           it doesn't matter */
+
+        fcntl(cx->pipeFd[1], F_SETPIPE_SZ, PIPE_SIZE);
+    }
+
+    while (*len > 0) {
+        inOff = *off;
+        n = splice(cx->inFd, &inOff, cx->pipeFd[1], NULL,
+                   (*len < PIPE_SIZE) ? *len : PIPE_SIZE,
+                   SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0) {
+            *len = 0;
+            break;
+        }
+
+        /* Drain the pipe into the destination */
+
+        outOff = *off;
+        while (n > 0) {
+            m = splice(cx->pipeFd[0], NULL, cx->outFd, &outOff, n,
+                       SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (m == -1) {
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            n -= m;
+            *off += m;
+            *len -= m;
+        }
+    }
+
+    return 0;
+}
+
+static int
+mmapRange(struct copyCtx *cx, off_t *off, off_t *len)
+{
+    long pageSize;
+    off_t mapOff;
+    size_t mapLen, skip;
+    char *addr;
+    int s;
+
+    pageSize = sysconf(_SC_PAGESIZE);
+
+    while (*len > 0) {
+
+        /* The mapping must start on a page boundary */
+
+        mapOff = *off - *off % pageSize;
+        skip = *off - mapOff;
+        mapLen = (*len + skip < MMAP_CHUNK) ? *len + skip : MMAP_CHUNK;
+
+        addr = mmap(NULL, mapLen, PROT_READ, MAP_SHARED, cx->inFd, mapOff);
+        if (addr == MAP_FAILED)
+            return -1;
+
+        madvise(addr, mapLen, MADV_SEQUENTIAL);     /* Just a hint */
+
+        s = pwriteAll(cx->outFd, addr + skip, mapLen - skip, *off);
+
+        munmap(addr, mapLen);
+        if (s == -1)
+            return -1;
+
+        *off += mapLen - skip;
+        *len -= mapLen - skip;
+    }
+
+    return 0;
+}
+
+/* Turn O_DIRECT on or off for 'fd' */
+
+static int
+setDirect(int fd, int on)
+{
+    int flags;
+
+    flags = fcntl(fd, F_GETFL);
+    if (flags == -1)
+        return -1;
+
+    flags = on ? (flags | O_DIRECT) : (flags & ~O_DIRECT);
+    return fcntl(fd, F_SETFL, flags);
+}
+
+static int
+directRange(struct copyCtx *cx, off_t *off, off_t *len)
+{
+    ssize_t n, aligned;
+    size_t want;
+    int s, savedErrno;
+
+    /* O_DIRECT requires the file offset, the transfer size, and the
+       buffer address all to be suitably aligned */
+
+    if (*off % DIRECT_ALIGN != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (setDirect(cx->inFd, 1) == -1 || setDirect(cx->outFd, 1) == -1) {
+        savedErrno = errno;
+        setDirect(cx->inFd, 0);
+        errno = savedErrno;
+        return -1;
+    }
+
+    s = 0;
+    while (*len >= DIRECT_ALIGN) {
+        want = (*len < (off_t) cx->bufSize) ? *len : (off_t) cx->bufSize;
+        want -= want % DIRECT_ALIGN;
+
+        n = pread(cx->inFd, cx->buf, want, *off);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            s = -1;
+            break;
+        }
+        if (n == 0) {
+            *len = 0;
+            break;
+        }
+
+        /* A short read means we hit end of file; any unaligned remainder
+           is written below, with O_DIRECT turned off */
+
+        aligned = n - n % DIRECT_ALIGN;
+        if (aligned == 0)
+            break;
+
+        if (pwriteAll(cx->outFd, cx->buf, aligned, *off) == -1) {
+            s = -1;
+            break;
+        }
+
+        *off += aligned;
+        *len -= aligned;
+    }
+
+    savedErrno = errno;
+    if (setDirect(cx->inFd, 0) == -1 || setDirect(cx->outFd, 0) == -1)
+        s = -1;
+    else
+        errno = savedErrno;
+
+    /* Copy the final partial block (if any) through the page cache */
+
+    if (s == 0 && *len > 0)
+        s = rwRange(cx, off, len);
+
+    return s;
+}
+
+static int (*rangeFuncs[CS_NUM_STRATEGIES])(struct copyCtx *, off_t *,
+                                            off_t *) = {
+    NULL, rwRange, copyFileRangeRange, sendfileRange, spliceRange,
+    mmapRange, directRange
+};
+
+/* Copy from 'inFd' until end of file, when the input is not a regular
+   file (and so its size is unknown, and it has no holes) */
+
+static int
+streamCopy(struct copyCtx *cx, struct copyStats *stats)
+{
+    ssize_t n;
+    size_t done;
+
+    while ((n = read(cx->inFd, cx->buf, cx->bufSize)) != 0) {
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        for (done = 0; done < (size_t) n; ) {
+            ssize_t m = write(cx->outFd, cx->buf + done, n - done);
+            if (m == -1) {
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            done += m;
+        }
+
+        stats->dataBytes += n;
+    }
+
+    stats->segments = 1;
+    return 0;
+}
+
+/* Copy the data segment of 'len' bytes at 'off' using strategy 's'. If
+   the strategy isn't supported for these files, switch to CS_RW for this
+   and all later segments. */
+
+static int
+copySegment(struct copyCtx *cx, enum copyStrategy s, off_t off, off_t len,
+            struct copyStats *stats)
+{
+    off_t start = off;
+
+    if (!stats->fellBack) {
+        if (rangeFuncs[s](cx, &off, &len) == 0) {
+            stats->dataBytes += off - start;
+            return 0;
+        }
+
+        if (errno != EINVAL && errno != ENOSYS && errno != EXDEV &&
+                errno != EOPNOTSUPP && errno != ENODEV)
+            return -1;
+
+        stats->fellBack = 1;
+    }
+
+    if (rwRange(cx, &off, &len) == -1)
+        return -1;
+
+    stats->dataBytes += off - start;
+    return 0;
+}
+
+/* Copy the contents of the file referred to by 'inFd' to the file
+   referred to by 'outFd', which should be an empty regular file, using
+   strategy 's'. If 'stats' is not NULL, it is used to return information
+   about the copy. Returns 0 on success, or -1 on error. */
+
+int
+copyFd(int inFd, int outFd, enum copyStrategy s, struct copyStats *stats)
+{
+    struct copyStats dummy;
+    struct copyCtx cx;
+    struct stat sb;
+    off_t pos, dataStart, dataEnd;
+    int savedErrno, status;
+
+    if (stats == NULL)
+        stats = &dummy;
+    memset(stats, 0, sizeof(struct copyStats));
+
+    if (s <= CS_AUTO || s >= CS_NUM_STRATEGIES)
+        s = copyChooseStrategy(inFd, outFd);
+    stats->used = s;
+
+    if (fstat(inFd, &sb) == -1)
+        return -1;
+
+    cx.inFd = inFd;
+    cx.outFd = outFd;
+    cx.pipeFd[0] = cx.pipeFd[1] = -1;
+    cx.bufSize = (s == CS_DIRECT) ? DIRECT_BUF_SIZE : RW_BUF_SIZE;
+    if (posix_memalign((void **) &cx.buf, DIRECT_ALIGN, cx.bufSize) != 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (!S_ISREG(sb.st_mode)) {
+        stats->used = CS_RW;
+        status = streamCopy(&cx, stats);
+
+    } else {
+
+        /* Copy each data segment, skipping the holes between them */
+
+        status = 0;
+        for (pos = 0; pos < sb.st_size; pos = dataEnd) {
+            dataStart = lseek(inFd, pos, SEEK_DATA);
+            if (dataStart == -1) {
+                if (errno == ENXIO)             /* Only a hole remains */
+                    break;
+                if (errno != EINVAL) {
+                    status = -1;
+                    break;
+                }
+                dataStart = pos;        /* No SEEK_DATA support, so */
+                dataEnd = sb.st_size;   /* treat the rest as data */
+            } else {
+                dataEnd = lseek(inFd, dataStart, SEEK_HOLE);
+                if (dataEnd == -1 || dataEnd > sb.st_size)
+                    dataEnd = sb.st_size;
+            }
+
+            if (dataStart >= sb.st_size)
+                break;
+
+            stats->holeBytes += dataStart - pos;
+            stats->segments++;
+
+            if (copySegment(&cx, s, dataStart, dataEnd - dataStart,
+                            stats) == -1) {
+                status = -1;
+                break;
+            }
+        }
+
+        if (status == 0) {
+            if (pos < sb.st_size)
+                stats->holeBytes += sb.st_size - pos;
+
+            /* Extend the destination to cover any trailing hole */
+
+            if (ftruncate(outFd, sb.st_size) == -1)
+                status = -1;
+        }
+    }
+
+    savedErrno = errno;
+    free(cx.buf);
+    if (cx.pipeFd[0] != -1) {
+        close(cx.pipeFd[0]);
+        close(cx.pipeFd[1]);
+    }
+    errno = savedErrno;
+
+    return status;
+}
+
+/* Copy the file 'src' to a new file 'dst' (which is truncated if it
+   already exists), using strategy 's'. Returns 0 on success, or -1
+   on error. */
+
+int
+copyFile(const char *src, const char *dst, enum copyStrategy s,
+         struct copyStats *stats)
+{
+    int inFd, outFd, status, savedErrno;
+
+    inFd = open(src, O_RDONLY);
+    if (inFd == -1)
+        return -1;
+
+    outFd = open(dst, O_CREAT | O_WRONLY | O_TRUNC,
+                 S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+    if (outFd == -1) {
+        savedErrno = errno;
+        close(inFd);
+        errno = savedErrno;
+        return -1;
+    }
+
+    status = copyFd(inFd, outFd, s, stats);
+
+    savedErrno = errno;
+    close(inFd);
+    if (close(outFd) == -1 && status == 0)
+        status = -1;
+    else
+        errno = savedErrno;
+
+    return status;
+}
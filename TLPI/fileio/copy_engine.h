@@ -0,0 +1,51 @@
+/*************************************************************************\
+*                  Copyright (C) Michael Kerrisk, 2020.                   *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU Lesser General Public License as published   *
+* by the Free Software Foundation, either version 3 or (at your option)   *
+* any later version. This program is distributed without any warranty.    *
+* See the files COPYING.lgpl-v3 and COPYING.gpl-v3 for details.           *
+\*************************************************************************/
+
+/* copy_engine.h
+
+   Header file for copy_engine.c.
+*/
+#ifndef COPY_ENGINE_H
+#define COPY_ENGINE_H           /* Prevent accidental double inclusion */
+
+#include <sys/types.h>
+
+enum copyStrategy {
+    CS_AUTO,                    /* Let copyChooseStrategy() decide */
+    CS_RW,                      /* read()/write() with a large buffer */
+    CS_COPY_FILE_RANGE,         /* copy_file_range() */
+    CS_SENDFILE,                /* sendfile() */
+    CS_SPLICE,                  /* splice() through a pipe */
+    CS_MMAP,                    /* write() from chunked mmap() of source */
+    CS_DIRECT,                  /* O_DIRECT with aligned buffer */
+    CS_NUM_STRATEGIES
+};
+
+struct copyStats {
+    enum copyStrategy used;     /* Strategy that was used */
+    int fellBack;               /* Nonzero if 'used' failed, and (some of)
+                                   the copy was done with CS_RW */
+    off_t dataBytes;            /* Bytes of data copied */
+    off_t holeBytes;            /* Bytes of holes skipped */
+    int segments;               /* Number of data segments copied */
+};
+
+const char *copyStrategyName(enum copyStrategy s);
+
+int copyStrategyFromName(const char *name);
+
+enum copyStrategy copyChooseStrategy(int inFd, int outFd);
+
+int copyFd(int inFd, int outFd, enum copyStrategy s, struct copyStats *stats);
+
+int copyFile(const char *src, const char *dst, enum copyStrategy s,
+             struct copyStats *stats);
+
+#endif
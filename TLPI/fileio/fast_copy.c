@@ -0,0 +1,95 @@
+/*************************************************************************\
+*                  Copyright (C) Michael Kerrisk, 2020.                   *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU General Public License as published by the   *
+* Free Software Foundation, either version 3 or (at your option) any      *
+* later version. This program is distributed without any warranty.  See   *
+* the file COPYING.gpl-v3 for details.                                    *
+\*************************************************************************/
+
+/* Supplementary program for Chapter 4 */
+
+/* fast_copy.c
+
+   Copy the file named argv[optind] to a new file named in argv[optind+1],
+   using the copy engine in copy_engine.c. Unlike copy.c, this program
+   preserves holes in the source file.
+
+   Usage: fast_copy [-s strategy] [-v] old-file new-file
+
+   'strategy' is one of: auto (the default), rw, copy_file_range,
+   sendfile, splice, mmap, direct. With -v, the strategy that was used,
+   the amounts of data and holes, and the time taken are reported.
+*/
+#include <time.h>
+#include "copy_engine.h"
+#include "tlpi_hdr.h"
+
+static double
+timeNow(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        errExit("clock_gettime");
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+usageError(const char *progName)
+{
+    fprintf(stderr, "Usage: %s [-s strategy] [-v] old-file new-file\n",
+            progName);
+    fprintf(stderr, "    -s strategy  auto (default), rw, copy_file_range, "
+                    "sendfile,\n");
+    fprintf(stderr, "                 splice, mmap, or direct\n");
+    fprintf(stderr, "    -v           Report on the copy\n");
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct copyStats stats;
+    int opt, verbose, s;
+    double start, secs;
+
+    s = CS_AUTO;
+    verbose = 0;
+
+    while ((opt = getopt(argc, argv, "s:v")) != -1) {
+        switch (opt) {
+        case 's':
+            s = copyStrategyFromName(optarg);
+            if (s == -1)
+                cmdLineErr("Unknown strategy: %s\n", optarg);
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            usageError(argv[0]);
+        }
+    }
+
+    if (argc != optind + 2)
+        usageError(argv[0]);
+
+    start = timeNow();
+    if (copyFile(argv[optind], argv[optind + 1], s, &stats) == -1)
+        errExit("copying %s to %s", argv[optind], argv[optind + 1]);
+    secs = timeNow() - start;
+
+    if (verbose) {
+        printf("Strategy:  %s%s\n", copyStrategyName(stats.used),
+               stats.fellBack ? " (fell back to rw)" : "");
+        printf("Data:      %lld bytes in %d segment(s)\n",
+               (long long) stats.dataBytes, stats.segments);
+        printf("Holes:     %lld bytes\n", (long long) stats.holeBytes);
+        printf("Time:      %.3f secs (%.1f MB/s)\n", secs,
+               (secs > 0) ? stats.dataBytes / secs / 1e6 : 0.0);
+    }
+
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,523 @@
+/*************************************************************************\
+*                  Copyright (C) Michael Kerrisk, 2020.                   *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU Lesser General Public License as published   *
+* by the Free Software Foundation, either version 3 or (at your option)   *
+* any later version. This program is distributed without any warranty.    *
+* See the files COPYING.lgpl-v3 and COPYING.gpl-v3 for details.           *
+\*************************************************************************/
+
+/* Supplementary program for Chapter 55 */
+
+/* range_lock.c
+
+   A manager for byte-range locks on a file that are shared between the
+   threads of a process as well as between processes.
+
+   Traditional fcntl() record locks are owned by a process, so they can't
+   be used to keep the threads of one process apart. OFD locks (F_OFD_SETLK
+   and so on; see i_fcntl_locking.c) are owned by an open file
+   description, so threads that each open() the file can use them, but
+   then every lock and unlock is a system call, and the kernel keeps a
+   separate set of locks for each thread.
+
+   Here, the threads of a process share one open file description, 'fd',
+   and the manager resolves conflicts between them in user space: it
+   keeps each lock that is held (or being acquired) in an interval tree,
+   and a thread that asks for a range that conflicts with one in the tree
+   waits on a condition variable. The kernel is used only to coordinate
+   with other processes: the OFD locks on 'fd' cover the union of the
+   ranges that are held in the tree, with a write lock wherever a thread
+   holds a write lock. Since no two threads can hold overlapping write
+   locks, and the kernel merges adjacent and overlapping locks of the
+   same type held through one open file description, this takes few
+   system calls:
+
+   - a read lock that lies within ranges already read-locked by other
+     threads needs no system call;
+   - releasing a read lock only unlocks the parts of its range that no
+     other thread holds; and
+   - a write lock takes one call to lock and one to unlock.
+
+   The kernel lock is taken without holding the manager's mutex, so that
+   a thread waiting for another process (rlmLockWait()) doesn't hold up
+   the other threads. Until the call completes, the lock is in the tree
+   marked as pending: it stops conflicting locks from being granted, but
+   doesn't count as covering its range when another thread decides
+   whether its own read lock needs a system call.
+
+   Offsets are of type off_t, and a 'len' of 0 means "to the end of the
+   file", as with fcntl(); 'start' is always relative to the start of the
+   file. With RL_NO_KERNEL, the manager locks only between threads, and
+   'fd' is not used.
+
+   The interval tree is a treap ordered by start offset; each node also
+   records the greatest end offset in its subtree, so that a search for
+   overlapping ranges can skip subtrees that end before the range starts.
+*/
+#define _GNU_SOURCE     /* To get definitions of 'OFD' locking commands */
+#include <pthread.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include "range_lock.h"
+
+#ifdef __linux__
+#ifndef F_OFD_GETLK     /* In case we are on a system with glibc version
+                           earlier than 2.20 */
+#define F_OFD_GETLK     36
+#define F_OFD_SETLK     37
+#define F_OFD_SETLKW    38
+#endif
+#endif
+
+/* The greatest off_t value; used as the end of a range that extends to
+   the end of the file */
+
+#define RL_OFF_MAX ((off_t) ((1ULL << (sizeof(off_t) * 8 - 1)) - 1))
+
+struct rangeLock {              /* A node in the interval tree */
+    off_t start;                /* Range is [start, end) */
+    off_t end;
+    off_t maxEnd;               /* Greatest 'end' in this subtree */
+    unsigned int prio;          /* Treap priority */
+    int type;                   /* F_RDLCK or F_WRLCK */
+    int pending;                /* Kernel lock not yet acquired */
+    struct rangeLock *left, *right;
+};
+
+struct rangeLockMgr {
+    int fd;
+    int flags;
+    pthread_mutex_t mtx;        /* Protects all of the following */
+    pthread_cond_t cond;        /* Signaled when a lock is removed */
+    struct rangeLock *root;
+    unsigned int seed;          /* For treap priorities */
+    struct rlStats stats;
+};
+
+/* ---------------------------------------------------------------- */
+/* The interval tree */
+
+static int
+keyLess(const struct rangeLock *a, const struct rangeLock *b)
+{
+    if (a->start != b->start)
+        return a->start < b->start;
+    return (uintptr_t) a < (uintptr_t) b;
+}
+
+static void
+fixMaxEnd(struct rangeLock *n)
+{
+    n->maxEnd = n->end;
+    if (n->left != NULL && n->left->maxEnd > n->maxEnd)
+        n->maxEnd = n->left->maxEnd;
+    if (n->right != NULL && n->right->maxEnd > n->maxEnd)
+        n->maxEnd = n->right->maxEnd;
+}
+
+static struct rangeLock *
+rotateRight(struct rangeLock *n)
+{
+    struct rangeLock *l = n->left;
+
+    n->left = l->right;
+    l->right = n;
+    fixMaxEnd(n);
+    fixMaxEnd(l);
+    return l;
+}
+
+static struct rangeLock *
+rotateLeft(struct rangeLock *n)
+{
+    struct rangeLock *r = n->right;
+
+    n->right = r->left;
+    r->left = n;
+    fixMaxEnd(n);
+    fixMaxEnd(r);
+    return r;
+}
+
+static struct rangeLock *
+treeInsert(struct rangeLock *t, struct rangeLock *n)
+{
+    if (t == NULL) {
+        n->left = n->right = NULL;
+        n->maxEnd = n->end;
+        return n;
+    }
+
+    if (keyLess(n, t)) {
+        t->left = treeInsert(t->left, n);
+        if (t->left->prio > t->prio)
+            return rotateRight(t);
+    } else {
+        t->right = treeInsert(t->right, n);
+        if (t->right->prio > t->prio)
+            return rotateLeft(t);
+    }
+
+    fixMaxEnd(t);
+    return t;
+}
+
+/* Join two treaps, where every key in 'a' is less than every key in 'b' */
+
+static struct rangeLock *
+treeJoin(struct rangeLock *a, struct rangeLock *b)
+{
+    if (a == NULL)
+        return b;
+    if (b == NULL)
+        return a;
+
+    if (a->prio > b->prio) {
+        a->right = treeJoin(a->right, b);
+        fixMaxEnd(a);
+        return a;
+    } else {
+        b->left = treeJoin(a, b->left);
+        fixMaxEnd(b);
+        return b;
+    }
+}
+
+static struct rangeLock *
+treeRemove(struct rangeLock *t, struct rangeLock *n)
+{
+    if (t == NULL)                      /* Shouldn't happen */
+        return NULL;
+
+    if (t == n)
+        return treeJoin(n->left, n->right);
+
+    if (keyLess(n, t))
+        t->left = treeRemove(t->left, n);
+    else
+        t->right = treeRemove(t->right, n);
+
+    fixMaxEnd(t);
+    return t;
+}
+
+/* Call 'fn' for each lock in 't' that overlaps [start, end), in order of
+   start offset, until 'fn' returns nonzero. Returns the last value
+   returned by 'fn', or 0. */
+
+static int
+visitOverlaps(struct rangeLock *t, off_t start, off_t end,
+              int (*fn)(struct rangeLock *, void *), void *arg)
+{
+    int s;
+
+    if (t == NULL || t->maxEnd <= start)
+        return 0;
+
+    s = visitOverlaps(t->left, start, end, fn, arg);
+    if (s != 0)
+        return s;
+
+    if (t->start >= end)        /* Nothing further right can overlap */
+        return 0;
+
+    if (t->end > start) {
+        s = fn(t, arg);
+        if (s != 0)
+            return s;
+    }
+
+    return visitOverlaps(t->right, start, end, fn, arg);
+}
+
+static int
+conflicts(struct rangeLock *n, void *arg)
+{
+    return n->type == F_WRLCK || *(int *) arg == F_WRLCK;
+}
+
+/* State for finding the parts of a range that are not covered by the
+   (read) locks in the tree */
+
+struct gapScan {
+    off_t pos;                  /* Start of the part not yet scanned */
+    off_t end;                  /* End of the range */
+    int countPending;           /* Do pending locks cover their range? */
+    struct rangeLockMgr *m;     /* If not NULL, unlock each gap */
+    int gaps;                   /* Number of gaps found */
+};
+
+static int kernelLock(struct rangeLockMgr *m, int cmd, int type,
+                      off_t start, off_t end);
+
+static void
+foundGap(struct gapScan *gs, off_t start, off_t end)
+{
+    gs->gaps++;
+    if (gs->m != NULL) {
+        gs->m->stats.kernelCalls++;
+        kernelLock(gs->m, F_OFD_SETLK, F_UNLCK, start, end);
+    }
+}
+
+static int
+scanGap(struct rangeLock *n, void *arg)
+{
+    struct gapScan *gs = arg;
+
+    if (n->pending && !gs->countPending)
+        return 0;
+
+    if (n->start > gs->pos)
+        foundGap(gs, gs->pos, n->start);
+    if (n->end > gs->pos)
+        gs->pos = n->end;
+
+    return gs->pos >= gs->end;          /* Stop once range is covered */
+}
+
+/* Find the gaps in [start, end) left by the locks in the tree; if
+   'unlock' is nonzero, remove the kernel lock from each gap. Returns the
+   number of gaps. */
+
+static int
+findGaps(struct rangeLockMgr *m, off_t start, off_t end, int countPending,
+         int unlock)
+{
+    struct gapScan gs;
+
+    gs.pos = start;
+    gs.end = end;
+    gs.countPending = countPending;
+    gs.m = unlock ? m : NULL;
+    gs.gaps = 0;
+
+    visitOverlaps(m->root, start, end, scanGap, &gs);
+    if (gs.pos < end)
+        foundGap(&gs, gs.pos, end);
+
+    return gs.gaps;
+}
+
+/* ---------------------------------------------------------------- */
+
+static int
+kernelLock(struct rangeLockMgr *m, int cmd, int type, off_t start,
+           off_t end)
+{
+    struct flock fl;
+
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = start;
+    fl.l_len = (end == RL_OFF_MAX) ? 0 : end - start;
+    fl.l_pid = 0;                       /* Must be 0 for OFD locks */
+
+    return fcntl(m->fd, cmd, &fl);
+}
+
+/* Remove 'rl' from the tree, release the parts of its kernel lock that
+   no other lock needs, and wake any waiting threads. Called with the
+   mutex held. */
+
+static void
+removeLock(struct rangeLockMgr *m, struct rangeLock *rl)
+{
+    m->root = treeRemove(m->root, rl);
+
+    if (!(m->flags & RL_NO_KERNEL)) {
+        if (rl->type == F_WRLCK) {      /* No other lock overlaps it */
+            m->stats.kernelCalls++;
+            kernelLock(m, F_OFD_SETLK, F_UNLCK, rl->start, rl->end);
+        } else {
+            findGaps(m, rl->start, rl->end, 1, 1);
+        }
+    }
+
+    pthread_cond_broadcast(&m->cond);
+}
+
+/* Create a manager for locks on the file open on 'fd'. 'flags' is 0 or
+   RL_NO_KERNEL. Returns NULL on error. */
+
+struct rangeLockMgr *
+rlmCreate(int fd, int flags)
+{
+    struct rangeLockMgr *m;
+    int s;
+
+    m = calloc(1, sizeof(struct rangeLockMgr));
+    if (m == NULL)
+        return NULL;
+
+    m->fd = fd;
+    m->flags = flags;
+    m->seed = (uintptr_t) m;
+    m->root = NULL;
+
+    s = pthread_mutex_init(&m->mtx, NULL);
+    if (s == 0) {
+        s = pthread_cond_init(&m->cond, NULL);
+        if (s != 0)
+            pthread_mutex_destroy(&m->mtx);
+    }
+    if (s != 0) {
+        free(m);
+        errno = s;
+        return NULL;
+    }
+
+    return m;
+}
+
+static void
+freeTree(struct rangeLock *t)
+{
+    if (t != NULL) {
+        freeTree(t->left);
+        freeTree(t->right);
+        free(t);
+    }
+}
+
+/* Destroy the manager; any locks still held are released */
+
+void
+rlmDestroy(struct rangeLockMgr *m)
+{
+    if (m->root != NULL && !(m->flags & RL_NO_KERNEL))
+        kernelLock(m, F_OFD_SETLK, F_UNLCK, 0, RL_OFF_MAX);
+    freeTree(m->root);
+
+    pthread_cond_destroy(&m->cond);
+    pthread_mutex_destroy(&m->mtx);
+    free(m);
+}
+
+/* Lock the range (private; public interfaces below) */
+
+static struct rangeLock *
+lockRange(struct rangeLockMgr *m, int cmd, int type, off_t start,
+          off_t len)
+{
+    struct rangeLock *rl;
+    int s, savedErrno, needKernel;
+
+    if ((type != F_RDLCK && type != F_WRLCK) || start < 0 || len < 0 ||
+            (len > 0 && start > RL_OFF_MAX - len)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    rl = malloc(sizeof(struct rangeLock));
+    if (rl == NULL)
+        return NULL;
+    rl->start = start;
+    rl->end = (len == 0) ? RL_OFF_MAX : start + len;
+    rl->type = type;
+
+    s = pthread_mutex_lock(&m->mtx);
+    if (s != 0) {
+        free(rl);
+        errno = s;
+        return NULL;
+    }
+
+    /* Wait until no other thread holds a conflicting lock */
+
+    while (visitOverlaps(m->root, rl->start, rl->end, conflicts, &type)) {
+        if (cmd == F_OFD_SETLK) {
+            pthread_mutex_unlock(&m->mtx);
+            free(rl);
+            errno = EAGAIN;
+            return NULL;
+        }
+        m->stats.waits++;
+        pthread_cond_wait(&m->cond, &m->mtx);
+    }
+
+    /* A write lock always needs a kernel lock; a read lock needs one
+       unless other (granted) read locks already cover its range */
+
+    needKernel = !(m->flags & RL_NO_KERNEL) &&
+                 (type == F_WRLCK ||
+                  findGaps(m, rl->start, rl->end, 0, 0) > 0);
+
+    m->seed = m->seed * 1103515245 + 12345;
+    rl->prio = m->seed >> 8;
+    rl->pending = needKernel;
+    m->root = treeInsert(m->root, rl);
+
+    if (needKernel) {
+        m->stats.kernelCalls++;
+        pthread_mutex_unlock(&m->mtx);
+
+        s = kernelLock(m, cmd, type, rl->start, rl->end);
+        savedErrno = errno;
+
+        pthread_mutex_lock(&m->mtx);
+        rl->pending = 0;
+
+        if (s == -1) {
+            removeLock(m, rl);
+            pthread_mutex_unlock(&m->mtx);
+            free(rl);
+            errno = savedErrno;
+            return NULL;
+        }
+    }
+
+    m->stats.locks++;
+    pthread_mutex_unlock(&m->mtx);
+    return rl;
+}
+
+/* Place a lock of 'type' (F_RDLCK or F_WRLCK) on the 'len' bytes starting
+   at 'start'. rlmLock() fails with EAGAIN if another thread or process
+   holds a conflicting lock; rlmLockWait() waits. Return a handle for
+   rlmUnlock(), or NULL on error. */
+
+struct rangeLock *
+rlmLock(struct rangeLockMgr *m, int type, off_t start, off_t len)
+{
+    return lockRange(m, F_OFD_SETLK, type, start, len);
+}
+
+struct rangeLock *
+rlmLockWait(struct rangeLockMgr *m, int type, off_t start, off_t len)
+{
+    return lockRange(m, F_OFD_SETLKW, type, start, len);
+}
+
+/* Release a lock obtained from rlmLock() or rlmLockWait(). Returns 0 on
+   success, or -1 on error. */
+
+int
+rlmUnlock(struct rangeLockMgr *m, struct rangeLock *rl)
+{
+    int s;
+
+    s = pthread_mutex_lock(&m->mtx);
+    if (s != 0) {
+        errno = s;
+        return -1;
+    }
+
+    removeLock(m, rl);
+
+    pthread_mutex_unlock(&m->mtx);
+    free(rl);
+    return 0;
+}
+
+void
+rlmGetStats(struct rangeLockMgr *m, struct rlStats *stats)
+{
+    pthread_mutex_lock(&m->mtx);
+    *stats = m->stats;
+    pthread_mutex_unlock(&m->mtx);
+}
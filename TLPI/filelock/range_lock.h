@@ -0,0 +1,45 @@
+/*************************************************************************\
+*                  Copyright (C) Michael Kerrisk, 2020.                   *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU Lesser General Public License as published   *
+* by the Free Software Foundation, either version 3 or (at your option)   *
+* any later version. This program is distributed without any warranty.    *
+* See the files COPYING.lgpl-v3 and COPYING.gpl-v3 for details.           *
+\*************************************************************************/
+
+/* range_lock.h
+
+   Header file for range_lock.c.
+*/
+#ifndef RANGE_LOCK_H
+#define RANGE_LOCK_H            /* Prevent accidental double inclusion */
+
+#include <sys/types.h>
+
+#define RL_NO_KERNEL    01      /* Lock between threads only */
+
+struct rangeLockMgr;            /* Opaque */
+struct rangeLock;               /* Opaque; one held lock */
+
+struct rlStats {
+    long locks;                 /* Locks granted */
+    long waits;                 /* Times a thread waited for another */
+    long kernelCalls;           /* fcntl() lock and unlock operations */
+};
+
+struct rangeLockMgr *rlmCreate(int fd, int flags);
+
+void rlmDestroy(struct rangeLockMgr *m);
+
+struct rangeLock *rlmLock(struct rangeLockMgr *m, int type,
+                          off_t start, off_t len);
+
+struct rangeLock *rlmLockWait(struct rangeLockMgr *m, int type,
+                              off_t start, off_t len);
+
+int rlmUnlock(struct rangeLockMgr *m, struct rangeLock *rl);
+
+void rlmGetStats(struct rangeLockMgr *m, struct rlStats *stats);
+
+#endif
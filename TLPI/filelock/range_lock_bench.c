@@ -0,0 +1,316 @@
+/*************************************************************************\
+*                  Copyright (C) Michael Kerrisk, 2020.                   *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU General Public License as published by the   *
+* Free Software Foundation, either version 3 or (at your option) any      *
+* later version. This program is distributed without any warranty.  See   *
+* the file COPYING.gpl-v3 for details.                                    *
+\*************************************************************************/
+
+/* Supplementary program for Chapter 55 */
+
+/* range_lock_bench.c
+
+   Compare the cost of locking random byte ranges of a file from many
+   threads, using:
+
+   fcntl    OFD locks (F_OFD_SETLKW), with each thread using its own open
+            file description, so that the threads' locks conflict
+   rlm      the range lock manager in range_lock.c, which resolves
+            conflicts between threads itself and holds OFD locks on one
+            shared open file description
+   local    the range lock manager with RL_NO_KERNEL (no file locks)
+
+   Usage: range_lock_bench [-t max-threads] [-n locks] [-f file-size]
+                           [-l max-len] [-w write-pct] [-p nprocs]
+
+   The program runs 1, 2, 4, ... up to 'max-threads' (default: 8) threads,
+   each of which locks and unlocks 'locks' (default: 20000) ranges of up
+   to 'max-len' (default: 4096) bytes at random offsets in the first
+   'file-size' (default: 1048576) bytes of a temporary file. 'write-pct'
+   percent (default: 20) of the locks are write locks. The output is the
+   number of lock/unlock pairs per second, and for "rlm", the number of
+   fcntl() calls made per lock.
+
+   With "-p", each test is run at once in 'nprocs' processes, each with
+   the given number of threads, so that the file locks must keep the
+   processes apart. ("local" mode can't do that, so it is skipped.)
+
+   While a thread holds a write lock, it fills the range in a shadow
+   buffer (shared between the processes) with its own ID, and then checks
+   that no other thread has changed it; any overlap between write locks
+   is reported as an error.
+*/
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <time.h>
+#include "range_lock.h"
+#include "tlpi_hdr.h"
+
+#ifndef F_OFD_SETLKW            /* In case we are on a system with glibc
+                                   version earlier than 2.20 */
+#define F_OFD_SETLKW    38
+#endif
+
+enum { M_FCNTL, M_RLM, M_LOCAL, NUM_MODES };
+
+static char path[] = "/tmp/range_lock_bench_XXXXXX";
+
+static int mode;
+static long numLocks, fileSize, maxLen;
+static int writePct, numProcs;
+static struct rangeLockMgr *mgr;
+static struct rlStats mgrStats;         /* Parent's manager, last test */
+static unsigned char *shadow;           /* One byte per file byte */
+static long *violations;                /* In shared memory */
+
+struct threadArg {
+    int id;
+    int fd;                             /* Used in "fcntl" mode */
+    pthread_t tid;
+};
+
+static double
+timeNow(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        errExit("clock_gettime");
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+ofdLock(int fd, int type, off_t start, off_t len)
+{
+    struct flock fl;
+
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = start;
+    fl.l_len = len;
+    fl.l_pid = 0;
+
+    if (fcntl(fd, F_OFD_SETLKW, &fl) == -1)
+        errExit("fcntl");
+}
+
+/* Fill the range with our ID, and check that nobody else writes it */
+
+static void
+checkExclusive(unsigned char id, off_t start, off_t len)
+{
+    memset(shadow + start, id, len);
+    for (off_t j = 0; j < len; j++) {
+        if (__atomic_load_n(&shadow[start + j], __ATOMIC_RELAXED) != id) {
+            __atomic_add_fetch(violations, 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+}
+
+static void *
+threadFunc(void *arg)
+{
+    struct threadArg *ta = arg;
+    struct rangeLock *rl = NULL;
+    unsigned int seed = ta->id * 7919 + 1;
+    off_t start, len;
+    int type;
+
+    for (long j = 0; j < numLocks; j++) {
+        len = 1 + rand_r(&seed) % maxLen;
+        start = rand_r(&seed) % (fileSize - len + 1);
+        type = (rand_r(&seed) % 100 < writePct) ? F_WRLCK : F_RDLCK;
+
+        if (mode == M_FCNTL) {
+            ofdLock(ta->fd, type, start, len);
+        } else {
+            rl = rlmLockWait(mgr, type, start, len);
+            if (rl == NULL)
+                errExit("rlmLockWait");
+        }
+
+        if (type == F_WRLCK)
+            checkExclusive(ta->id % 255 + 1, start, len);
+
+        if (mode == M_FCNTL) {
+            ofdLock(ta->fd, F_UNLCK, start, len);
+        } else {
+            if (rlmUnlock(mgr, rl) == -1)
+                errExit("rlmUnlock");
+        }
+    }
+
+    return NULL;
+}
+
+/* Run 'nthreads' threads in the current mode, in each of 'numProcs'
+   processes; return locks per second */
+
+static double
+runTest(int nthreads)
+{
+    struct threadArg *ta;
+    double start;
+    int s, fd, proc, status;
+
+    ta = calloc(nthreads, sizeof(struct threadArg));
+    if (ta == NULL)
+        errExit("calloc");
+
+    start = timeNow();
+
+    /* Process 0 is the parent */
+
+    for (proc = numProcs - 1; proc > 0; proc--) {
+        s = fork();
+        if (s == -1)
+            errExit("fork");
+        if (s == 0)
+            break;
+    }
+
+    /* Each process needs its own open file description, since OFD locks
+       belong to the description, not to the process */
+
+    if (mode != M_FCNTL) {
+        fd = open(path, O_RDWR);
+        if (fd == -1)
+            errExit("open");
+        mgr = rlmCreate(fd, (mode == M_LOCAL) ? RL_NO_KERNEL : 0);
+        if (mgr == NULL)
+            errExit("rlmCreate");
+    }
+
+    for (int t = 0; t < nthreads; t++) {
+        ta[t].id = proc * nthreads + t;
+        ta[t].fd = -1;
+        if (mode == M_FCNTL) {
+            ta[t].fd = open(path, O_RDWR);
+            if (ta[t].fd == -1)
+                errExit("open");
+        }
+    }
+
+    for (int t = 0; t < nthreads; t++) {
+        s = pthread_create(&ta[t].tid, NULL, threadFunc, &ta[t]);
+        if (s != 0)
+            errExitEN(s, "pthread_create");
+    }
+    for (int t = 0; t < nthreads; t++) {
+        s = pthread_join(ta[t].tid, NULL);
+        if (s != 0)
+            errExitEN(s, "pthread_join");
+    }
+
+    if (mode != M_FCNTL) {
+        rlmGetStats(mgr, &mgrStats);
+        rlmDestroy(mgr);
+        close(fd);
+    }
+
+    if (proc > 0)
+        _exit(EXIT_SUCCESS);
+
+    while (wait(&status) != -1)
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            fatal("child process failed");
+
+    start = timeNow() - start;
+
+    for (int t = 0; t < nthreads; t++)
+        if (ta[t].fd != -1)
+            close(ta[t].fd);
+    free(ta);
+
+    return (double) numProcs * nthreads * numLocks / start;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int maxThreads, opt, fd;
+    double rate;
+    struct rlStats stats;
+
+    maxThreads = 8;
+    numLocks = 20000;
+    fileSize = 1024 * 1024;
+    maxLen = 4096;
+    writePct = 20;
+    numProcs = 1;
+
+    while ((opt = getopt(argc, argv, "t:n:f:l:w:p:")) != -1) {
+        switch (opt) {
+        case 't':
+            maxThreads = getInt(optarg, GN_GT_0, "max-threads");
+            break;
+        case 'n':
+            numLocks = getLong(optarg, GN_GT_0, "locks");
+            break;
+        case 'f':
+            fileSize = getLong(optarg, GN_GT_0, "file-size");
+            break;
+        case 'l':
+            maxLen = getLong(optarg, GN_GT_0, "max-len");
+            break;
+        case 'w':
+            writePct = getInt(optarg, GN_NONNEG, "write-pct");
+            break;
+        case 'p':
+            numProcs = getInt(optarg, GN_GT_0, "nprocs");
+            break;
+        default:
+            usageErr("%s [-t max-threads] [-n locks] [-f file-size]\n"
+                     "        [-l max-len] [-w write-pct] [-p nprocs]\n",
+                     argv[0]);
+        }
+    }
+
+    if (maxLen > fileSize)
+        cmdLineErr("max-len must not exceed file-size\n");
+
+    shadow = mmap(NULL, fileSize + sizeof(long), PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shadow == MAP_FAILED)
+        errExit("mmap");
+    violations = (long *) (shadow + fileSize);
+
+    fd = mkstemp(path);
+    if (fd == -1)
+        errExit("mkstemp");
+    close(fd);
+
+    printf("%ld locks per thread, ranges of 1-%ld bytes in %ld, "
+           "%d%% write\n\n", numLocks, maxLen, fileSize, writePct);
+    printf("%7s %12s %12s %12s %10s\n", "threads", "fcntl/s", "rlm/s",
+           "local/s", "calls/lock");
+
+    for (int nthreads = 1; nthreads <= maxThreads; nthreads *= 2) {
+        printf("%7d", nthreads);
+        for (mode = 0; mode < NUM_MODES; mode++) {
+            if (mode == M_LOCAL && numProcs > 1) {
+                printf(" %12s", "-");
+                continue;
+            }
+            rate = runTest(nthreads);
+            printf(" %12.0f", rate);
+            if (mode == M_RLM)
+                stats = mgrStats;
+        }
+        printf(" %10.2f\n", (double) stats.kernelCalls / stats.locks);
+        if (nthreads < maxThreads && nthreads * 2 > maxThreads)
+            nthreads = maxThreads / 2;
+    }
+
+    unlink(path);
+
+    if (*violations > 0)
+        fatal("%ld write locks overlapped another", *violations);
+    exit(EXIT_SUCCESS);
+}
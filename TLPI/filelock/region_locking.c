@@ -20,7 +20,7 @@
 /* Lock a file region (private; public interfaces below) */
 
 static int
-lockReg(int fd, int cmd, int type, int whence, int start, off_t len)
+lockReg(int fd, int cmd, int type, int whence, off_t start, off_t len)
 {
     struct flock fl;
 
@@ -33,13 +33,13 @@ lockReg(int fd, int cmd, int type, int whence, int start, off_t len)
 }
 
 int                     /* Lock a file region using nonblocking F_SETLK */
-lockRegion(int fd, int type, int whence, int start, int len)
+lockRegion(int fd, int type, int whence, off_t start, off_t len)
 {
     return lockReg(fd, F_SETLK, type, whence, start, len);
 }
 
 int                     /* Lock a file region using blocking F_SETLKW */
-lockRegionWait(int fd, int type, int whence, int start, int len)
+lockRegionWait(int fd, int type, int whence, off_t start, off_t len)
 {
     return lockReg(fd, F_SETLKW, type, whence, start, len);
 }
@@ -48,7 +48,7 @@ lockRegionWait(int fd, int type, int whence, int start, int len)
    PID of process holding incompatible lock, or -1 on error. */
 
 pid_t
-regionIsLocked(int fd, int type, int whence, int start, int len)
+regionIsLocked(int fd, int type, int whence, off_t start, off_t len)
 {
     struct flock fl;
 
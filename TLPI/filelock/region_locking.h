@@ -19,10 +19,10 @@
 
 #include <sys/types.h>
 
-int lockRegion(int fd, int type, int whence, int start, int len);
+int lockRegion(int fd, int type, int whence, off_t start, off_t len);
 
-int lockRegionWait(int fd, int type, int whence, int start, int len);
+int lockRegionWait(int fd, int type, int whence, off_t start, off_t len);
 
-pid_t regionIsLocked(int fd, int type, int whence, int start, int len);
+pid_t regionIsLocked(int fd, int type, int whence, off_t start, off_t len);
 
 #endif
@@ -50,15 +50,22 @@
 #include <limits.h>
 #include <sys/select.h>
 #include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
 #include <fcntl.h>
-#include <ftw.h>
+#include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <sys/types.h>
+#include <sys/syscall.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
 #include <errno.h>
 
 #define errExit(msg)    do { perror(msg); exit(EXIT_FAILURE); \
@@ -72,20 +79,38 @@
 static int verboseMask;
 static int checkCache;
 static int dumpCache;
-static int readBufferSize = 0;
+static int readBufferSize = 0;          /* Fixed read() size (-b), or 0 */
+static size_t maxQueueBytes = 64 * 1024 * 1024;
+                                        /* Limit on events queued between
+                                           reader and main thread (-q) */
 static char *stopFile;
 static int abortOnCacheProblem;
 
 static FILE *logfp = NULL;
 
-static int inotifyReadCnt = 0;          /* Counts number of read()s from
-                                           inotify file descriptor */
+static long eventCnt = 0;               /* Number of events processed, */
+static double eventSecs = 0;            /*   and time spent doing so */
+static double buildSecs = 0;            /* Time taken by last (re)build
+                                           of the cache, */
+static int buildDirs = 0;               /*   and number of directories
+                                           added by it */
+static int buildCnt = 0;                /* Number of (re)builds */
 
-static const int INOTIFY_READ_BUF_LEN =
+static const int INOTIFY_READ_BUF_LEN =        /* Smallest read() */
         (100 * (sizeof(struct inotify_event) + NAME_MAX + 1));
 
 static void dumpCacheToLog(void);
 
+static double
+timeNow(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        errExit("clock_gettime");
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 /* Something went badly wrong. Create a 'stop' file to signal the
    'rand_dtree' processes to stop, dump a copy of the cache to the
    log file, and abort. */
@@ -173,27 +198,258 @@ displayInotifyEvent(struct inotify_event *ev)
 
 /* Data structures and functions for the watch list cache */
 
-/* We use a very simple data structure for caching watched directory
-   paths: a dynamically sized array that is searched linearly. Not
-   efficient, but our main goal is to demonstrate the use of inotify. */
+/* The cache is a tree that mirrors the monitored directory trees. Each
+   node records just one pathname component; the full pathname of a
+   directory is built on demand, by walking up the tree to a root node
+   (whose 'name' is a complete pathname, such as one of the pathnames
+   given on the command line). The nodes live in a dynamically sized
+   array, and are referred to by their index ("slot") in that array.
+   Unused slots are kept on a free list.
+
+   Two hash tables, chained through the nodes, provide fast lookups:
+   'wdHash' maps a watch descriptor to its node, and 'nameHash' maps a
+   (parent slot, name) pair to the corresponding child node. Thus, the
+   cost of handling an event does not depend on the number of cached
+   directories, and when a subtree is renamed, only the node at the top
+   of the subtree needs to be changed. */
 
 struct watch {
     int wd;                     /* Watch descriptor (-1 if slot unused) */
-    char path[PATH_MAX];        /* Cached pathname */
+    char *name;                 /* Pathname component (for a root node,
+                                   a complete pathname) */
+    int parent;                 /* Slot of parent node (-1 for a root) */
+    int firstChild;             /* Slot of first child node, or -1 */
+    int prevSibling;            /* Neighbors in list of parent's children */
+    int nextSibling;            /*   (or in list of root nodes) */
+    int wdNext;                 /* Next slot in 'wdHash' chain; for an
+                                   unused slot, next slot in free list */
+    int nameNext;               /* Next slot in 'nameHash' chain, or -2
+                                   if this node is not in 'nameHash' */
 };
 
-struct watch *wlCache = NULL;   /* Array of cached items */
+struct watch *wlCache = NULL;   /* Array of cache nodes */
 
 static int cacheSize = 0;       /* Current size of the array */
+static int cacheEntries = 0;    /* Number of slots in use */
+static int freeSlot = -1;       /* Head of list of unused slots */
+static int rootSlot = -1;       /* Head of list of root nodes */
+
+static int *wdHash = NULL;      /* Hash table buckets (each is the first */
+static int *nameHash = NULL;    /*   slot in a chain, or -1) */
+static int hashSize = 0;        /* Number of buckets (a power of 2) */
+
+static size_t nameBytes = 0;    /* Memory allocated for 'name' strings */
+
+static unsigned int
+wdHashIdx(int wd)
+{
+    return ((unsigned int) wd * 2654435761u) & (hashSize - 1);
+}
+
+static unsigned int
+nameHashIdx(int parent, const char *name)
+{
+    unsigned int h;
+
+    h = 2166136261u;                    /* FNV-1a */
+    for (const char *p = name; *p != '\0'; p++) {
+        h ^= (unsigned char) *p;
+        h *= 16777619u;
+    }
+    h ^= (unsigned int) parent;
+    h *= 16777619u;
+
+    return h & (hashSize - 1);
+}
+
+static void
+hashWd(int slot)
+{
+    unsigned int h;
+
+    h = wdHashIdx(wlCache[slot].wd);
+    wlCache[slot].wdNext = wdHash[h];
+    wdHash[h] = slot;
+}
+
+static void
+unhashWd(int slot)
+{
+    for (int *p = &wdHash[wdHashIdx(wlCache[slot].wd)]; *p != -1;
+            p = &wlCache[*p].wdNext) {
+        if (*p == slot) {
+            *p = wlCache[slot].wdNext;
+            return;
+        }
+    }
+}
+
+/* Root nodes are found via the 'rootSlot' list, not via 'nameHash' */
+
+static void
+hashName(int slot)
+{
+    unsigned int h;
+
+    if (wlCache[slot].parent == -1) {
+        wlCache[slot].nameNext = -2;
+        return;
+    }
+
+    h = nameHashIdx(wlCache[slot].parent, wlCache[slot].name);
+    wlCache[slot].nameNext = nameHash[h];
+    nameHash[h] = slot;
+}
+
+static void
+unhashName(int slot)
+{
+    if (wlCache[slot].nameNext == -2)
+        return;
+
+    for (int *p = &nameHash[nameHashIdx(wlCache[slot].parent,
+                                        wlCache[slot].name)];
+            *p != -1; p = &wlCache[*p].nameNext) {
+        if (*p == slot) {
+            *p = wlCache[slot].nameNext;
+            break;
+        }
+    }
+
+    wlCache[slot].nameNext = -2;
+}
+
+/* Double the number of hash buckets, and rehash all cache entries */
+
+static void
+growHash(void)
+{
+    hashSize = (hashSize == 0) ? 1024 : hashSize * 2;
+
+    free(wdHash);
+    free(nameHash);
+    wdHash = malloc(hashSize * sizeof(int));
+    nameHash = malloc(hashSize * sizeof(int));
+    if (wdHash == NULL || nameHash == NULL)
+        errExit("malloc");
+
+    for (int j = 0; j < hashSize; j++)
+        wdHash[j] = nameHash[j] = -1;
+
+    for (int j = 0; j < cacheSize; j++) {
+        if (wlCache[j].wd >= 0) {
+            hashWd(j);
+            if (wlCache[j].nameNext != -2)
+                hashName(j);
+        }
+    }
+}
+
+/* Add the node in 'slot' to the list of its parent's children */
+
+static void
+linkChild(int slot)
+{
+    int *head;
+
+    head = (wlCache[slot].parent == -1) ? &rootSlot :
+                &wlCache[wlCache[slot].parent].firstChild;
+
+    wlCache[slot].prevSibling = -1;
+    wlCache[slot].nextSibling = *head;
+    if (*head != -1)
+        wlCache[*head].prevSibling = slot;
+    *head = slot;
+}
+
+static void
+unlinkChild(int slot)
+{
+    struct watch *w = &wlCache[slot];
+
+    if (w->prevSibling != -1)
+        wlCache[w->prevSibling].nextSibling = w->nextSibling;
+    else if (w->parent == -1)
+        rootSlot = w->nextSibling;
+    else
+        wlCache[w->parent].firstChild = w->nextSibling;
+
+    if (w->nextSibling != -1)
+        wlCache[w->nextSibling].prevSibling = w->prevSibling;
+}
+
+static void
+setName(int slot, const char *name)
+{
+    char *p;
+
+    p = strdup(name);
+    if (p == NULL)
+        errExit("strdup");
+
+    if (wlCache[slot].name != NULL) {
+        nameBytes -= strlen(wlCache[slot].name) + 1;
+        free(wlCache[slot].name);
+    }
+
+    wlCache[slot].name = p;
+    nameBytes += strlen(p) + 1;
+}
+
+/* Place the pathname of the directory cached in 'slot' in 'buf'.
+   Returns 0 on success, or -1 if the pathname does not fit in 'size'
+   bytes (in which case 'buf' contains an empty string). */
+
+static int
+slotToPath(int slot, char *buf, size_t size)
+{
+    size_t len, nlen;
+
+    len = 0;
+    for (int s = slot; ; s = wlCache[s].parent) {
+        len += strlen(wlCache[s].name);
+        if (wlCache[s].parent == -1)
+            break;
+        len++;                          /* For the '/' separator */
+    }
+
+    if (len >= size) {
+        logMessage(VB_BASIC, "Pathname too long for slot %d\n", slot);
+        buf[0] = '\0';
+        return -1;
+    }
+
+    /* Fill in the components from right to left */
+
+    buf[len] = '\0';
+    for (int s = slot; ; s = wlCache[s].parent) {
+        nlen = strlen(wlCache[s].name);
+        len -= nlen;
+        memcpy(buf + len, wlCache[s].name, nlen);
+        if (wlCache[s].parent == -1)
+            break;
+        buf[--len] = '/';
+    }
+
+    return 0;
+}
 
 /* Deallocate the watch cache */
 
 static void
 freeCache(void)
 {
+    for (int j = 0; j < cacheSize; j++)
+        free(wlCache[j].name);          /* NULL for unused slots */
+
     free(wlCache);
-    cacheSize = 0;
+    free(wdHash);
+    free(nameHash);
     wlCache = NULL;
+    wdHash = nameHash = NULL;
+    cacheSize = cacheEntries = hashSize = 0;
+    freeSlot = rootSlot = -1;
+    nameBytes = 0;
 }
 
 /* Check that all pathnames in the cache are valid, and refer
@@ -204,19 +460,21 @@ checkCacheConsistency(void)
 {
     int failures;
     struct stat sb;
+    char path[PATH_MAX];
 
     failures = 0;
     for (int j = 0; j < cacheSize; j++) {
         if (wlCache[j].wd >= 0) {
-            if (lstat(wlCache[j].path, &sb) == -1) {
+            slotToPath(j, path, sizeof(path));
+            if (lstat(path, &sb) == -1) {
                 logMessage(0,
                         "checkCacheConsistency: stat: "
                         "[slot = %d; wd = %d] %s: %s\n",
-                        j, wlCache[j].wd, wlCache[j].path, strerror(errno));
+                        j, wlCache[j].wd, path, strerror(errno));
                 failures++;
         } else if (!S_ISDIR(sb.st_mode)) {
             logMessage(0, "checkCacheConsistency: %s is not a directory\n",
-                                wlCache[j].path);
+                                path);
                     exit(EXIT_FAILURE);
             }
         }
@@ -233,9 +491,12 @@ checkCacheConsistency(void)
 static int
 findWatch(int wd)
 {
-    for (int j = 0; j < cacheSize; j++)
-        if (wlCache[j].wd == wd)
-            return j;
+    if (hashSize == 0)
+        return -1;
+
+    for (int s = wdHash[wdHashIdx(wd)]; s != -1; s = wlCache[s].wdNext)
+        if (wlCache[s].wd == wd)
+            return s;
 
     return -1;
 }
@@ -258,7 +519,7 @@ findWatchChecked(int wd)
 
     /* With multiple renamers there are still rare cases where
        the cache is missing entries after a 'Could not find watch'
-       event. It looks as though this is because of races with nftw(),
+       event. It looks as though this is because of races with the tree scan,
        since the cache is (occasionally) re-created with fewer
        entries than there are objects in the tree(s). Returning
        -1 to our caller identifies that there's a problem, and the
@@ -271,17 +532,62 @@ findWatchChecked(int wd)
     }
 }
 
+/* Return the slot of the child of 'parent' called 'name', or -1 if
+   there is no such child in the cache */
+
+static int
+findChild(int parent, const char *name)
+{
+    if (hashSize == 0)
+        return -1;
+
+    for (int s = nameHash[nameHashIdx(parent, name)]; s != -1;
+            s = wlCache[s].nameNext)
+        if (wlCache[s].parent == parent && strcmp(wlCache[s].name, name) == 0)
+            return s;
+
+    return -1;
+}
+
 /* Mark a cache entry as unused */
 
 static void
 markCacheSlotEmpty(int slot)
 {
+    char path[PATH_MAX];
+    int child;
+
+    slotToPath(slot, path, sizeof(path));
     logMessage(VB_NOISY,
             "        markCacheSlotEmpty: slot = %d;  wd = %d; path = %s\n",
-            slot, wlCache[slot].wd, wlCache[slot].path);
+            slot, wlCache[slot].wd, path);
+
+    /* Normally, the subdirectories of a directory have been removed
+       from the cache before the directory itself is removed. If some
+       remain, turn them into root nodes that record their complete
+       pathnames, so that they retain the pathnames they had before. */
+
+    while ((child = wlCache[slot].firstChild) != -1) {
+        slotToPath(child, path, sizeof(path));
+        unhashName(child);
+        unlinkChild(child);
+        wlCache[child].parent = -1;
+        setName(child, path);
+        linkChild(child);
+    }
+
+    unhashWd(slot);
+    unhashName(slot);
+    unlinkChild(slot);
 
+    nameBytes -= strlen(wlCache[slot].name) + 1;
+    free(wlCache[slot].name);
+    wlCache[slot].name = NULL;
     wlCache[slot].wd = -1;
-    wlCache[slot].path[0] = '\0';
+
+    wlCache[slot].wdNext = freeSlot;
+    freeSlot = slot;
+    cacheEntries--;
 }
 
 /* Find a free slot in the cache */
@@ -289,38 +595,55 @@ markCacheSlotEmpty(int slot)
 static int
 findEmptyCacheSlot(void)
 {
-    const int ALLOC_INCR = 200;
+    int slot, oldSize;
 
-    for (int j = 0; j < cacheSize; j++)
-        if (wlCache[j].wd == -1)
-            return j;
+    if (freeSlot == -1) {
 
-    /* No free slot found; resize cache */
+        /* No free slot; resize cache, and put the new slots on the
+           free list (lowest numbered first) */
 
-    cacheSize += ALLOC_INCR;
+        oldSize = cacheSize;
+        cacheSize = (cacheSize == 0) ? 256 : cacheSize * 2;
 
-    wlCache = realloc(wlCache, cacheSize * sizeof(struct watch));
-    if (wlCache == NULL)
-        errExit("realloc");
+        wlCache = realloc(wlCache, cacheSize * sizeof(struct watch));
+        if (wlCache == NULL)
+            errExit("realloc");
 
-    for (int j = cacheSize - ALLOC_INCR; j < cacheSize; j++)
-        markCacheSlotEmpty(j);
+        for (int j = cacheSize - 1; j >= oldSize; j--) {
+            wlCache[j].wd = -1;
+            wlCache[j].name = NULL;
+            wlCache[j].wdNext = freeSlot;
+            freeSlot = j;
+        }
+    }
 
-    return cacheSize - ALLOC_INCR;      /* Return first slot in
-                                           newly allocated space */
+    slot = freeSlot;
+    freeSlot = wlCache[slot].wdNext;
+    return slot;
 }
 
-/* Add an item to the cache */
+/* Add an item to the cache, as a child of the node in 'parent' (or as a
+   root node, if 'parent' is -1) */
 
 static int
-addWatchToCache(int wd, const char *pathname)
+addWatchToCache(int wd, int parent, const char *name)
 {
     int slot;
 
+    if (cacheEntries >= hashSize)       /* Keep load factor <= 1 */
+        growHash();
+
     slot = findEmptyCacheSlot();
 
     wlCache[slot].wd = wd;
-    strncpy(wlCache[slot].path, pathname, PATH_MAX);
+    wlCache[slot].parent = parent;
+    wlCache[slot].firstChild = -1;
+    setName(slot, name);
+
+    linkChild(slot);
+    hashWd(slot);
+    hashName(slot);
+    cacheEntries++;
 
     return slot;
 }
@@ -331,19 +654,45 @@ addWatchToCache(int wd, const char *pathname)
 static int
 pathnameToCacheSlot(const char *pathname)
 {
-    for (int j = 0; j < cacheSize; j++)
-        if (wlCache[j].wd >= 0 && strcmp(wlCache[j].path, pathname) == 0)
-            return j;
+    char name[NAME_MAX + 1];
+    const char *p, *end;
+    size_t len, bestLen;
+    int slot;
 
-    return -1;
-}
+    /* Find the root node whose pathname is the longest prefix
+       of 'pathname' */
+
+    slot = -1;
+    bestLen = 0;
+    for (int r = rootSlot; r != -1; r = wlCache[r].nextSibling) {
+        len = strlen(wlCache[r].name);
+        if ((slot == -1 || len > bestLen) &&
+                strncmp(wlCache[r].name, pathname, len) == 0 &&
+                (pathname[len] == '/' || pathname[len] == '\0')) {
+            slot = r;
+            bestLen = len;
+        }
+    }
 
-/* Is 'pathname' in the watch cache? */
+    /* Walk down from the root, one pathname component at a time */
 
-static int
-pathnameInCache(const char *pathname)
-{
-    return pathnameToCacheSlot(pathname) >= 0;
+    for (p = pathname + bestLen; slot != -1 && *p != '\0'; p = end) {
+        while (*p == '/')
+            p++;
+        if (*p == '\0')
+            break;
+
+        end = strchrnul(p, '/');
+        len = end - p;
+        if (len > NAME_MAX)
+            return -1;
+        memcpy(name, p, len);
+        name[len] = '\0';
+
+        slot = findChild(slot, name);
+    }
+
+    return slot;
 }
 
 /* Dump contents of watch cache to the log file */
@@ -351,14 +700,15 @@ pathnameInCache(const char *pathname)
 static void
 dumpCacheToLog(void)
 {
+    char path[PATH_MAX];
     int cnt;
 
     cnt = 0;
 
     for (int j = 0; j < cacheSize; j++) {
         if (wlCache[j].wd >= 0) {
-            fprintf(logfp, "%d: wd = %d; %s\n", j,
-                    wlCache[j].wd, wlCache[j].path);
+            slotToPath(j, path, sizeof(path));
+            fprintf(logfp, "%d: wd = %d; %s\n", j, wlCache[j].wd, path);
             cnt++;
         }
     }
@@ -495,35 +845,161 @@ zapRootDirPath(const char *path)
 
 /***********************************************************************/
 
-/* Below is a function called by nftw() to traverse a directory tree.
-   The function adds a watch for each directory in the tree. Each
-   successful call to this function should return 0 to indicate to
-   nftw() that the tree traversal should continue. */
+/* Below is a parallel directory tree walker, used to add a watch and a
+   cache entry for each directory in a tree.
+
+   Each directory that remains to be scanned is a work item, and each
+   thread has its own deque of work items. A thread takes items from the
+   tail of its own deque, so that it walks its part of the tree
+   depth-first. When its deque is empty, a thread steals an item from the
+   head of another thread's deque; items nearer the top of the tree are
+   found there, and these are likely to represent the most work.
+
+   The watch for a directory is added before the directory's entries are
+   read, so that a subdirectory created during the scan is either seen by
+   the scan or reported by an IN_CREATE event (or both; see the discussion
+   of this race in processNextInotifyEvent()).
+
+   The cache is not designed for concurrent access, so the threads
+   serialize their use of it with a mutex. The expensive parts of the
+   scan (inotify_add_watch() and reading directories) are done without
+   holding the mutex. */
+
+struct workItem {
+    int parent;                 /* Cache slot of parent directory, or -1
+                                   if this directory becomes a root node */
+    int base;                   /* Offset of the name that is recorded in
+                                   the cache node (0 for a root node) */
+    char *path;                 /* Pathname of directory (malloc'ed) */
+};
+
+struct treeWalk;
+
+struct walkThread {
+    pthread_t thread;
+    struct treeWalk *tw;
+    int idx;                    /* Index of this thread in 'tw->threads' */
+    pthread_mutex_t mtx;        /* Protects the following fields */
+    struct workItem *items;     /* Deque of items: items[head..tail-1] */
+    int head;
+    int tail;
+    int size;                   /* Allocated size of 'items' */
+};
+
+struct treeWalk {
+    int inotifyFd;
+    int nthreads;
+    struct walkThread *threads;
+    pthread_mutex_t cacheMtx;   /* Serializes access to the cache */
+    int pending;                /* Number of items queued or being
+                                   scanned; the walk is complete when
+                                   this drops to 0 */
+    int dirCnt;                 /* Count of directories added to cache
+                                   (protected by 'cacheMtx') */
+};
 
-/* The usual hack for nftw()...  We can't pass arguments to the
-   function invoked by nftw(), so we use these global variables to
-   exchange information with the function. */
+/* A directory entry, as returned by getdents64() */
+
+struct linux_dirent64 {
+    ino64_t        d_ino;
+    off64_t        d_off;
+    unsigned short d_reclen;
+    unsigned char  d_type;
+    char           d_name[];
+};
+
+static int scanThreads;         /* Number of threads used for (re)building
+                                   the cache */
+
+/* Add a work item to the tail of the deque of thread 'wt' */
+
+static void
+pushWork(struct walkThread *wt, int parent, int base, char *path)
+{
+    __atomic_add_fetch(&wt->tw->pending, 1, __ATOMIC_ACQ_REL);
 
-static int dirCnt;      /* Count of directories added to watch list */
-static int ifd;         /* Inotify file descriptor */
+    pthread_mutex_lock(&wt->mtx);
+
+    if (wt->tail == wt->size) {
+        if (wt->head > 0) {             /* Reclaim space at head */
+            memmove(wt->items, wt->items + wt->head,
+                    (wt->tail - wt->head) * sizeof(struct workItem));
+            wt->tail -= wt->head;
+            wt->head = 0;
+        }
+
+        if (wt->tail == wt->size) {
+            wt->size = (wt->size == 0) ? 256 : wt->size * 2;
+            wt->items = realloc(wt->items,
+                                wt->size * sizeof(struct workItem));
+            if (wt->items == NULL)
+                errExit("realloc");
+        }
+    }
+
+    wt->items[wt->tail].parent = parent;
+    wt->items[wt->tail].base = base;
+    wt->items[wt->tail].path = path;
+    wt->tail++;
+
+    pthread_mutex_unlock(&wt->mtx);
+}
+
+/* Take an item from the tail ('fromTail' true) or the head of the deque
+   of thread 'wt'. Returns 1 if an item was obtained, otherwise 0. */
 
 static int
-traverseTree(const char *pathname, const struct stat *sb, int tflag,
-             struct FTW *ftwbuf)
+takeWork(struct walkThread *wt, int fromTail, struct workItem *item)
 {
-    int wd, slot, flags;
+    int found;
+
+    pthread_mutex_lock(&wt->mtx);
 
-    if (! S_ISDIR(sb->st_mode))
-        return 0;               /* Ignore nondirectory files */
+    found = wt->head < wt->tail;
+    if (found) {
+        if (fromTail)
+            *item = wt->items[--wt->tail];
+        else
+            *item = wt->items[wt->head++];
+
+        if (wt->head == wt->tail)
+            wt->head = wt->tail = 0;
+    }
+
+    pthread_mutex_unlock(&wt->mtx);
+
+    return found;
+}
+
+/* Add a watch and a cache entry for the directory in 'item', and queue
+   work items for its subdirectories */
+
+static void
+scanDir(struct walkThread *wt, struct workItem *item)
+{
+    struct treeWalk *tw = wt->tw;
+    char buf[32768] __attribute__ ((aligned(8)));
+    struct linux_dirent64 *d;
+    struct stat sb;
+    size_t plen, nlen;
+    ssize_t nread;
+    int wd, slot, flags, fd, isDir;
+    char *cpath;
 
     /* Create a watch for this directory */
 
-    flags = IN_CREATE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF;
+    /* IN_DELETE isn't needed to maintain the cache (IN_DELETE_SELF does
+       that), but it lets coalesceEvents() drop a directory that is
+       created and then deleted before we get to it */
+
+    flags = IN_CREATE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF |
+            IN_DELETE;
 
-    if (isRootDirPath(pathname))
+    if (isRootDirPath(item->path))
         flags |= IN_MOVE_SELF;
 
-    wd = inotify_add_watch(ifd, pathname, flags | IN_ONLYDIR);
+    wd = inotify_add_watch(tw->inotifyFd, item->path,
+                           flags | IN_ONLYDIR | IN_DONT_FOLLOW);
     if (wd == -1) {
 
         /* By the time we come to create a watch, the directory might already
@@ -532,111 +1008,821 @@ traverseTree(const char *pathname, const struct stat *sb, int tflag,
            Other errors are unexpected, and if we hit them, we give up. */
 
         logMessage(VB_BASIC, "inotify_add_watch: %s: %s\n",
-                pathname, strerror(errno));
+                item->path, strerror(errno));
         if (errno == ENOENT)
-            return 0;
+            return;
         else
             exit(EXIT_FAILURE);
     }
 
-    if (findWatch(wd) >= 0) {
+    pthread_mutex_lock(&tw->cacheMtx);
 
-        /* This watch descriptor is already in the cache;
-           nothing more to do. */
+    slot = findWatch(wd);
+    if (slot >= 0) {
 
-        logMessage(VB_BASIC, "WD %d already in cache (%s)\n", wd, pathname);
-        return 0;
+        /* This watch descriptor is already in the cache; but we still
+           scan the directory, since its subdirectories may not be */
+
+        logMessage(VB_BASIC, "WD %d already in cache (%s)\n", wd, item->path);
+    } else {
+        tw->dirCnt++;
+
+        /* Cache information about the watch */
+
+        slot = addWatchToCache(wd, item->parent, item->path + item->base);
+
+        /* Print the name of the current directory */
+
+        logMessage(VB_NOISY, "    watchDir: wd = %d [cache slot: %d]; %s\n",
+                    wd, slot, item->path);
     }
 
-    dirCnt++;
+    pthread_mutex_unlock(&tw->cacheMtx);
 
-    /* Cache information about the watch */
+    /* Queue the subdirectories. We open the directory with O_NOFOLLOW,
+       so as not to follow a soft link to a directory (which could lead
+       us in circles). */
 
-    slot = addWatchToCache(wd, pathname);
+    fd = open(item->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1) {
+        logMessage(VB_BASIC, "open: %s: %s (directory probably deleted "
+                "before we could scan it)\n", item->path, strerror(errno));
+        return;
+    }
 
-    /* Print the name of the current directory */
+    plen = strlen(item->path);
 
-    logMessage(VB_NOISY, "    watchDir: wd = %d [cache slot: %d]; %s\n",
-                wd, slot, pathname);
+    for (;;) {
+        nread = syscall(SYS_getdents64, fd, buf, sizeof(buf));
+        if (nread == -1) {
+            logMessage(VB_BASIC, "getdents64: %s: %s\n",
+                    item->path, strerror(errno));
+            break;
+        }
+        if (nread == 0)                 /* End of directory */
+            break;
 
-    return 0;
+        for (char *p = buf; p < buf + nread; p += d->d_reclen) {
+            d = (struct linux_dirent64 *) p;
+
+            if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+                continue;
+
+            /* Not all filesystems fill in 'd_type' */
+
+            if (d->d_type == DT_UNKNOWN)
+                isDir = fstatat(fd, d->d_name, &sb, AT_SYMLINK_NOFOLLOW) == 0 &&
+                        S_ISDIR(sb.st_mode);
+            else
+                isDir = d->d_type == DT_DIR;
+
+            if (!isDir)
+                continue;       /* Ignore nondirectory files */
+
+            nlen = strlen(d->d_name);
+            if (plen + 1 + nlen >= PATH_MAX) {
+                logMessage(VB_BASIC, "Pathname too long: %s/%s\n",
+                        item->path, d->d_name);
+                continue;
+            }
+
+            cpath = malloc(plen + 1 + nlen + 1);
+            if (cpath == NULL)
+                errExit("malloc");
+            memcpy(cpath, item->path, plen);
+            cpath[plen] = '/';
+            memcpy(cpath + plen + 1, d->d_name, nlen + 1);
+
+            pushWork(wt, slot, plen + 1, cpath);
+        }
+    }
+
+    close(fd);
+}
+
+/* Scan directories until there is no work left in any thread's deque */
+
+static void *
+walkWorker(void *arg)
+{
+    struct walkThread *wt = arg;
+    struct treeWalk *tw = wt->tw;
+    struct workItem item;
+    int found;
+
+    for (;;) {
+        found = takeWork(wt, 1, &item);
+
+        for (int k = 1; !found && k < tw->nthreads; k++)
+            found = takeWork(&tw->threads[(wt->idx + k) % tw->nthreads],
+                             0, &item);
+
+        if (found) {
+            scanDir(wt, &item);
+            free(item.path);
+
+            /* Any subdirectories were queued (and counted in 'pending')
+               before we mark this item as done, so 'pending' drops to 0
+               only when the whole tree has been scanned */
+
+            __atomic_sub_fetch(&tw->pending, 1, __ATOMIC_ACQ_REL);
+
+        } else if (__atomic_load_n(&tw->pending, __ATOMIC_ACQUIRE) == 0) {
+            break;
+        } else {
+            sched_yield();      /* Other threads are still scanning */
+        }
+    }
+
+    return NULL;
 }
 
 /* Add the directory in 'pathname' to the watch list of the inotify
    file descriptor 'inotifyFd'. The process is recursive: watch items
-   are also created for all of the subdirectories of 'pathname'.
-   Returns number of watches/cache entries added for this subtree. */
+   are also created for all of the subdirectories of 'pathname'. The
+   tree is scanned using 'nthreads' threads (the calling thread, plus
+   'nthreads' - 1 helpers). Returns number of watches/cache entries
+   added for this subtree. */
 
 static int
-watchDir(int inotifyFd, const char *pathname)
+watchDir(int inotifyFd, const char *pathname, int nthreads)
 {
-    dirCnt = 0;
-    ifd = inotifyFd;
+    char parentPath[PATH_MAX];
+    struct treeWalk tw;
+    const char *p;
+    char *path;
+    int parent, base, s;
+
+    tw.inotifyFd = inotifyFd;
+    tw.nthreads = (nthreads > 0) ? nthreads : 1;
+    tw.pending = 0;
+    tw.dirCnt = 0;
+    pthread_mutex_init(&tw.cacheMtx, NULL);
+
+    tw.threads = calloc(tw.nthreads, sizeof(struct walkThread));
+    if (tw.threads == NULL)
+        errExit("calloc");
 
-    /* Use FTW_PHYS to avoid following soft links to directories (which
-       could lead us in circles) */
+    for (int j = 0; j < tw.nthreads; j++) {
+        tw.threads[j].tw = &tw;
+        tw.threads[j].idx = j;
+        pthread_mutex_init(&tw.threads[j].mtx, NULL);
+    }
+
+    /* If the parent of 'pathname' is cached, the new subtree is attached
+       beneath it; otherwise, 'pathname' becomes a root node */
+
+    parent = -1;
+    base = 0;
+    p = strrchr(pathname, '/');
+    if (!isRootDirPath(pathname) && p != NULL && p > pathname &&
+            p - pathname < PATH_MAX) {
+        snprintf(parentPath, sizeof(parentPath), "%.*s",
+                 (int) (p - pathname), pathname);
+        parent = pathnameToCacheSlot(parentPath);
+        if (parent != -1)
+            base = p - pathname + 1;
+    }
+
+    path = strdup(pathname);
+    if (path == NULL)
+        errExit("strdup");
+    pushWork(&tw.threads[0], parent, base, path);
 
-    /* By the time we come to process 'pathname', it may already have
-       been deleted, so we log errors from nftw(), but keep on going */
+    /* The calling thread serves as the first walker */
+
+    for (int j = 1; j < tw.nthreads; j++) {
+        s = pthread_create(&tw.threads[j].thread, NULL, walkWorker,
+                           &tw.threads[j]);
+        if (s != 0) {
+            errno = s;
+            errExit("pthread_create");
+        }
+    }
 
-    if (nftw(pathname, traverseTree, 20, FTW_PHYS) == -1)
-        logMessage(VB_BASIC,
-                "nftw: %s: %s (directory probably deleted before we "
-                "could watch)\n", pathname, strerror(errno));
+    walkWorker(&tw.threads[0]);
 
-    return dirCnt;
+    for (int j = 1; j < tw.nthreads; j++) {
+        s = pthread_join(tw.threads[j].thread, NULL);
+        if (s != 0) {
+            errno = s;
+            errExit("pthread_join");
+        }
+    }
+
+    for (int j = 0; j < tw.nthreads; j++) {
+        free(tw.threads[j].items);
+        pthread_mutex_destroy(&tw.threads[j].mtx);
+    }
+    free(tw.threads);
+    pthread_mutex_destroy(&tw.cacheMtx);
+
+    return tw.dirCnt;
 }
 
 /* Add watches and cache entries for a subtree, logging a message
-   noting the number entries added. */
+   noting the number entries added, and the rate at which they
+   were added. */
 
-static void
-watchSubtree(int inotifyFd, char *path)
+static int
+watchSubtree(int inotifyFd, char *path, int nthreads)
 {
     int cnt;
+    double secs;
 
-    cnt = watchDir(inotifyFd, path);
+    secs = timeNow();
+    cnt = watchDir(inotifyFd, path, nthreads);
+    secs = timeNow() - secs;
 
-    logMessage(VB_BASIC, "    watchSubtree: %s: %d entries added\n",
-            path, cnt);
+    logMessage(VB_BASIC, "    watchSubtree: %s: %d entries added in "
+            "%.3f secs (%.0f dirs/sec)\n", path, cnt, secs,
+            (secs > 0) ? cnt / secs : 0.0);
+
+    return cnt;
 }
 
 /***********************************************************************/
 
-/* The directory oldPathPrefix/oldName was renamed to newPathPrefix/newName.
-   Fix up cache entries for oldPathPrefix/oldName and all of its subdirectories
-   to reflect the change. */
+/* The event pipeline
+
+   Events are passed from the inotify file descriptor to the cache in two
+   stages. A reader thread drains the file descriptor into a queue as
+   fast as events arrive, so that the kernel's event queue (whose length
+   is limited by /proc/sys/fs/inotify/max_queued_events) is less likely
+   to overflow while the main thread is busy, for example scanning a
+   newly created subtree, or rebuilding the cache. Each read() asks for
+   as many bytes as FIONREAD says are available (or 'readBufferSize'
+   bytes, if -b was specified), and the queue grows as needed, up to
+   'maxQueueBytes'; beyond that, the reader waits for the main thread to
+   catch up. The reader wakes the main thread's select() by writing to
+   an eventfd ('wakeFd') when the queue becomes nonempty.
+
+   The main thread takes all of the queued events at once, by swapping
+   buffers with the queue, and passes the batch through coalesceEvents()
+   before applying it to the cache. */
+
+struct evQueue {
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;        /* Signaled when events are added, and
+                                   when the queue is emptied */
+    char *buf;                  /* Queued events */
+    size_t len;                 /* Bytes queued */
+    size_t size;                /* Allocated size of 'buf' */
+    long events;                /* Number of events queued */
+    int stop;                   /* Tells the reader to stop */
+
+    /* Counters, displayed by the 's' command */
+
+    long reads;                 /* read()s from the inotify FD */
+    long long bytes;            /* Bytes read */
+    long eventsRead;
+    size_t maxRead;             /* Largest read() */
+    size_t maxLen;              /* Largest 'len' and 'events' seen */
+    long maxEvents;
+    long fullWaits;             /* Times the reader found the queue full */
+};
+
+static struct evQueue evq = {
+    .mtx = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER
+};
+
+static pthread_t readerThread;
+static int readerRunning = 0;
+static int readerFd;            /* The inotify FD that the reader reads */
+static int wakeFd = -1;         /* eventfd: reader ==> main thread */
+static int stopFd = -1;         /* eventfd: main thread ==> reader */
+
+static long eventsCoalesced = 0;        /* Events dropped by
+                                           coalesceEvents() */
+static long eventsDiscarded = 0;        /* Events dropped because the
+                                           cache was rebuilt */
+static int overflowCnt = 0;             /* IN_Q_OVERFLOW events seen */
+
+/* Return the number of events in the 'len' bytes at 'buf' */
+
+static long
+countEvents(const char *buf, size_t len)
+{
+    long cnt = 0;
+
+    for (const char *p = buf; p < buf + len;
+            p += sizeof(struct inotify_event) +
+                 ((const struct inotify_event *) p)->len)
+        cnt++;
+    return cnt;
+}
+
+/* Make sure that 'buf' (with allocated size '*size') has room for
+   'need' bytes */
 
 static void
-rewriteCachedPaths(const char *oldPathPrefix, const char *oldName,
-                   const char *newPathPrefix, const char *newName)
+growBuffer(char **buf, size_t *size, size_t need)
+{
+    size_t newSize;
+
+    if (need <= *size)
+        return;
+
+    newSize = (*size > 0) ? *size : INOTIFY_READ_BUF_LEN;
+    while (newSize < need)
+        newSize *= 2;
+
+    *buf = realloc(*buf, newSize);
+    if (*buf == NULL)
+        errExit("realloc");
+    *size = newSize;
+}
+
+/* The reader thread: move events from 'readerFd' to 'evq' until told
+   to stop */
+
+static void *
+readerFunc(void *arg)
+{
+    struct pollfd pfd[2];
+    uint64_t one = 1;
+    ssize_t numRead;
+    size_t want;
+    long cnt;
+    int avail, wasEmpty;
+
+    pfd[0].fd = readerFd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = stopFd;
+    pfd[1].events = POLLIN;
+
+    for (;;) {
+        if (poll(pfd, 2, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            errExit("poll");
+        }
+        if (pfd[1].revents & POLLIN)
+            break;
+        if (!(pfd[0].revents & POLLIN))
+            continue;
+
+        /* Size the read() to take everything that is available */
+
+        if (readBufferSize > 0) {
+            want = readBufferSize;
+        } else {
+            if (ioctl(readerFd, FIONREAD, &avail) == -1)
+                errExit("ioctl-FIONREAD");
+            want = (avail > INOTIFY_READ_BUF_LEN) ? avail :
+                                                    INOTIFY_READ_BUF_LEN;
+        }
+
+        pthread_mutex_lock(&evq.mtx);
+
+        /* If this read() would take the queue beyond its limit, wait
+           until the main thread takes the events (but always allow one
+           read() into an empty queue); then grow the queue as needed */
+
+        while (evq.len > 0 && evq.len + want > maxQueueBytes && !evq.stop) {
+            evq.fullWaits++;
+            pthread_cond_wait(&evq.cond, &evq.mtx);
+        }
+
+        if (evq.stop) {
+            pthread_mutex_unlock(&evq.mtx);
+            break;
+        }
+
+        growBuffer(&evq.buf, &evq.size, evq.len + want);
+
+        /* The read() doesn't block (the FD is nonblocking), so it is
+           done while holding the mutex, straight into the queue */
+
+        numRead = read(readerFd, evq.buf + evq.len, want);
+        if (numRead == -1) {
+            pthread_mutex_unlock(&evq.mtx);
+            if (errno == EAGAIN || errno == EINTR)
+                continue;
+            errExit("read");
+        }
+        if (numRead == 0) {
+            fprintf(stderr, "read() from inotify fd returned 0!");
+            exit(EXIT_FAILURE);
+        }
+
+        cnt = countEvents(evq.buf + evq.len, numRead);
+
+        wasEmpty = evq.len == 0;
+        evq.len += numRead;
+        evq.events += cnt;
+
+        evq.reads++;
+        evq.bytes += numRead;
+        evq.eventsRead += cnt;
+        if ((size_t) numRead > evq.maxRead)
+            evq.maxRead = numRead;
+        if (evq.len > evq.maxLen)
+            evq.maxLen = evq.len;
+        if (evq.events > evq.maxEvents)
+            evq.maxEvents = evq.events;
+
+        pthread_cond_broadcast(&evq.cond);
+        pthread_mutex_unlock(&evq.mtx);
+
+        if (wasEmpty && write(wakeFd, &one, sizeof(one)) == -1)
+            errExit("write-eventfd");
+    }
+
+    return NULL;
+}
+
+/* Start a reader thread for the inotify FD 'fd' */
+
+static void
+startReader(int fd)
 {
-    char fullPath[PATH_MAX], newPrefix[PATH_MAX];
-    char newPath[PATH_MAX];
-    size_t len;
     int s;
 
-    snprintf(fullPath, sizeof(fullPath), "%s/%s", oldPathPrefix, oldName);
-    snprintf(newPrefix, sizeof(newPrefix), "%s/%s", newPathPrefix, newName);
-    len = strlen(fullPath);
+    readerFd = fd;
+    evq.stop = 0;
 
-    logMessage(VB_BASIC, "Rename: %s ==> %s\n", fullPath, newPrefix);
+    s = pthread_create(&readerThread, NULL, readerFunc, NULL);
+    if (s != 0) {
+        errno = s;
+        errExit("pthread_create");
+    }
+    readerRunning = 1;
+}
 
-    for (int j = 0; j < cacheSize; j++) {
-        if (strncmp(fullPath, wlCache[j].path, len) == 0 &&
-                    (wlCache[j].path[len] == '/' ||
-                     wlCache[j].path[len] == '\0')) {
-            s = snprintf(newPath, sizeof(newPath), "%s%s", newPrefix,
-                    &wlCache[j].path[len]);
-            if (s > sizeof(newPath))
-                logMessage(VB_BASIC, "Truncated pathname: %s\n", newPath);
-
-            strncpy(wlCache[j].path, newPath, PATH_MAX);
-
-            logMessage(VB_NOISY, "    wd %d [cache slot %d] ==> %s\n",
-                    wlCache[j].wd, j, newPath);
+/* Stop the reader thread, close the inotify FD 'fd', and discard the
+   events that were queued from it */
+
+static void
+closeInotify(int fd)
+{
+    uint64_t val = 1;
+
+    if (readerRunning) {
+        pthread_mutex_lock(&evq.mtx);
+        evq.stop = 1;
+        pthread_cond_broadcast(&evq.cond);
+        pthread_mutex_unlock(&evq.mtx);
+
+        if (write(stopFd, &val, sizeof(val)) == -1)
+            errExit("write-eventfd");
+        pthread_join(readerThread, NULL);
+        if (read(stopFd, &val, sizeof(val)) == -1)      /* Reset */
+            errExit("read-eventfd");
+        readerRunning = 0;
+    }
+
+    close(fd);
+
+    pthread_mutex_lock(&evq.mtx);
+    eventsDiscarded += evq.events;
+    evq.len = 0;
+    evq.events = 0;
+    pthread_mutex_unlock(&evq.mtx);
+}
+
+/* Move the queued events into '*buf' (of allocated size '*size'),
+   either replacing the 'len' bytes that it holds (if 'append' is 0), or
+   after them. Returns the new number of bytes in '*buf'. */
+
+static size_t
+takeEvents(char **buf, size_t *size, size_t len, int append)
+{
+    char *tmp;
+    size_t tmpSize;
+
+    pthread_mutex_lock(&evq.mtx);
+
+    if (!append) {              /* Swap buffers with the queue */
+        tmp = *buf;
+        tmpSize = *size;
+        *buf = evq.buf;
+        *size = evq.size;
+        len = evq.len;
+        evq.buf = tmp;
+        evq.size = tmpSize;
+    } else if (evq.len > 0) {
+        growBuffer(buf, size, len + evq.len);
+        memcpy(*buf + len, evq.buf, evq.len);
+        len += evq.len;
+    }
+
+    evq.len = 0;
+    evq.events = 0;
+    pthread_cond_broadcast(&evq.cond);  /* The reader may be waiting */
+    pthread_mutex_unlock(&evq.mtx);
+
+    return len;
+}
+
+/* Wait up to 'usecs' microseconds for more events to be queued.
+   Returns 1 if there are events, else 0. */
+
+static int
+waitForEvents(long usecs)
+{
+    struct timespec ts;
+    int avail;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += usecs * 1000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&evq.mtx);
+    while (evq.len == 0 && readerRunning)
+        if (pthread_cond_timedwait(&evq.cond, &evq.mtx, &ts) == ETIMEDOUT)
+            break;
+    avail = evq.len > 0;
+    pthread_mutex_unlock(&evq.mtx);
+
+    return avail;
+}
+
+/* Coalescing
+
+   Within a batch, some events cancel or supersede others. Since the
+   cache is updated only when the batch is processed, it is cheaper to
+   drop or merge such events beforehand than to apply each of them. The
+   rules are:
+
+   - A directory that appears (IN_CREATE, or an IN_MOVED_TO without a
+     matching IN_MOVED_FROM) and is then renamed within the trees is
+     treated as having appeared under its new name. (When the first
+     event is processed, the directory is scanned under the name that
+     it has then, in any case.)
+   - A directory that appears and then goes (IN_DELETE, or an
+     IN_MOVED_FROM without a matching IN_MOVED_TO) is forgotten
+     altogether: we never add a watch for it, so there are no other
+     events for it.
+   - A chain of renames of the same directory (A ==> B, then B ==> C)
+     becomes a single rename (A ==> C), which is dropped if it ends
+     where it started.
+   - All events before an IN_Q_OVERFLOW are dropped, since the cache is
+     rebuilt when the overflow is processed.
+
+   The events that these rules relate must follow one another in the
+   batch, save for events that don't affect the cache (events for
+   files, and IN_IGNORED). An IN_MOVED_FROM and IN_MOVED_TO pair is
+   recognized, as in processNextInotifyEvent(), only if the two events
+   are consecutive. */
+
+#define COALESCE_WINDOW 64      /* Limit on the unrelated events that
+                                   may lie between related ones */
+
+enum { EK_OTHER, EK_NONE, EK_APPEAR, EK_GONE, EK_FROM, EK_TO };
+
+struct evRec {                  /* A parsed event */
+    const struct inotify_event *ev;
+    int wd;                     /* 'wd' and 'name' may be rewritten */
+    const char *name;
+    uint32_t len;               /* Length of 'name' field */
+    int kind;                   /* EK_* */
+    int drop;
+};
+
+static struct evRec *evRecs = NULL;
+static size_t evRecsSize = 0;
+
+static int
+sameDir(const struct evRec *a, const struct evRec *b)
+{
+    return a->wd == b->wd && strcmp(a->name, b->name) == 0;
+}
+
+/* Return the index of the next record after 'j' that might affect the
+   cache, or -1 if there is none within COALESCE_WINDOW records */
+
+static long
+nextRelevant(long j, long n)
+{
+    for (long k = j + 1; k < n && k <= j + COALESCE_WINDOW; k++)
+        if (!evRecs[k].drop && evRecs[k].kind != EK_NONE)
+            return k;
+    return -1;
+}
+
+/* Classify the events in the 'len' bytes at 'buf' into 'evRecs'.
+   Returns the number of events. */
+
+static long
+parseEvents(const char *buf, size_t len)
+{
+    const struct inotify_event *ev;
+    struct evRec *r;
+    long n;
+    uint32_t m;
+
+    n = 0;
+    for (const char *p = buf; p < buf + len;
+            p += sizeof(struct inotify_event) + ev->len) {
+        ev = (const struct inotify_event *) p;
+
+        if ((size_t) n == evRecsSize) {
+            evRecsSize = (evRecsSize == 0) ? 1024 : evRecsSize * 2;
+            evRecs = realloc(evRecs, evRecsSize * sizeof(struct evRec));
+            if (evRecs == NULL)
+                errExit("realloc");
+        }
+
+        r = &evRecs[n++];
+        r->ev = ev;
+        r->wd = ev->wd;
+        r->name = (ev->len > 0) ? ev->name : "";
+        r->len = ev->len;
+        r->drop = 0;
+
+        m = ev->mask;
+        if (m & (IN_Q_OVERFLOW | IN_UNMOUNT | IN_DELETE_SELF | IN_MOVE_SELF))
+            r->kind = EK_OTHER;
+        else if ((m & IN_IGNORED) || !(m & IN_ISDIR))
+            r->kind = EK_NONE;
+        else if (m & IN_CREATE)
+            r->kind = EK_APPEAR;
+        else if (m & IN_DELETE)
+            r->kind = EK_GONE;
+        else if (m & IN_MOVED_FROM)
+            r->kind = EK_FROM;
+        else if (m & IN_MOVED_TO)
+            r->kind = EK_TO;
+        else
+            r->kind = EK_OTHER;
+    }
+
+    /* Pair up IN_MOVED_FROM and IN_MOVED_TO events; an unpaired event
+       is a move into or out of the trees */
+
+    for (long j = 0; j < n; j++) {
+        if (evRecs[j].kind == EK_FROM) {
+            if (j + 1 < n && evRecs[j + 1].kind == EK_TO &&
+                    evRecs[j + 1].ev->cookie == evRecs[j].ev->cookie)
+                j++;                    /* Skip the pair */
+            else
+                evRecs[j].kind = EK_GONE;
+        } else if (evRecs[j].kind == EK_TO) {
+            evRecs[j].kind = EK_APPEAR;
+        }
+    }
+
+    return n;
+}
+
+/* Apply the coalescing rules to the 'len' bytes of events at 'buf',
+   writing the events that remain to 'out' (which must have room for
+   'len' bytes). Returns the number of bytes written to 'out'. */
+
+static size_t
+coalesceEvents(const char *buf, size_t len, char *out)
+{
+    struct inotify_event *oev;
+    long n, j, k, dropped;
+    char *p;
+
+    n = parseEvents(buf, len);
+    dropped = 0;
+
+    /* Drop everything before the last queue overflow */
+
+    for (j = n - 1; j > 0; j--) {
+        if (evRecs[j].ev->mask & IN_Q_OVERFLOW) {
+            for (k = 0; k < j; k++)
+                evRecs[k].drop = 1;
+            eventsDiscarded += j;
+            break;
+        }
+    }
+
+    for (j = 0; j < n; j++) {
+        if (evRecs[j].drop)
+            continue;
+
+        if (evRecs[j].kind == EK_APPEAR) {
+            for (;;) {
+                k = nextRelevant(j, n);
+                if (k == -1 || !sameDir(&evRecs[j], &evRecs[k]))
+                    break;
+
+                if (evRecs[k].kind == EK_GONE) {        /* Appear, gone */
+                    evRecs[j].drop = evRecs[k].drop = 1;
+                    dropped += 2;
+                    break;
+                }
+                if (evRecs[k].kind != EK_FROM)
+                    break;
+
+                /* Appear, then rename: appear under the new name */
+
+                evRecs[j].wd = evRecs[k + 1].wd;
+                evRecs[j].name = evRecs[k + 1].name;
+                evRecs[j].len = evRecs[k + 1].len;
+                evRecs[k].drop = evRecs[k + 1].drop = 1;
+                dropped += 2;
+            }
+
+        } else if (evRecs[j].kind == EK_FROM) {
+
+            /* A rename; evRecs[j + 1] is its IN_MOVED_TO */
+
+            for (;;) {
+                k = nextRelevant(j + 1, n);
+                if (k == -1 || evRecs[k].kind != EK_FROM ||
+                        !sameDir(&evRecs[j + 1], &evRecs[k]))
+                    break;
+
+                evRecs[j + 1].wd = evRecs[k + 1].wd;
+                evRecs[j + 1].name = evRecs[k + 1].name;
+                evRecs[j + 1].len = evRecs[k + 1].len;
+                evRecs[k].drop = evRecs[k + 1].drop = 1;
+                dropped += 2;
+            }
+
+            if (sameDir(&evRecs[j], &evRecs[j + 1])) {
+                evRecs[j].drop = evRecs[j + 1].drop = 1;
+                dropped += 2;
+            }
+            j++;                        /* Skip the IN_MOVED_TO */
         }
     }
+
+    if (dropped > 0)
+        logMessage(VB_NOISY, "Coalesced %ld of %ld events\n", dropped, n);
+    eventsCoalesced += dropped;
+
+    /* Write out the events that remain */
+
+    p = out;
+    for (j = 0; j < n; j++) {
+        if (evRecs[j].drop)
+            continue;
+
+        oev = (struct inotify_event *) p;
+        *oev = *evRecs[j].ev;
+        oev->wd = evRecs[j].wd;
+        oev->len = evRecs[j].len;
+        memcpy(oev->name, evRecs[j].name, evRecs[j].len);
+        p += sizeof(struct inotify_event) + evRecs[j].len;
+    }
+
+    return p - out;
+}
+
+/***********************************************************************/
+
+/* The directory 'oldName' in the directory cached in 'oldParent' was
+   renamed to 'newName' in the directory cached in 'newParent'. Move the
+   corresponding cache node; since the pathnames of its descendants are
+   built from their ancestors' names, they need no change. Returns 0 on
+   success, or -1 if the cache is found to be inconsistent. */
+
+static int
+moveCachedSubtree(int oldParent, const char *oldName,
+                  int newParent, const char *newName)
+{
+    char oldPrefix[PATH_MAX], newPrefix[PATH_MAX];
+    int slot, other;
+
+    slotToPath(oldParent, oldPrefix, sizeof(oldPrefix));
+    slotToPath(newParent, newPrefix, sizeof(newPrefix));
+
+    logMessage(VB_BASIC, "Rename: %s/%s ==> %s/%s\n",
+            oldPrefix, oldName, newPrefix, newName);
+
+    slot = findChild(oldParent, oldName);
+    if (slot == -1)
+        return 0;               /* Not cached; nothing to do */
+
+    /* A directory can't be moved beneath itself; if the cache says
+       otherwise, it is out of step with the filesystem */
+
+    for (int s = newParent; s != -1; s = wlCache[s].parent) {
+        if (s == slot) {
+            logMessage(0, "Rename of slot %d would create a loop\n", slot);
+            return -1;
+        }
+    }
+
+    /* If rename() replaced an (empty) directory, the cache entry for
+       that directory is removed when its IN_DELETE_SELF event arrives.
+       In the meantime, make sure that it is not found by name. */
+
+    other = findChild(newParent, newName);
+    if (other >= 0)
+        unhashName(other);
+
+    unhashName(slot);
+    unlinkChild(slot);
+    wlCache[slot].parent = newParent;
+    setName(slot, newName);
+    linkChild(slot);
+    hashName(slot);
+
+    logMessage(VB_NOISY, "    wd %d [cache slot %d] ==> %s/%s\n",
+            wlCache[slot].wd, slot, newPrefix, newName);
+
+    return 0;
 }
 
 /* Zap watches and cache entries for directory 'path' and all of its
@@ -646,53 +1832,51 @@ rewriteCachedPaths(const char *oldPathPrefix, const char *oldName,
 static int
 zapSubtree(int inotifyFd, char *path)
 {
-    size_t len;
-    int cnt;
-    char *pn;
+    char pn[PATH_MAX];
+    int top, slot, next, cnt;
 
     logMessage(VB_NOISY, "Zapping subtree: %s\n", path);
 
-    len = strlen(path);
-
-    /* The argument we receive might be a pointer to a pathname string
-       that is actually stored in the cache.  If we zap that pathname part way
-       through scanning the whole cache, then chaos results.  So, create a
-       temporary copy. */
+    top = pathnameToCacheSlot(path);
+    if (top == -1)
+        return 0;
 
-    pn = strdup(path);
+    /* Remove the nodes in postorder: descend to a node that has no
+       children, and remove it; then move back up to its parent, which
+       may now have no children of its own */
 
     cnt = 0;
+    slot = top;
+    for (;;) {
+        while (wlCache[slot].firstChild != -1)
+            slot = wlCache[slot].firstChild;
 
-    for (int j = 0; j < cacheSize; j++) {
-        if (wlCache[j].wd >= 0) {
-            if (strncmp(pn, wlCache[j].path, len) == 0 &&
-                    (wlCache[j].path[len] == '/' ||
-                     wlCache[j].path[len] == '\0')) {
-
-                logMessage(VB_NOISY,
-                           "    removing watch: wd = %d (%s)\n",
-                           wlCache[j].wd, wlCache[j].path);
+        next = (slot == top) ? -1 : wlCache[slot].parent;
 
-                if (inotify_rm_watch(inotifyFd, wlCache[j].wd) == -1) {
-                    logMessage(0, "inotify_rm_watch wd = %d (%s): %s\n",
-                            wlCache[j].wd, wlCache[j].path, strerror(errno));
+        slotToPath(slot, pn, sizeof(pn));
+        logMessage(VB_NOISY, "    removing watch: wd = %d (%s)\n",
+                   wlCache[slot].wd, pn);
 
-                    /* When we have multiple renamers, sometimes
-                       inotify_rm_watch() fails. In this case, we force a
-                       cache rebuild by returning -1.
-                       (TODO: Is there a better solution?) */
+        if (inotify_rm_watch(inotifyFd, wlCache[slot].wd) == -1) {
+            logMessage(0, "inotify_rm_watch wd = %d (%s): %s\n",
+                    wlCache[slot].wd, pn, strerror(errno));
 
-                    cnt = -1;
-                    break;
-                }
+            /* When we have multiple renamers, sometimes
+               inotify_rm_watch() fails. In this case, we force a
+               cache rebuild by returning -1.
+               (TODO: Is there a better solution?) */
 
-                markCacheSlotEmpty(j);
-                cnt++;
-            }
+            return -1;
         }
+
+        markCacheSlotEmpty(slot);
+        cnt++;
+
+        if (next == -1)
+            break;
+        slot = next;
     }
 
-    free(pn);
     return cnt;
 }
 
@@ -709,10 +1893,10 @@ reinitialize(int oldInotifyFd)
 {
     int inotifyFd;
     static int reinitCnt;
-    int cnt;
+    double start;
 
     if (oldInotifyFd >= 0) {
-        close(oldInotifyFd);
+        closeInotify(oldInotifyFd);
 
         reinitCnt++;
         logMessage(0, "Reinitializing cache and inotify FD (reinitCnt = %d)\n",
@@ -723,25 +1907,38 @@ reinitialize(int oldInotifyFd)
         reinitCnt = 0;
     }
 
-    inotifyFd = inotify_init();
+    inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
     if (inotifyFd == -1)
-        errExit("inotify_init");
+        errExit("inotify_init1");
 
     logMessage(VB_BASIC, "    new inotifyFd = %d\n", inotifyFd);
 
+    /* Start reading events straight away, so that the events that occur
+       while the cache is being built don't overflow the kernel's queue */
+
+    startReader(inotifyFd);
+    buildCnt++;
+
+    start = timeNow();
+
     freeCache();
 
+    buildDirs = 0;
     for (int j = 0; j < numRootDirs; j++)
         if (rootDirPaths[j] != NULL)
-            watchSubtree(inotifyFd, rootDirPaths[j]);
+            buildDirs += watchSubtree(inotifyFd, rootDirPaths[j],
+                                      scanThreads);
 
-    cnt = 0;
-    for (int j = 0; j < cacheSize; j++)
-        if (wlCache[j].wd >= 0)
-            cnt++;
+    buildSecs = timeNow() - start;
 
     if (oldInotifyFd >= 0)
-        logMessage(0, "Rebuilt cache with %d entries\n", cnt);
+        logMessage(0, "Rebuilt cache with %d entries in %.3f secs "
+                "(%.0f dirs/sec)\n", cacheEntries, buildSecs,
+                (buildSecs > 0) ? buildDirs / buildSecs : 0.0);
+    else
+        logMessage(VB_BASIC, "Built cache with %d entries in %.3f secs "
+                "(%.0f dirs/sec)\n", cacheEntries, buildSecs,
+                (buildSecs > 0) ? buildDirs / buildSecs : 0.0);
 
     return inotifyFd;
 }
@@ -751,17 +1948,22 @@ reinitialize(int oldInotifyFd)
    if there is an IN_MOVED_FROM+IN_MOVED_TO pair that share a cookie
    value, both events are consumed.
 
-   Returns the number of bytes in the event(s) consumed from 'buf'.  */
+   Returns the number of bytes in the event(s) consumed from 'buf'. If
+   the cache had to be rebuilt, this is 'bufSize', so that the remaining
+   events (which refer to the old inotify file descriptor) are discarded.
+*/
 
 static size_t
-processNextInotifyEvent(int *inotifyFd, char *buf, int bufSize, int firstTry)
+processNextInotifyEvent(int *inotifyFd, char *buf, size_t bufSize)
 {
     char fullPath[PATH_MAX + NAME_MAX];
+    char evPath[PATH_MAX];              /* Pathname of watched directory */
     struct inotify_event *ev;
     size_t evLen;
     int evCacheSlot;
 
     ev = (struct inotify_event *) buf;
+    evPath[0] = '\0';
 
     displayInotifyEvent(ev);
 
@@ -781,10 +1983,12 @@ processNextInotifyEvent(int *inotifyFd, char *buf, int bufSize, int firstTry)
 
             *inotifyFd = reinitialize(*inotifyFd);
 
-            /* Discard all remaining events in current read() buffer */
+            /* Discard all remaining events in current batch */
 
-            return INOTIFY_READ_BUF_LEN;
+            return bufSize;
         }
+
+        slotToPath(evCacheSlot, evPath, sizeof(evPath));
     }
 
     evLen = sizeof(struct inotify_event) + ev->len;
@@ -797,7 +2001,7 @@ processNextInotifyEvent(int *inotifyFd, char *buf, int bufSize, int firstTry)
            of its subdirectories. */
 
         snprintf(fullPath, sizeof(fullPath), "%s/%s",
-                 wlCache[evCacheSlot].path, ev->name);
+                 evPath, ev->name);
 
         logMessage(VB_BASIC, "Directory creation on wd %d: %s\n",
                 ev->wd, fullPath);
@@ -828,8 +2032,11 @@ processNextInotifyEvent(int *inotifyFd, char *buf, int bufSize, int firstTry)
                   but adding a second cache for the grandchild would leave the
                   cache in a confused state.) */
 
-        if (!pathnameInCache(fullPath))
-            watchSubtree(*inotifyFd, fullPath);
+        /* A newly created subtree is usually small, so it is not worth
+           starting extra threads to scan it */
+
+        if (findChild(evCacheSlot, ev->name) == -1)
+            watchSubtree(*inotifyFd, fullPath, 1);
 
     } else if (ev->mask & IN_DELETE_SELF) {
 
@@ -837,10 +2044,10 @@ processNextInotifyEvent(int *inotifyFd, char *buf, int bufSize, int firstTry)
            the cache. */
 
         logMessage(VB_BASIC, "Clearing watchlist item %d (%s)\n",
-                   ev->wd, wlCache[evCacheSlot].path);
+                   ev->wd, evPath);
 
-        if (isRootDirPath(wlCache[evCacheSlot].path))
-            zapRootDirPath(wlCache[evCacheSlot].path);
+        if (isRootDirPath(evPath))
+            zapRootDirPath(evPath);
 
         markCacheSlotEmpty(evCacheSlot);
             /* No need to remove the watch; that happens automatically */
@@ -856,10 +2063,11 @@ processNextInotifyEvent(int *inotifyFd, char *buf, int bufSize, int firstTry)
            tree(s).
 
            We assume that if this is an "intra-tree" rename() event, then the
-           "moved to" event is the next event in the buffer returned by the
-           current read(). (If we are already at the last event in this buffer,
-           then we ask our caller to read a bit more, in the hope of getting
-           the following IN_MOVED_TO event in the next read().)
+           "moved to" event is the next event in the current batch. (If an
+           IN_MOVED_FROM event is the last in the batch, then before the
+           batch is processed, processInotifyEvents() waits briefly for the
+           reader thread to deliver more events, in the hope of getting
+           the following IN_MOVED_TO event.)
 
            In most cases, the assumption holds. However, where multiple
            processes are manipulating the tree, we can can get event sequences
@@ -885,7 +2093,7 @@ processNextInotifyEvent(int *inotifyFd, char *buf, int bufSize, int firstTry)
 
            So, this program takes the simple approach of assuming that an
            IN_MOVED_FROM+IN_MOVED_TO pair occupy consecutive events in the
-           buffer returned by read().
+           batch.
 
            When that assumption is wrong (and we therefore fail to recognize
            an intra-tree rename() event), then the rename will be treated
@@ -931,8 +2139,9 @@ processNextInotifyEvent(int *inotifyFd, char *buf, int bufSize, int firstTry)
 
             int nextEvCacheSlot;
 
-            /* We have a rename() event. We need to fix up the cached pathnames
-             * for the corresponding directory and all of its subdirectories. */
+            /* We have a rename() event. We need to move the cache entry for
+             * the corresponding directory (and thus, implicitly, the entries
+             * for all of its subdirectories). */
 
             nextEvCacheSlot = findWatchChecked(nextEv->wd);
 
@@ -942,32 +2151,53 @@ processNextInotifyEvent(int *inotifyFd, char *buf, int bufSize, int firstTry)
 
                 *inotifyFd = reinitialize(*inotifyFd);
 
-                /* Discard all remaining events in current read() buffer */
+                /* Discard all remaining events in current batch */
 
-                return INOTIFY_READ_BUF_LEN;
+                return bufSize;
             }
 
-            rewriteCachedPaths(wlCache[evCacheSlot].path, ev->name,
-                               wlCache[nextEvCacheSlot].path, nextEv->name);
+            /* If the directory is not cached, then it was created and
+               renamed before we handled its IN_CREATE event (and so
+               watchSubtree() did not find it). Treat the rename as the
+               directory appearing under its new name. */
+
+            if (findChild(evCacheSlot, ev->name) == -1) {
+                if (findChild(nextEvCacheSlot, nextEv->name) == -1) {
+                    slotToPath(nextEvCacheSlot, fullPath, sizeof(fullPath));
+                    snprintf(fullPath + strlen(fullPath),
+                             sizeof(fullPath) - strlen(fullPath), "/%s",
+                             nextEv->name);
+                    watchSubtree(*inotifyFd, fullPath, 1);
+                }
+
+            } else if (moveCachedSubtree(evCacheSlot, ev->name,
+                           nextEvCacheSlot, nextEv->name) == -1) {
+
+                /* Cache reached an inconsistent state */
+
+                *inotifyFd = reinitialize(*inotifyFd);
+
+                /* Discard all remaining events in current batch */
+
+                return bufSize;
+            }
 
             /* We have also processed the next (IN_MOVED_TO) event,
                so skip over it */
 
             evLen += sizeof(struct inotify_event) + nextEv->len;
 
-        } else if (((char *) nextEv < buf + bufSize) || !firstTry) {
+        } else {
 
             /* We got a "moved from" event without an accompanying "moved to"
                event. The directory has been moved outside the tree we are
                monitoring. We need to remove the watches and zap the cache
                entries for the moved directory and all of its subdirectories. */
 
-            logMessage(VB_NOISY, "MOVED_OUT: %p %p\n",
-                    wlCache[evCacheSlot].path, ev->name);
-            logMessage(VB_NOISY, "firstTry = %d; remaining bytes = %d\n",
-                    firstTry, buf + bufSize - (char *) nextEv);
+            logMessage(VB_NOISY, "MOVED_OUT: %s/%s\n",
+                    evPath, ev->name);
             snprintf(fullPath, sizeof(fullPath), "%s/%s",
-                     wlCache[evCacheSlot].path, ev->name);
+                     evPath, ev->name);
 
             if (zapSubtree(*inotifyFd, fullPath) == -1) {
 
@@ -975,25 +2205,17 @@ processNextInotifyEvent(int *inotifyFd, char *buf, int bufSize, int firstTry)
 
                 *inotifyFd = reinitialize(*inotifyFd);
 
-                /* Discard all remaining events in current read() buffer */
+                /* Discard all remaining events in current batch */
 
-                return INOTIFY_READ_BUF_LEN;
+                return bufSize;
             }
-
-        } else {
-            logMessage(VB_NOISY, "HANGING IN_MOVED_FROM\n");
-
-            return -1;  /* Tell our caller to do another read() */
         }
 
     } else if (ev->mask & IN_Q_OVERFLOW) {
 
-        static int overflowCnt = 0;
-
         overflowCnt++;
 
-        logMessage(0, "Queue overflow (%d) (inotifyReadCnt = %d)\n",
-                    overflowCnt, inotifyReadCnt);
+        logMessage(0, "Queue overflow (%d)\n", overflowCnt);
 
         /* When the queue overflows, some events are lost, at which point
            we've lost any chance of keeping our cache consistent with the
@@ -1002,9 +2224,9 @@ processNextInotifyEvent(int *inotifyFd, char *buf, int bufSize, int firstTry)
 
         *inotifyFd = reinitialize(*inotifyFd);
 
-        /* Discard all remaining events in current read() buffer */
+        /* Discard all remaining events in current batch */
 
-        evLen = INOTIFY_READ_BUF_LEN;
+        evLen = bufSize;
 
     } else if (ev->mask & IN_UNMOUNT) {
 
@@ -1014,13 +2236,13 @@ processNextInotifyEvent(int *inotifyFd, char *buf, int bufSize, int firstTry)
            corresponding cache entry. */
 
         logMessage(0, "Filesystem unmounted: %s\n",
-                wlCache[evCacheSlot].path);
+                evPath);
 
         markCacheSlotEmpty(evCacheSlot);
             /* No need to remove the watch; that happens automatically */
 
     } else if (ev->mask & IN_MOVE_SELF &&
-            isRootDirPath(wlCache[evCacheSlot].path)) {
+            isRootDirPath(evPath)) {
 
         /* If the root path moves to a new location in the same filesystem,
            then all cached pathnames become invalid, and we have no direct way
@@ -1030,19 +2252,19 @@ processNextInotifyEvent(int *inotifyFd, char *buf, int bufSize, int firstTry)
            Instead, we'll keep things simple, and just cease monitoring it. */
 
         logMessage(0, "Root path moved: %s\n",
-                    wlCache[evCacheSlot].path);
+                    evPath);
 
-        zapRootDirPath(wlCache[evCacheSlot].path);
+        zapRootDirPath(evPath);
 
-        if (zapSubtree(*inotifyFd, wlCache[evCacheSlot].path) == -1) {
+        if (zapSubtree(*inotifyFd, evPath) == -1) {
 
             /* Cache reached an inconsistent state */
 
             *inotifyFd = reinitialize(*inotifyFd);
 
-            /* Discard all remaining events in current read() buffer */
+            /* Discard all remaining events in current batch */
 
-            return INOTIFY_READ_BUF_LEN;
+            return bufSize;
         }
     }
 
@@ -1055,129 +2277,75 @@ processNextInotifyEvent(int *inotifyFd, char *buf, int bufSize, int firstTry)
     return evLen;
 }
 
-static void
-alarmHandler(int sig)
-{
-    return;             /* Just interrupt read() */
-}
-
-/* Read a block of events from the inotify file descriptor, 'inotifyFd'.
-   Process the events relating to directories in the subtree we are
-   monitoring, in order to keep our cached view of the subtree in sync
-   with the filesystem. */
+/* Take the events that the reader thread has queued, coalesce them,
+   and process them, in order to keep our cached view of the subtrees
+   that we are monitoring in sync with the filesystem. */
 
 static void
 processInotifyEvents(int *inotifyFd)
 {
-    char buf[INOTIFY_READ_BUF_LEN]
-        __attribute__ ((aligned(__alignof__(struct inotify_event))));
-    ssize_t numRead, nr;
-    size_t cnt;
-    int evLen;
-    int firstTry;
-    struct sigaction sa;
-
-    /* SIGALRM handler is designed simply to interrupt read() */
-
-    sigemptyset(&sa.sa_mask);
-    sa.sa_handler = alarmHandler;
-    sa.sa_flags = 0;
-    if (sigaction(SIGALRM, &sa, NULL) == -1)
-        errExit("sigaction");
-
-    firstTry = 1;
-
-    /* Read some events from inotify file descriptor */
-
-    cnt = (readBufferSize > 0) ? readBufferSize : INOTIFY_READ_BUF_LEN;
-    numRead = read(*inotifyFd, buf, cnt);
-    if (numRead == -1)
-        errExit("read");
-    if (numRead == 0) {
-        fprintf(stderr, "read() from inotify fd returned 0!");
-        exit(EXIT_FAILURE);
+    static char *batch = NULL, *applyBuf = NULL;
+    static size_t batchSize = 0, applySize = 0;
+    const struct inotify_event *last;
+    size_t len, applyLen, evLen;
+    uint64_t val;
+    double start;
+    int builds;
+
+    /* Reset the eventfd counter; the reader writes to it again when it
+       next adds events to an empty queue */
+
+    if (read(wakeFd, &val, sizeof(val)) == -1 && errno != EAGAIN)
+        errExit("read-eventfd");
+
+    len = takeEvents(&batch, &batchSize, 0, 0);
+    if (len == 0)
+        return;
+
+    /* If the batch ends with an IN_MOVED_FROM event, it may be the first
+       half of an "intra-tree" rename(), in which case we want the
+       matching IN_MOVED_TO event to be in the same batch. Give it a short
+       time to arrive. Some rough testing suggests that a 2-millisecond
+       timeout is sufficient to ensure that, in around 99.8% of cases, we
+       get the IN_MOVED_TO event (if there is one) that matched an
+       IN_MOVED_FROM event, even in a highly dynamic directory tree. This
+       number may, of course, warrant tuning on different hardware and in
+       environments with different filesystem activity levels. We wait
+       only once: if the batch still ends with an IN_MOVED_FROM, it is
+       treated as a rename() out of the trees. */
+
+    last = NULL;
+    for (char *p = batch; p < batch + len;
+            p += sizeof(struct inotify_event) + last->len)
+        last = (const struct inotify_event *) p;
+
+    if ((last->mask & (IN_MOVED_FROM | IN_ISDIR)) ==
+            (IN_MOVED_FROM | IN_ISDIR)) {
+        logMessage(VB_NOISY, "HANGING IN_MOVED_FROM\n");
+        if (waitForEvents(2000))
+            len = takeEvents(&batch, &batchSize, len, 1);
     }
 
-    inotifyReadCnt++;
+    growBuffer(&applyBuf, &applySize, len);
+    applyLen = coalesceEvents(batch, len, applyBuf);
 
-    logMessage(VB_NOISY,
-               "\n==========> Read %d: got %zd bytes\n",
-               inotifyReadCnt, numRead);
+    logMessage(VB_NOISY, "\n==========> Batch: %zu bytes, %zu after "
+               "coalescing\n", len, applyLen);
 
-    /* Process each event in the buffer returned by read() */
+    /* Process each event that remains */
 
-    for (char *evp = buf; evp < buf + numRead; ) {
+    for (char *evp = applyBuf; evp < applyBuf + applyLen; evp += evLen) {
+        builds = buildCnt;
+        start = timeNow();
         evLen = processNextInotifyEvent(inotifyFd, evp,
-                                 buf + numRead - evp, firstTry);
-
-        if (evLen > 0) {
-            evp += evLen;
-            firstTry = 1;
-        } else {
+                                        applyBuf + applyLen - evp);
+        eventSecs += timeNow() - start;
 
-            /* We got here because an IN_MOVED_FROM event was found at the end
-               of a previously read buffer and that event may be part of an
-               "intra-tree" rename(), meaning that we should check if there is
-               a subsequent IN_MOVED_TO event with the same cookie value. We
-               left that event unprocessed and we will now try to read some
-               more events, delaying for a short time, to give the associated
-               IN_MOVED_IN event (if there is one) a chance to arrive. However,
-               we only want to do this once: if the read() below fails to
-               gather further events, then when we reprocess the IN_MOVED_FROM
-               we should treat it as though this is an out-of-tree rename().
-               Thus, we set 'firstTry' to 0 for the next
-               processNextInotifyEvent() call. */
+        /* If the cache was rebuilt, the rest of the batch was skipped */
 
-            int savedErrno;
-
-            firstTry = 0;
-
-            numRead = buf + numRead - evp;
-
-            /* Shuffle remaining bytes to start of buffer */
-
-            for (int j = 0; j < numRead; j++)
-                buf[j] = evp[j];
-
-            /* Set a timeout for read(). Some rough testing suggests
-               that a 2-millisecond timeout is sufficient to ensure that, in
-               around 99.8% of cases, we get the IN_MOVED_TO event (if there
-               is one) that matched an IN_MOVED_FROM event, even in a highly
-               dynamic directory tree. This number may, of course, warrant
-               tuning on different hardware and in environments with different
-               filesystem activity levels. */
-
-            ualarm(2000, 0);
-
-            nr = read(*inotifyFd, buf + numRead,
-                      INOTIFY_READ_BUF_LEN - numRead);
-
-            savedErrno = errno; /* In case ualarm() should change errno */
-            ualarm(0, 0);       /* Cancel alarm */
-            errno = savedErrno;
-
-            if (nr == -1 && errno != EINTR)
-                errExit("read");
-            if (nr == 0) {
-                fprintf(stderr, "read() from inotify fd returned 0!");
-                exit(EXIT_FAILURE);
-            }
-
-            if (errno != -1) {
-                numRead += nr;
-                inotifyReadCnt++;
-
-                logMessage(VB_NOISY,
-                       "\n==========> SECONDARY Read %d: got %zd bytes\n",
-                       inotifyReadCnt, nr);
-
-            } else {                    /* EINTR */
-                logMessage(VB_NOISY,
-                       "\n==========> SECONDARY Read got nothing\n");
-            }
-
-            evp = buf;          /* Start again at beginning of buffer */
-        }
+        if (buildCnt != builds)
+            eventsDiscarded += countEvents(evp, evLen) - 1;
+        eventCnt++;
     }
 }
 
@@ -1192,6 +2360,7 @@ executeCommand(int *inotifyFd)
     const int MAX_LINE = 100;
     ssize_t numRead;
     char line[MAX_LINE], arg[MAX_LINE];
+    char path[PATH_MAX];
     char cmd;
     int cnt, ns, failures;
     struct stat sb;
@@ -1221,7 +2390,7 @@ executeCommand(int *inotifyFd)
             logMessage(VB_BASIC, "Zapped: %s, %d entries\n", arg, cnt);
         }
 
-        watchSubtree(*inotifyFd, arg);
+        watchSubtree(*inotifyFd, arg, scanThreads);
         break;
 
     case 'c':   /* Check that all cached pathnames exist */
@@ -1231,23 +2400,22 @@ executeCommand(int *inotifyFd)
         failures = 0;
         for (int j = 0; j < cacheSize; j++) {
             if (wlCache[j].wd >= 0) {
-                if (lstat(wlCache[j].path, &sb) == -1) {
+                slotToPath(j, path, sizeof(path));
+                if (lstat(path, &sb) == -1) {
                     if (cmd == 'c')
                         logMessage(VB_BASIC,
                                 "stat: [slot = %d; wd = %d] %s: %s\n",
-                                j, wlCache[j].wd, wlCache[j].path,
-                                strerror(errno));
+                                j, wlCache[j].wd, path, strerror(errno));
                     failures++;
                 } else if (!S_ISDIR(sb.st_mode)) {
                     if (cmd == 'c')
-                        logMessage(0, "%s is not a directory\n",
-                                wlCache[j].path);
+                        logMessage(0, "%s is not a directory\n", path);
                     exit(EXIT_FAILURE);
                 } else {
                     if (cmd == 'c')
                         logMessage(VB_NOISY,
                                 "OK: [slot = %d; wd = %d] %s\n",
-                                j, wlCache[j].wd, wlCache[j].path);
+                                j, wlCache[j].wd, path);
                     cnt++;
                 }
             }
@@ -1263,8 +2431,8 @@ executeCommand(int *inotifyFd)
 
         for (int j = 0; j < cacheSize; j++) {
             if (wlCache[j].wd >= 0) {
-                logMessage(0, "%d: %d %s\n", j, wlCache[j].wd,
-                           wlCache[j].path);
+                slotToPath(j, path, sizeof(path));
+                logMessage(0, "%d: %d %s\n", j, wlCache[j].wd, path);
                 cnt++;
             }
         }
@@ -1272,6 +2440,36 @@ executeCommand(int *inotifyFd)
         logMessage(VB_BASIC, "Total entries: %d\n", cnt);
         break;
 
+    case 's':   /* Display cache statistics */
+
+        logMessage(0, "Cache entries: %d (slots: %d; hash buckets: %d)\n",
+                cacheEntries, cacheSize, hashSize);
+        logMessage(0, "Cache memory: %zu bytes\n",
+                cacheSize * sizeof(struct watch) +
+                2 * hashSize * sizeof(int) + nameBytes);
+        logMessage(0, "Last cache build: %d dirs in %.3f secs "
+                "(%.0f dirs/sec; %d threads)\n", buildDirs, buildSecs,
+                (buildSecs > 0) ? buildDirs / buildSecs : 0.0, scanThreads);
+        logMessage(0, "Events processed: %ld (%.2f usecs/event)\n",
+                eventCnt, (eventCnt > 0) ? eventSecs * 1e6 / eventCnt : 0.0);
+
+        pthread_mutex_lock(&evq.mtx);
+        logMessage(0, "Events read: %ld in %ld reads (%.0f bytes/read; "
+                "largest %zu)\n", evq.eventsRead, evq.reads,
+                (evq.reads > 0) ? (double) evq.bytes / evq.reads : 0.0,
+                evq.maxRead);
+        logMessage(0, "Events coalesced: %ld (ratio %.3f); discarded: %ld\n",
+                eventsCoalesced, (evq.eventsRead > 0) ?
+                (double) eventsCoalesced / evq.eventsRead : 0.0,
+                eventsDiscarded);
+        logMessage(0, "Queue depth: %ld events, %zu bytes (max %ld events, "
+                "%zu bytes; buffer %zu bytes)\n", evq.events, evq.len,
+                evq.maxEvents, evq.maxLen, evq.size);
+        logMessage(0, "Queue full: %ld times; overflows: %d\n",
+                evq.fullWaits, overflowCnt);
+        pthread_mutex_unlock(&evq.mtx);
+        break;
+
     case 'q':   /* Quit */
 
         exit(EXIT_SUCCESS);
@@ -1308,9 +2506,12 @@ executeCommand(int *inotifyFd)
         if (fp == NULL)
             perror("fopen");
 
-        for (int j = 0; j < cacheSize; j++)
-            if (wlCache[j].wd >= 0)
-                fprintf(fp, "%s\n", wlCache[j].path);
+        for (int j = 0; j < cacheSize; j++) {
+            if (wlCache[j].wd >= 0) {
+                slotToPath(j, path, sizeof(path));
+                fprintf(fp, "%s\n", path);
+            }
+        }
 
         fclose(fp);
         break;
@@ -1322,7 +2523,7 @@ executeCommand(int *inotifyFd)
         break;
 
     case '0':   /* Rebuild cache */
-        close(*inotifyFd);
+        closeInotify(*inotifyFd);
         *inotifyFd = reinitialize(-1);
         break;
 
@@ -1335,6 +2536,7 @@ executeCommand(int *inotifyFd)
         printf("d        Toggle cache dumping\n");
         printf("l        List cached pathnames\n");
         printf("q        Quit\n");
+        printf("s        Display cache statistics\n");
         printf("v [n]    Toggle/set verbose level for messages to stderr\n");
         printf("             0 = no messages\n");
         printf("             1 = basic messages\n");
@@ -1359,10 +2561,17 @@ usageError(const char *pname)
     fprintf(stderr, "    -x       Check cache consistency after each "
                                   "operation\n");
     fprintf(stderr, "    -d       Dump cache to log after every operation\n");
-    fprintf(stderr, "    -b size  Set buffer size for read() from "
-                                  "inotify FD\n");
+    fprintf(stderr, "    -b size  Read from inotify FD in 'size' chunks "
+            "(default: all\n"
+            "             available bytes)\n");
+    fprintf(stderr, "    -q size  Limit on bytes of events queued by "
+            "reader thread\n"
+            "             (default: 64 MB)\n");
     fprintf(stderr, "    -a file  Abort when cache inconsistency detected, "
             "and create 'stop' file\n");
+    fprintf(stderr, "    -t num   Number of threads used to scan the "
+            "tree(s) (default:\n"
+            "             number of online CPUs)\n");
 
     exit(EXIT_FAILURE);
 }
@@ -1381,8 +2590,11 @@ main(int argc, char *argv[])
     dumpCache = 0;
     stopFile = NULL;
     abortOnCacheProblem = 0;
+    scanThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (scanThreads < 1)
+        scanThreads = 1;
 
-    while ((opt = getopt(argc, argv, "a:dxl:v:b:")) != -1) {
+    while ((opt = getopt(argc, argv, "a:dxl:v:b:q:t:")) != -1) {
         switch (opt) {
 
         case 'a':
@@ -1406,6 +2618,18 @@ main(int argc, char *argv[])
             readBufferSize = atoi(optarg);
             break;
 
+        case 'q':
+            maxQueueBytes = strtoul(optarg, NULL, 0);
+            if (maxQueueBytes == 0)
+                usageError(argv[0]);
+            break;
+
+        case 't':
+            scanThreads = atoi(optarg);
+            if (scanThreads < 1)
+                usageError(argv[0]);
+            break;
+
         case 'l':
             logfp = fopen(optarg, "w+");
             if (logfp == NULL)
@@ -1425,6 +2649,13 @@ main(int argc, char *argv[])
 
     copyRootDirPaths(&argv[optind]);
 
+    /* Create the eventfds used to communicate with the reader thread */
+
+    wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    stopFd = eventfd(0, EFD_CLOEXEC);
+    if (wakeFd == -1 || stopFd == -1)
+        errExit("eventfd");
+
     /* Create an inotify instance and populate it with entries for
        directory named on command line */
 
@@ -1438,8 +2669,8 @@ main(int argc, char *argv[])
     for (;;) {
         FD_ZERO(&rfds);
         FD_SET(STDIN_FILENO, &rfds);
-        FD_SET(inotifyFd, &rfds);
-        if (select(inotifyFd + 1, &rfds, NULL, NULL, NULL) == -1)
+        FD_SET(wakeFd, &rfds);
+        if (select(wakeFd + 1, &rfds, NULL, NULL, NULL) == -1)
             errExit("select");
 
         if (FD_ISSET(STDIN_FILENO, &rfds)) {
@@ -1449,7 +2680,7 @@ main(int argc, char *argv[])
             fflush(stdout);
         }
 
-        if (FD_ISSET(inotifyFd, &rfds))
+        if (FD_ISSET(wakeFd, &rfds))
             processInotifyEvents(&inotifyFd);
     }
 
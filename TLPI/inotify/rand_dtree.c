@@ -17,6 +17,35 @@
    This program randomly creates, deletes, or renames
    subdirectories underneath the pathname specified in its
    sole command-line argument.
+
+   It can also quickly populate a tree with a given number of
+   directories (the 'p' operation), in order to measure how
+   inotify_dtree.c copes with large trees. For example:
+
+        $ ./rand_dtree -m 100000 /tmp/t p
+        $ ./inotify_dtree -v 1 /tmp/t   # Reports time to build cache
+        $ ./rand_dtree -m 1000 /tmp/t m &
+
+   and then use the inotify_dtree 's' command to display the time
+   taken per event and the memory used by the cache. (Watching very
+   large trees requires raising /proc/sys/fs/inotify/max_user_watches.)
+
+   The 'b' operation is a stress benchmark for inotify_dtree.c's event
+   pipeline. It generates directory events as fast as it can, in the
+   patterns that inotify_dtree.c coalesces: each operation creates a
+   directory, renames it zero or more times (to randomly chosen
+   directories in the tree), and usually removes it again. It reports
+   the number of operations (system calls) per second. For example:
+
+        $ ./rand_dtree -m 1000 /tmp/t p
+        $ ./inotify_dtree /tmp/t
+        (in another terminal:)
+        $ for j in 1 2 3 4; do ./rand_dtree -s 0 -m 100000 /tmp/t b & done
+
+   and then use the inotify_dtree 's' command to display the number of
+   events read and coalesced, the depth of the event queue, and the
+   number of queue overflows, and the 'c' command to check that the
+   cache is still consistent with the tree.
 */
 #if ! defined(_XOPEN_SOURCE) || _XOPEN_SOURCE < 700
 #undef _XOPEN_SOURCE
@@ -25,10 +54,13 @@
 #include <stdarg.h>
 #include <limits.h>
 #include <ftw.h>
+#include "curr_time.h"                  /* Declaration of timeNow() */
 #include "tlpi_hdr.h"
 
 #define DLIM 60
 
+#define FANOUT 32       /* Subdirectories per directory for 'p' */
+
 /* Hack! We can't pass arguments to the function invoked by nftw(),
    so we use these global variables to exchange information with
    the function */
@@ -87,15 +119,124 @@ logMessage(const char *format, ...)
     va_end(argList);
 }
 
+/* Create 'numDirs' directories under 'pathname', filling the tree
+   breadth-first, with FANOUT subdirectories in each directory. The
+   names include MARKER_STRING, so that the directories are candidates
+   for the 'd' and 'm' operations. */
+
+#define MARKER_STRING "--"
+
+static void
+populate(const char *pathname, int numDirs)
+{
+    char path[PATH_MAX];
+    int base;
+
+    base = getDirList(pathname);
+    if (base == 0)
+        fatal("No directories found under %s", pathname);
+
+    for (int j = 0; j < numDirs; j++) {
+        if (dcnt >= dlSize) {
+            dlSize += (dlSize < D_INCR) ? D_INCR : dlSize;
+            dirList = realloc(dirList, dlSize * sizeof(char *));
+            if (dirList == NULL)
+                errExit("realloc");
+        }
+
+        snprintf(path, sizeof(path), "%s/%ld%sp%d", dirList[j / FANOUT],
+                (long) getpid() % 100, MARKER_STRING, j);
+        if (mkdir(path, 0700) == -1)
+            errExit("mkdir: %s", path);
+
+        dirList[dcnt] = strdup(path);
+        if (dirList[dcnt] == NULL)
+            errExit("strdup");
+        dcnt++;
+    }
+
+    printf("Created %d directories (total now %d)\n", numDirs, dcnt);
+}
+
+/* Perform 'numOps' create/rename/remove cycles of directories under
+   'pathname' (see the 'b' operation above), stopping early if
+   'stopFile' is created, and sleeping 'usecs' microseconds after each
+   cycle */
+
+static void
+stress(const char *pathname, int numOps, int usecs, const char *stopFile)
+{
+    char path[PATH_MAX], target[PATH_MAX];
+    long calls;
+    int ndirs, nrenames;
+    double start, secs;
+
+    /* The directories that we create are never candidates as parents,
+       so the list of existing directories stays valid (unless other
+       processes remove directories, in which case some of our calls
+       fail, which doesn't matter) */
+
+    ndirs = getDirList(pathname);
+    if (ndirs == 0)
+        fatal("No directories found under %s", pathname);
+
+    calls = 0;
+    start = timeNow();
+
+    for (int j = 0; j < numOps; j++) {
+        snprintf(path, sizeof(path), "%s/%ld%sb%d",
+                dirList[random() % ndirs], (long) getpid() % 100,
+                MARKER_STRING, j);
+        calls++;
+        if (mkdir(path, 0700) == -1)
+            continue;
+        logMessage("mkdir: %s\n", path);
+
+        nrenames = random() % 4;
+        for (int k = 0; k < nrenames; k++) {
+            snprintf(target, sizeof(target), "%s/%ld%sb%d_%d",
+                    dirList[random() % ndirs], (long) getpid() % 100,
+                    MARKER_STRING, j, k);
+            calls++;
+            if (rename(path, target) == -1)
+                break;
+            logMessage("rename: %s ==> %s\n", path, target);
+            strcpy(path, target);
+        }
+
+        if (random() % 4 != 0) {        /* Usually, remove it again */
+            calls++;
+            if (rmdir(path) == 0)
+                logMessage("rmdir: %s\n", path);
+        }
+
+        if (usecs > 0)
+            usleep(usecs);
+
+        if (stopFile != NULL && access(stopFile, F_OK) == 0)
+            break;
+    }
+
+    secs = timeNow() - start;
+    printf("%ld operations in %.3f secs (%.0f ops/sec)\n", calls, secs,
+            (secs > 0) ? calls / secs : 0.0);
+}
+
 static void
 usageError(char *pname)
 {
-    fprintf(stderr, "Usage: %s [options] dirpath {c|d|m}\n\n", pname);
+    fprintf(stderr, "Usage: %s [options] dirpath {c|d|m|p|b}\n\n", pname);
     fprintf(stderr, "Perform random operations in the "
             "directory tree 'dirpath'\n");
     fprintf(stderr, "    c == create directories\n");
     fprintf(stderr, "    d == delete directories\n");
-    fprintf(stderr, "    m == rename directories\n\n");
+    fprintf(stderr, "    m == rename directories\n");
+    fprintf(stderr, "    p == populate tree with 'maxops' directories "
+            "(default 10000), then exit\n");
+    fprintf(stderr, "    b == create, rename, and delete directories as "
+            "fast as possible\n");
+    fprintf(stderr, "         ('maxops' (default 100000) times), then "
+            "exit\n\n");
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "    -l logfile     Record activity in log file\n");
     fprintf(stderr, "    -m maxops      Do at most 'maxops' operations "
@@ -107,8 +248,6 @@ usageError(char *pname)
     exit(EXIT_FAILURE);
 }
 
-#define MARKER_STRING "--"
-
 int
 main(int argc, char *argv[])
 {
@@ -163,6 +302,17 @@ main(int argc, char *argv[])
     if (optind + 1 >= argc)
         usageError(argv[0]);
 
+    if (argv[optind + 1][0] == 'p') {
+        populate(argv[optind], (maxops > 0) ? maxops : 10000);
+        exit(EXIT_SUCCESS);
+    }
+
+    if (argv[optind + 1][0] == 'b') {
+        stress(argv[optind], (maxops > 0) ? maxops : 100000, usecs,
+               stopFile);
+        exit(EXIT_SUCCESS);
+    }
+
     opcnt = 0;
 
     for (;;) {
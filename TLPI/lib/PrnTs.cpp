@@ -5,6 +5,9 @@
 #include <unistd.h>
 #include <time.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sched.h>
+#include <errno.h>
 #include <sys/signal.h>
 #include <pthread.h>
 #include <sys/fsuid.h> // setfsuid()
@@ -15,6 +18,10 @@
 /*
  * [2023-12-31] Jimm Chen:
  * PrnTs(): A printf-like function that prints timestamp prefix as well.
+ *
+ * By default, PrnTs() prints with printf(), holding a mutex. After
+ * PrnTs_start_async(), it instead queues its output for a flusher thread;
+ * see "Asynchronous mode" below.
  */
 
 #ifndef __int64
@@ -23,6 +30,8 @@
 
 static pthread_mutex_t s_prnts_mtx = PTHREAD_MUTEX_INITIALIZER;
 
+static __int64 s_prev_msec = -1; // time of previous PrnTs() output, for the "+delta"; under s_prnts_mtx
+
 
 char* now_timestr(char buf[], int bufchars, bool ymd = false)
 {
@@ -69,37 +78,535 @@ __int64 GetTickCount64()
 	return (__int64)tv_abs.tv_sec * 1000 + tv_abs.tv_usec / 1000;
 }
 
+// Caches the "[hh:mm:ss." part of the timestamp, so that localtime_r()
+// and its formatting are done only once per second.
+struct TsCache
+{
+	time_t sec;
+	char hms[16];
+};
+
+// Render the PrnTs() prefix, e.g. "[12:34:56.789](+  0.012s) ", for the
+// time 'usec' (microseconds since the Epoch). Returns the prefix length.
+static int render_prefix(char *buf, int bufchars, TsCache *cache,
+	__int64 usec, int delta_msec)
+{
+	time_t sec = (time_t)(usec / 1000000);
+	int millisec = (int)(usec % 1000000 / 1000);
+
+	if (sec != cache->sec)
+	{
+		struct tm stm = {};
+		localtime_r(&sec, &stm);
+		snprintf(cache->hms, sizeof(cache->hms), "[%02d:%02d:%02d.",
+			stm.tm_hour, stm.tm_min, stm.tm_sec);
+		cache->sec = sec;
+	}
+
+	int len = (int)strlen(cache->hms);
+	memcpy(buf, cache->hms, len);
+	buf[len++] = '0' + millisec / 100;
+	buf[len++] = '0' + millisec / 10 % 10;
+	buf[len++] = '0' + millisec % 10;
+	buf[len++] = ']';
+
+	len += snprintf(buf+len, bufchars-len, "(+%3u.%03us) ",
+		delta_msec / 1000, delta_msec % 1000);
+
+	return len;
+}
+
+static __int64 now_usec()
+{
+	timeval tv_abs;
+	gettimeofday(&tv_abs, NULL);
+
+	return (__int64)tv_abs.tv_sec * 1000000 + tv_abs.tv_usec;
+}
+
+// Return the "+delta" for output at 'now_msec', and make 'now_msec' the
+// time of the previous output, '*prev_msec'. Sync PrnTs() and the flusher
+// each keep their own '*prev_msec', under their own lock.
+static int next_delta(__int64 *prev_msec, __int64 now_msec)
+{
+	if (*prev_msec < 0)
+		*prev_msec = now_msec;
+
+	int delta_msec = (int)(now_msec - *prev_msec);
+	if (delta_msec < 0) // async records of different threads may be slightly out of order
+		delta_msec = 0;
+
+	*prev_msec = now_msec;
+	return delta_msec;
+}
+
+/*
+ * Asynchronous mode (PrnTs_start_async()).
+ *
+ * Each thread that calls PrnTs() gets its own ring buffer, of which it is
+ * the only writer, so PrnTs() takes no lock. It formats the message into
+ * the ring, after a header holding the time of the call; the prefix is
+ * rendered later. A flusher thread wakes every PRNTS_FLUSH_MSEC (or
+ * sooner, if a ring gets half full), takes the records from all rings in
+ * time order, renders their prefixes, and writes each batch with a
+ * single writev(), straight from the rings. (A record can still come out
+ * a little late, if its thread was delayed between reading the time and
+ * queuing the record, and missed a flush; its "+delta" is then 0.)
+ *
+ * If a ring is full, PrnTs() waits for the flusher, so no output is lost.
+ * Since the output bypasses stdio, don't mix printf() to the same file
+ * with async PrnTs(), or the order of the two will be unpredictable.
+ *
+ * The child of a fork() has no flusher thread, so it goes back to sync
+ * mode, dropping any records that were queued at the time of the fork
+ * (the parent's flusher writes those). It may call PrnTs_start_async()
+ * again.
+ */
+
+#define PRNTS_MSG_MAX 2000 // like the 2000-byte buffer of sync mode
+#define PRNTS_RING_SIZE (64 * 1024) // power of 2
+#define PRNTS_BATCH 256 // records per writev(); 3 iovecs each
+#define PRNTS_FLUSH_MSEC 10
+
+struct PrnTsRec // header of a record in a ring; the text follows
+{
+	__int64 usec; // time of the PrnTs() call
+	int len; // length of the text, including '\n'; -1 marks a wrap to the ring start
+	int pad;
+};
+
+#define PRNTS_ALIGN(n) (((n) + sizeof(PrnTsRec) - 1) & ~(sizeof(PrnTsRec) - 1))
+
+struct PrnTsRing
+{
+	alignas(64) unsigned __int64 head; // bytes written, by the owner thread
+	int busy; // owner is in PrnTs(), see PrnTs_stop_async()
+	int dead; // owner thread has exited
+
+	alignas(64) unsigned __int64 tail; // bytes consumed, by the flusher
+
+	unsigned __int64 fhead; // the flusher's snapshot of 'head'
+	unsigned __int64 fpos; // how far the flusher has got with this batch
+	PrnTsRing *next; // in s_rings list, protected by s_rings_mtx
+	char *buf;
+};
+
+static int s_async = 0;
+static int s_async_fd = -1;
+static int s_flush_stop = 0;
+static __int64 s_flush_prev_msec = -1; // the flusher's s_prev_msec; under s_rings_mtx
+static bool s_flush_kicked = false;
+static pthread_t s_flusher;
+static pthread_mutex_t s_flush_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_flush_cond = PTHREAD_COND_INITIALIZER;
+
+static PrnTsRing *s_rings = nullptr;
+static pthread_mutex_t s_rings_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t s_ring_key;
+static pthread_once_t s_ring_key_once = PTHREAD_ONCE_INIT;
+static __thread PrnTsRing *t_ring = nullptr;
+
+static void ring_destructor(void *arg)
+{
+	// The flusher frees the ring once it has drained it.
+	__atomic_store_n(&((PrnTsRing*)arg)->dead, 1, __ATOMIC_RELEASE);
+}
+
+static void make_ring_key()
+{
+	if (pthread_key_create(&s_ring_key, ring_destructor) != 0)
+		abort();
+}
+
+static PrnTsRing* my_ring()
+{
+	if (t_ring)
+		return t_ring;
+
+	PrnTsRing *r = nullptr;
+	if (posix_memalign((void**)&r, 64, sizeof(PrnTsRing)) != 0)
+		abort();
+	memset(r, 0, sizeof(PrnTsRing));
+
+	r->buf = (char*)malloc(PRNTS_RING_SIZE);
+	if (!r->buf)
+		abort();
+
+	pthread_once(&s_ring_key_once, make_ring_key);
+	pthread_setspecific(s_ring_key, r);
+
+	pthread_mutex_lock(&s_rings_mtx);
+	r->next = s_rings;
+	s_rings = r;
+	pthread_mutex_unlock(&s_rings_mtx);
+
+	t_ring = r;
+	return r;
+}
+
+static void kick_flusher()
+{
+	pthread_mutex_lock(&s_flush_mtx);
+	s_flush_kicked = true;
+	pthread_cond_signal(&s_flush_cond);
+	pthread_mutex_unlock(&s_flush_mtx);
+}
+
+static void prnts_async(PrnTsRing *r, const char* fmt, va_list args)
+{
+	static __thread char t_text[PRNTS_MSG_MAX];
+
+	__int64 usec = now_usec();
+
+	int len = vsnprintf(t_text, PRNTS_MSG_MAX-1, fmt, args); // -1 for trailing \n
+	if (len < 0)
+		len = 0;
+	else if (len > PRNTS_MSG_MAX-2)
+		len = PRNTS_MSG_MAX-2;
+	t_text[len++] = '\n';
+
+	unsigned __int64 head = r->head;
+	unsigned need = PRNTS_ALIGN(sizeof(PrnTsRec) + len);
+	unsigned offset = (unsigned)(head & (PRNTS_RING_SIZE - 1));
+	unsigned contig = PRNTS_RING_SIZE - offset;
+	unsigned total = need + (contig < need ? contig : 0);
+
+	// Wait until the flusher has made enough room
+	while (head + total - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) > PRNTS_RING_SIZE)
+	{
+		kick_flusher();
+		struct timespec ts = { 0, 100000 };
+		nanosleep(&ts, NULL);
+	}
+
+	if (contig < need) // record won't fit before the end of the ring
+	{
+		((PrnTsRec*)(r->buf + offset))->len = -1;
+		head += contig;
+		offset = 0;
+	}
+
+	PrnTsRec *rec = (PrnTsRec*)(r->buf + offset);
+	rec->usec = usec;
+	rec->len = len;
+	memcpy(rec + 1, t_text, len);
+
+	__atomic_store_n(&r->head, head + need, __ATOMIC_RELEASE);
+
+	if (head + need - __atomic_load_n(&r->tail, __ATOMIC_RELAXED) > PRNTS_RING_SIZE / 2)
+		kick_flusher();
+}
+
+// Return the next record at r->fpos, skipping any wrap marker, or
+// nullptr if the flusher has consumed all of its snapshot of the ring.
+static PrnTsRec* peek_record(PrnTsRing *r)
+{
+	while (r->fpos < r->fhead)
+	{
+		unsigned offset = (unsigned)(r->fpos & (PRNTS_RING_SIZE - 1));
+		PrnTsRec *rec = (PrnTsRec*)(r->buf + offset);
+		if (rec->len >= 0)
+			return rec;
+
+		r->fpos += PRNTS_RING_SIZE - offset;
+	}
+	return nullptr;
+}
+
+static void writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+	while (iovcnt > 0)
+	{
+		ssize_t n = writev(fd, iov, iovcnt);
+		if (n == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			return; // nowhere to report the error; drop the batch
+		}
+
+		while (iovcnt > 0 && (size_t)n >= iov->iov_len)
+		{
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0)
+		{
+			iov->iov_base = (char*)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+}
+
+// Write out everything that is in the rings now. Returns the number of
+// records written.
+static int flush_rings()
+{
+	static TsCache s_cache = { -1, "" };
+	static char s_prefix[PRNTS_BATCH][48];
+	static struct iovec s_iov[PRNTS_BATCH * 3];
+	static char s_dot[] = ".\n";
+
+	int written = 0;
+
+	pthread_mutex_lock(&s_rings_mtx);
+
+	for (PrnTsRing *r = s_rings; r; r = r->next)
+	{
+		r->fpos = r->tail;
+		r->fhead = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	}
+
+	for (;;)
+	{
+		// Gather a batch, merging the rings in time order
+		int nrec = 0, iovcnt = 0;
+		while (nrec < PRNTS_BATCH)
+		{
+			PrnTsRing *first = nullptr;
+			PrnTsRec *rec = nullptr;
+			for (PrnTsRing *r = s_rings; r; r = r->next)
+			{
+				PrnTsRec *x = peek_record(r);
+				if (x && (!rec || x->usec < rec->usec))
+				{
+					first = r;
+					rec = x;
+				}
+			}
+			if (!rec)
+				break;
+
+			int delta_msec = next_delta(&s_flush_prev_msec, rec->usec / 1000);
+			if (delta_msec >= 1000)
+			{
+				s_iov[iovcnt].iov_base = s_dot;
+				s_iov[iovcnt++].iov_len = 2;
+			}
+
+			s_iov[iovcnt].iov_base = s_prefix[nrec];
+			s_iov[iovcnt++].iov_len = render_prefix(s_prefix[nrec],
+				sizeof(s_prefix[0]), &s_cache, rec->usec, delta_msec);
+
+			s_iov[iovcnt].iov_base = rec + 1;
+			s_iov[iovcnt++].iov_len = rec->len;
+
+			first->fpos += PRNTS_ALIGN(sizeof(PrnTsRec) + rec->len);
+			nrec++;
+		}
+
+		if (nrec == 0)
+			break;
+
+		writev_all(s_async_fd, s_iov, iovcnt);
+		written += nrec;
+
+		// Now give the space back to the writers
+		for (PrnTsRing *r = s_rings; r; r = r->next)
+			__atomic_store_n(&r->tail, r->fpos, __ATOMIC_RELEASE);
+	}
+
+	// Free the rings of exited threads, once drained
+	for (PrnTsRing **pr = &s_rings; *pr; )
+	{
+		PrnTsRing *r = *pr;
+		if (__atomic_load_n(&r->dead, __ATOMIC_ACQUIRE) &&
+			r->tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE))
+		{
+			*pr = r->next;
+			free(r->buf);
+			free(r);
+		}
+		else
+			pr = &r->next;
+	}
+
+	pthread_mutex_unlock(&s_rings_mtx);
+	return written;
+}
+
+static void* flusher_thread(void*)
+{
+	for (;;)
+	{
+		bool stopping = __atomic_load_n(&s_flush_stop, __ATOMIC_ACQUIRE);
+
+		flush_rings();
+		if (stopping)
+			break;
+
+		pthread_mutex_lock(&s_flush_mtx);
+		if (!s_flush_kicked)
+		{
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += PRNTS_FLUSH_MSEC * 1000000;
+			if (ts.tv_nsec >= 1000000000)
+			{
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&s_flush_cond, &s_flush_mtx, &ts);
+		}
+		s_flush_kicked = false;
+		pthread_mutex_unlock(&s_flush_mtx);
+	}
+	return nullptr;
+}
+
+// fork() handlers. Holding all of our locks across the fork() means that
+// the child's copies of them, and of what they protect, are consistent.
+
+static void atfork_prepare()
+{
+	pthread_mutex_lock(&s_prnts_mtx);
+	pthread_mutex_lock(&s_rings_mtx);
+	pthread_mutex_lock(&s_flush_mtx);
+}
+
+static void atfork_parent()
+{
+	pthread_mutex_unlock(&s_flush_mtx);
+	pthread_mutex_unlock(&s_rings_mtx);
+	pthread_mutex_unlock(&s_prnts_mtx);
+}
+
+static void atfork_child()
+{
+	if (__atomic_load_n(&s_async, __ATOMIC_ACQUIRE))
+	{
+		// Only the forking thread exists in the child: drop the other
+		// threads' rings, and empty our own.
+		for (PrnTsRing *r = s_rings, *next; r; r = next)
+		{
+			next = r->next;
+			if (r != t_ring)
+			{
+				free(r->buf);
+				free(r);
+			}
+		}
+		s_rings = t_ring;
+		if (t_ring)
+		{
+			t_ring->next = nullptr;
+			t_ring->head = t_ring->tail = 0;
+		}
+
+		s_flush_kicked = false;
+		if (s_flush_prev_msec > s_prev_msec)
+			s_prev_msec = s_flush_prev_msec;
+		__atomic_store_n(&s_async, 0, __ATOMIC_RELEASE);
+	}
+
+	atfork_parent();
+}
+
+int PrnTs_start_async(int fd)
+{
+	if (__atomic_load_n(&s_async, __ATOMIC_ACQUIRE))
+		return 0;
+
+	static bool s_atexit_done = false;
+	if (!s_atexit_done)
+	{
+		atexit(PrnTs_stop_async);
+		pthread_atfork(atfork_prepare, atfork_parent, atfork_child);
+		s_atexit_done = true;
+	}
+
+	fflush(stdout); // so that earlier sync output comes first
+
+	pthread_mutex_lock(&s_prnts_mtx);
+	s_flush_prev_msec = s_prev_msec; // continue the "+delta" of sync output
+	pthread_mutex_unlock(&s_prnts_mtx);
+
+	s_async_fd = fd;
+	s_flush_stop = 0;
+	int err = pthread_create(&s_flusher, NULL, flusher_thread, NULL);
+	if (err != 0)
+	{
+		errno = err;
+		return -1;
+	}
+
+	__atomic_store_n(&s_async, 1, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+void PrnTs_stop_async()
+{
+	if (!__atomic_load_n(&s_async, __ATOMIC_ACQUIRE))
+		return;
+
+	__atomic_store_n(&s_async, 0, __ATOMIC_SEQ_CST);
+
+	// Wait for threads that saw s_async set to finish their PrnTs(). Don't
+	// hold s_rings_mtx while waiting: such a thread may be waiting for the
+	// flusher to make room in its ring.
+	for (;;)
+	{
+		bool busy = false;
+		pthread_mutex_lock(&s_rings_mtx);
+		for (PrnTsRing *r = s_rings; r && !busy; r = r->next)
+			busy = __atomic_load_n(&r->busy, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&s_rings_mtx);
+
+		if (!busy)
+			break;
+		sched_yield();
+	}
+
+	__atomic_store_n(&s_flush_stop, 1, __ATOMIC_RELEASE);
+	kick_flusher();
+	pthread_join(s_flusher, NULL);
+
+	pthread_mutex_lock(&s_prnts_mtx);
+	if (s_flush_prev_msec > s_prev_msec)
+		s_prev_msec = s_flush_prev_msec;
+	pthread_mutex_unlock(&s_prnts_mtx);
+}
 
 void PrnTs(const char* fmt, ...)
 {
+	va_list args;
+
+	if (__atomic_load_n(&s_async, __ATOMIC_RELAXED))
+	{
+		PrnTsRing *r = my_ring();
+		__atomic_store_n(&r->busy, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&s_async, __ATOMIC_SEQ_CST))
+		{
+			va_start(args, fmt);
+			prnts_async(r, fmt, args);
+			va_end(args);
+			__atomic_store_n(&r->busy, 0, __ATOMIC_RELEASE);
+			return;
+		}
+		__atomic_store_n(&r->busy, 0, __ATOMIC_RELEASE);
+	}
+
 	int err = pthread_mutex_lock(&s_prnts_mtx);
 	if (err != 0)
 		abort();
 
-	static __int64 s_prev_msec = GetTickCount64();
+	static TsCache s_cache = { -1, "" };
 
-	__int64 now_msec = GetTickCount64();
+	__int64 usec = now_usec();
 
 	char buf[2000] = { 0 };
 
 	// Print timestamp to show that time has elapsed for more than one second.
-	int delta_msec = (int)(now_msec - s_prev_msec);
+	int delta_msec = next_delta(&s_prev_msec, usec / 1000);
 	if (delta_msec >= 1000)
 	{
 		printf(".\n");
 	}
 
-	char timebuf[40] = {};
-	now_timestr(timebuf, ARRAYSIZE(timebuf));
+	int prefixlen = render_prefix(buf, ARRAYSIZE(buf), &s_cache, usec, delta_msec);
 
-	int prefixlen = (int)strlen(timebuf);
-	
-	snprintf(buf+prefixlen, sizeof(timebuf)-prefixlen, "(+%3u.%03us) ",
-		delta_msec / 1000, delta_msec % 1000);
-
-	prefixlen = (int)strlen(buf);
-
-	va_list args;
 	va_start(args, fmt);
 
 	vsnprintf(buf+prefixlen, ARRAYSIZE(buf)-prefixlen-1, // -1 for trailing \n
@@ -114,8 +621,6 @@ void PrnTs(const char* fmt, ...)
 
 	printf("%s", buf);
 
-	s_prev_msec = now_msec;
-
 	err = pthread_mutex_unlock(&s_prnts_mtx);
 	if (err != 0)
 		abort();
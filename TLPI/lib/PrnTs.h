@@ -8,6 +8,10 @@ extern"C"{
 
 void PrnTs(const char* fmt, ...);
 
+int PrnTs_start_async(int fd);
+
+void PrnTs_stop_async(void);
+
 const char* strsigname(int signo);
 
 void print_my_PXIDs();
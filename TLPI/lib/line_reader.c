@@ -0,0 +1 @@
+../sockets/line_reader.c
\ No newline at end of file
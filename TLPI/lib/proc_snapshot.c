@@ -0,0 +1 @@
+../sysinfo/proc_snapshot.c
\ No newline at end of file
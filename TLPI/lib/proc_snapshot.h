@@ -0,0 +1 @@
+../sysinfo/proc_snapshot.h
\ No newline at end of file
@@ -0,0 +1 @@
+../filelock/range_lock.c
\ No newline at end of file
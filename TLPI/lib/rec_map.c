@@ -0,0 +1 @@
+../loginacct/rec_map.c
\ No newline at end of file
@@ -0,0 +1 @@
+../loginacct/rec_map.h
\ No newline at end of file
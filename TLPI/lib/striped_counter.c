@@ -0,0 +1 @@
+../ch29-threads/striped_counter.c
\ No newline at end of file
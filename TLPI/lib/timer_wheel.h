@@ -0,0 +1 @@
+../timers/timer_wheel.h
\ No newline at end of file
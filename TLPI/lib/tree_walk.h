@@ -0,0 +1 @@
+../dirs_links/tree_walk.h
\ No newline at end of file
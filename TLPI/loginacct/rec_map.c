@@ -0,0 +1,668 @@
+/*************************************************************************\
+*                  Copyright (C) Michael Kerrisk, 2020.                   *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU Lesser General Public License as published   *
+* by the Free Software Foundation, either version 3 or (at your option)   *
+* any later version. This program is distributed without any warranty.    *
+* See the files COPYING.lgpl-v3 and COPYING.gpl-v3 for details.           *
+\*************************************************************************/
+
+/* Supplementary program for Chapter 40 */
+
+/* rec_map.c
+
+   Fast reading of large files of fixed-size, timestamped records, such
+   as process accounting files (Section 28.1) and utmp/wtmp files.
+
+   rmOpen(path, recSize, timeOf) maps the file into memory, read-only, so
+   that records are used in place rather than copied out with a read()
+   per record. 'timeOf' returns the timestamp of a record. A partial
+   record at the end of the file (one that is still being written) is
+   ignored. The whole file is mapped at once, so files of more than a
+   few gigabytes need a 64-bit system. Since the mapping is made with
+   MADV_SEQUENTIAL, the kernel reads ahead aggressively, and drops pages
+   soon after they have been scanned, so a scan of a file that is larger
+   than memory doesn't push everything else out of the page cache.
+
+   rmScan(rm, tmin, tmax, nthreads, fn, arg, stats) calls fn(rec, thread,
+   arg) for each record whose timestamp lies in the range [tmin, tmax]
+   (RM_TIME_MIN and RM_TIME_MAX make the range unbounded). The file is
+   divided into blocks of 'stride' records, which 'nthreads' threads (the
+   caller, plus 'nthreads' - 1 helpers; if 'nthreads' is 0, one per
+   online CPU) claim one at a time. As with treeWalk() in tree_walk.c,
+   'fn' must either do its own locking or keep per-thread results. With a
+   single thread, records are seen in file order.
+
+   rmIndex(rm, idxPath, stride) gives the scan a time index: for each
+   block, the smallest and largest timestamp that it contains. Records
+   aren't necessarily in time order (an accounting record is written when
+   a process terminates, but carries the time that it started), so the
+   index records a range rather than a single time. rmScan() skips the
+   blocks whose range doesn't overlap [tmin, tmax], and doesn't check the
+   time of each record in a block whose range lies within [tmin, tmax].
+
+   The index is kept in the sidecar file 'idxPath', so that it is built
+   only once. Since these files only ever grow (until they are rotated),
+   an index that covers the start of the file is brought up to date by
+   indexing just the records added since it was written. The index is
+   rebuilt if its first block no longer matches the file (because the
+   file has been rotated, or truncated). The new index is written to a
+   temporary file that is then renamed, so that readers never see a
+   partly written index.
+
+   For the programs that summarize these files, rmParseTime() converts a
+   command-line time to a bound for rmScan(), and an rmTable counts
+   records by a short key (such as a user or command name): rmTableFind()
+   returns the entry for a key, adding it if need be, rmTableMerge() adds
+   one table's totals into another (e.g., to combine the per-thread
+   totals of a scan), and rmTableSort() sorts the entries for printing.
+*/
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include "rec_map.h"
+
+#define IDX_MAGIC "TLPIRMX1"
+
+struct rmBlock {                /* Range of timestamps in a block */
+    long long min;
+    long long max;
+};
+
+struct idxHeader {              /* Start of an index file */
+    char magic[8];              /* IDX_MAGIC */
+    uint32_t recSize;
+    uint32_t stride;
+    uint64_t nrecs;             /* Records covered by the index */
+};
+
+struct recMap {
+    const char *base;           /* Start of mapping, or NULL if empty */
+    size_t mapSize;
+    size_t recSize;
+    size_t nrecs;
+    rmTimeFunc timeOf;
+    size_t stride;              /* Records per block */
+    struct rmBlock *blocks;     /* Index, or NULL */
+    size_t nblocks;
+};
+
+struct scan {                   /* State shared by the scanning threads */
+    struct recMap *rm;
+    long long tmin, tmax;
+    rmRecordFunc fn;
+    void *arg;
+    size_t nblocks;
+    size_t nextBlock;           /* Next block to be claimed */
+};
+
+struct scanThread {
+    struct scan *sc;
+    int idx;
+    struct rmStats stats;
+    pthread_t thread;
+};
+
+/* Map the file 'path', which consists of records of 'recSize' bytes.
+   Returns NULL on error. */
+
+struct recMap *
+rmOpen(const char *path, size_t recSize, rmTimeFunc timeOf)
+{
+    struct recMap *rm;
+    struct stat sb;
+    int fd, savedErrno;
+
+    if (recSize == 0 || timeOf == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    rm = calloc(1, sizeof(struct recMap));
+    if (rm == NULL)
+        return NULL;
+
+    rm->recSize = recSize;
+    rm->timeOf = timeOf;
+    rm->stride = RM_STRIDE;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        goto fail;
+    if (fstat(fd, &sb) == -1)
+        goto failClose;
+    if ((unsigned long long) sb.st_size > SIZE_MAX) {
+        errno = EFBIG;
+        goto failClose;
+    }
+
+    rm->nrecs = sb.st_size / recSize;
+    rm->mapSize = rm->nrecs * recSize;
+
+    if (rm->mapSize > 0) {              /* mmap() fails for length 0 */
+        rm->base = mmap(NULL, rm->mapSize, PROT_READ, MAP_SHARED, fd, 0);
+        if (rm->base == MAP_FAILED)
+            goto failClose;
+        madvise((void *) rm->base, rm->mapSize, MADV_SEQUENTIAL);
+    }
+
+    close(fd);                          /* The mapping remains */
+    return rm;
+
+failClose:
+    savedErrno = errno;
+    close(fd);
+    errno = savedErrno;
+fail:
+    savedErrno = errno;
+    free(rm);
+    errno = savedErrno;
+    return NULL;
+}
+
+size_t
+rmCount(const struct recMap *rm)
+{
+    return rm->nrecs;
+}
+
+const void *
+rmRecord(const struct recMap *rm, size_t idx)
+{
+    return (idx < rm->nrecs) ? rm->base + idx * rm->recSize : NULL;
+}
+
+/* ---------------------------------------------------------------- */
+/* The time index */
+
+/* Find the range of timestamps in block 'b' */
+
+static void
+indexBlock(const struct recMap *rm, size_t b, struct rmBlock *blk)
+{
+    size_t first, last;
+    long long t;
+
+    first = b * rm->stride;
+    last = first + rm->stride;
+    if (last > rm->nrecs)
+        last = rm->nrecs;
+
+    blk->min = RM_TIME_MAX;
+    blk->max = RM_TIME_MIN;
+    for (size_t j = first; j < last; j++) {
+        t = rm->timeOf(rm->base + j * rm->recSize);
+        if (t < blk->min)
+            blk->min = t;
+        if (t > blk->max)
+            blk->max = t;
+    }
+}
+
+/* Read the index file 'idxPath' into 'blocks' (which has room for an
+   index of the whole file). Returns the number of records covered by
+   the index, or 0 if there is no usable index. */
+
+static size_t
+readIndex(const struct recMap *rm, const char *idxPath,
+          struct rmBlock *blocks)
+{
+    struct idxHeader hdr;
+    struct rmBlock blk0;
+    size_t nblocks, len;
+    ssize_t n;
+    int fd;
+
+    fd = open(idxPath, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return 0;
+
+    n = pread(fd, &hdr, sizeof(hdr), 0);
+    if (n != sizeof(hdr) || memcmp(hdr.magic, IDX_MAGIC, 8) != 0 ||
+            hdr.recSize != rm->recSize || hdr.stride != rm->stride ||
+            hdr.nrecs == 0 || hdr.nrecs > rm->nrecs) {
+        close(fd);
+        return 0;
+    }
+
+    nblocks = (hdr.nrecs + rm->stride - 1) / rm->stride;
+    len = nblocks * sizeof(struct rmBlock);
+    n = pread(fd, blocks, len, sizeof(hdr));
+    close(fd);
+    if (n < 0 || (size_t) n != len)
+        return 0;
+
+    /* If the first block has changed, this is not the file that was
+       indexed. (Checking this costs just one block's worth of reading,
+       whereas checking the whole index would cost as much as rebuilding
+       it.) If the first block was partial when the index was written, it
+       may since have grown; in that case, it is indexed again anyway. */
+
+    if (hdr.nrecs >= rm->stride) {
+        indexBlock(rm, 0, &blk0);
+        if (blk0.min != blocks[0].min || blk0.max != blocks[0].max)
+            return 0;
+    }
+
+    return hdr.nrecs;
+}
+
+/* Write the index to 'idxPath', by way of a temporary file. Returns 0
+   on success, or -1 on error. */
+
+static int
+writeIndex(const struct recMap *rm, const char *idxPath)
+{
+    struct idxHeader hdr;
+    char *tmpPath;
+    size_t len;
+    int fd, savedErrno;
+
+    if (asprintf(&tmpPath, "%s.tmp%ld", idxPath, (long) getpid()) == -1) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+        goto fail;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, IDX_MAGIC, 8);
+    hdr.recSize = rm->recSize;
+    hdr.stride = rm->stride;
+    hdr.nrecs = rm->nrecs;
+
+    len = rm->nblocks * sizeof(struct rmBlock);
+    errno = 0;
+    if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+            (len > 0 && write(fd, rm->blocks, len) != (ssize_t) len)) {
+        if (errno == 0)
+            errno = ENOSPC;             /* Short write */
+        goto failUnlink;
+    }
+
+    if (close(fd) == -1) {
+        fd = -1;
+        goto failUnlink;
+    }
+    fd = -1;
+    if (rename(tmpPath, idxPath) == -1)
+        goto failUnlink;
+
+    free(tmpPath);
+    return 0;
+
+failUnlink:
+    savedErrno = errno;
+    if (fd != -1)
+        close(fd);
+    unlink(tmpPath);
+    errno = savedErrno;
+fail:
+    savedErrno = errno;
+    free(tmpPath);
+    errno = savedErrno;
+    return -1;
+}
+
+/* Give 'rm' a time index with 'stride' records per block (RM_STRIDE if
+   'stride' is 0), using the index in the file 'idxPath' (if it is not
+   NULL) as far as it is valid, and saving the updated index there.
+   Returns 0 on success, or -1 on error. If just the saving fails, the
+   index is nevertheless used by later scans. */
+
+int
+rmIndex(struct recMap *rm, const char *idxPath, int stride)
+{
+    struct rmBlock *blocks;
+    size_t nblocks, covered, first;
+
+    if (stride < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    free(rm->blocks);
+    rm->blocks = NULL;
+    rm->nblocks = 0;
+    rm->stride = (stride > 0) ? stride : RM_STRIDE;
+
+    nblocks = (rm->nrecs + rm->stride - 1) / rm->stride;
+    blocks = malloc((nblocks + 1) * sizeof(struct rmBlock));
+    if (blocks == NULL)
+        return -1;
+
+    rm->blocks = blocks;
+    rm->nblocks = nblocks;
+
+    covered = (idxPath != NULL) ? readIndex(rm, idxPath, blocks) : 0;
+
+    /* Index the blocks that the saved index doesn't cover completely */
+
+    first = covered / rm->stride;
+    for (size_t b = first; b < nblocks; b++)
+        indexBlock(rm, b, &blocks[b]);
+
+    if (idxPath == NULL || covered == rm->nrecs)
+        return 0;                       /* Nothing new to save */
+
+    return writeIndex(rm, idxPath);
+}
+
+/* ---------------------------------------------------------------- */
+/* Scanning */
+
+/* Scan blocks claimed from 'sc' until none remain */
+
+static void *
+scanWorker(void *arg)
+{
+    struct scanThread *st = arg;
+    struct scan *sc = st->sc;
+    struct recMap *rm = sc->rm;
+    const char *rec, *end;
+    const struct rmBlock *blk;
+    size_t b, first, last;
+    long long t;
+    int checkTime, unbounded;
+
+    unbounded = sc->tmin == RM_TIME_MIN && sc->tmax == RM_TIME_MAX;
+
+    for (;;) {
+        b = __atomic_fetch_add(&sc->nextBlock, 1, __ATOMIC_RELAXED);
+        if (b >= sc->nblocks)
+            break;
+
+        checkTime = !unbounded;
+        if (checkTime && rm->blocks != NULL) {
+            blk = &rm->blocks[b];
+            if (blk->max < sc->tmin || blk->min > sc->tmax) {
+                st->stats.blocksSkipped++;
+                continue;
+            }
+            if (blk->min >= sc->tmin && blk->max <= sc->tmax)
+                checkTime = 0;          /* Whole block is in range */
+        }
+
+        st->stats.blocksRead++;
+
+        first = b * rm->stride;
+        last = first + rm->stride;
+        if (last > rm->nrecs)
+            last = rm->nrecs;
+        end = rm->base + last * rm->recSize;
+        st->stats.examined += last - first;
+
+        for (rec = rm->base + first * rm->recSize; rec < end;
+                rec += rm->recSize) {
+            if (checkTime) {
+                t = rm->timeOf(rec);
+                if (t < sc->tmin || t > sc->tmax)
+                    continue;
+            }
+            st->stats.records++;
+            sc->fn(rec, st->idx, sc->arg);
+        }
+    }
+
+    return NULL;
+}
+
+/* Call 'fn' for each record with a timestamp in the range [tmin, tmax].
+   If 'stats' is not NULL, it returns counts for the scan. Returns 0 on
+   success, or -1 on error. */
+
+int
+rmScan(struct recMap *rm, long long tmin, long long tmax, int nthreads,
+       rmRecordFunc fn, void *arg, struct rmStats *stats)
+{
+    struct scan sc;
+    struct scanThread *threads;
+    int started;
+
+    if (nthreads <= 0) {
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (nthreads < 1)
+            nthreads = 1;
+    }
+
+    sc.rm = rm;
+    sc.tmin = tmin;
+    sc.tmax = tmax;
+    sc.fn = fn;
+    sc.arg = arg;
+    sc.nblocks = (rm->nrecs + rm->stride - 1) / rm->stride;
+    sc.nextBlock = 0;
+
+    if ((size_t) nthreads > sc.nblocks)
+        nthreads = (sc.nblocks > 0) ? sc.nblocks : 1;
+
+    threads = calloc(nthreads, sizeof(struct scanThread));
+    if (threads == NULL)
+        return -1;
+
+    for (int j = 0; j < nthreads; j++) {
+        threads[j].sc = &sc;
+        threads[j].idx = j;
+    }
+
+    /* The calling thread serves as the first scanner */
+
+    for (started = 1; started < nthreads; started++)
+        if (pthread_create(&threads[started].thread, NULL, scanWorker,
+                           &threads[started]) != 0)
+            break;              /* Carry on with the threads we have */
+
+    scanWorker(&threads[0]);
+
+    for (int j = 1; j < started; j++)
+        pthread_join(threads[j].thread, NULL);
+
+    if (stats != NULL) {
+        memset(stats, 0, sizeof(struct rmStats));
+        for (int j = 0; j < started; j++) {
+            stats->records += threads[j].stats.records;
+            stats->examined += threads[j].stats.examined;
+            stats->blocksRead += threads[j].stats.blocksRead;
+            stats->blocksSkipped += threads[j].stats.blocksSkipped;
+        }
+    }
+
+    free(threads);
+    return 0;
+}
+
+void
+rmClose(struct recMap *rm)
+{
+    if (rm->base != NULL)
+        munmap((void *) rm->base, rm->mapSize);
+    free(rm->blocks);
+    free(rm);
+}
+
+/* ---------------------------------------------------------------- */
+/* Helpers for the summarizing programs */
+
+/* Convert 'str', which is either "YYYY-MM-DD[ HH:MM[:SS]]" (local time)
+   or "@seconds-since-Epoch", to a time in '*t'. Returns 0 on success, or
+   -1 on error. */
+
+int
+rmParseTime(const char *str, long long *t)
+{
+    static const char *formats[] = {
+        "%Y-%m-%d %H:%M:%S", "%Y-%m-%d %H:%M", "%Y-%m-%d", NULL
+    };
+    struct tm tm;
+    const char *end;
+    char *endp;
+    time_t tt;
+
+    if (str[0] == '@') {
+        errno = 0;
+        *t = strtoll(str + 1, &endp, 10);
+        if (errno != 0)
+            return -1;
+        if (endp == str + 1 || *endp != '\0') {
+            errno = EINVAL;
+            return -1;
+        }
+        return 0;
+    }
+
+    for (int j = 0; formats[j] != NULL; j++) {
+        memset(&tm, 0, sizeof(struct tm));
+        end = strptime(str, formats[j], &tm);
+        if (end != NULL && *end == '\0') {
+            tm.tm_isdst = -1;           /* Let mktime() decide */
+            tt = mktime(&tm);
+            if (tt == -1) {
+                errno = ERANGE;
+                return -1;
+            }
+            *t = tt;
+            return 0;
+        }
+    }
+
+    errno = EINVAL;
+    return -1;
+}
+
+/* Hash a key (always RM_KEY_LEN bytes): FNV-1a, but taking eight bytes
+   at a time, with a final fold so that the high bits, which see the
+   most mixing, affect the low bits used to choose a slot */
+
+static size_t
+hashKey(const char *key)
+{
+    uint64_t h = 14695981039346656037ULL;
+    uint64_t w;
+
+    for (int j = 0; j < RM_KEY_LEN; j += sizeof(w)) {
+        memcpy(&w, key + j, sizeof(w));
+        h = (h ^ w) * 1099511628211ULL;
+    }
+    return h ^ (h >> 32);
+}
+
+/* Double the size of 't' (or give it its first entries) */
+
+static int
+growTable(struct rmTable *t)
+{
+    struct rmEntry *old, *ents, *e;
+    size_t oldSize, size;
+
+    old = t->ents;
+    oldSize = t->size;
+    size = (oldSize == 0) ? 64 : oldSize * 2;
+    ents = calloc(size, sizeof(struct rmEntry));
+    if (ents == NULL)
+        return -1;
+
+    for (size_t j = 0; j < oldSize; j++) {
+        if (old[j].used) {
+            e = &ents[hashKey(old[j].key) & (size - 1)];
+            while (e->used)
+                e = (e == &ents[size - 1]) ? ents : e + 1;
+            *e = old[j];
+        }
+    }
+
+    free(old);
+    t->ents = ents;
+    t->size = size;
+    return 0;
+}
+
+/* Return the entry in 't' for the 'keyLen' bytes at 'key', adding it
+   (with zero totals) if it is not present. Returns NULL on error. */
+
+struct rmEntry *
+rmTableFind(struct rmTable *t, const void *key, size_t keyLen)
+{
+    struct rmEntry *e;
+    char k[RM_KEY_LEN];
+    size_t j;
+
+    if (keyLen > RM_KEY_LEN) {
+        errno = EINVAL;
+        return NULL;
+    }
+    memset(k, 0, RM_KEY_LEN);
+    memcpy(k, key, keyLen);
+
+    if (t->used * 2 >= t->size && growTable(t) == -1)
+        return NULL;
+
+    j = hashKey(k) & (t->size - 1);
+    for (;;) {
+        e = &t->ents[j];
+        if (!e->used) {
+            memcpy(e->key, k, RM_KEY_LEN);
+            e->used = 1;
+            t->used++;
+            return e;
+        }
+        if (memcmp(e->key, k, RM_KEY_LEN) == 0)
+            return e;
+        j = (j + 1) & (t->size - 1);
+    }
+}
+
+/* Add the totals in 'from' into 'to'. Returns 0 on success, or -1 on
+   error. */
+
+int
+rmTableMerge(struct rmTable *to, const struct rmTable *from)
+{
+    struct rmEntry *e;
+
+    for (size_t j = 0; j < from->size; j++) {
+        if (from->ents[j].used) {
+            e = rmTableFind(to, from->ents[j].key, RM_KEY_LEN);
+            if (e == NULL)
+                return -1;
+            e->count += from->ents[j].count;
+            e->sum += from->ents[j].sum;
+        }
+    }
+    return 0;
+}
+
+/* Move the entries of 't' to the start of 't->ents', and sort them with
+   'cmp' (which is passed two 'struct rmEntry *'). Returns the number of
+   entries. Afterward, 't' can no longer be searched; it can only be
+   freed. */
+
+size_t
+rmTableSort(struct rmTable *t, int (*cmp)(const void *, const void *))
+{
+    size_t n = 0;
+
+    for (size_t j = 0; j < t->size; j++)
+        if (t->ents[j].used)
+            t->ents[n++] = t->ents[j];
+    qsort(t->ents, n, sizeof(struct rmEntry), cmp);
+    return n;
+}
+
+void
+rmTableFree(struct rmTable *t)
+{
+    free(t->ents);
+    memset(t, 0, sizeof(struct rmTable));
+}
@@ -0,0 +1,95 @@
+/*************************************************************************\
+*                  Copyright (C) Michael Kerrisk, 2020.                   *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU Lesser General Public License as published   *
+* by the Free Software Foundation, either version 3 or (at your option)   *
+* any later version. This program is distributed without any warranty.    *
+* See the files COPYING.lgpl-v3 and COPYING.gpl-v3 for details.           *
+\*************************************************************************/
+
+/* rec_map.h
+
+   Header file for rec_map.c.
+*/
+#ifndef REC_MAP_H
+#define REC_MAP_H               /* Prevent accidental double inclusion */
+
+#include <sys/types.h>
+
+#define RM_STRIDE 4096          /* Default number of records per block */
+
+#define RM_TIME_MIN (-0x7fffffffffffffffLL - 1)
+#define RM_TIME_MAX 0x7fffffffffffffffLL
+
+struct recMap;
+
+/* Return the timestamp of record 'rec' */
+
+typedef long long (*rmTimeFunc)(const void *rec);
+
+/* Called for each record in a scan, by any of the scanning threads
+   ('thread' is 0 to nthreads - 1) */
+
+typedef void (*rmRecordFunc)(const void *rec, int thread, void *arg);
+
+struct rmStats {
+    long long records;          /* Records passed to the callback */
+    long long examined;         /* Records in the blocks scanned */
+    long blocksRead;            /* Blocks scanned */
+    long blocksSkipped;         /* Blocks skipped by using the index */
+};
+
+#define RM_KEY_LEN 32           /* Largest key in an rmTable */
+
+struct rmEntry {                /* Totals for one key */
+    char key[RM_KEY_LEN];       /* Padded with null bytes */
+    int used;
+    long long count;
+    long long sum;
+};
+
+struct rmTable {                /* Hash table of rmEntry, with linear
+                                   probing; all zero when empty */
+    struct rmEntry *ents;
+    size_t size;                /* Always a power of 2 */
+    size_t used;
+};
+
+/* Descriptions of the -s, -e, -j and -i options, for the usage messages
+   of programs that select and scan records in the manner of
+   acct_stats.c and utmpx_stats.c */
+
+#define RM_USAGE_OPTIONS \
+    "\t-s Only records at or after 'start'\n" \
+    "\t-e Only records at or before 'end'\n" \
+    "\t   (times are YYYY-MM-DD[ HH:MM[:SS]] or @secs)\n" \
+    "\t-j Scan with 'nthreads' threads (default: 1; 0 means one per CPU)\n" \
+    "\t-i Use (and update) the time index in 'file.idx'\n"
+
+struct recMap *rmOpen(const char *path, size_t recSize, rmTimeFunc timeOf);
+
+size_t rmCount(const struct recMap *rm);
+
+const void *rmRecord(const struct recMap *rm, size_t idx);
+
+int rmIndex(struct recMap *rm, const char *idxPath, int stride);
+
+int rmScan(struct recMap *rm, long long tmin, long long tmax, int nthreads,
+           rmRecordFunc fn, void *arg, struct rmStats *stats);
+
+void rmClose(struct recMap *rm);
+
+int rmParseTime(const char *str, long long *t);
+
+struct rmEntry *rmTableFind(struct rmTable *t, const void *key,
+                            size_t keyLen);
+
+int rmTableMerge(struct rmTable *to, const struct rmTable *from);
+
+size_t rmTableSort(struct rmTable *t,
+                   int (*cmp)(const void *, const void *));
+
+void rmTableFree(struct rmTable *t);
+
+#endif
@@ -0,0 +1,246 @@
+/*************************************************************************\
+*                  Copyright (C) Michael Kerrisk, 2020.                   *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU General Public License as published by the   *
+* Free Software Foundation, either version 3 or (at your option) any      *
+* later version. This program is distributed without any warranty.  See   *
+* the file COPYING.gpl-v3 for details.                                    *
+\*************************************************************************/
+
+/* Supplementary program for Chapter 40 */
+
+/* utmpx_stats.c
+
+   Summarize a (possibly very large) utmp-style file, such as wtmp: the
+   number of records of each type, and with -u, the number of logins
+   (USER_PROCESS records) per user, optionally only for records in a
+   given time window (-s and -e).
+
+   Where dump_utmpx.c reads the file with getutxent(), which read()s one
+   record at a time, this program maps the file with rmOpen() (see
+   rec_map.c) and scans it with 'nthreads' threads (-j), each of which
+   accumulates its own totals. With -i, a time index is kept in the file
+   'file.idx', so that a scan of a time window reads only the parts of
+   the file that can hold records in that window. With -R, the file is
+   instead read with getutxent(), for comparison. The per-user totals are
+   kept in rmTable hash tables (also from rec_map.c).
+
+   The time taken, and the number of records scanned per second, are
+   written to stderr.
+
+   This program is Linux-specific.
+*/
+#define _GNU_SOURCE
+#include <utmpx.h>
+#include <paths.h>
+#include "curr_time.h"                  /* Declaration of timeNow() */
+#include "rec_map.h"
+#include "tlpi_hdr.h"
+
+#define MAX_TYPE 9              /* Largest ut_type value (DEAD_PROCESS) */
+
+struct threadAgg {              /* Totals accumulated by one thread */
+    long long types[MAX_TYPE + 2];      /* Last element: unknown types */
+    struct rmTable users;       /* Logins per user */
+    char pad[64];               /* Keep threads' totals in separate
+                                   cache lines */
+};
+
+static const char *typeNames[MAX_TYPE + 2] = {
+    "EMPTY", "RUN_LVL", "BOOT_TIME", "NEW_TIME", "OLD_TIME",
+    "INIT_PROCESS", "LOGIN_PROCESS", "USER_PROCESS", "DEAD_PROCESS",
+    "ACCOUNTING", "(unknown)"
+};
+
+static int byUser;
+
+static long long
+recTime(const void *rec)
+{
+    return ((const struct utmpx *) rec)->ut_tv.tv_sec;
+}
+
+/* Add record 'rec' to the totals of thread 'thread' (an rmRecordFunc) */
+
+static void
+addRecord(const void *rec, int thread, void *arg)
+{
+    struct threadAgg *ta = (struct threadAgg *) arg + thread;
+    const struct utmpx *ut = rec;
+    struct rmEntry *e;
+
+    ta->types[(ut->ut_type >= 0 && ut->ut_type <= MAX_TYPE) ?
+              ut->ut_type : MAX_TYPE + 1]++;
+
+    if (byUser && ut->ut_type == USER_PROCESS) {
+        e = rmTableFind(&ta->users, ut->ut_user,
+                        strnlen(ut->ut_user, __UT_NAMESIZE));
+        if (e == NULL)
+            errExit("rmTableFind");
+        e->count++;
+    }
+}
+
+static int
+cmpCount(const void *a, const void *b)
+{
+    const struct rmEntry *e1 = a, *e2 = b;
+
+    return (e2->count > e1->count) - (e2->count < e1->count);
+}
+
+/* Read the file with getutxent(), as dump_utmpx.c does, adding each
+   record in [tmin, tmax]. Returns the number of records read. */
+
+static long long
+getutxentScan(const char *path, long long tmin, long long tmax,
+              struct threadAgg *agg)
+{
+    struct utmpx *ut;
+    long long nrecs, t;
+
+    if (utmpxname(path) == -1)
+        errExit("utmpxname");
+
+    setutxent();
+    nrecs = 0;
+    while ((ut = getutxent()) != NULL) {
+        nrecs++;
+        t = recTime(ut);
+        if (t >= tmin && t <= tmax)
+            addRecord(ut, 0, agg);
+    }
+    endutxent();
+
+    return nrecs;
+}
+
+static void
+usageError(const char *progName, const char *msg)
+{
+    if (msg != NULL)
+        fprintf(stderr, "%s\n", msg);
+    fprintf(stderr, "Usage: %s [-u] [-s start] [-e end] [-j nthreads] "
+            "[-i] [-n num] [-R] [file]\n", progName);
+    fprintf(stderr, "\t-u Show logins per user\n");
+    fputs(RM_USAGE_OPTIONS, stderr);
+    fprintf(stderr, "\t-n Show at most 'num' users "
+            "(default: 20; 0 means all)\n");
+    fprintf(stderr, "\t-R Read the file with getutxent(), for "
+            "comparison\n");
+    fprintf(stderr, "'file' defaults to %s\n", _PATH_WTMP);
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct recMap *rm;
+    struct threadAgg *aggs, total;
+    struct rmStats stats;
+    long long tmin, tmax, nrecs;
+    int opt, nthreads, useIndex, useRead, max;
+    const char *path;
+    char *idxPath;
+    double elapsed;
+    size_t n, j;
+
+    tmin = RM_TIME_MIN;
+    tmax = RM_TIME_MAX;
+    nthreads = 1;
+    useIndex = useRead = 0;
+    max = 20;
+
+    while ((opt = getopt(argc, argv, "us:e:j:in:R")) != -1) {
+        switch (opt) {
+        case 'u': byUser = 1;                                   break;
+        case 's':
+            if (rmParseTime(optarg, &tmin) == -1)
+                cmdLineErr("start: bad time: %s\n", optarg);
+            break;
+        case 'e':
+            if (rmParseTime(optarg, &tmax) == -1)
+                cmdLineErr("end: bad time: %s\n", optarg);
+            break;
+        case 'j': nthreads = getInt(optarg, GN_NONNEG, "nthreads"); break;
+        case 'i': useIndex = 1;                                 break;
+        case 'n': max = getInt(optarg, GN_NONNEG, "num");       break;
+        case 'R': useRead = 1;                                  break;
+        default:  usageError(argv[0], NULL);
+        }
+    }
+
+    if (optind < argc - 1)
+        usageError(argv[0], "Too many arguments");
+    path = (optind < argc) ? argv[optind] : _PATH_WTMP;
+
+    if (nthreads == 0 || useRead)
+        nthreads = useRead ? 1 : sysconf(_SC_NPROCESSORS_ONLN);
+
+    aggs = calloc(nthreads, sizeof(struct threadAgg));
+    if (aggs == NULL)
+        errExit("calloc");
+    memset(&stats, 0, sizeof(stats));
+
+    if (useRead) {
+        rm = NULL;
+        elapsed = timeNow();
+        nrecs = getutxentScan(path, tmin, tmax, aggs);
+    } else {
+        rm = rmOpen(path, sizeof(struct utmpx), recTime);
+        if (rm == NULL)
+            errExit("rmOpen: %s", path);
+
+        if (useIndex) {
+            if (asprintf(&idxPath, "%s.idx", path) == -1)
+                fatal("asprintf");
+            if (rmIndex(rm, idxPath, 0) == -1)
+                errMsg("rmIndex: %s", idxPath); /* Carry on regardless */
+            free(idxPath);
+        }
+
+        elapsed = timeNow();
+        if (rmScan(rm, tmin, tmax, nthreads, addRecord, aggs, &stats) == -1)
+            errExit("rmScan");
+        nrecs = stats.examined;
+    }
+
+    /* Merge the threads' totals */
+
+    memset(&total, 0, sizeof(total));
+    for (int t = 0; t < nthreads; t++) {
+        for (j = 0; j < MAX_TYPE + 2; j++)
+            total.types[j] += aggs[t].types[j];
+        if (rmTableMerge(&total.users, &aggs[t].users) == -1)
+            errExit("rmTableMerge");
+    }
+    elapsed = timeNow() - elapsed;
+
+    printf("%-14s %10s\n", "type", "records");
+    for (j = 0; j < MAX_TYPE + 2; j++)
+        if (total.types[j] > 0)
+            printf("%-14s %10lld\n", typeNames[j], total.types[j]);
+
+    if (byUser) {
+        n = rmTableSort(&total.users, cmpCount);
+
+        printf("\n%-16s %10s\n", "user", "logins");
+        for (j = 0; j < n && (max == 0 || j < (size_t) max); j++)
+            printf("%-16.*s %10lld\n", __UT_NAMESIZE,
+                   total.users.ents[j].key, total.users.ents[j].count);
+        if (j < n)
+            printf("(%zu more)\n", n - j);
+    }
+
+    fprintf(stderr, "%lld records scanned in %.3f secs (%.0f records/sec)",
+            nrecs, elapsed, (elapsed > 0) ? nrecs / elapsed : 0.0);
+    if (stats.blocksSkipped > 0)
+        fprintf(stderr, "; %ld of %ld blocks skipped by index",
+                stats.blocksSkipped, stats.blocksSkipped + stats.blocksRead);
+    fprintf(stderr, "\n");
+
+    if (rm != NULL)
+        rmClose(rm);
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,172 @@
+/*************************************************************************\
+*                  Copyright (C) Michael Kerrisk, 2020.                   *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU General Public License as published by the   *
+* Free Software Foundation, either version 3 or (at your option) any      *
+* later version. This program is distributed without any warranty.  See   *
+* the file COPYING.gpl-v3 for details.                                    *
+\*************************************************************************/
+
+/* Supplementary program for Chapter 44 */
+
+/* fifo_seqnum_load.c
+
+   A load generator for fifo_seqnum_server.c.
+
+   Usage: fifo_seqnum_load [-c clients] [-n requests] [-s seq-len]
+
+   The program creates 'clients' (default: 8) child processes, each of
+   which behaves like fifo_seqnum_client.c, except that it sends
+   'requests' (default: 10000) requests one after another, keeping both
+   FIFOs open between requests. Each client checks that the sequence
+   numbers it is given increase. When all of the clients have finished,
+   the program reports the total number of requests per second.
+
+   The clients are started together, after all of them have created
+   their FIFOs. Start the server (with or without "-b") first.
+*/
+#include <sys/wait.h>
+#include <time.h>
+#include "fifo_seqnum.h"
+
+static double
+timeNow(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        errExit("clock_gettime");
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The body of each client: wait until 'startFd' reaches EOF, then send
+   'numReqs' requests */
+
+static void
+runClient(int startFd, int numReqs, int seqLen)
+{
+    char clientFifo[CLIENT_FIFO_NAME_LEN];
+    int serverFd, clientFd, lastSeq;
+    struct request req;
+    struct response resp;
+    char ch;
+
+    snprintf(clientFifo, CLIENT_FIFO_NAME_LEN, CLIENT_FIFO_TEMPLATE,
+            (long) getpid());
+    if (mkfifo(clientFifo, S_IRUSR | S_IWUSR | S_IWGRP) == -1
+                && errno != EEXIST)
+        errExit("mkfifo %s", clientFifo);
+
+    serverFd = open(SERVER_FIFO, O_WRONLY);
+    if (serverFd == -1)
+        errExit("open %s", SERVER_FIFO);
+
+    if (read(startFd, &ch, 1) == -1)
+        errExit("read");
+
+    req.pid = getpid();
+    req.seqLen = seqLen;
+    clientFd = -1;
+    lastSeq = -1;
+
+    for (int j = 0; j < numReqs; j++) {
+        if (write(serverFd, &req, sizeof(struct request)) !=
+                sizeof(struct request))
+            fatal("Can't write to server");
+
+        /* As in fifo_seqnum_client.c, open our FIFO after sending the
+           first request; the open() completes when the server opens the
+           FIFO for writing. A server that isn't using "-b" closes the FIFO
+           after each response, so we also open an extra write descriptor,
+           so that we never see EOF between responses. */
+
+        if (clientFd == -1) {
+            clientFd = open(clientFifo, O_RDONLY);
+            if (clientFd == -1)
+                errExit("open %s", clientFifo);
+            if (open(clientFifo, O_WRONLY) == -1)
+                errExit("open %s", clientFifo);
+        }
+
+        if (read(clientFd, &resp, sizeof(struct response))
+                != sizeof(struct response))
+            fatal("Can't read response from server");
+
+        if (resp.seqNum <= lastSeq)
+            fatal("Sequence number went backward (%d after %d)",
+                  resp.seqNum, lastSeq);
+        lastSeq = resp.seqNum;
+    }
+
+    unlink(clientFifo);
+}
+
+int
+main(int argc, char *argv[])
+{
+    int numClients, numReqs, seqLen, opt, status, failed;
+    int startPipe[2];
+    double start, elapsed;
+
+    numClients = 8;
+    numReqs = 10000;
+    seqLen = 1;
+    while ((opt = getopt(argc, argv, "c:n:s:")) != -1) {
+        switch (opt) {
+        case 'c':
+            numClients = getInt(optarg, GN_GT_0, "clients");
+            break;
+        case 'n':
+            numReqs = getInt(optarg, GN_GT_0, "requests");
+            break;
+        case 's':
+            seqLen = getInt(optarg, GN_GT_0, "seq-len");
+            break;
+        default:
+            usageErr("%s [-c clients] [-n requests] [-s seq-len]\n",
+                     argv[0]);
+        }
+    }
+
+    umask(0);                   /* So we get the permissions we want */
+
+    if (pipe(startPipe) == -1)
+        errExit("pipe");
+
+    for (int j = 0; j < numClients; j++) {
+        switch (fork()) {
+        case -1:
+            errExit("fork");
+        case 0:
+            close(startPipe[1]);
+            runClient(startPipe[0], numReqs, seqLen);
+            _exit(EXIT_SUCCESS);
+        default:
+            break;
+        }
+    }
+
+    /* Give the clients time to create their FIFOs, then start them */
+
+    close(startPipe[0]);
+    sleep(1);
+    start = timeNow();
+    close(startPipe[1]);
+
+    failed = 0;
+    while (wait(&status) != -1)
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            failed++;
+    if (errno != ECHILD)
+        errExit("wait");
+    elapsed = timeNow() - start;
+
+    printf("%d clients x %d requests: %.3f secs, %.0f requests/sec\n",
+           numClients, numReqs, elapsed,
+           (double) numClients * numReqs / elapsed);
+    if (failed > 0)
+        fatal("%d clients failed", failed);
+
+    exit(EXIT_SUCCESS);
+}
@@ -27,10 +27,303 @@
    See fifo_seqnum.h for the format of request and response messages.
 
    The client is in fifo_seqnum_client.c.
+
+   Usage: fifo_seqnum_server [-b] [-C cache-size]
+
+   By default, the server handles requests as described above: one read()
+   per request, and an open()/write()/close() of the client FIFO for each
+   response. With "-b", the server instead:
+
+   * reads as many requests as are available (up to REQ_BATCH) with each
+     read(); since each request is written with a single write() of less
+     than PIPE_BUF bytes, a read never returns part of a request;
+
+   * keeps the client FIFOs open in a cache (of at most 'cache-size'
+     entries, default 64) indexed by client PID, so that a client that
+     makes repeated requests costs one open() in total; when the cache is
+     full, the least recently used FIFO is closed;
+
+   * drops a cached FIFO when the client goes away. The server watches a
+     PID file descriptor (pidfd_open(), Linux 5.3) for each cached client,
+     so that the FIFO is closed as soon as the client terminates, before
+     its PID can be reused by another client. A write() that fails with
+     EPIPE doesn't by itself mean that the client has gone: a client that
+     (like fifo_seqnum_client.c) creates its FIFO afresh for each request
+     has closed the FIFO that we cached. So, unless the pidfd shows that
+     the client has terminated, the server reopens the FIFO and tries the
+     write() once more.
+
+   In this mode, the client FIFO is switched to nonblocking mode after it
+   has been opened, so that a client that stops reading its responses is
+   dropped instead of blocking the server.
+
+   The load generator fifo_seqnum_load.c measures the request rate that the
+   server achieves in either mode.
 */
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <poll.h>
 #include <signal.h>
 #include "fifo_seqnum.h"
 
+#define REQ_BATCH 256           /* Maximum requests per read() */
+
+static int seqNum = 0;          /* This is our "service" */
+
+/* The cache of open client FIFOs. Entries are found by PID through a
+   hash table (with chaining through 'hashNext'), and are kept in a list
+   in order of use (most recent first) for LRU eviction. Links are indexes
+   into 'cache', with -1 for "none". */
+
+struct cacheEntry {
+    pid_t pid;                  /* 0 if the entry is free */
+    int fd;                     /* Client FIFO, open for writing */
+    int pidfd;                  /* PID file descriptor, or -1 */
+    int hashNext;
+    int lruPrev, lruNext;
+};
+
+static struct cacheEntry *cache;
+static int cacheSize, nHash;
+static int *hashHead;
+static int lruHead = -1, lruTail = -1;
+static int epfd;
+
+static int
+hashOf(pid_t pid)
+{
+    return (unsigned int) pid % nHash;
+}
+
+static void
+lruUnlink(int e)
+{
+    if (cache[e].lruPrev != -1)
+        cache[cache[e].lruPrev].lruNext = cache[e].lruNext;
+    else
+        lruHead = cache[e].lruNext;
+    if (cache[e].lruNext != -1)
+        cache[cache[e].lruNext].lruPrev = cache[e].lruPrev;
+    else
+        lruTail = cache[e].lruPrev;
+}
+
+static void
+lruPushFront(int e)
+{
+    cache[e].lruPrev = -1;
+    cache[e].lruNext = lruHead;
+    if (lruHead != -1)
+        cache[lruHead].lruPrev = e;
+    lruHead = e;
+    if (lruTail == -1)
+        lruTail = e;
+}
+
+static int
+cacheFind(pid_t pid)
+{
+    for (int e = hashHead[hashOf(pid)]; e != -1; e = cache[e].hashNext)
+        if (cache[e].pid == pid)
+            return e;
+    return -1;
+}
+
+/* Close the FIFO for entry 'e', and make the entry free */
+
+static void
+cacheEvict(int e)
+{
+    int *link;
+
+    for (link = &hashHead[hashOf(cache[e].pid)]; *link != e;
+            link = &cache[*link].hashNext)
+        ;
+    *link = cache[e].hashNext;
+    lruUnlink(e);
+
+    if (close(cache[e].fd) == -1)
+        errMsg("close");
+    if (cache[e].pidfd != -1 && close(cache[e].pidfd) == -1)
+        errMsg("close");    /* Closing the pidfd also removes it from epoll */
+
+    cache[e].pid = 0;
+}
+
+/* Return the FIFO for client 'pid', opening it (and making room in the
+   cache) if necessary. Returns -1 if the FIFO can't be opened. */
+
+static int
+getClientFd(pid_t pid)
+{
+    char clientFifo[CLIENT_FIFO_NAME_LEN];
+    struct epoll_event ev;
+    int e, fd, flags;
+
+    e = cacheFind(pid);
+    if (e != -1) {
+        lruUnlink(e);
+        lruPushFront(e);
+        return cache[e].fd;
+    }
+
+    snprintf(clientFifo, CLIENT_FIFO_NAME_LEN, CLIENT_FIFO_TEMPLATE,
+            (long) pid);
+    fd = open(clientFifo, O_WRONLY);
+    if (fd == -1) {                     /* Open failed, give up on client */
+        errMsg("open %s", clientFifo);
+        return -1;
+    }
+
+    flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+        errExit("fcntl");
+
+    /* Find a free entry; if there is none, evict the least recently
+       used one */
+
+    for (e = 0; e < cacheSize; e++)
+        if (cache[e].pid == 0)
+            break;
+    if (e == cacheSize) {
+        e = lruTail;
+        cacheEvict(e);
+    }
+
+    cache[e].pid = pid;
+    cache[e].fd = fd;
+    cache[e].hashNext = hashHead[hashOf(pid)];
+    hashHead[hashOf(pid)] = e;
+    lruPushFront(e);
+
+    /* Watch for the termination of the client; if pidfd_open() isn't
+       available, we rely on EPIPE */
+
+    cache[e].pidfd = syscall(SYS_pidfd_open, pid, 0);
+    if (cache[e].pidfd != -1) {
+        ev.events = EPOLLIN;
+        ev.data.u64 = pid;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, cache[e].pidfd, &ev) == -1)
+            errExit("epoll_ctl");
+    }
+
+    return fd;
+}
+
+/* Return true if the client of cache entry 'e' is known to have
+   terminated, which is so if its pidfd is readable */
+
+static int
+clientGone(int e)
+{
+    struct pollfd pfd;
+
+    if (cache[e].pidfd == -1)
+        return 0;
+    pfd.fd = cache[e].pidfd;
+    pfd.events = POLLIN;
+    return poll(&pfd, 1, 0) > 0;
+}
+
+/* Write 'resp' to client 'pid', reopening its FIFO once if the cached
+   one has been closed by the client (see the comments at the start of
+   this file). Returns -1 if the client should be dropped. */
+
+static int
+sendResponse(pid_t pid, const struct response *resp)
+{
+    int fd, e, gone, savedErrno;
+
+    for (int attempt = 0; ; attempt++) {
+        fd = getClientFd(pid);
+        if (fd == -1)
+            return -1;
+
+        if (write(fd, resp, sizeof(struct response))
+                == sizeof(struct response))
+            return 0;
+
+        savedErrno = errno;
+        if (savedErrno != EPIPE && savedErrno != EAGAIN)
+            errMsg("write");
+
+        e = cacheFind(pid);
+        gone = clientGone(e);
+        cacheEvict(e);
+        if (savedErrno != EPIPE || gone || attempt > 0)
+            return -1;
+    }
+}
+
+/* The "-b" mode: batched reads of requests, and cached client FIFOs */
+
+static void
+serveBatched(int serverFd, int maxCache)
+{
+    struct request req[REQ_BATCH];
+    struct epoll_event evlist[64];
+    struct epoll_event ev;
+    struct response resp;
+    ssize_t numRead;
+    int nready, e;
+
+    cacheSize = maxCache;
+    nHash = 2 * maxCache + 1;
+    cache = calloc(cacheSize, sizeof(struct cacheEntry));
+    hashHead = malloc(nHash * sizeof(int));
+    if (cache == NULL || hashHead == NULL)
+        errExit("calloc");
+    for (int j = 0; j < nHash; j++)
+        hashHead[j] = -1;
+
+    epfd = epoll_create1(0);
+    if (epfd == -1)
+        errExit("epoll_create1");
+
+    ev.events = EPOLLIN;
+    ev.data.u64 = 0;                    /* PID 0 means the server FIFO */
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, serverFd, &ev) == -1)
+        errExit("epoll_ctl");
+
+    for (;;) {
+        nready = epoll_wait(epfd, evlist, 64, -1);
+        if (nready == -1) {
+            if (errno == EINTR)
+                continue;
+            errExit("epoll_wait");
+        }
+
+        /* Drop the FIFOs of clients that have terminated, before handling
+           any requests (which might come from a new process with a
+           recycled PID) */
+
+        for (int j = 0; j < nready; j++) {
+            if (evlist[j].data.u64 == 0)
+                continue;
+            e = cacheFind((pid_t) evlist[j].data.u64);
+            if (e != -1)
+                cacheEvict(e);
+        }
+
+        numRead = read(serverFd, req, sizeof(req));
+        if (numRead == -1) {
+            if (errno == EAGAIN)
+                continue;
+            errExit("read");
+        }
+        if (numRead % sizeof(struct request) != 0)
+            fprintf(stderr, "Partial request read; discarding\n");
+
+        for (int j = 0; j < numRead / (ssize_t) sizeof(struct request); j++) {
+            resp.seqNum = seqNum;
+            if (sendResponse(req[j].pid, &resp) == -1)
+                fprintf(stderr, "Dropping client %ld\n", (long) req[j].pid);
+
+            seqNum += req[j].seqLen;    /* Update our sequence number */
+        }
+    }
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -38,7 +331,22 @@ main(int argc, char *argv[])
     char clientFifo[CLIENT_FIFO_NAME_LEN];
     struct request req;
     struct response resp;
-    int seqNum = 0;                     /* This is our "service" */
+    int opt, batched, maxCache;
+
+    batched = 0;
+    maxCache = 64;
+    while ((opt = getopt(argc, argv, "bC:")) != -1) {
+        switch (opt) {
+        case 'b':
+            batched = 1;
+            break;
+        case 'C':
+            maxCache = getInt(optarg, GN_GT_0, "cache-size");
+            break;
+        default:
+            usageErr("%s [-b] [-C cache-size]\n", argv[0]);
+        }
+    }
 
     /* Create well-known FIFO, and open it for reading */
 
@@ -60,6 +368,12 @@ main(int argc, char *argv[])
 
     if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)    errExit("signal");
 
+    if (batched) {
+        if (fcntl(serverFd, F_SETFL, O_NONBLOCK) == -1)
+            errExit("fcntl");
+        serveBatched(serverFd, maxCache);
+    }
+
     for (;;) {                          /* Read requests and send responses */
         if (read(serverFd, &req, sizeof(struct request))
                 != sizeof(struct request)) {
@@ -0,0 +1,930 @@
+/*************************************************************************\
+*                  Copyright (C) Michael Kerrisk, 2020.                   *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU General Public License as published by the   *
+* Free Software Foundation, either version 3 or (at your option) any      *
+* later version. This program is distributed without any warranty.  See   *
+* the file COPYING.gpl-v3 for details.                                    *
+\*************************************************************************/
+
+/* Supplementary program for Chapter 43 */
+
+/* ipc_bench.c
+
+   Compare the latency and bandwidth of the IPC transports that are
+   demonstrated in this tree: pipes, FIFOs, UNIX domain stream and
+   datagram sockets, System V and POSIX message queues, System V and
+   POSIX shared memory, and (realtime) signals.
+
+   Usage: ipc_bench [-t transport,...] [-M max-size] [-p cpu,cpu] [-c]
+
+   For each transport and each message size from 8 bytes up to 'max-size'
+   (default: 1048576), in steps of a factor of 8 (plus 'max-size'
+   itself), a child process is created, and:
+
+   * Latency: the parent sends a message to the child, which sends a
+     message of the same size back ("ping-pong"). The figure shown is half
+     of the mean round-trip time, in microseconds.
+
+   * Bandwidth: the parent sends a stream of messages to the child, which
+     then replies with a single message. The figure shown is MB/s.
+
+   The shared memory transports copy each message into and out of a ring
+   of four slots in the shared segment, and use futexes to wait; the
+   signal transport carries 8 bytes in each signal's 'sigval'. A "-" in
+   the output means that the transport doesn't support that size with the
+   current system limits (e.g., /proc/sys/kernel/msgmax for System V
+   message queues, or /proc/sys/fs/mqueue/msgsize_max for POSIX ones,
+   which can be exceeded only with privilege).
+
+   "-p" pins the parent to the first CPU and the child to the second
+   (the parent's original affinity is restored after each measurement).
+   "-c" prints CSV instead of tables.
+*/
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/msg.h>
+#include <sys/shm.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <mqueue.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include "tlpi_hdr.h"
+
+#define MIN_SIZE 8
+#define SHM_SLOTS 4             /* Must be a power of 2 */
+#define LAT_BYTES (32 * 1024 * 1024)    /* Latency test moves about this
+                                           much data each way... */
+#define LAT_MIN_ITERS 100               /* ...but does at least this */
+#define LAT_MAX_ITERS 20000             /* and at most this many trips */
+#define BW_BYTES (256 * 1024 * 1024)    /* Likewise, for the bandwidth */
+#define BW_MIN_MSGS 100                 /* test */
+#define BW_MAX_MSGS 200000
+#define SHM_WAIT_SECS 1         /* How often a futex waiter checks that
+                                   its peer still exists */
+
+enum { TO_CHILD, TO_PARENT };   /* Directions */
+
+/* Each direction of a shared memory channel is a ring of SHM_SLOTS
+   message slots, with counters of messages written and read; a process
+   that must wait sleeps in futex(FUTEX_WAIT) on the relevant counter */
+
+struct shmRing {
+    uint32_t head __attribute__((aligned(64)));     /* Messages written */
+    int readerWaiting;
+    uint32_t tail __attribute__((aligned(64)));     /* Messages read */
+    int writerWaiting;
+};
+
+struct chan {                   /* State of one transport instance */
+    size_t msgSize;
+    int isParent;
+    pid_t peer;
+    int fd[2][2];               /* Per direction: [0] read, [1] write */
+    char fifoPath[2][64];
+    int msqid;
+    mqd_t mqd[2];
+    char mqName[2][64];
+    int shmid;
+    char shmName[64];
+    void *shmAddr;
+    size_t shmLen;
+};
+
+struct transport {
+    const char *name;
+    int (*open)(struct chan *ch);       /* Before fork(); returns -1 if
+                                           msgSize is unsupported */
+    void (*afterFork)(struct chan *ch); /* In each process */
+    void (*send)(struct chan *ch, int dir, const char *buf);
+    void (*recv)(struct chan *ch, int dir, char *buf);
+    void (*close)(struct chan *ch);     /* In the parent, at the end */
+};
+
+/* ---------------------------------------------------------------- */
+/* Byte-stream transports: pipes, FIFOs, and UNIX stream sockets */
+
+static void
+streamSend(struct chan *ch, int dir, const char *buf)
+{
+    size_t done;
+    ssize_t n;
+
+    for (done = 0; done < ch->msgSize; done += n) {
+        n = write(ch->fd[dir][1], buf + done, ch->msgSize - done);
+        if (n <= 0)
+            errExit("write");
+    }
+}
+
+static void
+streamRecv(struct chan *ch, int dir, char *buf)
+{
+    size_t done;
+    ssize_t n;
+
+    for (done = 0; done < ch->msgSize; done += n) {
+        n = read(ch->fd[dir][0], buf + done, ch->msgSize - done);
+        if (n == -1)
+            errExit("read");
+        if (n == 0)
+            fatal("unexpected EOF");
+    }
+}
+
+/* Close the descriptors that this process doesn't use */
+
+static void
+fdAfterFork(struct chan *ch)
+{
+    int sendDir = ch->isParent ? TO_CHILD : TO_PARENT;
+
+    for (int dir = 0; dir < 2; dir++) {
+        int unused = (dir == sendDir) ? 0 : 1;
+        if (ch->fd[dir][unused] != ch->fd[dir][1 - unused])
+            close(ch->fd[dir][unused]);
+    }
+}
+
+static void
+fdClose(struct chan *ch)
+{
+    int sendDir = TO_CHILD;
+
+    close(ch->fd[sendDir][1]);
+    close(ch->fd[1 - sendDir][0]);
+}
+
+static int
+pipeOpen(struct chan *ch)
+{
+    if (pipe(ch->fd[TO_CHILD]) == -1 || pipe(ch->fd[TO_PARENT]) == -1)
+        errExit("pipe");
+
+    /* A bigger pipe buffer means fewer context switches when streaming */
+
+    for (int dir = 0; dir < 2; dir++)
+        fcntl(ch->fd[dir][1], F_SETPIPE_SZ, 1024 * 1024);
+    return 0;
+}
+
+static int
+fifoOpen(struct chan *ch)
+{
+    for (int dir = 0; dir < 2; dir++) {
+        snprintf(ch->fifoPath[dir], sizeof(ch->fifoPath[dir]),
+                 "/tmp/ipc_bench_fifo.%ld.%d", (long) getpid(), dir);
+        if (mkfifo(ch->fifoPath[dir], S_IRUSR | S_IWUSR) == -1)
+            errExit("mkfifo");
+
+        /* Opening the read end with O_NONBLOCK means that neither open()
+           blocks; fdAfterFork() then closes the end that each process
+           doesn't use */
+
+        ch->fd[dir][0] = open(ch->fifoPath[dir], O_RDONLY | O_NONBLOCK);
+        if (ch->fd[dir][0] == -1)
+            errExit("open");
+        ch->fd[dir][1] = open(ch->fifoPath[dir], O_WRONLY);
+        if (ch->fd[dir][1] == -1)
+            errExit("open");
+        if (fcntl(ch->fd[dir][0], F_SETFL, 0) == -1)
+            errExit("fcntl");
+        fcntl(ch->fd[dir][1], F_SETPIPE_SZ, 1024 * 1024);
+    }
+    return 0;
+}
+
+static void
+fifoClose(struct chan *ch)
+{
+    fdClose(ch);
+    for (int dir = 0; dir < 2; dir++)
+        unlink(ch->fifoPath[dir]);
+}
+
+static int
+socketpairOpen(struct chan *ch, int type)
+{
+    int sv[2], bufSize;
+
+    if (socketpair(AF_UNIX, type, 0, sv) == -1)
+        errExit("socketpair");
+
+    /* Both directions use the same pair of sockets: the parent uses
+       sv[0], and the child sv[1] */
+
+    ch->fd[TO_CHILD][1] = ch->fd[TO_PARENT][0] = sv[0];
+    ch->fd[TO_CHILD][0] = ch->fd[TO_PARENT][1] = sv[1];
+
+    /* A datagram must fit in the send buffer. SO_SNDBUFFORCE can exceed
+       /proc/sys/net/core/wmem_max, but needs privilege. */
+
+    bufSize = 2 * ch->msgSize + 65536;
+    for (int j = 0; j < 2; j++) {
+        if (setsockopt(sv[j], SOL_SOCKET, SO_SNDBUFFORCE, &bufSize,
+                       sizeof(bufSize)) == -1)
+            setsockopt(sv[j], SOL_SOCKET, SO_SNDBUF, &bufSize,
+                       sizeof(bufSize));
+    }
+    return 0;
+}
+
+static void
+socketAfterFork(struct chan *ch)
+{
+    close(ch->isParent ? ch->fd[TO_CHILD][0] : ch->fd[TO_CHILD][1]);
+}
+
+static void
+socketClose(struct chan *ch)
+{
+    close(ch->fd[TO_CHILD][1]);
+}
+
+static int
+unixStreamOpen(struct chan *ch)
+{
+    return socketpairOpen(ch, SOCK_STREAM);
+}
+
+/* ---------------------------------------------------------------- */
+/* UNIX datagram sockets */
+
+static void
+dgramSend(struct chan *ch, int dir, const char *buf)
+{
+    if (send(ch->fd[dir][1], buf, ch->msgSize, 0) != (ssize_t) ch->msgSize)
+        errExit("send");
+}
+
+static void
+dgramRecv(struct chan *ch, int dir, char *buf)
+{
+    if (recv(ch->fd[dir][0], buf, ch->msgSize, 0) != (ssize_t) ch->msgSize)
+        errExit("recv");
+}
+
+static int
+unixDgramOpen(struct chan *ch)
+{
+    char *buf;
+    int ok;
+
+    socketpairOpen(ch, SOCK_DGRAM);
+
+    /* Find out whether a datagram of this size can be sent */
+
+    buf = calloc(1, ch->msgSize);
+    if (buf == NULL)
+        errExit("calloc");
+    ok = send(ch->fd[TO_CHILD][1], buf, ch->msgSize, MSG_DONTWAIT) ==
+            (ssize_t) ch->msgSize &&
+         recv(ch->fd[TO_CHILD][0], buf, ch->msgSize, 0) ==
+            (ssize_t) ch->msgSize;
+    free(buf);
+
+    if (!ok) {
+        close(ch->fd[TO_CHILD][0]);
+        close(ch->fd[TO_CHILD][1]);
+        return -1;
+    }
+    return 0;
+}
+
+/* ---------------------------------------------------------------- */
+/* System V message queues: one queue, with the message type giving the
+   direction */
+
+struct benchMsg {
+    long mtype;
+    char mtext[];
+};
+
+static struct benchMsg *msgBuf;
+
+static int
+sysvMsgOpen(struct chan *ch)
+{
+    struct msqid_ds ds;
+
+    ch->msqid = msgget(IPC_PRIVATE, IPC_CREAT | S_IRUSR | S_IWUSR);
+    if (ch->msqid == -1)
+        errExit("msgget");
+
+    /* Try to let the queue hold a few messages (needs privilege beyond
+       /proc/sys/kernel/msgmnb) */
+
+    if (msgctl(ch->msqid, IPC_STAT, &ds) == -1)
+        errExit("msgctl-IPC_STAT");
+    if (ds.msg_qbytes < 4 * ch->msgSize) {
+        ds.msg_qbytes = 4 * ch->msgSize;
+        msgctl(ch->msqid, IPC_SET, &ds);
+    }
+
+    msgBuf = malloc(sizeof(struct benchMsg) + ch->msgSize);
+    if (msgBuf == NULL)
+        errExit("malloc");
+
+    /* Find out whether a message of this size can be sent */
+
+    msgBuf->mtype = 1;
+    if (msgsnd(ch->msqid, msgBuf, ch->msgSize, IPC_NOWAIT) == -1 ||
+            msgrcv(ch->msqid, msgBuf, ch->msgSize, 0, IPC_NOWAIT) == -1) {
+        msgctl(ch->msqid, IPC_RMID, NULL);
+        free(msgBuf);
+        return -1;
+    }
+    return 0;
+}
+
+static void
+sysvMsgSend(struct chan *ch, int dir, const char *buf)
+{
+    msgBuf->mtype = dir + 1;
+    memcpy(msgBuf->mtext, buf, ch->msgSize);
+    if (msgsnd(ch->msqid, msgBuf, ch->msgSize, 0) == -1)
+        errExit("msgsnd");
+}
+
+static void
+sysvMsgRecv(struct chan *ch, int dir, char *buf)
+{
+    if (msgrcv(ch->msqid, msgBuf, ch->msgSize, dir + 1, 0) !=
+            (ssize_t) ch->msgSize)
+        errExit("msgrcv");
+    memcpy(buf, msgBuf->mtext, ch->msgSize);
+}
+
+static void
+sysvMsgClose(struct chan *ch)
+{
+    msgctl(ch->msqid, IPC_RMID, NULL);
+    free(msgBuf);
+}
+
+/* ---------------------------------------------------------------- */
+/* POSIX message queues: one queue per direction */
+
+static int
+posixMqOpen(struct chan *ch)
+{
+    struct mq_attr attr;
+
+    attr.mq_flags = 0;
+    attr.mq_maxmsg = 4;
+    attr.mq_msgsize = ch->msgSize;
+
+    for (int dir = 0; dir < 2; dir++) {
+        snprintf(ch->mqName[dir], sizeof(ch->mqName[dir]),
+                 "/ipc_bench.%ld.%d", (long) getpid(), dir);
+        ch->mqd[dir] = mq_open(ch->mqName[dir], O_RDWR | O_CREAT | O_EXCL,
+                               S_IRUSR | S_IWUSR, &attr);
+        if (ch->mqd[dir] == (mqd_t) -1) {
+            if (dir == 1) {
+                mq_close(ch->mqd[0]);
+                mq_unlink(ch->mqName[0]);
+            }
+            if (errno == EINVAL || errno == EMFILE || errno == ENOMEM)
+                return -1;
+            errExit("mq_open");
+        }
+    }
+    return 0;
+}
+
+static void
+posixMqSend(struct chan *ch, int dir, const char *buf)
+{
+    if (mq_send(ch->mqd[dir], buf, ch->msgSize, 0) == -1)
+        errExit("mq_send");
+}
+
+static void
+posixMqRecv(struct chan *ch, int dir, char *buf)
+{
+    if (mq_receive(ch->mqd[dir], buf, ch->msgSize, NULL) !=
+            (ssize_t) ch->msgSize)
+        errExit("mq_receive");
+}
+
+static void
+posixMqClose(struct chan *ch)
+{
+    for (int dir = 0; dir < 2; dir++) {
+        mq_close(ch->mqd[dir]);
+        mq_unlink(ch->mqName[dir]);
+    }
+}
+
+/* ---------------------------------------------------------------- */
+/* Shared memory: System V or POSIX; the segment holds one shmRing and
+   SHM_SLOTS message slots for each direction */
+
+static size_t
+shmDirSize(size_t msgSize)
+{
+    return sizeof(struct shmRing) +
+            SHM_SLOTS * ((msgSize + 63) & ~(size_t) 63);
+}
+
+static struct shmRing *
+shmRingOf(struct chan *ch, int dir)
+{
+    return (struct shmRing *) ((char *) ch->shmAddr +
+                               dir * shmDirSize(ch->msgSize));
+}
+
+static char *
+shmSlot(struct chan *ch, int dir, uint32_t n)
+{
+    return (char *) (shmRingOf(ch, dir) + 1) +
+            (n & (SHM_SLOTS - 1)) * ((ch->msgSize + 63) & ~(size_t) 63);
+}
+
+/* Return true if the other process has terminated. The parent uses
+   WNOWAIT, so as to leave the child for measure() to reap. */
+
+static int
+peerGone(struct chan *ch)
+{
+    siginfo_t info;
+
+    if (!ch->isParent)
+        return getppid() != ch->peer;
+
+    info.si_pid = 0;
+    if (waitid(P_PID, ch->peer, &info, WEXITED | WNOHANG | WNOWAIT) == -1)
+        errExit("waitid");
+    return info.si_pid != 0;
+}
+
+/* Wait until '*counter' differs from 'old'. Unlike the other transports,
+   shared memory gives no EOF or error if the peer dies, so we wake
+   every SHM_WAIT_SECS to check on it, rather than waiting forever. */
+
+static void
+shmWait(struct chan *ch, uint32_t *counter, int *waiting, uint32_t old)
+{
+    struct timespec ts = { SHM_WAIT_SECS, 0 };
+
+    for (int j = 0; j < 100; j++)
+        if (__atomic_load_n(counter, __ATOMIC_ACQUIRE) != old)
+            return;
+
+    for (;;) {
+        __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(counter, __ATOMIC_SEQ_CST) != old)
+            break;
+        if (syscall(SYS_futex, counter, FUTEX_WAIT, old, &ts, NULL, 0)
+                == -1) {
+            if (errno == ETIMEDOUT) {
+                if (peerGone(ch))
+                    fatal("shm: %s process has terminated",
+                          ch->isParent ? "child" : "parent");
+            } else if (errno != EAGAIN && errno != EINTR) {
+                errExit("futex-FUTEX_WAIT");
+            }
+        }
+    }
+    __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+}
+
+/* Increment '*counter', and wake the other process if it is waiting */
+
+static void
+shmAdvance(uint32_t *counter, int *waiting)
+{
+    __atomic_add_fetch(counter, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST) &&
+            syscall(SYS_futex, counter, FUTEX_WAKE, 1, NULL, NULL, 0) == -1)
+        errExit("futex-FUTEX_WAKE");
+}
+
+static void
+shmSend(struct chan *ch, int dir, const char *buf)
+{
+    struct shmRing *r = shmRingOf(ch, dir);
+    uint32_t head = r->head;
+
+    while (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == SHM_SLOTS)
+        shmWait(ch, &r->tail, &r->writerWaiting, head - SHM_SLOTS);
+
+    memcpy(shmSlot(ch, dir, head), buf, ch->msgSize);
+    shmAdvance(&r->head, &r->readerWaiting);
+}
+
+static void
+shmRecv(struct chan *ch, int dir, char *buf)
+{
+    struct shmRing *r = shmRingOf(ch, dir);
+    uint32_t tail = r->tail;
+
+    if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == tail)
+        shmWait(ch, &r->head, &r->readerWaiting, tail);
+
+    memcpy(buf, shmSlot(ch, dir, tail), ch->msgSize);
+    shmAdvance(&r->tail, &r->writerWaiting);
+}
+
+static int
+sysvShmOpen(struct chan *ch)
+{
+    ch->shmLen = 2 * shmDirSize(ch->msgSize);
+    ch->shmid = shmget(IPC_PRIVATE, ch->shmLen,
+                       IPC_CREAT | S_IRUSR | S_IWUSR);
+    if (ch->shmid == -1) {
+        if (errno == EINVAL || errno == ENOMEM || errno == ENOSPC)
+            return -1;
+        errExit("shmget");
+    }
+
+    ch->shmAddr = shmat(ch->shmid, NULL, 0);
+    if (ch->shmAddr == (void *) -1)
+        errExit("shmat");
+
+    /* Mark for deletion now; the segment lives until both processes have
+       detached it */
+
+    if (shmctl(ch->shmid, IPC_RMID, NULL) == -1)
+        errExit("shmctl");
+    return 0;
+}
+
+static void
+sysvShmClose(struct chan *ch)
+{
+    shmdt(ch->shmAddr);
+}
+
+static int
+posixShmOpen(struct chan *ch)
+{
+    int fd;
+
+    ch->shmLen = 2 * shmDirSize(ch->msgSize);
+    snprintf(ch->shmName, sizeof(ch->shmName), "/ipc_bench.%ld",
+             (long) getpid());
+    fd = shm_open(ch->shmName, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+    if (fd == -1)
+        errExit("shm_open");
+    if (ftruncate(fd, ch->shmLen) == -1)
+        errExit("ftruncate");
+
+    ch->shmAddr = mmap(NULL, ch->shmLen, PROT_READ | PROT_WRITE, MAP_SHARED,
+                       fd, 0);
+    if (ch->shmAddr == MAP_FAILED)
+        errExit("mmap");
+    close(fd);
+    return 0;
+}
+
+static void
+posixShmClose(struct chan *ch)
+{
+    munmap(ch->shmAddr, ch->shmLen);
+    shm_unlink(ch->shmName);
+}
+
+/* ---------------------------------------------------------------- */
+/* Realtime signals: each signal carries 8 bytes in its 'sigval'. The
+   signal is blocked and accepted with sigwaitinfo(). */
+
+#define BENCH_SIG (SIGRTMIN + 1)
+
+static int
+signalOpen(struct chan *ch)
+{
+    sigset_t set;
+
+    if (ch->msgSize > sizeof(union sigval))
+        return -1;
+
+    sigemptyset(&set);
+    sigaddset(&set, BENCH_SIG);
+    if (sigprocmask(SIG_BLOCK, &set, NULL) == -1)
+        errExit("sigprocmask");
+    return 0;
+}
+
+static void
+signalSend(struct chan *ch, int dir, const char *buf)
+{
+    union sigval sv;
+
+    memcpy(&sv, buf, ch->msgSize);
+    while (sigqueue(ch->peer, BENCH_SIG, sv) == -1) {
+        if (errno != EAGAIN)            /* EAGAIN: queue is full */
+            errExit("sigqueue");
+        sched_yield();
+    }
+}
+
+static void
+signalRecv(struct chan *ch, int dir, char *buf)
+{
+    siginfo_t si;
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, BENCH_SIG);
+    while (sigwaitinfo(&set, &si) == -1)
+        if (errno != EINTR)
+            errExit("sigwaitinfo");
+    memcpy(buf, &si.si_value, ch->msgSize);
+}
+
+static void
+signalClose(struct chan *ch)
+{
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, BENCH_SIG);
+    if (sigprocmask(SIG_UNBLOCK, &set, NULL) == -1)
+        errExit("sigprocmask");
+}
+
+static const struct transport transports[] = {
+    { "pipe",        pipeOpen,       fdAfterFork,     streamSend,
+      streamRecv,    fdClose },
+    { "fifo",        fifoOpen,       fdAfterFork,     streamSend,
+      streamRecv,    fifoClose },
+    { "unix_stream", unixStreamOpen, socketAfterFork, streamSend,
+      streamRecv,    socketClose },
+    { "unix_dgram",  unixDgramOpen,  socketAfterFork, dgramSend,
+      dgramRecv,     socketClose },
+    { "sysv_msg",    sysvMsgOpen,    NULL,            sysvMsgSend,
+      sysvMsgRecv,   sysvMsgClose },
+    { "posix_mq",    posixMqOpen,    NULL,            posixMqSend,
+      posixMqRecv,   posixMqClose },
+    { "sysv_shm",    sysvShmOpen,    NULL,            shmSend,
+      shmRecv,       sysvShmClose },
+    { "posix_shm",   posixShmOpen,   NULL,            shmSend,
+      shmRecv,       posixShmClose },
+    { "signal",      signalOpen,     NULL,            signalSend,
+      signalRecv,    signalClose },
+};
+
+#define NUM_TRANSPORTS ((int) (sizeof(transports) / sizeof(transports[0])))
+
+/* ---------------------------------------------------------------- */
+
+static double
+timeNow(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        errExit("clock_gettime");
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long
+clampCount(long n, long min, long max)
+{
+    return (n < min) ? min : (n > max) ? max : n;
+}
+
+static cpu_set_t origCpus;      /* Our affinity before any pinTo() */
+
+/* Pin the caller to 'cpu', or, if 'cpu' is -1, restore the affinity
+   saved in main() */
+
+static void
+pinTo(int cpu)
+{
+    cpu_set_t set;
+
+    if (cpu < 0) {
+        set = origCpus;
+    } else {
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+    }
+    if (sched_setaffinity(0, sizeof(set), &set) == -1)
+        errExit("sched_setaffinity");
+}
+
+/* Measure transport 't' with messages of 'size' bytes. Returns 0 with
+   the one-way latency (usecs) and the bandwidth (MB/s) in '*lat' and
+   '*bw', or -1 if the size isn't supported. */
+
+static int
+measure(const struct transport *t, size_t size, const int *cpus,
+        double *lat, double *bw)
+{
+    struct chan ch;
+    long latIters, bwMsgs;
+    double start;
+    char *buf;
+    int status;
+
+    memset(&ch, 0, sizeof(ch));
+    ch.msgSize = size;
+    if (t->open(&ch) == -1)
+        return -1;
+
+    buf = malloc(size);
+    if (buf == NULL)
+        errExit("malloc");
+    memset(buf, 'x', size);
+
+    latIters = clampCount(LAT_BYTES / size, LAT_MIN_ITERS, LAT_MAX_ITERS);
+    bwMsgs = clampCount(BW_BYTES / size, BW_MIN_MSGS, BW_MAX_MSGS);
+
+    ch.peer = fork();
+    if (ch.peer == -1)
+        errExit("fork");
+
+    if (ch.peer == 0) {                 /* Child: echo, then sink */
+        ch.isParent = 0;
+        ch.peer = getppid();
+        if (cpus[0] >= 0)
+            pinTo(cpus[1]);
+        if (t->afterFork != NULL)
+            t->afterFork(&ch);
+
+        for (long j = 0; j < latIters; j++) {
+            t->recv(&ch, TO_CHILD, buf);
+            t->send(&ch, TO_PARENT, buf);
+        }
+
+        for (long j = 0; j < bwMsgs; j++)
+            t->recv(&ch, TO_CHILD, buf);
+        t->send(&ch, TO_PARENT, buf);
+
+        _exit(EXIT_SUCCESS);
+    }
+
+    ch.isParent = 1;
+    if (cpus[0] >= 0)
+        pinTo(cpus[0]);
+    if (t->afterFork != NULL)
+        t->afterFork(&ch);
+
+    start = timeNow();
+    for (long j = 0; j < latIters; j++) {
+        t->send(&ch, TO_CHILD, buf);
+        t->recv(&ch, TO_PARENT, buf);
+    }
+    *lat = (timeNow() - start) / latIters / 2 * 1e6;
+
+    start = timeNow();
+    for (long j = 0; j < bwMsgs; j++)
+        t->send(&ch, TO_CHILD, buf);
+    t->recv(&ch, TO_PARENT, buf);
+    *bw = (double) bwMsgs * size / (timeNow() - start) / 1e6;
+
+    if (waitpid(ch.peer, &status, 0) == -1)
+        errExit("waitpid");
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        fatal("%s: child failed with size %zu", t->name, size);
+
+    t->close(&ch);
+    free(buf);
+    if (cpus[0] >= 0)
+        pinTo(-1);
+    return 0;
+}
+
+static void
+usageError(const char *progName)
+{
+    fprintf(stderr, "Usage: %s [-t transport,...] [-M max-size] "
+                    "[-p cpu,cpu] [-c]\n", progName);
+    fprintf(stderr, "Transports:");
+    for (int j = 0; j < NUM_TRANSPORTS; j++)
+        fprintf(stderr, " %s", transports[j].name);
+    fprintf(stderr, "\n");
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+    static double lat[NUM_TRANSPORTS][16], bw[NUM_TRANSPORTS][16];
+    static int ok[NUM_TRANSPORTS][16];
+    int wanted[NUM_TRANSPORTS];
+    int cpus[2] = { -1, -1 };
+    long maxSize;
+    size_t size;
+    size_t sizes[16];
+    int opt, csv, nsizes, t, s;
+    char *tok, *comma;
+
+    maxSize = 1024 * 1024;
+    csv = 0;
+    for (t = 0; t < NUM_TRANSPORTS; t++)
+        wanted[t] = 1;
+
+    while ((opt = getopt(argc, argv, "t:M:p:c")) != -1) {
+        switch (opt) {
+        case 't':
+            for (t = 0; t < NUM_TRANSPORTS; t++)
+                wanted[t] = 0;
+            for (tok = strtok(optarg, ","); tok != NULL;
+                    tok = strtok(NULL, ",")) {
+                for (t = 0; t < NUM_TRANSPORTS; t++)
+                    if (strcmp(tok, transports[t].name) == 0)
+                        break;
+                if (t == NUM_TRANSPORTS)
+                    usageError(argv[0]);
+                wanted[t] = 1;
+            }
+            break;
+        case 'M':
+            maxSize = getLong(optarg, GN_GT_0, "max-size");
+            break;
+        case 'p':
+            comma = strchr(optarg, ',');
+            if (comma == NULL)
+                usageError(argv[0]);
+            *comma = '\0';
+            cpus[0] = getInt(optarg, GN_NONNEG, "cpu");
+            cpus[1] = getInt(comma + 1, GN_NONNEG, "cpu");
+            break;
+        case 'c':
+            csv = 1;
+            break;
+        default:
+            usageError(argv[0]);
+        }
+    }
+
+    if (sched_getaffinity(0, sizeof(origCpus), &origCpus) == -1)
+        errExit("sched_getaffinity");
+
+    /* Writes to a pipe whose reader has gone should fail with EPIPE */
+
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+        errExit("signal");
+
+    if (csv)
+        printf("transport,size,latency_us,bandwidth_MBps\n");
+
+    nsizes = 0;
+    for (size = MIN_SIZE; size < (size_t) maxSize && nsizes < 15; size *= 8)
+        sizes[nsizes++] = size;
+    sizes[nsizes++] = maxSize;
+
+    for (s = 0; s < nsizes; s++) {
+        size = sizes[s];
+        for (t = 0; t < NUM_TRANSPORTS; t++) {
+            if (!wanted[t])
+                continue;
+            ok[t][s] = measure(&transports[t], size, cpus,
+                               &lat[t][s], &bw[t][s]) == 0;
+            if (csv && ok[t][s]) {
+                printf("%s,%zu,%.2f,%.1f\n", transports[t].name, size,
+                       lat[t][s], bw[t][s]);
+                fflush(stdout);
+            }
+        }
+    }
+
+    if (csv)
+        exit(EXIT_SUCCESS);
+
+    for (int table = 0; table < 2; table++) {
+        printf("%s\n", (table == 0) ? "One-way latency (usecs)" :
+                                      "Bandwidth (MB/s)");
+        printf("%-12s", "Transport");
+        for (s = 0; s < nsizes; s++) {
+            size = sizes[s];
+            if (size < 1024)
+                printf(" %8zuB", size);
+            else if (size < 1024 * 1024)
+                printf(" %7zuKB", size / 1024);
+            else
+                printf(" %7zuMB", size / (1024 * 1024));
+        }
+        printf("\n");
+
+        for (t = 0; t < NUM_TRANSPORTS; t++) {
+            if (!wanted[t])
+                continue;
+            printf("%-12s", transports[t].name);
+            for (s = 0; s < nsizes; s++) {
+                if (!ok[t][s])
+                    printf(" %9s", "-");
+                else if (table == 0)
+                    printf(" %9.2f", lat[t][s]);
+                else
+                    printf(" %9.1f", bw[t][s]);
+            }
+            printf("\n");
+        }
+        printf("\n");
+    }
+
+    exit(EXIT_SUCCESS);
+}
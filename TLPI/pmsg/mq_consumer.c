@@ -0,0 +1,524 @@
+/*************************************************************************\
+*                  Copyright (C) Michael Kerrisk, 2020.                   *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU Lesser General Public License as published   *
+* by the Free Software Foundation, either version 3 or (at your option)   *
+* any later version. This program is distributed without any warranty.    *
+* See the files COPYING.lgpl-v3 and COPYING.gpl-v3 for details.           *
+\*************************************************************************/
+
+/* Supplementary program for Chapter 52 */
+
+/* mq_consumer.c
+
+   A consumer of messages from several POSIX message queues.
+
+   mq_notify_via_thread.c drains a single queue after each SIGEV_THREAD
+   notification, and allocates a new buffer each time it does so. On
+   Linux, a message queue descriptor is a file descriptor (see Section
+   52.7 of TLPI), so it can instead be monitored with epoll, which
+   doesn't need re-registration after each message, and lets one thread
+   watch any number of queues. This module does the following:
+
+   * One "poller" thread waits on an epoll instance to which each queue
+     (opened or switched to O_NONBLOCK) is added. For each ready queue in
+     turn, the poller receives up to RECV_BATCH messages with nonblocking
+     mq_receive() calls into buffers taken from a preallocated pool, and
+     queues them for the workers under a single lock acquisition per
+     batch. A queue that still holds messages is simply reported again
+     by the next epoll_wait(), so that one busy queue can't hold up the
+     others.
+
+   * Queued messages are held in a heap ordered by priority (and, within
+     a priority, by arrival), so that, as with mq_receive() itself, the
+     highest-priority message is handled first, even across queues.
+
+   * A pool of worker threads takes messages from the heap (up to
+     WORKER_BATCH at a time), calls the handler, and returns the buffers
+     to the pool. When the pool is empty, the poller stops receiving until
+     a buffer is returned, so that messages stay in the kernel queues
+     (where senders block, or get EAGAIN) rather than piling up in memory.
+
+   Usage:
+
+       c = mqcCreate(nworkers, nbufs, handler, arg);
+       q = mqcAddQueue(c, mqd);         (for each queue)
+       mqcStart(c);
+       ...
+       mqcDestroy(c);                   (handles all messages taken from
+                                         the queues, then stops)
+*/
+#define _GNU_SOURCE
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include "mq_consumer.h"
+#include "tlpi_hdr.h"
+
+#define RECV_BATCH 32           /* Messages received per lock acquisition */
+#define WORKER_BATCH 8          /* Messages taken by a worker at a time */
+
+struct mqcMsg {
+    char *buf;
+    size_t len;
+    unsigned int prio;
+    int queue;
+    unsigned long seq;          /* Arrival order, for equal priorities */
+};
+
+struct mqConsumer {
+    mqcHandler handler;
+    void *arg;
+    int nworkers;
+    pthread_t poller;
+    pthread_t *workers;
+    int started;
+
+    int epfd;
+    int stopFd;                 /* eventfd that stops the poller */
+    int nqueues;
+    mqd_t mqd[MQC_MAX_QUEUES];
+    size_t bufSize;             /* Largest mq_msgsize of the queues */
+
+    pthread_mutex_t mtx;        /* Protects everything below */
+    pthread_cond_t workCond;    /* Signaled when messages are queued */
+    pthread_cond_t bufCond;     /* Signaled when buffers are freed */
+    int pollerStop;             /* Poller must stop receiving */
+    int stopping;               /* Workers stop once the heap is empty */
+    int nbufs;
+    char *bufMem;
+    char **freeBufs;            /* Stack of free buffers */
+    int nfree;
+    struct mqcMsg *heap;        /* At most 'nbufs' messages */
+    int heapLen;
+    unsigned long seq;
+    struct mqcStats stats;
+};
+
+/* ---------------------------------------------------------------- */
+/* The heap of messages waiting for a worker */
+
+static int
+higher(const struct mqcMsg *a, const struct mqcMsg *b)
+{
+    return a->prio > b->prio || (a->prio == b->prio && a->seq < b->seq);
+}
+
+static void
+heapPush(struct mqConsumer *c, const struct mqcMsg *m)
+{
+    struct mqcMsg tmp;
+    int j, parent;
+
+    j = c->heapLen++;
+    c->heap[j] = *m;
+    while (j > 0) {
+        parent = (j - 1) / 2;
+        if (!higher(&c->heap[j], &c->heap[parent]))
+            break;
+        tmp = c->heap[j];
+        c->heap[j] = c->heap[parent];
+        c->heap[parent] = tmp;
+        j = parent;
+    }
+}
+
+static void
+heapPop(struct mqConsumer *c, struct mqcMsg *m)
+{
+    struct mqcMsg tmp;
+    int j, child;
+
+    *m = c->heap[0];
+    c->heap[0] = c->heap[--c->heapLen];
+
+    j = 0;
+    for (;;) {
+        child = 2 * j + 1;
+        if (child >= c->heapLen)
+            break;
+        if (child + 1 < c->heapLen && higher(&c->heap[child + 1],
+                                             &c->heap[child]))
+            child++;
+        if (!higher(&c->heap[child], &c->heap[j]))
+            break;
+        tmp = c->heap[j];
+        c->heap[j] = c->heap[child];
+        c->heap[child] = tmp;
+        j = child;
+    }
+}
+
+/* ---------------------------------------------------------------- */
+/* Threads */
+
+/* Receive one batch of (up to RECV_BATCH) messages from queue 'q' into
+   the buffer pool. We take only one batch at a time, so that a busy
+   queue can't starve the others (whose messages may have a higher
+   priority): since the queues are level-triggered in the epoll set, a
+   queue that still holds messages is reported again by the next
+   epoll_wait(). */
+
+static void
+receiveBatch(struct mqConsumer *c, int q)
+{
+    struct mqcMsg msgs[RECV_BATCH];
+    char *bufs[RECV_BATCH];
+    unsigned int prio;
+    ssize_t numRead;
+    int nbufs, nmsgs, s;
+
+    /* Take a batch of buffers from the pool, waiting if need be */
+
+    s = pthread_mutex_lock(&c->mtx);
+    if (s != 0)
+        errExitEN(s, "pthread_mutex_lock");
+
+    if (c->nfree == 0 && !c->pollerStop)
+        c->stats.poolWaits++;
+    while (c->nfree == 0 && !c->pollerStop) {
+        s = pthread_cond_wait(&c->bufCond, &c->mtx);
+        if (s != 0)
+            errExitEN(s, "pthread_cond_wait");
+    }
+
+    if (c->pollerStop) {            /* Leave the rest in the queue */
+        s = pthread_mutex_unlock(&c->mtx);
+        if (s != 0)
+            errExitEN(s, "pthread_mutex_unlock");
+        return;
+    }
+
+    nbufs = 0;
+    while (nbufs < RECV_BATCH && c->nfree > 0)
+        bufs[nbufs++] = c->freeBufs[--c->nfree];
+
+    s = pthread_mutex_unlock(&c->mtx);
+    if (s != 0)
+        errExitEN(s, "pthread_mutex_unlock");
+
+    /* Receive without holding the lock */
+
+    for (nmsgs = 0; nmsgs < nbufs; nmsgs++) {
+        numRead = mq_receive(c->mqd[q], bufs[nmsgs], c->bufSize, &prio);
+        if (numRead == -1) {
+            if (errno == EAGAIN)
+                break;
+            errExit("mq_receive");
+        }
+        msgs[nmsgs].buf = bufs[nmsgs];
+        msgs[nmsgs].len = numRead;
+        msgs[nmsgs].prio = prio;
+        msgs[nmsgs].queue = q;
+    }
+
+    /* Queue the messages, and return the unused buffers */
+
+    s = pthread_mutex_lock(&c->mtx);
+    if (s != 0)
+        errExitEN(s, "pthread_mutex_lock");
+
+    for (int j = 0; j < nmsgs; j++) {
+        msgs[j].seq = c->seq++;
+        heapPush(c, &msgs[j]);
+    }
+    for (int j = nmsgs; j < nbufs; j++)
+        c->freeBufs[c->nfree++] = bufs[j];
+    c->stats.received += nmsgs;
+    c->stats.receiveBatches++;
+
+    if (nmsgs > 1)
+        s = pthread_cond_broadcast(&c->workCond);
+    else if (nmsgs == 1)
+        s = pthread_cond_signal(&c->workCond);
+    if (s != 0)
+        errExitEN(s, "pthread_cond_signal");
+
+    s = pthread_mutex_unlock(&c->mtx);
+    if (s != 0)
+        errExitEN(s, "pthread_mutex_unlock");
+}
+
+static void *
+pollerThread(void *arg)
+{
+    struct mqConsumer *c = arg;
+    struct epoll_event evlist[MQC_MAX_QUEUES + 1];
+    int nready;
+
+    for (;;) {
+        nready = epoll_wait(c->epfd, evlist, MQC_MAX_QUEUES + 1, -1);
+        if (nready == -1) {
+            if (errno == EINTR)
+                continue;
+            errExit("epoll_wait");
+        }
+
+        for (int j = 0; j < nready; j++) {
+            if (evlist[j].data.u32 == MQC_MAX_QUEUES)   /* stopFd */
+                return NULL;
+            receiveBatch(c, evlist[j].data.u32);
+        }
+    }
+}
+
+static void *
+workerThread(void *arg)
+{
+    struct mqConsumer *c = arg;
+    struct mqcMsg msgs[WORKER_BATCH];
+    int n, s;
+
+    s = pthread_mutex_lock(&c->mtx);
+    if (s != 0)
+        errExitEN(s, "pthread_mutex_lock");
+
+    for (;;) {
+        while (c->heapLen == 0 && !c->stopping) {
+            s = pthread_cond_wait(&c->workCond, &c->mtx);
+            if (s != 0)
+                errExitEN(s, "pthread_cond_wait");
+        }
+        if (c->heapLen == 0)            /* Stopping, and nothing left */
+            break;
+
+        for (n = 0; n < WORKER_BATCH && c->heapLen > 0; n++)
+            heapPop(c, &msgs[n]);
+
+        s = pthread_mutex_unlock(&c->mtx);
+        if (s != 0)
+            errExitEN(s, "pthread_mutex_unlock");
+
+        for (int j = 0; j < n; j++)
+            c->handler(msgs[j].queue, msgs[j].buf, msgs[j].len,
+                       msgs[j].prio, c->arg);
+
+        s = pthread_mutex_lock(&c->mtx);
+        if (s != 0)
+            errExitEN(s, "pthread_mutex_lock");
+
+        for (int j = 0; j < n; j++)
+            c->freeBufs[c->nfree++] = msgs[j].buf;
+        c->stats.handled += n;
+
+        s = pthread_cond_signal(&c->bufCond);
+        if (s != 0)
+            errExitEN(s, "pthread_cond_signal");
+    }
+
+    s = pthread_mutex_unlock(&c->mtx);
+    if (s != 0)
+        errExitEN(s, "pthread_mutex_unlock");
+
+    return NULL;
+}
+
+/* ---------------------------------------------------------------- */
+/* Public interface */
+
+/* Create a consumer with 'nworkers' worker threads and a pool of 'nbufs'
+   message buffers. Returns NULL (with 'errno' set) on error. */
+
+struct mqConsumer *
+mqcCreate(int nworkers, int nbufs, mqcHandler handler, void *arg)
+{
+    struct mqConsumer *c;
+    struct epoll_event ev;
+
+    if (nworkers < 1 || nbufs < 1) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    c = calloc(1, sizeof(struct mqConsumer));
+    if (c == NULL)
+        return NULL;
+
+    c->handler = handler;
+    c->arg = arg;
+    c->nworkers = nworkers;
+    c->nbufs = nbufs;
+
+    pthread_mutex_init(&c->mtx, NULL);
+    pthread_cond_init(&c->workCond, NULL);
+    pthread_cond_init(&c->bufCond, NULL);
+
+    c->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (c->epfd == -1) {
+        free(c);
+        return NULL;
+    }
+
+    c->stopFd = eventfd(0, EFD_CLOEXEC);
+    if (c->stopFd == -1) {
+        close(c->epfd);
+        free(c);
+        return NULL;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.u32 = MQC_MAX_QUEUES;
+    if (epoll_ctl(c->epfd, EPOLL_CTL_ADD, c->stopFd, &ev) == -1) {
+        close(c->stopFd);
+        close(c->epfd);
+        free(c);
+        return NULL;
+    }
+
+    return c;
+}
+
+/* Add the queue 'mqd' (which must be open for reading) to the consumer,
+   and put it in nonblocking mode. This must be done before mqcStart().
+   Returns a queue number (passed to the handler), or -1 on error. */
+
+int
+mqcAddQueue(struct mqConsumer *c, mqd_t mqd)
+{
+    struct mq_attr attr, newAttr;
+    struct epoll_event ev;
+
+    if (c->started || c->nqueues == MQC_MAX_QUEUES) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (mq_getattr(mqd, &attr) == -1)
+        return -1;
+
+    if (!(attr.mq_flags & O_NONBLOCK)) {
+        newAttr = attr;
+        newAttr.mq_flags = O_NONBLOCK;
+        if (mq_setattr(mqd, &newAttr, NULL) == -1)
+            return -1;
+    }
+
+    ev.events = EPOLLIN;                /* Level-triggered */
+    ev.data.u32 = c->nqueues;
+    if (epoll_ctl(c->epfd, EPOLL_CTL_ADD, mqd, &ev) == -1)
+        return -1;
+
+    if ((size_t) attr.mq_msgsize > c->bufSize)
+        c->bufSize = attr.mq_msgsize;
+    c->mqd[c->nqueues] = mqd;
+    return c->nqueues++;
+}
+
+/* Tell the workers to stop once the heap is empty, and wait for the
+   first 'n' of them (those that were created) to do so */
+
+static void
+stopWorkers(struct mqConsumer *c, int n)
+{
+    int s;
+
+    pthread_mutex_lock(&c->mtx);
+    c->stopping = 1;
+    pthread_cond_broadcast(&c->workCond);
+    pthread_mutex_unlock(&c->mtx);
+
+    for (int j = 0; j < n; j++) {
+        s = pthread_join(c->workers[j], NULL);
+        if (s != 0)
+            errExitEN(s, "pthread_join");
+    }
+}
+
+/* Allocate the buffer pool and start the threads. Returns 0 on success,
+   or -1 on error, in which case no threads are left running (and the
+   consumer can only be passed to mqcDestroy()). */
+
+int
+mqcStart(struct mqConsumer *c)
+{
+    int nstarted, s;
+
+    if (c->started || c->nqueues == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    c->bufMem = malloc((size_t) c->nbufs * c->bufSize);
+    c->freeBufs = malloc(c->nbufs * sizeof(char *));
+    c->heap = malloc(c->nbufs * sizeof(struct mqcMsg));
+    c->workers = calloc(c->nworkers, sizeof(pthread_t));
+    if (c->bufMem == NULL || c->freeBufs == NULL || c->heap == NULL ||
+            c->workers == NULL)
+        return -1;
+
+    for (int j = 0; j < c->nbufs; j++)
+        c->freeBufs[j] = c->bufMem + (size_t) j * c->bufSize;
+    c->nfree = c->nbufs;
+
+    s = 0;
+    for (nstarted = 0; nstarted < c->nworkers; nstarted++) {
+        s = pthread_create(&c->workers[nstarted], NULL, workerThread, c);
+        if (s != 0)
+            break;
+    }
+    if (s == 0)
+        s = pthread_create(&c->poller, NULL, pollerThread, c);
+
+    if (s != 0) {               /* mqcDestroy() mustn't free the consumer
+                                   while these threads are using it */
+        stopWorkers(c, nstarted);
+        errno = s;
+        return -1;
+    }
+
+    c->started = 1;
+    return 0;
+}
+
+void
+mqcGetStats(struct mqConsumer *c, struct mqcStats *stats)
+{
+    pthread_mutex_lock(&c->mtx);
+    *stats = c->stats;
+    pthread_mutex_unlock(&c->mtx);
+}
+
+/* Stop receiving, let the workers handle the messages that have already
+   been received, and free the consumer. The queue descriptors are not
+   closed.
+
+   The poller is stopped (and joined) first: were the workers told to
+   stop at the same time, they could find the heap empty and exit while
+   the poller was still queuing messages that it had received. */
+
+void
+mqcDestroy(struct mqConsumer *c)
+{
+    int s;
+
+    if (c->started) {
+        pthread_mutex_lock(&c->mtx);
+        c->pollerStop = 1;
+        pthread_cond_broadcast(&c->bufCond);
+        pthread_mutex_unlock(&c->mtx);
+
+        if (eventfd_write(c->stopFd, 1) == -1)
+            errExit("eventfd_write");
+
+        s = pthread_join(c->poller, NULL);
+        if (s != 0)
+            errExitEN(s, "pthread_join");
+
+        /* Now nothing more can be added to the heap */
+
+        stopWorkers(c, c->nworkers);
+    }
+
+    close(c->stopFd);
+    close(c->epfd);
+    pthread_cond_destroy(&c->workCond);
+    pthread_cond_destroy(&c->bufCond);
+    pthread_mutex_destroy(&c->mtx);
+    free(c->bufMem);
+    free(c->freeBufs);
+    free(c->heap);
+    free(c->workers);
+    free(c);
+}
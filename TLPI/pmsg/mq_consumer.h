@@ -0,0 +1,50 @@
+/*************************************************************************\
+*                  Copyright (C) Michael Kerrisk, 2020.                   *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU Lesser General Public License as published   *
+* by the Free Software Foundation, either version 3 or (at your option)   *
+* any later version. This program is distributed without any warranty.    *
+* See the files COPYING.lgpl-v3 and COPYING.gpl-v3 for details.           *
+\*************************************************************************/
+
+/* mq_consumer.h
+
+   Header file for mq_consumer.c.
+*/
+#ifndef MQ_CONSUMER_H
+#define MQ_CONSUMER_H           /* Prevent accidental double inclusion */
+
+#include <mqueue.h>
+#include <stddef.h>
+
+#define MQC_MAX_QUEUES 64
+
+/* Called in a worker thread for each message; 'queue' is the value
+   returned by mqcAddQueue() for the queue that the message came from.
+   The message buffer is reused once the handler returns. */
+
+typedef void (*mqcHandler)(int queue, const char *msg, size_t len,
+                           unsigned int prio, void *arg);
+
+struct mqConsumer;
+
+struct mqcStats {
+    long received;              /* Messages taken from the queues */
+    long handled;               /* Messages passed to the handler */
+    long receiveBatches;        /* Number of batches of mq_receive() calls */
+    long poolWaits;             /* Times the buffer pool was empty */
+};
+
+struct mqConsumer *mqcCreate(int nworkers, int nbufs, mqcHandler handler,
+                             void *arg);
+
+int mqcAddQueue(struct mqConsumer *c, mqd_t mqd);
+
+int mqcStart(struct mqConsumer *c);
+
+void mqcGetStats(struct mqConsumer *c, struct mqcStats *stats);
+
+void mqcDestroy(struct mqConsumer *c);
+
+#endif
@@ -0,0 +1,393 @@
+/*************************************************************************\
+*                  Copyright (C) Michael Kerrisk, 2020.                   *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU General Public License as published by the   *
+* Free Software Foundation, either version 3 or (at your option) any      *
+* later version. This program is distributed without any warranty.  See   *
+* the file COPYING.gpl-v3 for details.                                    *
+\*************************************************************************/
+
+/* Supplementary program for Chapter 52 */
+
+/* mq_consumer_bench.c
+
+   Measure the rate at which messages can be consumed from several POSIX
+   message queues, comparing two consumers:
+
+   notify   the approach of mq_notify_via_thread.c: each queue has a
+            SIGEV_THREAD notification; the notification function
+            re-registers, allocates a buffer, and drains the queue
+
+   epoll    the consumer in mq_consumer.c: one thread drains all of the
+            queues (via epoll) into a buffer pool, and worker threads
+            handle the messages in priority order
+
+   Usage: mq_consumer_bench [-q nqueues] [-w nworkers] [-n msgs]
+                            [-s msgsize,...] [-d depth,...]
+
+   For each message size (mq_msgsize; default: 64,512,4096,8192) and queue
+   depth (mq_maxmsg; default: 10,64,256), the program creates 'nqueues'
+   queues (default: 2), and for each queue, a producer process that sends
+   'msgs' messages (default: 100000) with priorities 0 to 7. The output is
+   the number of messages consumed per second.
+
+   Queue sizes beyond /proc/sys/fs/mqueue/msg_max and msgsize_max, and
+   beyond the RLIMIT_MSGQUEUE resource limit, need privilege; the program
+   tries to raise RLIMIT_MSGQUEUE, and shows "-" for queues that it can't
+   create.
+*/
+#define _GNU_SOURCE
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include "mq_consumer.h"
+#include "tlpi_hdr.h"
+
+#define NUM_PRIOS 8
+
+static long totalMsgs;          /* Messages expected by the consumer */
+static long handled;            /* Messages handled so far */
+static volatile unsigned long checksum;
+static pthread_mutex_t doneMtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t doneCond = PTHREAD_COND_INITIALIZER;
+
+static mqd_t mqds[MQC_MAX_QUEUES];
+static int activeThreads;       /* Running notification functions */
+
+static double
+timeNow(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        errExit("clock_gettime");
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Called for each message, by either consumer */
+
+static void
+handleMsg(int queue, const char *msg, size_t len, unsigned int prio,
+          void *arg)
+{
+    int s;
+
+    checksum += (unsigned char) msg[0] + (unsigned char) msg[len - 1];
+
+    if (__atomic_add_fetch(&handled, 1, __ATOMIC_RELAXED) == totalMsgs) {
+        s = pthread_mutex_lock(&doneMtx);
+        if (s != 0)
+            errExitEN(s, "pthread_mutex_lock");
+        s = pthread_cond_signal(&doneCond);
+        if (s != 0)
+            errExitEN(s, "pthread_cond_signal");
+        s = pthread_mutex_unlock(&doneMtx);
+        if (s != 0)
+            errExitEN(s, "pthread_mutex_unlock");
+    }
+}
+
+static void
+waitForAll(void)
+{
+    int s;
+
+    s = pthread_mutex_lock(&doneMtx);
+    if (s != 0)
+        errExitEN(s, "pthread_mutex_lock");
+    while (__atomic_load_n(&handled, __ATOMIC_RELAXED) < totalMsgs) {
+        s = pthread_cond_wait(&doneCond, &doneMtx);
+        if (s != 0)
+            errExitEN(s, "pthread_cond_wait");
+    }
+    s = pthread_mutex_unlock(&doneMtx);
+    if (s != 0)
+        errExitEN(s, "pthread_mutex_unlock");
+}
+
+/* ---------------------------------------------------------------- */
+/* The "notify" consumer, as in mq_notify_via_thread.c */
+
+static void notifySetup(mqd_t *mqdp);
+
+static void
+drainQueue(mqd_t *mqdp)
+{
+    ssize_t numRead;
+    unsigned int prio;
+    char *msg;
+    struct mq_attr attr;
+
+    if (mq_getattr(*mqdp, &attr) == -1)
+        errExit("mq_getattr");
+
+    msg = malloc(attr.mq_msgsize);
+    if (msg == NULL)
+        errExit("malloc");
+
+    while ((numRead = mq_receive(*mqdp, msg, attr.mq_msgsize, &prio)) >= 0)
+        handleMsg(mqdp - mqds, msg, numRead, prio, NULL);
+
+    if (errno != EAGAIN)
+        errExit("mq_receive");
+
+    free(msg);
+}
+
+static void
+threadFunc(union sigval sv)
+{
+    __atomic_add_fetch(&activeThreads, 1, __ATOMIC_SEQ_CST);
+    notifySetup(sv.sival_ptr);
+    drainQueue(sv.sival_ptr);
+    __atomic_sub_fetch(&activeThreads, 1, __ATOMIC_SEQ_CST);
+}
+
+static void
+notifySetup(mqd_t *mqdp)
+{
+    struct sigevent sev;
+
+    sev.sigev_notify = SIGEV_THREAD;
+    sev.sigev_notify_function = threadFunc;
+    sev.sigev_notify_attributes = NULL;
+    sev.sigev_value.sival_ptr = mqdp;
+
+    if (mq_notify(*mqdp, &sev) == -1)
+        errExit("mq_notify");
+}
+
+/* ---------------------------------------------------------------- */
+
+/* Create a producer process that sends 'nmsgs' messages of 'size' bytes
+   on the queue 'name', after the read end of 'startPipe' reaches EOF */
+
+static void
+producer(const char *name, int startPipe[2], long nmsgs, long size)
+{
+    mqd_t mqd;
+    char *msg, ch;
+
+    switch (fork()) {
+    case -1:
+        errExit("fork");
+    case 0:
+        break;
+    default:
+        return;
+    }
+
+    close(startPipe[1]);
+
+    /* Open the queue separately: the consumer's descriptor (which we
+       inherit) refers to an open queue description that is in
+       nonblocking mode */
+
+    mqd = mq_open(name, O_WRONLY);
+    if (mqd == (mqd_t) -1)
+        errExit("mq_open");
+
+    msg = malloc(size);
+    if (msg == NULL)
+        errExit("malloc");
+    memset(msg, 'x', size);
+
+    if (read(startPipe[0], &ch, 1) == -1)
+        errExit("read");
+
+    for (long j = 0; j < nmsgs; j++)
+        if (mq_send(mqd, msg, size, j % NUM_PRIOS) == -1)
+            errExit("mq_send");
+
+    _exit(EXIT_SUCCESS);
+}
+
+/* Run one test; returns messages/sec, or -1 if the queues can't be
+   created */
+
+static double
+runTest(int useEpoll, int nqueues, int nworkers, long nmsgs, long size,
+        long depth)
+{
+    struct mqConsumer *c = NULL;
+    struct mq_attr attr;
+    char names[MQC_MAX_QUEUES][64];
+    int startPipe[2], status;
+    double start, elapsed;
+
+    attr.mq_flags = 0;
+    attr.mq_maxmsg = depth;
+    attr.mq_msgsize = size;
+
+    for (int q = 0; q < nqueues; q++) {
+        snprintf(names[q], sizeof(names[q]), "/mq_consumer_bench.%ld.%d",
+                 (long) getpid(), q);
+        mqds[q] = mq_open(names[q],
+                          O_RDONLY | O_CREAT | O_EXCL | O_NONBLOCK,
+                          S_IRUSR | S_IWUSR, &attr);
+        if (mqds[q] == (mqd_t) -1) {
+            if (errno != EINVAL && errno != EMFILE && errno != ENOMEM)
+                errExit("mq_open");
+            for (int j = 0; j < q; j++) {
+                mq_close(mqds[j]);
+                mq_unlink(names[j]);
+            }
+            return -1;
+        }
+    }
+
+    totalMsgs = nqueues * nmsgs;
+    handled = 0;
+
+    if (useEpoll) {
+        c = mqcCreate(nworkers, 4 * depth + 64, handleMsg,
+                      NULL);
+        if (c == NULL)
+            errExit("mqcCreate");
+        for (int q = 0; q < nqueues; q++)
+            if (mqcAddQueue(c, mqds[q]) == -1)
+                errExit("mqcAddQueue");
+        if (mqcStart(c) == -1)
+            errExit("mqcStart");
+    } else {
+        for (int q = 0; q < nqueues; q++)
+            notifySetup(&mqds[q]);
+    }
+
+    if (pipe(startPipe) == -1)
+        errExit("pipe");
+    for (int q = 0; q < nqueues; q++)
+        producer(names[q], startPipe, nmsgs, size);
+    close(startPipe[0]);
+
+    start = timeNow();
+    close(startPipe[1]);
+    waitForAll();
+    elapsed = timeNow() - start;
+
+    while (wait(&status) != -1)
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            fatal("producer failed");
+
+    if (useEpoll) {
+        mqcDestroy(c);
+    } else {
+
+        /* Remove the notifications, and let any notification function
+           that is still draining a queue finish before we close it */
+
+        for (int q = 0; q < nqueues; q++)
+            if (mq_notify(mqds[q], NULL) == -1)
+                errExit("mq_notify");
+        usleep(10000);
+        while (__atomic_load_n(&activeThreads, __ATOMIC_SEQ_CST) > 0)
+            usleep(1000);
+    }
+
+    for (int q = 0; q < nqueues; q++) {
+        mq_close(mqds[q]);
+        mq_unlink(names[q]);
+    }
+
+    return totalMsgs / elapsed;
+}
+
+static int
+parseList(char *list, long *vals, int max, const char *name)
+{
+    int n = 0;
+
+    for (char *tok = strtok(list, ","); tok != NULL && n < max;
+            tok = strtok(NULL, ","))
+        vals[n++] = getLong(tok, GN_GT_0, name);
+    return n;
+}
+
+static void
+usageError(const char *progName)
+{
+    fprintf(stderr, "Usage: %s [-q nqueues] [-w nworkers] [-n msgs]\n"
+            "        [-s msgsize,...] [-d depth,...]\n", progName);
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+    char defaultSizes[] = "64,512,4096,8192";
+    char defaultDepths[] = "10,64,256";
+    char *sizeList, *depthList;
+    long sizes[16], depths[16], nmsgs;
+    int nsizes, ndepths, nqueues, nworkers, opt;
+    double rate[2];
+    struct rlimit rl;
+
+    nqueues = 2;
+    nworkers = 2;
+    nmsgs = 100000;
+    sizeList = defaultSizes;
+    depthList = defaultDepths;
+
+    while ((opt = getopt(argc, argv, "q:w:n:s:d:")) != -1) {
+        switch (opt) {
+        case 'q':
+            nqueues = getInt(optarg, GN_GT_0, "nqueues");
+            if (nqueues > MQC_MAX_QUEUES)
+                cmdLineErr("At most %d queues\n", MQC_MAX_QUEUES);
+            break;
+        case 'w':
+            nworkers = getInt(optarg, GN_GT_0, "nworkers");
+            break;
+        case 'n':
+            nmsgs = getLong(optarg, GN_GT_0, "msgs");
+            break;
+        case 's':
+            sizeList = optarg;
+            break;
+        case 'd':
+            depthList = optarg;
+            break;
+        default:
+            usageError(argv[0]);
+        }
+    }
+
+    nsizes = parseList(sizeList, sizes, 16, "msgsize");
+    ndepths = parseList(depthList, depths, 16, "depth");
+
+    /* Try to lift the limit on the memory used by our queues */
+
+    rl.rlim_cur = rl.rlim_max = RLIM_INFINITY;
+    if (setrlimit(RLIMIT_MSGQUEUE, &rl) == -1 &&
+            getrlimit(RLIMIT_MSGQUEUE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_MSGQUEUE, &rl);
+    }
+
+    printf("%d queues, %d workers, %ld messages per queue\n\n",
+           nqueues, nworkers, nmsgs);
+    printf("%8s %6s %12s %12s %8s\n", "msgsize", "depth", "notify/s",
+           "epoll/s", "ratio");
+
+    for (int s = 0; s < nsizes; s++) {
+        for (int d = 0; d < ndepths; d++) {
+            for (int m = 0; m < 2; m++)
+                rate[m] = runTest(m, nqueues, nworkers, nmsgs, sizes[s],
+                                  depths[d]);
+
+            if (rate[0] < 0 || rate[1] < 0) {
+                printf("%8ld %6ld %12s %12s %8s\n", sizes[s], depths[d],
+                       "-", "-", "-");
+                continue;
+            }
+            printf("%8ld %6ld %12.0f %12.0f %8.2f\n", sizes[s], depths[d],
+                   rate[0], rate[1], rate[1] / rate[0]);
+        }
+    }
+
+    exit(EXIT_SUCCESS);
+}
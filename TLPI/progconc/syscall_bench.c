@@ -0,0 +1,750 @@
+/*************************************************************************\
+*                  Copyright (C) Michael Kerrisk, 2020.                   *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU General Public License as published by the   *
+* Free Software Foundation, either version 3 or (at your option) any      *
+* later version. This program is distributed without any warranty.  See   *
+* the file COPYING.gpl-v3 for details.                                    *
+\*************************************************************************/
+
+/* Supplementary program for Chapter 3 */
+
+/* syscall_bench.c
+
+   Measure the cost of system calls and related operations. This does the
+   job of syscall_speed.c, vdso/gettimeofday.c, sig_speed_sigsuspend.c,
+   and seccomp/seccomp_perf.c, but without the need for time(1) or for
+   building several variants of a program with -D.
+
+   Usage: syscall_bench [-l] [-f table|csv|json] [-t msecs] [-w msecs]
+                        [-c] [case...]
+
+   Each of the named cases (default: all; "-l" lists them) is run in a
+   child process of its own, so that one case's setup (e.g., a seccomp
+   filter) doesn't affect the others. The case is first run for 'msecs'
+   of warm-up ("-w", default: 100), which also estimates the cost of one
+   iteration; it is then timed for 'msecs' ("-t", default: 500).
+
+   Timing is done with the CPU's timestamp counter (TSC) on x86, or with
+   clock_gettime(CLOCK_MONOTONIC) elsewhere, or if "-c" is given. The
+   timer's own overhead is subtracted. Cheap operations are timed in
+   batches of iterations, with a batch taking about 1 microsecond; each
+   batch then contributes its mean time per iteration to a histogram, from
+   which percentiles are reported. Expensive operations are timed one at
+   a time.
+
+   The results (in nanoseconds per iteration) are printed as a table, as
+   CSV, or as JSON; the CSV and JSON forms include the host name and kernel
+   release, so that results from different systems can be compared.
+*/
+#define _GNU_SOURCE
+#include <sys/syscall.h>
+#include <sys/prctl.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <linux/futex.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <linux/audit.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sched.h>
+#include <time.h>
+#include "tlpi_hdr.h"
+
+#define TARGET_BATCH_NS 1000    /* Aim for timed batches of this length */
+#define MAX_BATCH 10000
+
+/* Per-iteration times are recorded in picoseconds, in a histogram that
+   has HIST_SUB buckets for each power of two (about 6% resolution) */
+
+#define HIST_SUB 16
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+struct benchCase {
+    const char *name;
+    const char *desc;
+    int (*setup)(void);         /* Returns -1 if the case can't be run */
+    void (*op)(void);           /* One iteration */
+    void (*teardown)(void);
+};
+
+struct benchResult {            /* Sent from child to parent */
+    int ok;
+    long long iterations;
+    int batch;
+    double meanNs, minNs, p50Ns, p90Ns, p99Ns, p999Ns, maxNs;
+};
+
+static int useTsc;
+static double nsPerTick;
+
+/* ---------------------------------------------------------------- */
+/* Timer */
+
+static inline uint64_t
+ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (useTsc)
+        return __builtin_ia32_rdtsc();
+#endif
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t
+monoNs(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        errExit("clock_gettime");
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Find the length of a tick, by comparing the TSC with the monotonic
+   clock over 50 ms */
+
+static void
+calibrateTimer(void)
+{
+    uint64_t t0, t1, n0, n1;
+    struct timespec pause = { 0, 50000000 };
+
+    if (!useTsc) {
+        nsPerTick = 1;
+        return;
+    }
+
+    n0 = monoNs();
+    t0 = ticks();
+    nanosleep(&pause, NULL);
+    n1 = monoNs();
+    t1 = ticks();
+
+    nsPerTick = (double) (n1 - n0) / (t1 - t0);
+}
+
+/* ---------------------------------------------------------------- */
+/* The cases */
+
+static void __attribute__((noinline))
+emptyFunc(void)
+{
+    __asm__ __volatile__("" ::: "memory");
+}
+
+static void
+opGetppid(void)
+{
+    getppid();
+}
+
+static void
+opSyscallGetppid(void)
+{
+    syscall(SYS_getppid);
+}
+
+static void
+opGettimeofday(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+}
+
+static void
+opSyscallGettimeofday(void)
+{
+    struct timeval tv;
+
+    syscall(SYS_gettimeofday, &tv, NULL);
+}
+
+static void
+opClockMono(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+}
+
+static void
+opClockCoarse(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+}
+
+static void
+opSyscallClock(void)
+{
+    struct timespec ts;
+
+    syscall(SYS_clock_gettime, CLOCK_MONOTONIC, &ts);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static void
+opRdtsc(void)
+{
+    volatile uint64_t t = __builtin_ia32_rdtsc();
+    (void) t;
+}
+#endif
+
+static void
+opSchedYield(void)
+{
+    sched_yield();
+}
+
+/* futex_wake: FUTEX_WAKE when there are no waiters; futex_roundtrip:
+   wake a peer thread, and wait for it to wake us in turn */
+
+static int futexWord;
+static pthread_t futexPeer;
+
+static long
+futex(int *uaddr, int op, int val)
+{
+    return syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0);
+}
+
+static void
+opFutexWake(void)
+{
+    futex(&futexWord, FUTEX_WAKE_PRIVATE, 1);
+}
+
+static void *
+futexPeerFunc(void *arg)
+{
+    for (;;) {
+        while (__atomic_load_n(&futexWord, __ATOMIC_ACQUIRE) == 0)
+            futex(&futexWord, FUTEX_WAIT_PRIVATE, 0);
+        if (futexWord == 2)                     /* Told to stop */
+            return NULL;
+
+        __atomic_store_n(&futexWord, 0, __ATOMIC_RELEASE);
+        futex(&futexWord, FUTEX_WAKE_PRIVATE, 1);
+    }
+}
+
+static int
+setupFutexRoundtrip(void)
+{
+    int s;
+
+    futexWord = 0;
+    s = pthread_create(&futexPeer, NULL, futexPeerFunc, NULL);
+    if (s != 0)
+        errExitEN(s, "pthread_create");
+    return 0;
+}
+
+static void
+opFutexRoundtrip(void)
+{
+    __atomic_store_n(&futexWord, 1, __ATOMIC_RELEASE);
+    futex(&futexWord, FUTEX_WAKE_PRIVATE, 1);
+    while (__atomic_load_n(&futexWord, __ATOMIC_ACQUIRE) == 1)
+        futex(&futexWord, FUTEX_WAIT_PRIVATE, 1);
+}
+
+static void
+teardownFutexRoundtrip(void)
+{
+    __atomic_store_n(&futexWord, 2, __ATOMIC_RELEASE);
+    futex(&futexWord, FUTEX_WAKE_PRIVATE, 1);
+    pthread_join(futexPeer, NULL);
+}
+
+/* signal_self: send a signal to ourself, and catch it; signal_roundtrip:
+   send a signal to a peer process, and wait for its reply, as in
+   sig_speed_sigsuspend.c */
+
+static pid_t sigPeer;
+static sigset_t emptyMask;
+
+static void
+handler(int sig)
+{
+}
+
+static int
+setupSignalSelf(void)
+{
+    struct sigaction sa;
+
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    sa.sa_handler = handler;
+    if (sigaction(SIGUSR1, &sa, NULL) == -1)
+        errExit("sigaction");
+    return 0;
+}
+
+static void
+opSignalSelf(void)
+{
+    kill(getpid(), SIGUSR1);
+}
+
+static int
+setupSignalRoundtrip(void)
+{
+    sigset_t blockMask;
+
+    setupSignalSelf();
+
+    /* Block the signal except while in sigsuspend(), so that a signal
+       that arrives early isn't lost */
+
+    sigemptyset(&emptyMask);
+    sigemptyset(&blockMask);
+    sigaddset(&blockMask, SIGUSR1);
+    if (sigprocmask(SIG_BLOCK, &blockMask, NULL) == -1)
+        errExit("sigprocmask");
+
+    sigPeer = fork();
+    if (sigPeer == -1)
+        errExit("fork");
+
+    if (sigPeer == 0) {                         /* Peer echoes signals */
+        for (;;) {
+            if (sigsuspend(&emptyMask) == -1 && errno != EINTR)
+                errExit("sigsuspend");
+            if (kill(getppid(), SIGUSR1) == -1)
+                _exit(EXIT_SUCCESS);
+        }
+    }
+
+    return 0;
+}
+
+static void
+opSignalRoundtrip(void)
+{
+    if (kill(sigPeer, SIGUSR1) == -1)
+        errExit("kill");
+    if (sigsuspend(&emptyMask) == -1 && errno != EINTR)
+        errExit("sigsuspend");
+}
+
+static void
+teardownSignalRoundtrip(void)
+{
+    kill(sigPeer, SIGKILL);
+    waitpid(sigPeer, NULL, 0);
+}
+
+/* seccomp_getppid: getppid() with a seccomp filter like the one in
+   seccomp/seccomp_perf.c installed */
+
+#if defined(__x86_64__)
+#define BENCH_AUDIT_ARCH AUDIT_ARCH_X86_64
+#elif defined(__i386__)
+#define BENCH_AUDIT_ARCH AUDIT_ARCH_I386
+#elif defined(__aarch64__)
+#define BENCH_AUDIT_ARCH AUDIT_ARCH_AARCH64
+#endif
+
+#ifdef BENCH_AUDIT_ARCH
+static int
+setupSeccomp(void)
+{
+    struct sock_filter filter[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                 (offsetof(struct seccomp_data, arch))),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, BENCH_AUDIT_ARCH, 1, 0),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_KILL_PROCESS),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                 (offsetof(struct seccomp_data, nr))),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_openat, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ERRNO | EPERM),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW)
+    };
+    struct sock_fprog prog = {
+        .len = (unsigned short) (sizeof(filter) / sizeof(filter[0])),
+        .filter = filter,
+    };
+
+    if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) == -1)
+        return -1;
+    if (syscall(SYS_seccomp, SECCOMP_SET_MODE_FILTER, 0, &prog) == -1)
+        return -1;
+    return 0;
+}
+#endif
+
+static const struct benchCase cases[] = {
+    { "func",                 "call of an empty function (baseline)",
+      NULL, emptyFunc, NULL },
+    { "getppid",              "getppid()",
+      NULL, opGetppid, NULL },
+    { "syscall_getppid",      "syscall(SYS_getppid)",
+      NULL, opSyscallGetppid, NULL },
+    { "gettimeofday",         "gettimeofday() (vDSO)",
+      NULL, opGettimeofday, NULL },
+    { "gettimeofday_syscall", "syscall(SYS_gettimeofday)",
+      NULL, opSyscallGettimeofday, NULL },
+    { "clock_mono",           "clock_gettime(CLOCK_MONOTONIC) (vDSO)",
+      NULL, opClockMono, NULL },
+    { "clock_coarse",         "clock_gettime(CLOCK_MONOTONIC_COARSE)",
+      NULL, opClockCoarse, NULL },
+    { "clock_syscall",        "syscall(SYS_clock_gettime)",
+      NULL, opSyscallClock, NULL },
+#if defined(__x86_64__) || defined(__i386__)
+    { "rdtsc",                "read the timestamp counter",
+      NULL, opRdtsc, NULL },
+#endif
+    { "sched_yield",          "sched_yield()",
+      NULL, opSchedYield, NULL },
+    { "futex_wake",           "FUTEX_WAKE with no waiters",
+      NULL, opFutexWake, NULL },
+    { "futex_roundtrip",      "wake a thread by futex, and be woken",
+      setupFutexRoundtrip, opFutexRoundtrip, teardownFutexRoundtrip },
+    { "signal_self",          "kill() to self, and catch the signal",
+      setupSignalSelf, opSignalSelf, NULL },
+    { "signal_roundtrip",     "signal to another process, and back",
+      setupSignalRoundtrip, opSignalRoundtrip, teardownSignalRoundtrip },
+#ifdef BENCH_AUDIT_ARCH
+    { "seccomp_getppid",      "getppid() under a seccomp filter",
+      setupSeccomp, opGetppid, NULL },
+#endif
+};
+
+#define NUM_CASES ((int) (sizeof(cases) / sizeof(cases[0])))
+
+/* ---------------------------------------------------------------- */
+/* Measurement */
+
+static int
+histIndex(uint64_t v)
+{
+    int e;
+
+    if (v < HIST_SUB)
+        return v;
+    e = 63 - __builtin_clzll(v);                /* e >= 4 */
+    return (e - 3) * HIST_SUB + ((v >> (e - 4)) & (HIST_SUB - 1));
+}
+
+static uint64_t                 /* Smallest value counted in bucket 'idx' */
+histValue(int idx)
+{
+    if (idx < HIST_SUB)
+        return idx;
+    return (uint64_t) (HIST_SUB + idx % HIST_SUB) << (idx / HIST_SUB - 1);
+}
+
+static double                   /* Returns nanoseconds */
+histPercentile(const unsigned long *hist, unsigned long total, double pct)
+{
+    unsigned long want, sum;
+
+    want = total * pct / 100;
+    sum = 0;
+    for (int j = 0; j < HIST_BUCKETS; j++) {
+        sum += hist[j];
+        if (sum > want)
+            return histValue(j) / 1000.0;
+    }
+    return 0;
+}
+
+/* Return the timer overhead: the median of many back-to-back readings */
+
+static double
+timerOverhead(void)
+{
+    unsigned long hist[HIST_BUCKETS];
+    uint64_t t0, t1;
+
+    memset(hist, 0, sizeof(hist));
+    for (int j = 0; j < 100000; j++) {
+        t0 = ticks();
+        t1 = ticks();
+        hist[histIndex(t1 - t0)]++;
+    }
+
+    for (int j = 0, sum = 0; j < HIST_BUCKETS; j++) {
+        sum += hist[j];
+        if (sum > 50000)
+            return histValue(j);
+    }
+    return 0;
+}
+
+static void
+runCase(const struct benchCase *bc, int warmMs, int runMs,
+        struct benchResult *res)
+{
+    static unsigned long hist[HIST_BUCKETS];
+    uint64_t start, end, t0, t1, limit;
+    double overhead, estNs, ps, sumPs, minPs, maxPs;
+    long long n;
+    unsigned long batches;
+    int batch;
+
+    memset(res, 0, sizeof(*res));
+    memset(hist, 0, sizeof(hist));
+
+    if (bc->setup != NULL && bc->setup() == -1)
+        return;
+
+    /* Warm up, and estimate the cost of an iteration */
+
+    limit = warmMs * 1e6 / nsPerTick;
+    start = ticks();
+    n = 0;
+    do {
+        for (int j = 0; j < 100; j++)
+            bc->op();
+        n += 100;
+        end = ticks();
+    } while (end - start < limit);
+
+    estNs = (end - start) * nsPerTick / n;
+    batch = (estNs >= TARGET_BATCH_NS) ? 1 : TARGET_BATCH_NS / estNs;
+    if (batch > MAX_BATCH)
+        batch = MAX_BATCH;
+
+    overhead = timerOverhead();
+
+    /* Timed run */
+
+    limit = runMs * 1e6 / nsPerTick;
+    sumPs = 0;
+    minPs = 1e30;
+    maxPs = 0;
+    batches = 0;
+    start = ticks();
+    do {
+        t0 = ticks();
+        for (int j = 0; j < batch; j++)
+            bc->op();
+        t1 = ticks();
+
+        ps = ((double) (t1 - t0) - overhead) * nsPerTick * 1000 / batch;
+        if (ps < 0)
+            ps = 0;
+        hist[histIndex((uint64_t) ps)]++;
+        sumPs += ps;
+        if (ps < minPs)
+            minPs = ps;
+        if (ps > maxPs)
+            maxPs = ps;
+        batches++;
+    } while (t1 - start < limit);
+
+    if (bc->teardown != NULL)
+        bc->teardown();
+
+    res->ok = 1;
+    res->iterations = (long long) batches * batch;
+    res->batch = batch;
+    res->meanNs = sumPs / batches / 1000;
+    res->minNs = minPs / 1000;
+    res->p50Ns = histPercentile(hist, batches, 50);
+    res->p90Ns = histPercentile(hist, batches, 90);
+    res->p99Ns = histPercentile(hist, batches, 99);
+    res->p999Ns = histPercentile(hist, batches, 99.9);
+    res->maxNs = maxPs / 1000;
+}
+
+/* Run case 'bc' in a child process, and return its results */
+
+static void
+runInChild(const struct benchCase *bc, int warmMs, int runMs,
+           struct benchResult *res)
+{
+    int pfd[2], status;
+    ssize_t n;
+    pid_t pid;
+
+    if (pipe(pfd) == -1)
+        errExit("pipe");
+
+    pid = fork();
+    if (pid == -1)
+        errExit("fork");
+
+    if (pid == 0) {
+        close(pfd[0]);
+        runCase(bc, warmMs, runMs, res);
+        if (write(pfd[1], res, sizeof(*res)) != sizeof(*res))
+            _exit(EXIT_FAILURE);
+        _exit(EXIT_SUCCESS);
+    }
+
+    close(pfd[1]);
+    n = read(pfd[0], res, sizeof(*res));
+    if (n != sizeof(*res))
+        res->ok = 0;
+    close(pfd[0]);
+
+    if (waitpid(pid, &status, 0) == -1)
+        errExit("waitpid");
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        res->ok = 0;
+}
+
+/* ---------------------------------------------------------------- */
+/* Output */
+
+enum format { FMT_TABLE, FMT_CSV, FMT_JSON };
+
+static void
+printResult(enum format fmt, const struct utsname *uts,
+            const struct benchCase *bc, const struct benchResult *r,
+            int first)
+{
+    switch (fmt) {
+    case FMT_TABLE:
+        if (!r->ok) {
+            printf("%-22s unavailable\n", bc->name);
+            break;
+        }
+        printf("%-22s %11lld %6d %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+               bc->name, r->iterations, r->batch, r->meanNs, r->minNs,
+               r->p50Ns, r->p99Ns, r->p999Ns, r->maxNs);
+        break;
+
+    case FMT_CSV:
+        if (!r->ok)
+            break;
+        printf("%s,%s,%s,%s,%lld,%d,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f\n",
+               uts->nodename, uts->release, useTsc ? "tsc" : "clock",
+               bc->name, r->iterations, r->batch, r->meanNs, r->minNs,
+               r->p50Ns, r->p90Ns, r->p99Ns, r->p999Ns, r->maxNs);
+        break;
+
+    case FMT_JSON:
+        if (!r->ok)
+            break;
+        printf("%s    {\"case\": \"%s\", \"iterations\": %lld, "
+               "\"batch\": %d, \"mean_ns\": %.2f, \"min_ns\": %.2f, "
+               "\"p50_ns\": %.2f, \"p90_ns\": %.2f, \"p99_ns\": %.2f, "
+               "\"p999_ns\": %.2f, \"max_ns\": %.2f}",
+               first ? "" : ",\n", bc->name, r->iterations, r->batch,
+               r->meanNs, r->minNs, r->p50Ns, r->p90Ns, r->p99Ns,
+               r->p999Ns, r->maxNs);
+        break;
+    }
+    fflush(stdout);
+}
+
+static void
+usageError(const char *progName)
+{
+    fprintf(stderr, "Usage: %s [-l] [-f table|csv|json] [-t msecs] "
+                    "[-w msecs] [-c] [case...]\n", progName);
+    fprintf(stderr, "    -l        List the cases\n");
+    fprintf(stderr, "    -f fmt    Output format (default: table)\n");
+    fprintf(stderr, "    -t msecs  Timed run per case (default: 500)\n");
+    fprintf(stderr, "    -w msecs  Warm-up per case (default: 100)\n");
+    fprintf(stderr, "    -c        Time with clock_gettime(), not the TSC\n");
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct benchResult res;
+    struct utsname uts;
+    enum format fmt;
+    int opt, warmMs, runMs, first, c, j;
+
+    fmt = FMT_TABLE;
+    warmMs = 100;
+    runMs = 500;
+#if defined(__x86_64__) || defined(__i386__)
+    useTsc = 1;
+#endif
+
+    while ((opt = getopt(argc, argv, "lf:t:w:c")) != -1) {
+        switch (opt) {
+        case 'l':
+            for (j = 0; j < NUM_CASES; j++)
+                printf("%-22s %s\n", cases[j].name, cases[j].desc);
+            exit(EXIT_SUCCESS);
+        case 'f':
+            if (strcmp(optarg, "table") == 0)
+                fmt = FMT_TABLE;
+            else if (strcmp(optarg, "csv") == 0)
+                fmt = FMT_CSV;
+            else if (strcmp(optarg, "json") == 0)
+                fmt = FMT_JSON;
+            else
+                usageError(argv[0]);
+            break;
+        case 't': runMs = getInt(optarg, GN_GT_0, "msecs");     break;
+        case 'w': warmMs = getInt(optarg, GN_GT_0, "msecs");    break;
+        case 'c': useTsc = 0;                                   break;
+        default:  usageError(argv[0]);
+        }
+    }
+
+    for (j = optind; j < argc; j++) {
+        for (c = 0; c < NUM_CASES; c++)
+            if (strcmp(argv[j], cases[c].name) == 0)
+                break;
+        if (c == NUM_CASES)
+            cmdLineErr("Unknown case: %s (use -l to list cases)\n", argv[j]);
+    }
+
+    if (uname(&uts) == -1)
+        errExit("uname");
+
+    calibrateTimer();
+
+    switch (fmt) {
+    case FMT_TABLE:
+        printf("%s %s, timer: %s (all times in ns)\n\n", uts.nodename,
+               uts.release, useTsc ? "TSC" : "clock_gettime");
+        printf("%-22s %11s %6s %9s %9s %9s %9s %9s %9s\n", "Case",
+               "Iterations", "Batch", "Mean", "Min", "p50", "p99", "p99.9",
+               "Max");
+        break;
+    case FMT_CSV:
+        printf("host,kernel,timer,case,iterations,batch,mean_ns,min_ns,"
+               "p50_ns,p90_ns,p99_ns,p999_ns,max_ns\n");
+        break;
+    case FMT_JSON:
+        printf("{\n  \"host\": \"%s\",\n  \"kernel\": \"%s\",\n"
+               "  \"timer\": \"%s\",\n  \"cases\": [\n", uts.nodename,
+               uts.release, useTsc ? "tsc" : "clock");
+        break;
+    }
+
+    first = 1;
+    for (c = 0; c < NUM_CASES; c++) {
+        int wanted = (optind == argc);
+
+        for (j = optind; j < argc && !wanted; j++)
+            wanted = strcmp(argv[j], cases[c].name) == 0;
+        if (!wanted)
+            continue;
+
+        runInChild(&cases[c], warmMs, runMs, &res);
+        printResult(fmt, &uts, &cases[c], &res, first);
+        if (res.ok)
+            first = 0;
+    }
+
+    if (fmt == FMT_JSON)
+        printf("\n  ]\n}\n");
+
+    exit(EXIT_SUCCESS);
+}
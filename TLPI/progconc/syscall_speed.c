@@ -21,6 +21,8 @@
    Compiling with -DNOSYSCALL causes a call to a simple function
    returning an integer, which can be used to compare the overhead
    of a simple function call against that of a system call.
+
+   See also syscall_bench.c, which times this and other operations itself.
 */
 #include "tlpi_hdr.h"
 
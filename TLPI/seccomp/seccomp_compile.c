@@ -0,0 +1,487 @@
+/*************************************************************************\
+*                  Copyright (C) Michael Kerrisk, 2020.                   *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU Lesser General Public License as published   *
+* by the Free Software Foundation, either version 3 or (at your option)   *
+* any later version. This program is distributed without any warranty.    *
+* See the files COPYING.lgpl-v3 and COPYING.gpl-v3 for details.           *
+\*************************************************************************/
+
+/* Supplementary program for Chapter Z */
+
+/* seccomp_compile.c
+
+   A small compiler that turns a system call policy (see seccomp_compile.h)
+   into a seccomp BPF program.
+
+   The other programs in this directory build their filters by hand as a
+   linear chain of BPF_JEQ tests, one per system call. The cost of such a
+   filter grows with the length of the chain, and every system call that
+   isn't in the chain (typically, the most frequent case) runs the whole
+   chain. sfcCompile() can produce that linear form (SFC_LINEAR), but can
+   also produce:
+
+   SFC_TREE: the rules are turned into a sorted list of segments (ranges
+        of system call numbers, where adjacent numbers that get the same
+        action are merged), and the filter does a binary search of that
+        list using BPF_JGE tests, down to groups of LEAF_SEGMENTS segments,
+        which are tested in turn. The cost is then about
+        log2(segments / LEAF_SEGMENTS) + LEAF_SEGMENTS tests, rather than
+        one test per rule.
+
+   SFC_TREE_HOT: as SFC_TREE, but preceded by direct BPF_JEQ tests for
+        the SFC_HOT_MAX rules with the largest (nonzero) 'weight', so that
+        the most frequent calls are decided in one or two tests.
+
+   Rules may carry a check of one 64-bit argument. Because the BPF
+   accumulator is only 32 bits wide, the check is done on the two halves
+   of the argument separately (as in seccomp_arg64.c).
+
+   Classic BPF conditional jumps can only skip 255 instructions; where the
+   compiler needs a longer jump, it inserts a BPF_JA (which has a 32-bit
+   offset).
+
+   sfcRun() interprets a program produced by sfcCompile() against a
+   'seccomp_data' structure, so that the forms can be checked against each
+   other without installing them.
+*/
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "seccomp_compile.h"
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define ARG_LO(i)   (offsetof(struct seccomp_data, args[i]))
+#define ARG_HI(i)   (offsetof(struct seccomp_data, args[i]) + sizeof(__u32))
+#else
+#define ARG_LO(i)   (offsetof(struct seccomp_data, args[i]) + sizeof(__u32))
+#define ARG_HI(i)   (offsetof(struct seccomp_data, args[i]))
+#endif
+
+#ifndef SECCOMP_RET_KILL_THREAD
+#define SECCOMP_RET_KILL_THREAD SECCOMP_RET_KILL
+#endif
+
+struct code {                   /* A growable sequence of instructions */
+    struct sock_filter *insns;
+    int len;
+    int cap;
+    int err;                    /* Nonzero if an allocation failed, or the
+                                   program became too long */
+};
+
+struct segment {                /* System calls numbered 'lo' to 'hi'... */
+    __u32 lo;
+    __u32 hi;
+    const struct sfcRule *rule; /* ...are decided by this rule, or... */
+    __u32 action;               /* ...if 'rule' is NULL, get this action */
+};
+
+#define LEAF_SEGMENTS 4         /* Segments tested in turn at each leaf of
+                                   the binary search */
+
+static void
+emit(struct code *c, __u16 code, __u32 k, __u8 jt, __u8 jf)
+{
+    struct sock_filter *n;
+
+    if (c->err)
+        return;
+
+    if (c->len >= BPF_MAXINSNS) {
+        c->err = E2BIG;
+        return;
+    }
+
+    if (c->len == c->cap) {
+        c->cap = (c->cap == 0) ? 64 : c->cap * 2;
+        n = realloc(c->insns, c->cap * sizeof(struct sock_filter));
+        if (n == NULL) {
+            c->err = ENOMEM;
+            return;
+        }
+        c->insns = n;
+    }
+
+    c->insns[c->len].code = code;
+    c->insns[c->len].k = k;
+    c->insns[c->len].jt = jt;
+    c->insns[c->len].jf = jf;
+    c->len++;
+}
+
+static void
+append(struct code *c, struct code *tail)
+{
+    if (tail->err && !c->err)
+        c->err = tail->err;
+
+    for (int j = 0; j < tail->len; j++)
+        emit(c, tail->insns[j].code, tail->insns[j].k,
+             tail->insns[j].jt, tail->insns[j].jf);
+
+    free(tail->insns);
+    memset(tail, 0, sizeof(*tail));
+}
+
+/* Emit a test of the accumulator against 'k' that skips the following 'n'
+   instructions if the result of the test equals 'skipIf' (and otherwise
+   continues with the next instruction) */
+
+static void
+emitSkip(struct code *c, __u16 test, __u32 k, int skipIf, int n)
+{
+    if (n <= 255) {
+        if (skipIf)
+            emit(c, BPF_JMP | test | BPF_K, k, n, 0);
+        else
+            emit(c, BPF_JMP | test | BPF_K, k, 0, n);
+    } else {
+        if (skipIf)
+            emit(c, BPF_JMP | test | BPF_K, k, 0, 1);
+        else
+            emit(c, BPF_JMP | test | BPF_K, k, 1, 0);
+        emit(c, BPF_JMP | BPF_JA, n, 0, 0);
+    }
+}
+
+static void
+emitLoad(struct code *c, __u32 offset)
+{
+    emit(c, BPF_LD | BPF_W | BPF_ABS, offset, 0, 0);
+}
+
+/* Emit the instructions that decide a call that has matched 'rule'. Every
+   path through them ends with a BPF_RET. */
+
+static void
+emitRule(struct code *c, const struct sfcRule *rule)
+{
+    __u32 hi = rule->argVal >> 32, lo = rule->argVal & 0xffffffff;
+    __u32 match = rule->action, fail = rule->argFailAction;
+    int i = rule->argIdx;
+
+    switch (rule->argOp) {
+    case SFC_ARG_NONE:
+        emit(c, BPF_RET | BPF_K, rule->action, 0, 0);
+        return;
+
+    case SFC_ARG_NE:
+        match = rule->argFailAction;
+        fail = rule->action;
+        /* FALLTHROUGH */
+    case SFC_ARG_EQ:
+        emitLoad(c, ARG_HI(i));
+        emit(c, BPF_JMP | BPF_JEQ | BPF_K, hi, 0, 3);
+        emitLoad(c, ARG_LO(i));
+        emit(c, BPF_JMP | BPF_JEQ | BPF_K, lo, 0, 1);
+        break;
+
+    case SFC_ARG_LE:
+        match = rule->argFailAction;
+        fail = rule->action;
+        /* FALLTHROUGH */
+    case SFC_ARG_GT:
+        emitLoad(c, ARG_HI(i));
+        emit(c, BPF_JMP | BPF_JGT | BPF_K, hi, 3, 0);
+        emit(c, BPF_JMP | BPF_JEQ | BPF_K, hi, 0, 3);
+        emitLoad(c, ARG_LO(i));
+        emit(c, BPF_JMP | BPF_JGT | BPF_K, lo, 0, 1);
+        break;
+    }
+
+    emit(c, BPF_RET | BPF_K, match, 0, 0);
+    emit(c, BPF_RET | BPF_K, fail, 0, 0);
+}
+
+/* Emit a direct test of the (loaded) system call number against 'rule' */
+
+static void
+emitRuleTest(struct code *c, const struct sfcRule *rule)
+{
+    struct code body = { 0 };
+
+    emitRule(&body, rule);
+    emitSkip(c, BPF_JEQ, rule->nr, 0, body.len);
+    append(c, &body);
+}
+
+/* Emit the tests for segments seg[a] to seg[b - 1], followed by a
+   return of 'defaultAction' for calls that match none of them */
+
+static void
+emitLeaf(struct code *c, const struct segment *seg, int a, int b,
+         __u32 defaultAction)
+{
+    struct code body;
+
+    for (int j = a; j < b; j++) {
+        memset(&body, 0, sizeof(body));
+        if (seg[j].rule != NULL)
+            emitRule(&body, seg[j].rule);
+        else
+            emit(&body, BPF_RET | BPF_K, seg[j].action, 0, 0);
+
+        if (seg[j].lo == seg[j].hi) {
+            emitSkip(c, BPF_JEQ, seg[j].lo, 0, body.len);
+        } else {
+            emitSkip(c, BPF_JGT, seg[j].hi, 1, body.len + 1);
+            emitSkip(c, BPF_JGE, seg[j].lo, 0, body.len);
+        }
+        append(c, &body);
+    }
+
+    emit(c, BPF_RET | BPF_K, defaultAction, 0, 0);
+}
+
+/* Emit a binary search of the segments seg[a] to seg[b - 1] */
+
+static void
+emitTree(struct code *c, const struct segment *seg, int a, int b,
+         __u32 defaultAction)
+{
+    struct code left = { 0 };
+    int mid;
+
+    if (b - a <= LEAF_SEGMENTS) {
+        emitLeaf(c, seg, a, b, defaultAction);
+        return;
+    }
+
+    mid = a + (b - a) / 2;
+    emitTree(&left, seg, a, mid, defaultAction);
+    emitSkip(c, BPF_JGE, seg[mid].lo, 1, left.len);
+    append(c, &left);
+    emitTree(c, seg, mid, b, defaultAction);
+}
+
+static int
+cmpRuleNr(const void *a, const void *b)
+{
+    const struct sfcRule *ra = *(const struct sfcRule **) a;
+    const struct sfcRule *rb = *(const struct sfcRule **) b;
+
+    return (ra->nr > rb->nr) - (ra->nr < rb->nr);
+}
+
+static int
+cmpRuleWeight(const void *a, const void *b)
+{
+    const struct sfcRule *ra = *(const struct sfcRule **) a;
+    const struct sfcRule *rb = *(const struct sfcRule **) b;
+
+    if (ra->weight != rb->weight)
+        return (ra->weight < rb->weight) - (ra->weight > rb->weight);
+    return (ra < rb) ? -1 : (ra > rb);  /* Keep policy order for ties */
+}
+
+/* Add the segment 'lo'..'hi' to 'seg', merging it with the previous
+   segment if both are adjacent and simply return the same action */
+
+static void
+addSegment(struct segment *seg, int *n, __u32 lo, __u32 hi,
+           const struct sfcRule *rule, __u32 action)
+{
+    if (rule != NULL && rule->argOp == SFC_ARG_NONE) {
+        action = rule->action;
+        rule = NULL;
+    }
+
+    if (*n > 0 && rule == NULL && seg[*n - 1].rule == NULL &&
+            seg[*n - 1].action == action && seg[*n - 1].hi + 1 == lo) {
+        seg[*n - 1].hi = hi;
+        return;
+    }
+
+    seg[*n].lo = lo;
+    seg[*n].hi = hi;
+    seg[*n].rule = rule;
+    seg[*n].action = action;
+    (*n)++;
+}
+
+/* Emit the part of the program that handles one architecture; it starts
+   by loading the system call number */
+
+static int
+emitArch(struct code *c, const struct sfcArch *a, enum sfcForm form)
+{
+    const struct sfcRule **sorted;
+    struct segment *seg;
+    int nseg, nhot;
+
+    emitLoad(c, offsetof(struct seccomp_data, nr));
+
+    if (form == SFC_LINEAR) {
+        if (a->nrLimit != 0) {
+            emit(c, BPF_JMP | BPF_JGE | BPF_K, a->nrLimit, 0, 1);
+            emit(c, BPF_RET | BPF_K, a->nrLimitAction, 0, 0);
+        }
+        for (int j = 0; j < a->nrules; j++)
+            emitRuleTest(c, &a->rules[j]);
+        emit(c, BPF_RET | BPF_K, a->defaultAction, 0, 0);
+        return 0;
+    }
+
+    sorted = malloc((a->nrules + 1) * sizeof(struct sfcRule *));
+    seg = malloc((a->nrules + 1) * sizeof(struct segment));
+    if (sorted == NULL || seg == NULL) {
+        free(sorted);
+        free(seg);
+        return ENOMEM;
+    }
+
+    for (int j = 0; j < a->nrules; j++)
+        sorted[j] = &a->rules[j];
+
+    if (form == SFC_TREE_HOT) {
+        qsort(sorted, a->nrules, sizeof(sorted[0]), cmpRuleWeight);
+        nhot = 0;
+        for (int j = 0; j < a->nrules && nhot < SFC_HOT_MAX; j++) {
+            if (sorted[j]->weight == 0)
+                break;
+            if (a->nrLimit != 0 && sorted[j]->nr >= a->nrLimit)
+                continue;               /* Unreachable */
+            emitRuleTest(c, sorted[j]);
+            nhot++;
+        }
+    }
+
+    /* Build the segments. Rules at or above 'nrLimit' can never be
+       reached (in the linear form, the limit is tested first), so they are
+       dropped. */
+
+    qsort(sorted, a->nrules, sizeof(sorted[0]), cmpRuleNr);
+    nseg = 0;
+    for (int j = 0; j < a->nrules; j++) {
+        if (a->nrLimit != 0 && sorted[j]->nr >= a->nrLimit)
+            break;
+        if (j > 0 && sorted[j]->nr == sorted[j - 1]->nr) {
+            free(sorted);
+            free(seg);
+            return EINVAL;              /* Duplicate rule */
+        }
+        addSegment(seg, &nseg, sorted[j]->nr, sorted[j]->nr, sorted[j], 0);
+    }
+    if (a->nrLimit != 0)
+        addSegment(seg, &nseg, a->nrLimit, 0xffffffff, NULL,
+                   a->nrLimitAction);
+
+    emitTree(c, seg, 0, nseg, a->defaultAction);
+
+    free(sorted);
+    free(seg);
+    return 0;
+}
+
+/* Compile 'policy' into a BPF program of the given form. On success,
+   return 0 and place the program in '*prog' (free it with sfcFree()). On
+   error, return -1 with 'errno' set: EINVAL for an invalid policy, E2BIG
+   if the program would exceed BPF_MAXINSNS instructions, or ENOMEM. */
+
+int
+sfcCompile(const struct sfcPolicy *policy, enum sfcForm form,
+           struct sock_fprog *prog)
+{
+    struct code c = { 0 };
+    struct code body;
+    int s;
+
+    for (int j = 0; j < policy->narchs; j++)
+        for (int r = 0; r < policy->archs[j].nrules; r++) {
+            const struct sfcRule *rule = &policy->archs[j].rules[r];
+            if (rule->argOp != SFC_ARG_NONE &&
+                    (rule->argIdx < 0 || rule->argIdx > 5)) {
+                errno = EINVAL;
+                return -1;
+            }
+        }
+
+    /* For each architecture: if the architecture doesn't match, skip the
+       code for that architecture */
+
+    emitLoad(&c, offsetof(struct seccomp_data, arch));
+
+    for (int j = 0; j < policy->narchs; j++) {
+        memset(&body, 0, sizeof(body));
+        s = emitArch(&body, &policy->archs[j], form);
+        if (s != 0) {
+            free(body.insns);
+            free(c.insns);
+            errno = s;
+            return -1;
+        }
+        emitSkip(&c, BPF_JEQ, policy->archs[j].arch, 0, body.len);
+        append(&c, &body);
+    }
+
+    emit(&c, BPF_RET | BPF_K, policy->badArchAction, 0, 0);
+
+    if (c.err) {
+        free(c.insns);
+        errno = c.err;
+        return -1;
+    }
+
+    prog->len = c.len;
+    prog->filter = c.insns;
+    return 0;
+}
+
+void
+sfcFree(struct sock_fprog *prog)
+{
+    free(prog->filter);
+    prog->filter = NULL;
+    prog->len = 0;
+}
+
+/* Run 'prog' against 'data', returning the SECCOMP_RET_* value that the
+   program yields. Only the instructions that sfcCompile() generates are
+   understood; anything else (including a jump off the end of the program)
+   yields SECCOMP_RET_KILL_THREAD. */
+
+__u32
+sfcRun(const struct sock_fprog *prog, const struct seccomp_data *data)
+{
+    const struct sock_filter *f;
+    __u32 acc = 0;
+    int taken;
+
+    for (int pc = 0; pc < prog->len; pc++) {
+        f = &prog->filter[pc];
+
+        switch (f->code) {
+        case BPF_LD | BPF_W | BPF_ABS:
+            if (f->k > sizeof(*data) - sizeof(__u32))
+                return SECCOMP_RET_KILL_THREAD;
+            memcpy(&acc, (const char *) data + f->k, sizeof(acc));
+            continue;
+
+        case BPF_RET | BPF_K:
+            return f->k;
+
+        case BPF_JMP | BPF_JA:
+            pc += f->k;
+            continue;
+
+        case BPF_JMP | BPF_JEQ | BPF_K:
+            taken = acc == f->k;
+            break;
+        case BPF_JMP | BPF_JGT | BPF_K:
+            taken = acc > f->k;
+            break;
+        case BPF_JMP | BPF_JGE | BPF_K:
+            taken = acc >= f->k;
+            break;
+        default:
+            return SECCOMP_RET_KILL_THREAD;
+        }
+
+        pc += taken ? f->jt : f->jf;
+    }
+
+    return SECCOMP_RET_KILL_THREAD;
+}
@@ -0,0 +1,72 @@
+/*************************************************************************\
+*                  Copyright (C) Michael Kerrisk, 2020.                   *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU Lesser General Public License as published   *
+* by the Free Software Foundation, either version 3 or (at your option)   *
+* any later version. This program is distributed without any warranty.    *
+* See the files COPYING.lgpl-v3 and COPYING.gpl-v3 for details.           *
+\*************************************************************************/
+
+/* seccomp_compile.h
+
+   Header file for seccomp_compile.c.
+*/
+#ifndef SECCOMP_COMPILE_H
+#define SECCOMP_COMPILE_H       /* Prevent accidental double inclusion */
+
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+
+enum sfcArgOp {                 /* Comparisons of a 64-bit argument */
+    SFC_ARG_NONE,               /* No argument check */
+    SFC_ARG_EQ,
+    SFC_ARG_NE,
+    SFC_ARG_GT,                 /* Unsigned comparisons */
+    SFC_ARG_LE
+};
+
+struct sfcRule {
+    __u32 nr;                   /* System call number */
+    __u32 action;               /* SECCOMP_RET_* value for this call... */
+    enum sfcArgOp argOp;        /* ...if 'args[argIdx] argOp argVal' holds */
+    int argIdx;
+    __u64 argVal;
+    __u32 argFailAction;        /* SECCOMP_RET_* value if it doesn't */
+    unsigned int weight;        /* Relative call frequency; the compiled
+                                   form checks the heaviest calls first */
+};
+
+struct sfcArch {                /* The rules for one architecture */
+    __u32 arch;                 /* AUDIT_ARCH_* value */
+    const struct sfcRule *rules;
+    int nrules;
+    __u32 defaultAction;        /* For calls that match no rule */
+    __u32 nrLimit;              /* If nonzero, calls numbered >= nrLimit
+                                   (e.g., x32 calls on x86-64) get... */
+    __u32 nrLimitAction;        /* ...this action */
+};
+
+struct sfcPolicy {
+    const struct sfcArch *archs;
+    int narchs;
+    __u32 badArchAction;        /* For architectures not in 'archs' */
+};
+
+enum sfcForm {
+    SFC_LINEAR,                 /* One test per rule, in the given order */
+    SFC_TREE,                   /* Binary search on the system call number */
+    SFC_TREE_HOT                /* Likewise, after direct tests of the
+                                   SFC_HOT_MAX heaviest calls */
+};
+
+#define SFC_HOT_MAX 4
+
+int sfcCompile(const struct sfcPolicy *policy, enum sfcForm form,
+               struct sock_fprog *prog);
+
+void sfcFree(struct sock_fprog *prog);
+
+__u32 sfcRun(const struct sock_fprog *prog, const struct seccomp_data *data);
+
+#endif
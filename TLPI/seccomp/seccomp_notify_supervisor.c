@@ -0,0 +1,607 @@
+/*************************************************************************\
+*                  Copyright (C) Michael Kerrisk, 2020.                   *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU General Public License as published by the   *
+* Free Software Foundation, either version 3 or (at your option) any      *
+* later version. This program is distributed without any warranty.  See   *
+* the file COPYING.gpl-v3 for details.                                    *
+\*************************************************************************/
+
+/* Supplementary program for Chapter Z */
+
+/* seccomp_notify_supervisor.c
+
+   A multithreaded supervisor for seccomp user-space notifications, and a
+   benchmark of its throughput.
+
+   seccomp_user_notification.c shows the mechanism with one target and a
+   tracer that handles one notification at a time. Here, each of a number
+   of target processes installs a filter with its own listener file
+   descriptor, which it passes to the supervisor. The supervisor adds all
+   of the listener FDs to a single epoll instance, and a pool of worker
+   threads waits on that instance. Each FD is registered with
+   EPOLLONESHOT, so that only one worker is woken per notification; that
+   worker fetches the notification (SECCOMP_IOCTL_NOTIF_RECV), rearms the
+   FD (so that another worker can pick up the same target's next
+   notification), and then handles the notification.
+
+   The supervisor uses the cheapest response that the system call allows:
+
+   continue  getppid() is intercepted and answered with
+             SECCOMP_USER_NOTIF_FLAG_CONTINUE, so that the kernel executes
+             the call as normal; the supervisor never looks at the target.
+
+   emulate   getppid() is intercepted and answered with a return value
+             supplied by the supervisor (the usual NOTIF_SEND response).
+
+   addfd     open("/dev/null") is intercepted. The supervisor reads the
+             pathname from the target with process_vm_readv(), and if it is
+             "/dev/null", installs a duplicate of its own (already open)
+             descriptor for that file in the target with
+             SECCOMP_IOCTL_NOTIF_ADDFD, using SECCOMP_ADDFD_FLAG_SEND (Linux
+             5.14) to send the response in the same operation. Other
+             pathnames get SECCOMP_USER_NOTIF_FLAG_CONTINUE.
+
+   Note that SECCOMP_USER_NOTIF_FLAG_CONTINUE must not be used to allow a
+   call after checking its pointer arguments, because the target's memory
+   can change after the check (see seccomp_unotify(2)); this program uses
+   it only for calls that it doesn't care about.
+
+   Usage: seccomp_notify_supervisor [-m mode,...] [-t ntargets,...]
+                                    [-w nworkers] [-c calls]
+
+   For each mode (default: all) and each number of targets (default:
+   1,2,4,8,16), the program creates the targets and a pool of 'nworkers'
+   worker threads (default: 4). Each target first times 'calls' (default:
+   20000) uncontrolled calls, then installs the filter and times the same
+   number of intercepted calls. The output shows the total rate of
+   intercepted calls, and the mean and 99th percentile of the latency that
+   interception added to each call.
+*/
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/prctl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include "scm_functions.h"
+#include "tlpi_hdr.h"
+
+#ifndef SECCOMP_ADDFD_FLAG_SEND
+#define SECCOMP_ADDFD_FLAG_SEND (1UL << 1)
+#endif
+
+#define X32_SYSCALL_BIT         0x40000000
+#define MAX_WORKERS 64
+
+enum mode { M_CONTINUE, M_EMULATE, M_ADDFD, M_NUM_MODES };
+
+static const char *modeNames[] = { "continue", "emulate", "addfd" };
+
+struct targetResult {           /* Filled in by each target */
+    double baseNs;              /* Mean time of an uncontrolled call */
+    double meanNs;              /* Mean time of an intercepted call */
+    double p99Ns;               /* 99th percentile of the same */
+};
+
+/* State shared by the supervisor's worker threads */
+
+static enum mode runMode;
+static int epfd;                /* epoll instance for the listener FDs */
+static int stopFd;              /* eventfd that tells workers to finish */
+static volatile int stopping;
+static int devNullFd;           /* Injected into targets in addfd mode */
+static int addfdSend = 1;       /* Does NOTIF_ADDFD support
+                                   SECCOMP_ADDFD_FLAG_SEND? */
+static struct seccomp_notif_sizes sizes;
+static long handled[MAX_WORKERS];
+
+static int
+seccomp(unsigned int operation, unsigned int flags, void *args)
+{
+    return syscall(__NR_seccomp, operation, flags, args);
+}
+
+static double
+nsNow(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* ---------------------------------------------------------------- */
+/* Target processes */
+
+/* Install a filter that sends a notification for the system call used in
+   'mode', and return the listener file descriptor */
+
+static int
+installNotifyFilter(enum mode mode)
+{
+    struct sock_filter filter[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                 (offsetof(struct seccomp_data, arch))),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, AUDIT_ARCH_X86_64, 0, 2),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                 (offsetof(struct seccomp_data, nr))),
+        BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, X32_SYSCALL_BIT, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_KILL_PROCESS),
+
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                 (mode == M_ADDFD) ? __NR_openat : __NR_getppid, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_USER_NOTIF),
+
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+    };
+
+    struct sock_fprog prog = {
+        .len = (unsigned short) (sizeof(filter) / sizeof(filter[0])),
+        .filter = filter,
+    };
+
+    int notifyFd;
+
+    if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0))
+        errExit("prctl");
+
+    notifyFd = seccomp(SECCOMP_SET_MODE_FILTER,
+                       SECCOMP_FILTER_FLAG_NEW_LISTENER, &prog);
+    if (notifyFd == -1)
+        errExit("seccomp-install-notify-filter");
+
+    return notifyFd;
+}
+
+/* Make the system call that 'mode' intercepts */
+
+static void
+targetCall(enum mode mode)
+{
+    int fd;
+
+    if (mode == M_ADDFD) {
+        fd = open("/dev/null", O_RDONLY);
+        if (fd == -1)
+            errExit("Target: open");
+        close(fd);
+    } else {
+        if (getppid() == -1)
+            errExit("Target: getppid");
+    }
+}
+
+static int
+cmpDouble(const void *a, const void *b)
+{
+    double da = *(const double *) a, db = *(const double *) b;
+
+    return (da > db) - (da < db);
+}
+
+/* Create a target process that sends its listener FD over 'sv[1]', waits
+   until the read end of 'startPipe' reaches EOF, then times 'calls' calls,
+   placing the results in '*res' */
+
+static pid_t
+targetProcess(int sv[2], int startPipe[2], enum mode mode, int calls,
+              struct targetResult *res)
+{
+    double *lat, t0, sum;
+    pid_t pid;
+    char ch;
+    int notifyFd;
+
+    pid = fork();
+    if (pid == -1)
+        errExit("fork");
+    if (pid > 0)
+        return pid;
+
+    close(sv[0]);
+    close(startPipe[1]);
+
+    lat = malloc(calls * sizeof(double));
+    if (lat == NULL)
+        errExit("malloc");
+
+    t0 = nsNow();
+    for (int j = 0; j < calls; j++)
+        targetCall(mode);
+    res->baseNs = (nsNow() - t0) / calls;
+
+    notifyFd = installNotifyFilter(mode);
+    if (sendfd(sv[1], notifyFd) == -1)
+        errExit("sendfd");
+    close(notifyFd);
+    close(sv[1]);
+
+    if (read(startPipe[0], &ch, 1) == -1)
+        errExit("read");
+
+    sum = 0;
+    for (int j = 0; j < calls; j++) {
+        t0 = nsNow();
+        targetCall(mode);
+        lat[j] = nsNow() - t0;
+        sum += lat[j];
+    }
+
+    qsort(lat, calls, sizeof(double), cmpDouble);
+    res->meanNs = sum / calls;
+    res->p99Ns = lat[(int) (calls * 0.99)];
+
+    _exit(EXIT_SUCCESS);
+}
+
+/* ---------------------------------------------------------------- */
+/* The supervisor */
+
+/* Answer notification 'req' on 'notifyFd' according to 'runMode' */
+
+static void
+respond(int notifyFd, struct seccomp_notif *req,
+        struct seccomp_notif_resp *resp)
+{
+    struct seccomp_notif_addfd addfd;
+    struct iovec local, remote;
+    char path[16];
+    ssize_t n;
+    int fd;
+
+    memset(resp, 0, sizes.seccomp_notif_resp);
+    resp->id = req->id;
+
+    switch (runMode) {
+    case M_CONTINUE:
+        resp->flags = SECCOMP_USER_NOTIF_FLAG_CONTINUE;
+        break;
+
+    case M_EMULATE:
+        resp->val = getpid();           /* The targets' parent is us */
+        break;
+
+    case M_ADDFD:
+
+        /* Fetch (a prefix of) the pathname given to openat(). The ID check
+           afterward confirms that the PID still belongs to the target. */
+
+        local.iov_base = path;
+        local.iov_len = sizeof(path);
+        remote.iov_base = (void *) (uintptr_t) req->data.args[1];
+        remote.iov_len = sizeof(path);
+        n = process_vm_readv(req->pid, &local, 1, &remote, 1, 0);
+
+        if (ioctl(notifyFd, SECCOMP_IOCTL_NOTIF_ID_VALID, &req->id) == -1)
+            return;                     /* Target has gone */
+
+        if (n < (ssize_t) sizeof("/dev/null") ||
+                strcmp(path, "/dev/null") != 0) {
+            resp->flags = SECCOMP_USER_NOTIF_FLAG_CONTINUE;
+            break;
+        }
+
+        memset(&addfd, 0, sizeof(addfd));
+        addfd.id = req->id;
+        addfd.srcfd = devNullFd;
+        addfd.newfd_flags = (req->data.args[2] & O_CLOEXEC) ? O_CLOEXEC : 0;
+
+        if (__atomic_load_n(&addfdSend, __ATOMIC_RELAXED)) {
+            addfd.flags = SECCOMP_ADDFD_FLAG_SEND;
+            if (ioctl(notifyFd, SECCOMP_IOCTL_NOTIF_ADDFD, &addfd) != -1)
+                return;                 /* Response has been sent */
+
+            if (errno != EINVAL) {      /* No response has been sent */
+                if (errno == ENOENT)    /* Target was interrupted */
+                    return;
+                resp->error = -errno;   /* E.g., EMFILE in the target */
+                break;
+            }
+
+            /* Kernel before 5.14: install the FD, then respond */
+
+            __atomic_store_n(&addfdSend, 0, __ATOMIC_RELAXED);
+            addfd.flags = 0;
+        }
+
+        fd = ioctl(notifyFd, SECCOMP_IOCTL_NOTIF_ADDFD, &addfd);
+        if (fd == -1) {
+            if (errno == ENOENT)        /* Target was interrupted */
+                return;
+            resp->error = -errno;       /* Fail the target's openat() */
+            break;
+        }
+        resp->val = fd;
+        break;
+
+    default:
+        fatal("bad mode");
+    }
+
+    if (ioctl(notifyFd, SECCOMP_IOCTL_NOTIF_SEND, resp) == -1 &&
+            errno != ENOENT)            /* ENOENT: target was interrupted */
+        errMsg("ioctl-SECCOMP_IOCTL_NOTIF_SEND");
+}
+
+/* Wake-up signal for a worker that is blocked in NOTIF_RECV at shutdown */
+
+static void
+wakeHandler(int sig)
+{
+}
+
+static void *
+worker(void *arg)
+{
+    long id = (long) arg;
+    struct seccomp_notif *req;
+    struct seccomp_notif_resp *resp;
+    struct epoll_event ev;
+    int fd, got;
+
+    req = malloc(sizes.seccomp_notif);
+    resp = malloc(sizes.seccomp_notif_resp);
+    if (req == NULL || resp == NULL)
+        errExit("malloc");
+
+    while (!stopping) {
+        if (epoll_wait(epfd, &ev, 1, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            errExit("epoll_wait");
+        }
+
+        fd = ev.data.fd;
+        if (fd == stopFd)
+            break;
+
+        /* EPOLLHUP means that all of the target's threads have gone.
+           Leave the descriptor disarmed; main() closes it. */
+
+        if (!(ev.events & EPOLLIN))
+            continue;
+
+        memset(req, 0, sizes.seccomp_notif);
+        got = ioctl(fd, SECCOMP_IOCTL_NOTIF_RECV, req) != -1;
+        if (!got && errno != ENOENT && errno != EINTR)
+            errExit("ioctl-SECCOMP_IOCTL_NOTIF_RECV");
+
+        /* Rearm the descriptor before handling the notification, so that
+           another worker can handle this target's next notification */
+
+        ev.events = EPOLLIN | EPOLLONESHOT;
+        if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) == -1)
+            errExit("epoll_ctl");
+
+        if (!got)               /* Target was interrupted, or has gone */
+            continue;
+
+        respond(fd, req, resp);
+        handled[id]++;
+    }
+
+    free(req);
+    free(resp);
+    return NULL;
+}
+
+/* Run 'ntargets' targets in mode 'mode' under a supervisor with 'nworkers'
+   workers, and print a line of results */
+
+static void
+runOnce(enum mode mode, int ntargets, int nworkers, int calls)
+{
+    struct targetResult *res;
+    struct epoll_event ev;
+    pthread_t thr[MAX_WORKERS];
+    pid_t *pids;
+    int *notifyFds;
+    int startPipe[2], sv[2], s;
+    double t0, elapsed, added, p99;
+    long total;
+
+    res = mmap(NULL, ntargets * sizeof(struct targetResult),
+               PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (res == MAP_FAILED)
+        errExit("mmap");
+    pids = calloc(ntargets, sizeof(pid_t));
+    notifyFds = calloc(ntargets, sizeof(int));
+    if (pids == NULL || notifyFds == NULL)
+        errExit("calloc");
+
+    runMode = mode;
+    stopping = 0;
+    memset(handled, 0, sizeof(handled));
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1)
+        errExit("epoll_create1");
+
+    stopFd = eventfd(0, EFD_CLOEXEC);
+    if (stopFd == -1)
+        errExit("eventfd");
+
+    if (pipe(startPipe) == -1)
+        errExit("pipe");
+
+    /* Create the targets, and collect their listener FDs */
+
+    for (int j = 0; j < ntargets; j++) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+            errExit("socketpair");
+
+        pids[j] = targetProcess(sv, startPipe, mode, calls, &res[j]);
+        close(sv[1]);
+
+        notifyFds[j] = recvfd(sv[0]);
+        if (notifyFds[j] == -1)
+            errExit("recvfd");
+        close(sv[0]);
+
+        ev.events = EPOLLIN | EPOLLONESHOT;
+        ev.data.fd = notifyFds[j];
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, notifyFds[j], &ev) == -1)
+            errExit("epoll_ctl");
+    }
+    close(startPipe[0]);
+
+    for (long j = 0; j < nworkers; j++) {
+        s = pthread_create(&thr[j], NULL, worker, (void *) j);
+        if (s != 0)
+            errExitEN(s, "pthread_create");
+    }
+
+    /* Start the targets together, and wait for them to finish */
+
+    t0 = nsNow();
+    close(startPipe[1]);
+
+    for (int j = 0; j < ntargets; j++) {
+        if (waitpid(pids[j], &s, 0) == -1)
+            errExit("waitpid");
+        if (!WIFEXITED(s) || WEXITSTATUS(s) != 0)
+            fatal("target %d failed (status 0x%x)", j, s);
+    }
+    elapsed = nsNow() - t0;
+
+    /* Stop the workers: the eventfd wakes those in epoll_wait() (it is
+       level-triggered, so it wakes all of them), and the signal interrupts
+       any that are blocked in NOTIF_RECV */
+
+    stopping = 1;
+    ev.events = EPOLLIN;
+    ev.data.fd = stopFd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, stopFd, &ev) == -1)
+        errExit("epoll_ctl");
+    if (eventfd_write(stopFd, 1) == -1)
+        errExit("eventfd_write");
+
+    for (int j = 0; j < nworkers; j++) {
+        pthread_kill(thr[j], SIGUSR1);
+        s = pthread_join(thr[j], NULL);
+        if (s != 0)
+            errExitEN(s, "pthread_join");
+    }
+
+    total = 0;
+    for (int j = 0; j < nworkers; j++)
+        total += handled[j];
+
+    added = 0;
+    p99 = 0;
+    for (int j = 0; j < ntargets; j++) {
+        added += res[j].meanNs - res[j].baseNs;
+        if (res[j].p99Ns - res[j].baseNs > p99)
+            p99 = res[j].p99Ns - res[j].baseNs;
+    }
+
+    printf("%-9s %7d %7d %12.0f %12.2f %12.2f\n", modeNames[mode],
+           ntargets, nworkers, total / (elapsed / 1e9),
+           added / ntargets / 1e3, p99 / 1e3);
+
+    for (int j = 0; j < ntargets; j++)
+        close(notifyFds[j]);
+    close(stopFd);
+    close(epfd);
+    free(pids);
+    free(notifyFds);
+    munmap(res, ntargets * sizeof(struct targetResult));
+}
+
+static void
+usageError(const char *progName)
+{
+    fprintf(stderr, "Usage: %s [-m mode,...] [-t ntargets,...] "
+            "[-w nworkers] [-c calls]\n", progName);
+    fprintf(stderr, "Modes: continue emulate addfd\n");
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+    char defaultTargets[] = "1,2,4,8,16";
+    char *targetList, *tok;
+    int wanted[M_NUM_MODES], ntargets[32];
+    int opt, nworkers, calls, m, nlists;
+    struct sigaction sa;
+
+    for (m = 0; m < M_NUM_MODES; m++)
+        wanted[m] = 1;
+    targetList = defaultTargets;
+    nworkers = 4;
+    calls = 20000;
+
+    while ((opt = getopt(argc, argv, "m:t:w:c:")) != -1) {
+        switch (opt) {
+        case 'm':
+            for (m = 0; m < M_NUM_MODES; m++)
+                wanted[m] = 0;
+            for (tok = strtok(optarg, ","); tok != NULL;
+                    tok = strtok(NULL, ",")) {
+                for (m = 0; m < M_NUM_MODES; m++)
+                    if (strcmp(tok, modeNames[m]) == 0)
+                        break;
+                if (m == M_NUM_MODES)
+                    usageError(argv[0]);
+                wanted[m] = 1;
+            }
+            break;
+        case 't':
+            targetList = optarg;
+            break;
+        case 'w':
+            nworkers = getInt(optarg, GN_GT_0, "nworkers");
+            if (nworkers > MAX_WORKERS)
+                cmdLineErr("At most %d workers\n", MAX_WORKERS);
+            break;
+        case 'c':
+            calls = getInt(optarg, GN_GT_0, "calls");
+            break;
+        default:
+            usageError(argv[0]);
+        }
+    }
+
+    nlists = 0;
+    for (tok = strtok(targetList, ","); tok != NULL && nlists < 32;
+            tok = strtok(NULL, ","))
+        ntargets[nlists++] = getInt(tok, GN_GT_0, "ntargets");
+
+    if (seccomp(SECCOMP_GET_NOTIF_SIZES, 0, &sizes) == -1)
+        errExit("seccomp-SECCOMP_GET_NOTIF_SIZES");
+
+    devNullFd = open("/dev/null", O_RDONLY);
+    if (devNullFd == -1)
+        errExit("open");
+
+    sa.sa_handler = wakeHandler;
+    sa.sa_flags = 0;                    /* No SA_RESTART */
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGUSR1, &sa, NULL) == -1)
+        errExit("sigaction");
+
+    printf("%-9s %7s %7s %12s %12s %12s\n", "Mode", "Targets", "Workers",
+           "Calls/sec", "Added(us)", "Added-p99");
+
+    for (m = 0; m < M_NUM_MODES; m++)
+        if (wanted[m])
+            for (int j = 0; j < nlists; j++)
+                runOnce(m, ntargets[j], nworkers, calls);
+
+    exit(EXIT_SUCCESS);
+}
@@ -15,6 +15,29 @@
    How much does a simple seccomp() filter cost vis-a-vis a trivial system
    call such as getppid()?
 
+   Usage: seccomp_perf num-loops [x]
+          seccomp_perf -m [-n num-loops] [-s rules,...] [-V]
+
+   In the first form, the program makes 'num-loops' getppid() calls, after
+   installing a small hand-written filter if 'x' is specified; time the
+   program with time(1).
+
+   In the second form, the program measures how the cost of a filter grows
+   with the size of the policy, for filters built by seccomp_compile.c in
+   each of its forms. For each policy size (default: 8, 16, 32, ..., 1024
+   rules), it builds an allow-list policy and, in a child process for each
+   form, installs the filter and times 'num-loops' (default: 1000000)
+   getppid() calls. The policy allows every second system call number, so
+   that adjacent rules can't be merged, and places getppid() last in the
+   linear form (which is therefore a worst case for that form); getppid()
+   is also given a weight, so that the "hot" form tests it first (see
+   buildPolicy() for why its rule also checks an argument). The
+   output shows the size of each filter in instructions, and the cost per
+   call in nanoseconds over a run with no filter.
+
+   "-V" first checks that all forms of each policy give the same result for
+   a range of system call numbers and arguments (using sfcRun()).
+
    To test with the in-kernel JIT compiler enabled:
 
         $ sudo sh -c "echo 1 > /proc/sys/net/core/bpf_jit_enable"
@@ -28,12 +51,11 @@
 #include <linux/seccomp.h>
 #include <sys/prctl.h>
 #include <sys/types.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <unistd.h>
-
-#define errExit(msg)    do { perror(msg); exit(EXIT_FAILURE); \
-                        } while (0)
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include "seccomp_compile.h"
+#include "tlpi_hdr.h"
 
 /* For the x32 ABI, all system call numbers have bit 30 set */
 
@@ -97,18 +119,271 @@ install_filter(void)
         errExit("seccomp");
 }
 
+/* Build the allow-list policy used by the "-m" mode: 'nrules' rules, in
+   the order used for the linear form */
+
+static const __u32 essential[] = {      /* Needed by the child */
+    __NR_clock_gettime, __NR_exit, __NR_exit_group,
+    __NR_lseek,                         /* See below */
+    __NR_getppid                        /* Must be last */
+};
+
+#define NUM_ESSENTIAL ((int) (sizeof(essential) / sizeof(essential[0])))
+
+static void
+buildPolicy(struct sfcRule *rules, int nrules, struct sfcArch *arch,
+            struct sfcPolicy *policy)
+{
+    __u32 nr;
+    int j, k, n;
+
+    /* Filler rules: every second system call number, skipping those
+       in 'essential' */
+
+    n = 0;
+    for (nr = 0; n < nrules - NUM_ESSENTIAL; nr += 2) {
+        for (k = 0; k < NUM_ESSENTIAL; k++)
+            if (essential[k] == nr)
+                break;
+        if (k < NUM_ESSENTIAL)
+            continue;
+        memset(&rules[n], 0, sizeof(rules[n]));
+        rules[n].nr = nr;
+        rules[n].action = SECCOMP_RET_ALLOW;
+        n++;
+    }
+
+    for (j = 0; j < NUM_ESSENTIAL; j++, n++) {
+        memset(&rules[n], 0, sizeof(rules[n]));
+        rules[n].nr = essential[j];
+        rules[n].action = SECCOMP_RET_ALLOW;
+    }
+
+    /* As in seccomp_arg64.c: lseek() fails if 'offset' is > 1000 */
+
+    rules[n - 2].argOp = SFC_ARG_LE;
+    rules[n - 2].argIdx = 1;
+    rules[n - 2].argVal = 1000;
+    rules[n - 2].argFailAction = SECCOMP_RET_ERRNO | EINVAL;
+
+    /* getppid() is the hot call. Since Linux 5.11, the kernel doesn't run
+       the filter at all for a call that the filter allows whatever its
+       arguments are, so getppid() is allowed only if its (unused) first
+       argument is 0; that makes the filter run on each call. */
+
+    rules[n - 1].weight = 1000;
+    rules[n - 1].argOp = SFC_ARG_EQ;
+    rules[n - 1].argIdx = 0;
+    rules[n - 1].argVal = 0;
+    rules[n - 1].argFailAction = SECCOMP_RET_ERRNO | EINVAL;
+
+    arch->arch = AUDIT_ARCH_X86_64;
+    arch->rules = rules;
+    arch->nrules = n;
+    arch->defaultAction = SECCOMP_RET_ERRNO | ENOSYS;
+    arch->nrLimit = X32_SYSCALL_BIT;
+    arch->nrLimitAction = SECCOMP_RET_KILL_PROCESS;
+
+    policy->archs = arch;
+    policy->narchs = 1;
+    policy->badArchAction = SECCOMP_RET_KILL_PROCESS;
+}
+
+/* Check that 'progs[0]' to 'progs[nprogs - 1]' agree on a range of
+   inputs */
+
+static void
+verifyForms(const struct sock_fprog *progs, int nprogs, int nrules)
+{
+    static const __u64 argVals[] = { 0, 1000, 1001, 0x100000000ULL };
+    static const __u32 archs[] = { AUDIT_ARCH_X86_64, AUDIT_ARCH_I386 };
+    struct seccomp_data data;
+    __u32 r0, r;
+    long ntests;
+
+    ntests = 0;
+    for (int a = 0; a < 2; a++) {
+        for (__u32 nr = 0; nr < 2 * nrules + 64; nr++) {
+            for (int o = 0; o < 4; o++) {
+                memset(&data, 0, sizeof(data));
+                data.arch = archs[a];
+                data.nr = (o == 3 && nr < 64) ? X32_SYSCALL_BIT + nr : nr;
+                data.args[0] = argVals[o];
+                data.args[1] = argVals[o];
+
+                r0 = sfcRun(&progs[0], &data);
+                for (int f = 1; f < nprogs; f++) {
+                    r = sfcRun(&progs[f], &data);
+                    if (r != r0)
+                        fatal("%d rules: form %d gives 0x%x for call %u "
+                              "(arg 0x%llx); form 0 gives 0x%x", nrules,
+                              f, r, data.nr,
+                              (unsigned long long) data.args[1], r0);
+                }
+                ntests++;
+            }
+        }
+    }
+
+    printf("%d rules: %ld inputs, all forms agree\n", nrules, ntests);
+}
+
+/* In a child process, install 'prog' (if not NULL) and return the time
+   taken per getppid() call, in nanoseconds (best of three runs) */
+
+static double
+timeCalls(const struct sock_fprog *prog, int nloops)
+{
+    struct timespec start, end;
+    double *result, ns;
+    pid_t pid;
+    int status;
+
+    result = mmap(NULL, sizeof(double), PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (result == MAP_FAILED)
+        errExit("mmap");
+
+    pid = fork();
+    if (pid == -1)
+        errExit("fork");
+
+    if (pid == 0) {
+        if (prog != NULL) {
+            if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0))
+                errExit("prctl");
+            if (seccomp(SECCOMP_SET_MODE_FILTER, 0, (void *) prog) == -1)
+                errExit("seccomp");
+        }
+
+        *result = 0;
+        for (int r = 0; r < 3; r++) {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (int j = 0; j < nloops; j++)
+                if (syscall(__NR_getppid, 0) == -1)
+                    _exit(EXIT_FAILURE);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+
+            ns = ((end.tv_sec - start.tv_sec) * 1e9 +
+                    (end.tv_nsec - start.tv_nsec)) / nloops;
+            if (r == 0 || ns < *result)
+                *result = ns;
+        }
+        _exit(EXIT_SUCCESS);
+    }
+
+    if (waitpid(pid, &status, 0) == -1)
+        errExit("waitpid");
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        fatal("child failed (status 0x%x)", status);
+
+    ns = *result;
+    munmap(result, sizeof(double));
+    return ns;
+}
+
+static void
+measureMatrix(int nloops, char *sizeList, int verify)
+{
+    static const enum sfcForm forms[] = { SFC_LINEAR, SFC_TREE,
+                                          SFC_TREE_HOT };
+    struct sock_fprog progs[3];
+    struct sfcRule *rules;
+    struct sfcPolicy policy;
+    struct sfcArch arch;
+    double base, ns;
+    int nrules;
+    char *tok;
+
+    base = timeCalls(NULL, nloops);
+    printf("No filter: %.1f ns per getppid() call\n\n", base);
+
+    printf("%6s  %-15s %-15s %-15s\n", "", "Linear", "Tree", "Tree+hot");
+    printf("%6s ", "Rules");
+    for (int f = 0; f < 3; f++)
+        printf(" %6s %8s", "insns", "ns/call");
+    printf("\n");
+
+    for (tok = strtok(sizeList, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        nrules = getInt(tok, GN_GT_0, "rules");
+        if (nrules < NUM_ESSENTIAL)
+            nrules = NUM_ESSENTIAL;
+
+        rules = calloc(nrules, sizeof(struct sfcRule));
+        if (rules == NULL)
+            errExit("calloc");
+        buildPolicy(rules, nrules, &arch, &policy);
+
+        for (int f = 0; f < 3; f++)
+            if (sfcCompile(&policy, forms[f], &progs[f]) == -1)
+                errExit("sfcCompile");
+
+        if (verify)
+            verifyForms(progs, 3, nrules);
+
+        printf("%6d ", nrules);
+        for (int f = 0; f < 3; f++) {
+            ns = timeCalls(&progs[f], nloops);
+            printf(" %6d %8.1f", progs[f].len, ns - base);
+            fflush(stdout);
+        }
+        printf("\n");
+
+        for (int f = 0; f < 3; f++)
+            sfcFree(&progs[f]);
+        free(rules);
+    }
+}
+
+static void
+usageError(const char *progName)
+{
+    fprintf(stderr, "Usage: %s <num-loops> [x]\n", progName);
+    fprintf(stderr, "       (use 'x' to run with BPF filter applied)\n");
+    fprintf(stderr, "       %s -m [-n num-loops] [-s rules,...] [-V]\n",
+            progName);
+    exit(EXIT_FAILURE);
+}
+
 int
 main(int argc, char *argv[])
 {
-    int nloops;
+    char defaultSizes[] = "8,16,32,64,128,256,512,1024";
+    char *sizeList;
+    int nloops, opt, matrix, verify;
+
+    matrix = 0;
+    verify = 0;
+    nloops = 1000000;
+    sizeList = defaultSizes;
+    while ((opt = getopt(argc, argv, "mn:s:V")) != -1) {
+        switch (opt) {
+        case 'm':
+            matrix = 1;
+            break;
+        case 'n':
+            nloops = getInt(optarg, GN_GT_0, "num-loops");
+            break;
+        case 's':
+            sizeList = optarg;
+            break;
+        case 'V':
+            verify = 1;
+            break;
+        default:
+            usageError(argv[0]);
+        }
+    }
 
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s <num-loops> [x]\n", argv[0]);
-        fprintf(stderr, "       (use 'x' to run with BPF filter applied)\n");
-        exit(EXIT_FAILURE);
+    if (matrix) {
+        measureMatrix(nloops, sizeList, verify);
+        exit(EXIT_SUCCESS);
     }
 
-    if (argc > 2) {
+    if (optind >= argc)
+        usageError(argv[0]);
+
+    if (argc > optind + 1) {
         printf("Applying BPF filter\n");
 
         if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0))
@@ -117,7 +392,7 @@ main(int argc, char *argv[])
         install_filter();
     }
 
-    nloops = atoi(argv[1]);
+    nloops = atoi(argv[optind]);
 
     for (int j = 0; j < nloops; j++)
         getppid();
@@ -0,0 +1,267 @@
+/*************************************************************************\
+*                  Copyright (C) Michael Kerrisk, 2020.                   *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU General Public License as published by the   *
+* Free Software Foundation, either version 3 or (at your option) any      *
+* later version. This program is distributed without any warranty.  See   *
+* the file COPYING.gpl-v3 for details.                                    *
+\*************************************************************************/
+
+/* Supplementary program for Chapter 60 */
+
+/* dgram_blast_cl.c
+
+   A datagram load generator for the servers in id_echo_sv.c (UDP) and
+   ud_ucase_sv.c (UNIX domain). For each of a list of batch sizes, the
+   program repeatedly sends a batch of datagrams with one sendmmsg() call,
+   then collects the replies using recvmmsg(), and reports the number of
+   datagrams echoed per second.
+
+   Usage: dgram_blast_cl [-u | -p service host] [-b batch-sizes]
+                         [-n datagrams] [-s msg-size]
+
+   -u selects the UNIX domain server (at SV_SOCK_PATH in ud_ucase.h);
+   otherwise, datagrams are sent to the UDP echo service on 'host'.
+   'batch-sizes' is a comma-separated list (default: "1,4,16,64,256").
+
+   For example:
+
+        $ ./ud_ucase_sv -q -b 64 &
+        $ ./dgram_blast_cl -u -n 200000
+
+        $ ./id_echo_sv -F -p 51000 -b 64 &
+        $ ./dgram_blast_cl -p 51000 -n 200000 localhost
+
+   Replies that don't arrive within a short timeout (because a datagram
+   or its reply was dropped) are counted as lost. Each datagram starts
+   with its sequence number (in decimal, which ud_ucase_sv.c's conversion
+   to uppercase leaves unchanged), so that a reply that arrives after its
+   batch has timed out is not mistaken for a reply to the next batch;
+   such replies are counted as late.
+
+   See also id_echo_sv.c and ud_ucase_sv.c.
+*/
+#define _GNU_SOURCE             /* To get recvmmsg() and sendmmsg() */
+#include <sys/un.h>
+#include <time.h>
+#include "inet_sockets.h"
+#include "ud_ucase.h"           /* Also defines BUF_SIZE (UNIX domain) */
+
+#define MAX_BATCH 1024
+#define MAX_MSG 500             /* Same as BUF_SIZE in id_echo.h */
+#define REPLY_TIMEOUT_MS 200
+#define SEQ_LEN 8               /* Digits of sequence number at the start
+                                   of each datagram (fits in BUF_SIZE) */
+#define SEQ_MOD 100000000L      /* 10^SEQ_LEN: sequence numbers wrap */
+
+static struct mmsghdr msgs[MAX_BATCH];
+static struct iovec iovs[MAX_BATCH];
+static char bufs[MAX_BATCH][MAX_MSG];
+
+static double
+timeNow(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        errExit("clock_gettime");
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Set up 'n' slots of 'len' bytes each. Destination addresses are not
+   needed, since the socket is connected to the server. */
+
+static void
+setSlots(int n, size_t len)
+{
+    int j;
+
+    for (j = 0; j < n; j++) {
+        iovs[j].iov_base = bufs[j];
+        iovs[j].iov_len = len;
+        memset(&msgs[j].msg_hdr, 0, sizeof(struct msghdr));
+        msgs[j].msg_hdr.msg_iov = &iovs[j];
+        msgs[j].msg_hdr.msg_iovlen = 1;
+    }
+}
+
+/* Send 'total' datagrams in batches of 'batch', collecting the replies
+   for each batch before sending the next. Returns the number of
+   replies received; '*late' is set to the number of replies that
+   arrived after their batch timed out, and '*elapsed' to the time
+   taken. */
+
+static long
+blast(int sfd, int batch, long total, size_t msgSize, long *late,
+      double *elapsed)
+{
+    long numSent, numRecv, seq, first;
+    char seqStr[32];            /* Large enough for any long */
+    double start;
+    int n, got, s, j;
+
+    numRecv = 0;
+    *late = 0;
+    start = timeNow();
+
+    for (numSent = 0; numSent < total; numSent += n) {
+        n = (total - numSent < batch) ? total - numSent : batch;
+        first = numSent % SEQ_MOD;
+
+        setSlots(n, msgSize);
+        for (j = 0; j < n; j++) {
+            snprintf(seqStr, sizeof(seqStr), "%0*ld", SEQ_LEN,
+                    (first + j) % SEQ_MOD);
+            memcpy(bufs[j], seqStr, SEQ_LEN);
+        }
+
+        for (got = 0; got < n; got += s) {
+            s = sendmmsg(sfd, &msgs[got], n - got, 0);
+            if (s == -1)
+                errExit("sendmmsg");
+        }
+
+        /* Gather replies until we have them all, or the receive
+           timeout expires (recvmmsg() then fails with EAGAIN). Only
+           replies to this batch count. */
+
+        setSlots(n, MAX_MSG);
+        for (got = 0; got < n; ) {
+            s = recvmmsg(sfd, msgs, n - got, MSG_WAITFORONE, NULL);
+            if (s == -1) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK ||
+                        errno == ECONNREFUSED)
+                    break;              /* Count the rest as lost */
+                errExit("recvmmsg");
+            }
+
+            for (j = 0; j < s; j++) {
+                memcpy(seqStr, bufs[j], SEQ_LEN);
+                seqStr[SEQ_LEN] = '\0';
+                seq = (msgs[j].msg_len >= SEQ_LEN) ? atol(seqStr) : -1;
+                if (seq >= 0 && (seq - first + SEQ_MOD) % SEQ_MOD < n)
+                    got++;
+                else
+                    (*late)++;
+            }
+        }
+        numRecv += got;
+    }
+
+    *elapsed = timeNow() - start;
+    return numRecv;
+}
+
+static void
+usageError(const char *pname)
+{
+    fprintf(stderr, "Usage: %s [-u | -p service host] [-b batch-sizes] "
+                    "[-n datagrams] [-s msg-size]\n", pname);
+    fprintf(stderr, "    -u   Use the UNIX domain server (%s)\n",
+                    SV_SOCK_PATH);
+    fprintf(stderr, "    -p   UDP service name or port (default: \"echo\")\n");
+    fprintf(stderr, "    -b   Comma-separated batch sizes "
+                    "(default: 1,4,16,64,256)\n");
+    fprintf(stderr, "    -n   Datagrams sent per batch size "
+                    "(default: 100000)\n");
+    fprintf(stderr, "    -s   Datagram size (default: %d for UNIX domain, "
+                    "64 for UDP)\n", BUF_SIZE);
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct sockaddr_un svaddr, claddr;
+    struct timeval tv;
+    Boolean unixDomain;
+    const char *service;
+    char *batchList, *tok, *saveptr;
+    long total, numRecv, late;
+    size_t msgSize;
+    double elapsed;
+    int sfd, opt, batch;
+
+    unixDomain = FALSE;
+    service = "echo";
+    batchList = "1,4,16,64,256";
+    total = 100000;
+    msgSize = 0;
+    while ((opt = getopt(argc, argv, "up:b:n:s:")) != -1) {
+        switch (opt) {
+        case 'u': unixDomain = TRUE;                                break;
+        case 'p': service = optarg;                                 break;
+        case 'b': batchList = optarg;                               break;
+        case 'n': total = getLong(optarg, GN_GT_0, "datagrams");    break;
+        case 's': msgSize = getInt(optarg, GN_GT_0, "msg-size");    break;
+        default:  usageError(argv[0]);
+        }
+    }
+
+    if (unixDomain == (optind < argc))  /* Need 'host' iff UDP */
+        usageError(argv[0]);
+
+    if (msgSize == 0)
+        msgSize = unixDomain ? BUF_SIZE : 64;
+    if (msgSize > MAX_MSG || msgSize < SEQ_LEN)
+        cmdLineErr("msg-size must be from %d to %d\n", SEQ_LEN, MAX_MSG);
+
+    if (unixDomain) {
+
+        /* As in ud_ucase_cl.c, bind to a unique pathname, so that the
+           server can reply to us */
+
+        sfd = socket(AF_UNIX, SOCK_DGRAM, 0);
+        if (sfd == -1)
+            errExit("socket");
+
+        memset(&claddr, 0, sizeof(struct sockaddr_un));
+        claddr.sun_family = AF_UNIX;
+        snprintf(claddr.sun_path, sizeof(claddr.sun_path),
+                "/tmp/dgram_blast_cl.%ld", (long) getpid());
+        if (bind(sfd, (struct sockaddr *) &claddr,
+                 sizeof(struct sockaddr_un)) == -1)
+            errExit("bind");
+
+        memset(&svaddr, 0, sizeof(struct sockaddr_un));
+        svaddr.sun_family = AF_UNIX;
+        strncpy(svaddr.sun_path, SV_SOCK_PATH, sizeof(svaddr.sun_path) - 1);
+        if (connect(sfd, (struct sockaddr *) &svaddr,
+                    sizeof(struct sockaddr_un)) == -1)
+            errExit("connect");
+    } else {
+        sfd = inetConnect(argv[optind], service, SOCK_DGRAM);
+        if (sfd == -1)
+            errExit("inetConnect");
+    }
+
+    tv.tv_sec = 0;
+    tv.tv_usec = REPLY_TIMEOUT_MS * 1000;
+    if (setsockopt(sfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1)
+        errExit("setsockopt");
+
+    printf("%8s %10s %10s %10s %12s\n", "batch", "sent", "lost", "late",
+           "pkts/s");
+
+    batchList = strdup(batchList);      /* strtok_r() modifies its argument */
+    if (batchList == NULL)
+        errExit("strdup");
+
+    for (tok = strtok_r(batchList, ",", &saveptr); tok != NULL;
+            tok = strtok_r(NULL, ",", &saveptr)) {
+        batch = getInt(tok, GN_GT_0, "batch-size");
+        if (batch > MAX_BATCH)
+            cmdLineErr("batch-size must be at most %d\n", MAX_BATCH);
+
+        numRecv = blast(sfd, batch, total, msgSize, &late, &elapsed);
+        printf("%8d %10ld %10ld %10ld %12.0f\n", batch, total,
+                total - numRecv, late, numRecv / elapsed);
+    }
+
+    if (unixDomain)
+        remove(claddr.sun_path);        /* Remove client socket pathname */
+    exit(EXIT_SUCCESS);
+}
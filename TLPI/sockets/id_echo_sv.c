@@ -16,35 +16,145 @@
    reads datagrams and then sends copies back to the originating address.
 
    NOTE: this program must be run under a root login, in order to allow the
-   "echo" port (7) to be bound. Alternatively, for test purposes, you can edit
-   id_echo.h and replace the SERVICE name with a suitable unreserved port
-   number (e.g., "51000"), and make a corresponding change in the client.
+   "echo" port (7) to be bound. Alternatively, for test purposes, you can
+   use the "-p" option to specify a suitable unreserved port number
+   (e.g., "51000"), and make a corresponding change in the client.
 
-   See also id_echo_cl.c.
+   Usage: id_echo_sv [-F] [-b batch-size] [-p service]
+
+   By default, one recvfrom() and one sendto() call are made per datagram.
+   With "-b", up to 'batch-size' datagrams are received with a single
+   recvmmsg() call and echoed with a single sendmmsg() call, using a
+   preallocated set of mmsghdr/iovec slots. "-F" keeps the server in the
+   foreground, rather than making it a daemon.
+
+   See also id_echo_cl.c and dgram_blast_cl.c.
 */
+#define _GNU_SOURCE             /* To get recvmmsg() and sendmmsg() */
 #include <syslog.h>
 #include "id_echo.h"
 #include "become_daemon.h"
 
+#define MAX_BATCH 1024
+
+/* Slots for batched I/O. Each datagram is received into its own buffer,
+   and the sender's address is recorded alongside, so that the same
+   mmsghdr array can then be passed to sendmmsg() to echo the batch. */
+
+static struct mmsghdr msgs[MAX_BATCH];
+static struct iovec iovs[MAX_BATCH];
+static struct sockaddr_storage addrs[MAX_BATCH];
+static char bufs[MAX_BATCH][BUF_SIZE];
+
+static void
+resetSlots(int batch)
+{
+    int j;
+
+    for (j = 0; j < batch; j++) {
+        iovs[j].iov_base = bufs[j];
+        iovs[j].iov_len = BUF_SIZE;
+        msgs[j].msg_hdr.msg_name = &addrs[j];
+        msgs[j].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+        msgs[j].msg_hdr.msg_iov = &iovs[j];
+        msgs[j].msg_hdr.msg_iovlen = 1;
+        msgs[j].msg_hdr.msg_control = NULL;
+        msgs[j].msg_hdr.msg_controllen = 0;
+        msgs[j].msg_hdr.msg_flags = 0;
+    }
+}
+
+/* Receive datagrams in batches and return copies to senders */
+
+static void
+serveBatched(int sfd, int batch)
+{
+    int numRecv, numSent, j, s;
+
+    for (;;) {
+        resetSlots(batch);
+
+        /* MSG_WAITFORONE: block for the first datagram only, then
+           take whatever else is already queued */
+
+        numRecv = recvmmsg(sfd, msgs, batch, MSG_WAITFORONE, NULL);
+        if (numRecv == -1) {
+            if (errno == EINTR)
+                continue;
+            errExit("recvmmsg");
+        }
+
+        /* Each reply is the same length as the corresponding request,
+           and goes to the address recorded by recvmmsg() */
+
+        for (j = 0; j < numRecv; j++)
+            iovs[j].iov_len = msgs[j].msg_len;
+
+        /* sendmmsg() may send fewer than the requested number of
+           datagrams; if it fails on a datagram, skip that one */
+
+        for (numSent = 0; numSent < numRecv; numSent += s) {
+            s = sendmmsg(sfd, &msgs[numSent], numRecv - numSent, 0);
+            if (s == -1) {
+                syslog(LOG_WARNING, "Error echoing response (%s)",
+                        strerror(errno));
+                s = 1;
+            }
+        }
+    }
+}
+
+static void
+usageError(const char *pname)
+{
+    fprintf(stderr, "Usage: %s [-F] [-b batch-size] [-p service]\n", pname);
+    fprintf(stderr, "    -F   Stay in foreground (don't become a daemon)\n");
+    fprintf(stderr, "    -b   Use recvmmsg()/sendmmsg() with batches of up "
+                    "to 'batch-size' (max %d)\n", MAX_BATCH);
+    fprintf(stderr, "    -p   Service name or port (default: \"%s\")\n",
+                    SERVICE);
+    exit(EXIT_FAILURE);
+}
+
 int
 main(int argc, char *argv[])
 {
-    int sfd;
+    int sfd, opt, batch;
+    Boolean foreground;
+    const char *service;
     ssize_t numRead;
     socklen_t len;
     struct sockaddr_storage claddr;
     char buf[BUF_SIZE];
     char addrStr[IS_ADDR_STR_LEN];
 
-    if (becomeDaemon(0) == -1)
+    foreground = FALSE;
+    batch = 0;
+    service = SERVICE;
+    while ((opt = getopt(argc, argv, "Fb:p:")) != -1) {
+        switch (opt) {
+        case 'F': foreground = TRUE;                                break;
+        case 'b': batch = getInt(optarg, GN_GT_0, "batch-size");    break;
+        case 'p': service = optarg;                                 break;
+        default:  usageError(argv[0]);
+        }
+    }
+
+    if (batch > MAX_BATCH)
+        usageError(argv[0]);
+
+    if (!foreground && becomeDaemon(0) == -1)
         errExit("becomeDaemon");
 
-    sfd = inetBind(SERVICE, SOCK_DGRAM, NULL);
+    sfd = inetBind(service, SOCK_DGRAM, NULL);
     if (sfd == -1) {
         syslog(LOG_ERR, "Could not create server socket (%s)", strerror(errno));
         exit(EXIT_FAILURE);
     }
 
+    if (batch > 0)
+        serveBatched(sfd, batch);       /* Doesn't return */
+
     /* Receive datagrams and return copies to senders */
 
     for (;;) {
@@ -0,0 +1,338 @@
+/*************************************************************************\
+*                  Copyright (C) Michael Kerrisk, 2020.                   *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU General Public License as published by the   *
+* Free Software Foundation, either version 3 or (at your option) any      *
+* later version. This program is distributed without any warranty.  See   *
+* the file COPYING.gpl-v3 for details.                                    *
+\*************************************************************************/
+
+/* Supplementary program for Chapter 60 */
+
+/* is_echo_bench_cl.c
+
+   A benchmark client for the concurrency models of is_echo_sv.c.
+
+   Usage: is_echo_bench_cl [-p service] [-t threads] [-n conns-per-thread]
+                           [-s msg-size] [-P server-pid [-k idle-conns]] host
+
+   The program measures two things:
+
+   1. Connection rate. Each of 'threads' threads repeatedly connects to
+      the server, sends a message of 'msg-size' bytes, reads the echoed
+      message back, and closes the connection. The number of connections
+      completed per second is reported.
+
+   2. Memory per connection (only if "-P" is given). The proportional set
+      size (Pss, from /proc/PID/smaps_rollup) of the server process and
+      all of its descendants is summed, then 'idle-conns' connections are
+      opened and left idle, and the sum is taken again. The difference,
+      divided by 'idle-conns', is reported. Note that with the "prefork"
+      and "threads" models, connections beyond the number of workers just
+      wait in the listen backlog, so the figure shows the fixed cost of
+      the pool rather than a per-connection cost.
+
+   For example:
+
+        $ ./is_echo_sv -F -p 51000 -m prefork -n 16 &
+        $ ./is_echo_bench_cl -p 51000 -t 8 -n 5000 -P $! -k 1000 localhost
+
+   (The idle connections need one file descriptor each, so it may be
+   necessary to raise the RLIMIT_NOFILE limit with "ulimit -n".)
+
+   See also is_echo_sv.c.
+*/
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <dirent.h>
+#include <ctype.h>
+#include <limits.h>
+#include "inet_sockets.h"
+#include "rdwrn.h"
+#include "tlpi_hdr.h"
+
+#define CONNECT_TIMEOUT 3        /* Seconds allowed for each idle connect() */
+
+#define MAX_PROCS 65536         /* Max. processes considered when summing
+                                   the server's memory usage */
+
+static const char *host;
+static const char *service;
+static int connsPerThread;
+static size_t msgSize;
+
+struct threadArg {
+    pthread_t tid;
+    long numDone;
+};
+
+static void     /* SIGALRM handler: interrupts blocked connect() */
+alarmHandler(int sig)
+{
+}
+
+static double
+timeNow(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        errExit("clock_gettime");
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *
+threadFunc(void *arg)
+{
+    struct threadArg *ta = arg;
+    char *out, *in;
+    int sfd, j;
+
+    out = malloc(msgSize);
+    in = malloc(msgSize);
+    if (out == NULL || in == NULL)
+        errExit("malloc");
+    memset(out, 'x', msgSize);
+
+    for (j = 0; j < connsPerThread; j++) {
+        sfd = inetConnect(host, service, SOCK_STREAM);
+        if (sfd == -1)
+            continue;
+
+        if (writen(sfd, out, msgSize) == msgSize &&
+                readn(sfd, in, msgSize) == msgSize)
+            ta->numDone++;
+
+        close(sfd);
+    }
+
+    free(out);
+    free(in);
+    return NULL;
+}
+
+/* Return the Pss (in kB) of process 'pid', or 0 if it can't be read */
+
+static long
+pssOf(pid_t pid)
+{
+    char path[64], line[256];
+    FILE *fp;
+    long kb;
+
+    snprintf(path, sizeof(path), "/proc/%ld/smaps_rollup", (long) pid);
+    fp = fopen(path, "r");
+    if (fp == NULL)
+        return 0;
+
+    kb = 0;
+    while (fgets(line, sizeof(line), fp) != NULL)
+        if (sscanf(line, "Pss: %ld kB", &kb) == 1)
+            break;
+
+    fclose(fp);
+    return kb;
+}
+
+/* Sum the Pss of 'root' and all of its descendants */
+
+static long
+treePss(pid_t root)
+{
+    static pid_t pids[MAX_PROCS], ppids[MAX_PROCS];
+    static char inTree[MAX_PROCS];
+    char path[PATH_MAX], buf[512];
+    struct dirent *dp;
+    DIR *dirp;
+    FILE *fp;
+    char *p;
+    int nproc, j, k, changed;
+    long ppid, total;
+
+    /* Take a snapshot of the (PID, PPID) pairs of all processes */
+
+    dirp = opendir("/proc");
+    if (dirp == NULL)
+        errExit("opendir");
+
+    nproc = 0;
+    while ((dp = readdir(dirp)) != NULL && nproc < MAX_PROCS) {
+        if (!isdigit((unsigned char) dp->d_name[0]))
+            continue;
+
+        snprintf(path, sizeof(path), "/proc/%s/stat", dp->d_name);
+        fp = fopen(path, "r");
+        if (fp == NULL)
+            continue;                   /* Process has gone away */
+        p = fgets(buf, sizeof(buf), fp);
+        fclose(fp);
+        if (p == NULL)
+            continue;
+
+        /* The command name may contain spaces or parentheses; the
+           fields that we want follow the last ')' */
+
+        p = strrchr(buf, ')');
+        if (p == NULL || sscanf(p + 1, " %*c %ld", &ppid) != 1)
+            continue;
+
+        pids[nproc] = atol(dp->d_name);
+        ppids[nproc] = ppid;
+        inTree[nproc] = (pids[nproc] == root);
+        nproc++;
+    }
+    closedir(dirp);
+
+    /* Mark descendants of 'root', repeating until nothing changes */
+
+    do {
+        changed = 0;
+        for (j = 0; j < nproc; j++) {
+            if (inTree[j])
+                continue;
+            for (k = 0; k < nproc; k++) {
+                if (inTree[k] && pids[k] == ppids[j]) {
+                    inTree[j] = 1;
+                    changed = 1;
+                    break;
+                }
+            }
+        }
+    } while (changed);
+
+    total = 0;
+    for (j = 0; j < nproc; j++)
+        if (inTree[j])
+            total += pssOf(pids[j]);
+
+    return total;
+}
+
+static void
+usageError(const char *pname)
+{
+    fprintf(stderr, "Usage: %s [-p service] [-t threads] "
+            "[-n conns-per-thread] [-s msg-size]\n"
+            "           [-P server-pid [-k idle-conns]] host\n", pname);
+    fprintf(stderr, "    -p   Service name or port (default: \"echo\")\n");
+    fprintf(stderr, "    -t   Client threads (default: 4)\n");
+    fprintf(stderr, "    -n   Connections made by each thread "
+                    "(default: 2000)\n");
+    fprintf(stderr, "    -s   Message size (default: 64)\n");
+    fprintf(stderr, "    -P   PID of server; enables memory measurement\n");
+    fprintf(stderr, "    -k   Idle connections held open for memory "
+                    "measurement (default: 500)\n");
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct threadArg *ta;
+    int numThreads, numIdle, opt, s, j;
+    pid_t serverPid;
+    long total, before, after;
+    int *idle, numOpen;
+    struct sigaction sa;
+    double start, elapsed;
+
+    service = "echo";
+    numThreads = 4;
+    connsPerThread = 2000;
+    msgSize = 64;
+    serverPid = 0;
+    numIdle = 500;
+    while ((opt = getopt(argc, argv, "p:t:n:s:P:k:")) != -1) {
+        switch (opt) {
+        case 'p': service = optarg;                                     break;
+        case 't': numThreads = getInt(optarg, GN_GT_0, "threads");      break;
+        case 'n': connsPerThread = getInt(optarg, GN_GT_0, "conns");    break;
+        case 's': msgSize = getInt(optarg, GN_GT_0, "msg-size");        break;
+        case 'P': serverPid = getInt(optarg, GN_GT_0, "server-pid");    break;
+        case 'k': numIdle = getInt(optarg, GN_GT_0, "idle-conns");      break;
+        default:  usageError(argv[0]);
+        }
+    }
+
+    if (optind >= argc)
+        usageError(argv[0]);
+    host = argv[optind];
+
+    /* Connection rate */
+
+    ta = calloc(numThreads, sizeof(struct threadArg));
+    if (ta == NULL)
+        errExit("calloc");
+
+    start = timeNow();
+    for (j = 0; j < numThreads; j++) {
+        s = pthread_create(&ta[j].tid, NULL, threadFunc, &ta[j]);
+        if (s != 0)
+            errExitEN(s, "pthread_create");
+    }
+
+    total = 0;
+    for (j = 0; j < numThreads; j++) {
+        s = pthread_join(ta[j].tid, NULL);
+        if (s != 0)
+            errExitEN(s, "pthread_join");
+        total += ta[j].numDone;
+    }
+    elapsed = timeNow() - start;
+
+    printf("threads: %d; msg-size: %zu; connections: %ld ok, %ld failed\n",
+           numThreads, msgSize, total,
+           (long) numThreads * connsPerThread - total);
+    printf("connections/s: %.0f\n", total / elapsed);
+
+    if (serverPid == 0)
+        exit(EXIT_SUCCESS);
+
+    /* Memory per connection */
+
+    sleep(1);                   /* Let "fork" model children finish */
+    before = treePss(serverPid);
+
+    idle = calloc(numIdle, sizeof(int));
+    if (idle == NULL)
+        errExit("calloc");
+
+    /* Once the server's listen backlog is full (which happens quickly
+       with the "prefork" and "threads" models), connect() blocks until
+       the kernel gives up, which may take minutes. So we place a timeout
+       on each connect() and stop opening connections if it expires. */
+
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;                    /* Interrupt connect() */
+    sa.sa_handler = alarmHandler;
+    if (sigaction(SIGALRM, &sa, NULL) == -1)
+        errExit("sigaction");
+
+    for (numOpen = 0; numOpen < numIdle; numOpen++) {
+        alarm(CONNECT_TIMEOUT);
+        idle[numOpen] = inetConnect(host, service, SOCK_STREAM);
+        alarm(0);
+        if (idle[numOpen] == -1) {
+            fprintf(stderr, "Could not open idle connection %d; "
+                    "continuing with %d\n", numOpen, numOpen);
+            break;
+        }
+    }
+
+    if (numOpen == 0)
+        fatal("No idle connections could be opened");
+
+    sleep(1);                   /* Let server accept the connections */
+    after = treePss(serverPid);
+
+    printf("server Pss: %ld kB idle, %ld kB with %d connections; "
+           "%.2f kB/connection\n", before, after, numOpen,
+           (double) (after - before) / numOpen);
+
+    for (j = 0; j < numOpen; j++)
+        close(idle[j]);
+
+    exit(EXIT_SUCCESS);
+}
@@ -16,20 +16,58 @@
 
    NOTE: this program must be run under a root login, in order to allow the
    "echo" port (7) to be bound. Alternatively, for test purposes, you can
-   replace the SERVICE name below with a suitable unreserved port number
+   use the "-p" option to specify a suitable unreserved port number
    (e.g., "51000"), and make a corresponding change in the client.
 
-   See also is_echo_cl.c.
+   Usage: is_echo_sv [-F] [-m model] [-n workers] [-p service]
+
+   The "-m" option selects the concurrency model:
+
+   fork     (the default) A new child process is created for each client,
+            and terminated children are reaped by a SIGCHLD handler.
+
+   prefork  'workers' child processes are created at startup. Each of them
+            sits in a loop accepting connections on the shared listening
+            socket and handling them one at a time. The parent restarts any
+            worker that terminates.
+
+   threads  A fixed pool of 'workers' threads, each of which accepts and
+            handles connections on the shared listening socket.
+
+   epoll    A single thread multiplexes all clients using epoll and
+            nonblocking I/O.
+
+   With the "prefork" and "threads" models, at most 'workers' clients are
+   served concurrently; further clients wait in the listen backlog.
+
+   The "-F" option keeps the server in the foreground, rather than making
+   it a daemon.
+
+   See also is_echo_cl.c and is_echo_bench_cl.c.
 */
+#define _GNU_SOURCE             /* To get accept4() */
 #include <signal.h>
 #include <syslog.h>
+#include <pthread.h>
 #include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+#include <fcntl.h>
+#include <time.h>
 #include "become_daemon.h"
 #include "inet_sockets.h"       /* Declarations of inet*() socket functions */
 #include "tlpi_hdr.h"
 
 #define SERVICE "echo"          /* Name of TCP service */
 #define BUF_SIZE 4096
+#define BACKLOG 10              /* As in the book's version of this program
+                                   (which used only the "fork" model) */
+#define BIG_BACKLOG 128         /* For the other models, which are meant to
+                                   be benchmarked with many clients */
+#define MAX_EVENTS 64           /* Max. # of events returned by a single
+                                   epoll_wait() call */
+#define ACCEPT_PAUSE_MS 100     /* How long the "epoll" model stops
+                                   accepting after an accept() failure */
 
 static void             /* SIGCHLD handler to reap dead child processes */
 grimReaper(int sig)
@@ -42,9 +80,10 @@ grimReaper(int sig)
     errno = savedErrno;
 }
 
-/* Handle a client request: copy socket input back to socket */
+/* Handle a client request: copy socket input back to socket.
+   Returns 0 on success, or -1 on error (which has been logged). */
 
-static void
+static int
 handleRequest(int cfd)
 {
     char buf[BUF_SIZE];
@@ -53,24 +92,48 @@ handleRequest(int cfd)
     while ((numRead = read(cfd, buf, BUF_SIZE)) > 0) {
         if (write(cfd, buf, numRead) != numRead) {
             syslog(LOG_ERR, "write() failed: %s", strerror(errno));
-            exit(EXIT_FAILURE);
+            return -1;
         }
     }
 
     if (numRead == -1) {
         syslog(LOG_ERR, "Error from read(): %s", strerror(errno));
-        exit(EXIT_FAILURE);
+        return -1;
     }
+
+    return 0;
 }
 
-int
-main(int argc, char *argv[])
+/* Repeatedly accept a connection on 'lfd' and handle it. Used by the
+   "prefork" workers and by the threads of the "threads" pool. Never
+   returns. */
+
+static void
+acceptLoop(int lfd)
 {
-    int lfd, cfd;               /* Listening and connected sockets */
-    struct sigaction sa;
+    int cfd;
 
-    if (becomeDaemon(0) == -1)
-        errExit("becomeDaemon");
+    for (;;) {
+        cfd = accept(lfd, NULL, NULL);
+        if (cfd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            syslog(LOG_ERR, "Failure in accept(): %s", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        handleRequest(cfd);             /* Errors are logged; carry on */
+        close(cfd);
+    }
+}
+
+/* "fork" model: one child per connection */
+
+static void
+serveFork(int lfd)
+{
+    struct sigaction sa;
+    int cfd;
 
     /* Establish SIGCHLD handler to reap terminated child processes */
 
@@ -82,12 +145,6 @@ main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
-    lfd = inetListen(SERVICE, 10, NULL);
-    if (lfd == -1) {
-        syslog(LOG_ERR, "Could not create server socket (%s)", strerror(errno));
-        exit(EXIT_FAILURE);
-    }
-
     for (;;) {
         cfd = accept(lfd, NULL, NULL);  /* Wait for connection */
         if (cfd == -1) {
@@ -105,8 +162,7 @@ main(int argc, char *argv[])
 
         case 0:                         /* Child */
             close(lfd);                 /* Unneeded copy of listening socket */
-            handleRequest(cfd);
-            _exit(EXIT_SUCCESS);
+            _exit(handleRequest(cfd) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
 
         default:                        /* Parent */
             close(cfd);                 /* Unneeded copy of connected socket */
@@ -114,3 +170,367 @@ main(int argc, char *argv[])
         }
     }
 }
+
+/* "prefork" model: a fixed set of children share the listening socket */
+
+static pid_t
+startWorker(int lfd)
+{
+    pid_t pid, parentPid;
+
+    parentPid = getpid();
+    pid = fork();
+    if (pid == 0) {
+
+        /* Make sure that workers don't outlive the parent, which would
+           otherwise leave them holding the listening port */
+
+        if (prctl(PR_SET_PDEATHSIG, SIGTERM) == -1 || getppid() != parentPid)
+            _exit(EXIT_FAILURE);
+
+        acceptLoop(lfd);
+        _exit(EXIT_SUCCESS);            /* Not reached */
+    }
+    if (pid == -1)
+        syslog(LOG_ERR, "Can't create child (%s)", strerror(errno));
+    return pid;
+}
+
+static void
+servePrefork(int lfd, int numWorkers)
+{
+    pid_t pid;
+    int j;
+
+    for (j = 0; j < numWorkers; j++)
+        if (startWorker(lfd) == -1)
+            exit(EXIT_FAILURE);
+
+    /* Replace any worker that dies. If fork() fails, wait and retry,
+       since the failure may be temporary. */
+
+    for (;;) {
+        pid = wait(NULL);
+        if (pid == -1) {
+            if (errno == EINTR)
+                continue;
+            syslog(LOG_ERR, "Error from wait(): %s", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        while (startWorker(lfd) == -1)
+            sleep(1);
+    }
+}
+
+/* "threads" model: a fixed pool of threads share the listening socket */
+
+static void *
+poolThreadFunc(void *arg)
+{
+    acceptLoop((int) (long) arg);
+    return NULL;                        /* Not reached */
+}
+
+static void
+serveThreads(int lfd, int numWorkers)
+{
+    pthread_t tid;
+    int j, s;
+
+    for (j = 0; j < numWorkers; j++) {
+        s = pthread_create(&tid, NULL, poolThreadFunc, (void *) (long) lfd);
+        if (s != 0) {
+            syslog(LOG_ERR, "pthread_create() failed: %s", strerror(s));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* Pool threads run forever. We don't use pthread_exit() here, since
+       that would make the memory statistics in /proc/PID unavailable
+       (see is_echo_bench_cl.c). */
+
+    for (;;)
+        pause();
+}
+
+/* "epoll" model: a single thread, nonblocking I/O. If the peer is not
+   reading fast enough, unwritten data is held in the connection's buffer,
+   and we stop reading from that peer until the buffer has drained. */
+
+struct conn {
+    int fd;
+    uint32_t events;            /* Current epoll interest set */
+    size_t len;                 /* Bytes of pending output in 'buf' */
+    size_t off;                 /* Bytes of pending output already sent */
+    char buf[BUF_SIZE];
+};
+
+/* Set the epoll interest set of 'c' to 'events', if it isn't already */
+
+static int
+setInterest(int epfd, struct conn *c, uint32_t events)
+{
+    struct epoll_event ev;
+
+    if (c->events == events)
+        return 0;
+
+    ev.events = events;
+    ev.data.ptr = c;
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev) == -1)
+        return -1;
+    c->events = events;
+    return 0;
+}
+
+/* Service a ready client. Returns 0 if the connection should be kept,
+   or -1 if it should be closed. */
+
+static int
+serviceConn(int epfd, struct conn *c)
+{
+    ssize_t numRead, numWritten;
+
+    for (;;) {
+        while (c->off < c->len) {       /* Drain pending output first */
+            numWritten = write(c->fd, c->buf + c->off, c->len - c->off);
+            if (numWritten == -1) {
+                if (errno == EINTR)
+                    continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    return -1;
+
+                /* Peer is slow: wait for EPOLLOUT, and stop reading */
+
+                return setInterest(epfd, c, EPOLLOUT);
+            }
+            c->off += numWritten;
+        }
+
+        numRead = read(c->fd, c->buf, BUF_SIZE);
+        if (numRead == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return -1;
+            break;
+        }
+        if (numRead == 0)
+            return -1;                  /* EOF */
+
+        c->len = numRead;
+        c->off = 0;
+    }
+
+    return setInterest(epfd, c, EPOLLIN);
+}
+
+/* Return the current time on the monotonic clock, in milliseconds */
+
+static long long
+msecNow(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void
+serveEpoll(int lfd)
+{
+    struct epoll_event ev;
+    struct epoll_event evlist[MAX_EVENTS];
+    struct conn *c;
+    int epfd, cfd, ready, j, reserveFd, timeout;
+    long long resumeTime;               /* When to resume accepting, or 0 */
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) {
+        syslog(LOG_ERR, "epoll_create1() failed: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (fcntl(lfd, F_SETFL, fcntl(lfd, F_GETFL) | O_NONBLOCK) == -1) {
+        syslog(LOG_ERR, "fcntl() failed: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;                 /* NULL identifies the listener */
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev) == -1) {
+        syslog(LOG_ERR, "epoll_ctl() failed: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    /* A spare file descriptor, which is given up when we run out of
+       file descriptors, so that we can accept and close the connection
+       that we can't serve (as in is_seqnum_sv.c) */
+
+    reserveFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    resumeTime = 0;
+
+    for (;;) {
+        timeout = -1;
+        if (resumeTime != 0) {
+            timeout = resumeTime - msecNow();
+            if (timeout <= 0) {         /* Try accepting again */
+                ev.events = EPOLLIN;
+                ev.data.ptr = NULL;
+                if (epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev) == -1) {
+                    syslog(LOG_ERR, "epoll_ctl() failed: %s",
+                           strerror(errno));
+                    exit(EXIT_FAILURE);
+                }
+                resumeTime = 0;
+                timeout = -1;
+            }
+        }
+
+        ready = epoll_wait(epfd, evlist, MAX_EVENTS, timeout);
+        if (ready == -1) {
+            if (errno == EINTR)
+                continue;
+            syslog(LOG_ERR, "epoll_wait() failed: %s", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        for (j = 0; j < ready; j++) {
+            c = evlist[j].data.ptr;
+
+            if (c != NULL) {
+                if (serviceConn(epfd, c) == -1) {
+                    close(c->fd);
+                    free(c);
+                }
+                continue;
+            }
+
+            for (;;) {                  /* Accept all pending connections */
+                cfd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (cfd == -1) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK ||
+                            errno == EINTR || errno == ECONNABORTED)
+                        break;
+
+                    /* Typically EMFILE or ENFILE. The listening socket is
+                       level-triggered, so it would be reported again at
+                       once, and we would spin. Instead, accept and close
+                       one connection using the spare file descriptor, and
+                       stop watching the listening socket for a while. */
+
+                    syslog(LOG_ERR, "Failure in accept(): %s "
+                           "(pausing for %d ms)", strerror(errno),
+                           ACCEPT_PAUSE_MS);
+                    if (reserveFd != -1) {
+                        close(reserveFd);
+                        cfd = accept(lfd, NULL, NULL);
+                        if (cfd != -1)
+                            close(cfd);
+                        reserveFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+                    }
+                    if (epoll_ctl(epfd, EPOLL_CTL_DEL, lfd, NULL) == -1) {
+                        syslog(LOG_ERR, "epoll_ctl() failed: %s",
+                               strerror(errno));
+                        exit(EXIT_FAILURE);
+                    }
+                    resumeTime = msecNow() + ACCEPT_PAUSE_MS;
+                    break;
+                }
+
+                c = malloc(sizeof(struct conn));
+                if (c == NULL) {
+                    syslog(LOG_ERR, "malloc() failed");
+                    close(cfd);
+                    continue;
+                }
+                c->fd = cfd;
+                c->events = EPOLLIN;
+                c->len = c->off = 0;
+
+                ev.events = EPOLLIN;
+                ev.data.ptr = c;
+                if (epoll_ctl(epfd, EPOLL_CTL_ADD, cfd, &ev) == -1) {
+                    syslog(LOG_ERR, "epoll_ctl() failed: %s",
+                           strerror(errno));
+                    close(cfd);
+                    free(c);
+                }
+            }
+        }
+    }
+}
+
+static void
+usageError(const char *pname)
+{
+    fprintf(stderr, "Usage: %s [-F] [-m model] [-n workers] [-p service]\n",
+            pname);
+    fprintf(stderr, "    -F   Stay in foreground (don't become a daemon)\n");
+    fprintf(stderr, "    -m   Concurrency model: fork (default), prefork, "
+                    "threads, or epoll\n");
+    fprintf(stderr, "    -n   Number of workers for prefork/threads "
+                    "(default: 8)\n");
+    fprintf(stderr, "    -p   Service name or port (default: \"%s\")\n",
+            SERVICE);
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+    int lfd;                    /* Listening socket */
+    int opt, numWorkers;
+    Boolean foreground;
+    const char *model, *service;
+
+    foreground = FALSE;
+    model = "fork";
+    numWorkers = 8;
+    service = SERVICE;
+    while ((opt = getopt(argc, argv, "Fm:n:p:")) != -1) {
+        switch (opt) {
+        case 'F': foreground = TRUE;                                  break;
+        case 'm': model = optarg;                                     break;
+        case 'n': numWorkers = getInt(optarg, GN_GT_0, "workers");    break;
+        case 'p': service = optarg;                                   break;
+        default:  usageError(argv[0]);
+        }
+    }
+
+    if (strcmp(model, "fork") != 0 && strcmp(model, "prefork") != 0 &&
+            strcmp(model, "threads") != 0 && strcmp(model, "epoll") != 0)
+        usageError(argv[0]);
+
+    if (!foreground && becomeDaemon(0) == -1)
+        errExit("becomeDaemon");
+
+    /* Except in the "fork" model, where each process serves just one
+       client, ignore SIGPIPE, so that a client that goes away is reported
+       as an error from write(), rather than killing a process that
+       serves other clients too */
+
+    if (strcmp(model, "fork") != 0 && signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+        syslog(LOG_ERR, "Error from signal(): %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    lfd = inetListen(service, (strcmp(model, "fork") == 0) ?
+                              BACKLOG : BIG_BACKLOG, NULL);
+    if (lfd == -1) {
+        syslog(LOG_ERR, "Could not create server socket (%s)", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (strcmp(model, "prefork") == 0)
+        servePrefork(lfd, numWorkers);
+    else if (strcmp(model, "threads") == 0)
+        serveThreads(lfd, numWorkers);
+    else if (strcmp(model, "epoll") == 0)
+        serveEpoll(lfd);
+    else
+        serveFork(lfd);
+
+    exit(EXIT_FAILURE);                 /* Not reached */
+}
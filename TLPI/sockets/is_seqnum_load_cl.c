@@ -0,0 +1,236 @@
+/*************************************************************************\
+*                  Copyright (C) Michael Kerrisk, 2020.                   *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU General Public License as published by the   *
+* Free Software Foundation, either version 3 or (at your option) any      *
+* later version. This program is distributed without any warranty.  See   *
+* the file COPYING.gpl-v3 for details.                                    *
+\*************************************************************************/
+
+/* Supplementary program for Chapter 59 */
+
+/* is_seqnum_load_cl.c
+
+   A load-generating client for is_seqnum_sv.c. It performs the same
+   request/response exchange as is_seqnum_cl.c, but from several threads
+   at once, each making many requests (one connection per request, as the
+   server protocol requires). At the end, the aggregate request rate and
+   the 50th/99th percentile request latencies are reported.
+
+   Usage:  is_seqnum_load_cl [-t threads] [-n requests-per-thread]
+                             [-l sequence-len] server-host
+
+   For example, to compare the iterative and event-driven server modes:
+
+        $ ./is_seqnum_sv &
+        $ ./is_seqnum_load_cl -t 8 -n 10000 localhost
+        $ kill %1
+        $ ./is_seqnum_sv --workers 4 &
+        $ ./is_seqnum_load_cl -t 8 -n 10000 localhost
+
+   (Note that the iterative server prints a line for every connection,
+   so for a fair comparison, redirect its output to /dev/null.)
+
+   See also is_seqnum_cl.c and is_seqnum_sv.c.
+*/
+#include <netdb.h>
+#include <pthread.h>
+#include <time.h>
+#include "is_seqnum.h"
+
+struct threadArg {
+    pthread_t tid;
+    int numReqs;
+    long *latency;              /* Per-request latency, in nanoseconds */
+    int numDone;                /* Requests that completed successfully */
+};
+
+static struct addrinfo *srvAddrs;       /* From getaddrinfo() */
+static const char *reqLenStr;           /* Includes terminating newline */
+
+static long
+nsecSince(const struct timespec *start)
+{
+    struct timespec now;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &now) == -1)
+        errExit("clock_gettime");
+    return (now.tv_sec - start->tv_sec) * 1000000000L +
+           (now.tv_nsec - start->tv_nsec);
+}
+
+/* Perform one request, in the same way as is_seqnum_cl.c.
+   Returns 0 on success, or -1 on error. */
+
+static int
+doRequest(void)
+{
+    char seqNumStr[INT_LEN];
+    struct addrinfo *rp;
+    size_t len;
+    int cfd;
+
+    for (rp = srvAddrs; rp != NULL; rp = rp->ai_next) {
+        cfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+        if (cfd == -1)
+            continue;
+
+        if (connect(cfd, rp->ai_addr, rp->ai_addrlen) != -1)
+            break;
+
+        close(cfd);
+    }
+
+    if (rp == NULL)
+        return -1;
+
+    /* Send request and newline in a single write() */
+
+    len = strlen(reqLenStr);
+    if (write(cfd, reqLenStr, len) != len ||
+            readLine(cfd, seqNumStr, INT_LEN) <= 0) {
+        close(cfd);
+        return -1;
+    }
+
+    close(cfd);
+    return 0;
+}
+
+static void *
+threadFunc(void *arg)
+{
+    struct threadArg *ta = arg;
+    struct timespec start;
+    int j;
+
+    for (j = 0; j < ta->numReqs; j++) {
+        if (clock_gettime(CLOCK_MONOTONIC, &start) == -1)
+            errExit("clock_gettime");
+
+        if (doRequest() == -1)
+            continue;
+
+        ta->latency[ta->numDone++] = nsecSince(&start);
+    }
+
+    return NULL;
+}
+
+static int
+cmpLong(const void *a, const void *b)
+{
+    long x = *(const long *) a;
+    long y = *(const long *) b;
+
+    return (x > y) - (x < y);
+}
+
+static void
+usageError(const char *pname)
+{
+    fprintf(stderr, "Usage: %s [-t threads] [-n requests-per-thread] "
+                    "[-l sequence-len] server-host\n", pname);
+    fprintf(stderr, "    -t   Number of client threads (default: 4)\n");
+    fprintf(stderr, "    -n   Requests made by each thread "
+                    "(default: 10000)\n");
+    fprintf(stderr, "    -l   Sequence length requested (default: 1)\n");
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct addrinfo hints;
+    struct threadArg *ta;
+    struct timespec start;
+    long *all;
+    long elapsed, total;
+    int numThreads, numReqs, seqLen, opt, s, j;
+    char buf[INT_LEN + 1];
+
+    numThreads = 4;
+    numReqs = 10000;
+    seqLen = 1;
+    while ((opt = getopt(argc, argv, "t:n:l:")) != -1) {
+        switch (opt) {
+        case 't': numThreads = getInt(optarg, GN_GT_0, "threads");  break;
+        case 'n': numReqs = getInt(optarg, GN_GT_0, "requests");    break;
+        case 'l': seqLen = getInt(optarg, GN_GT_0, "sequence-len"); break;
+        default:  usageError(argv[0]);
+        }
+    }
+
+    if (optind >= argc)
+        usageError(argv[0]);
+
+    snprintf(buf, sizeof(buf), "%d\n", seqLen);
+    reqLenStr = buf;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;                /* Allows IPv4 or IPv6 */
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV;
+
+    if (getaddrinfo(argv[optind], PORT_NUM, &hints, &srvAddrs) != 0)
+        errExit("getaddrinfo");
+
+    ta = calloc(numThreads, sizeof(struct threadArg));
+    if (ta == NULL)
+        errExit("calloc");
+
+    for (j = 0; j < numThreads; j++) {
+        ta[j].numReqs = numReqs;
+        ta[j].latency = calloc(numReqs, sizeof(long));
+        if (ta[j].latency == NULL)
+            errExit("calloc");
+    }
+
+    if (clock_gettime(CLOCK_MONOTONIC, &start) == -1)
+        errExit("clock_gettime");
+
+    for (j = 0; j < numThreads; j++) {
+        s = pthread_create(&ta[j].tid, NULL, threadFunc, &ta[j]);
+        if (s != 0)
+            errExitEN(s, "pthread_create");
+    }
+
+    for (j = 0; j < numThreads; j++) {
+        s = pthread_join(ta[j].tid, NULL);
+        if (s != 0)
+            errExitEN(s, "pthread_join");
+    }
+
+    elapsed = nsecSince(&start);
+
+    /* Merge the per-thread latency samples and sort them, so that
+       percentiles can be picked out directly */
+
+    all = calloc((size_t) numThreads * numReqs, sizeof(long));
+    if (all == NULL)
+        errExit("calloc");
+
+    total = 0;
+    for (j = 0; j < numThreads; j++) {
+        memcpy(all + total, ta[j].latency, ta[j].numDone * sizeof(long));
+        total += ta[j].numDone;
+    }
+
+    printf("threads: %d; requests: %ld ok, %ld failed; elapsed: %.3f s\n",
+           numThreads, total, (long) numThreads * numReqs - total,
+           elapsed / 1e9);
+
+    if (total == 0)
+        exit(EXIT_FAILURE);
+
+    qsort(all, total, sizeof(long), cmpLong);
+
+    printf("requests/s: %.0f\n", total / (elapsed / 1e9));
+    printf("latency (usec): p50 = %.1f; p99 = %.1f; max = %.1f\n",
+           all[total / 2] / 1e3, all[(total * 99) / 100] / 1e3,
+           all[total - 1] / 1e3);
+
+    freeaddrinfo(srvAddrs);
+    exit(EXIT_SUCCESS);
+}
@@ -15,43 +15,65 @@
    A simple Internet stream socket server. Our service is to provide
    unique sequence numbers to clients.
 
-   Usage:  is_seqnum_sv [init-seq-num]
+   Usage:  is_seqnum_sv [--workers N] [init-seq-num]
                         (default = 0)
 
-   See also is_seqnum_cl.c.
+   By default, clients are handled iteratively, one at a time. With
+   "--workers N" (or "-w N"), N threads are created instead. Each thread
+   owns its own listening socket (bound to the same port using
+   SO_REUSEPORT, so that the kernel spreads incoming connections across
+   the threads) and its own epoll instance, and services many clients
+   concurrently using nonblocking I/O. The sequence number is shared by
+   all of the threads and is updated with an atomic fetch-and-add, so
+   that the granted sequences remain globally unique.
+
+   See also is_seqnum_cl.c and is_seqnum_load_cl.c.
 */
+#define _GNU_SOURCE             /* To get accept4() */
 #define _BSD_SOURCE             /* To get definitions of NI_MAXHOST and
                                    NI_MAXSERV from <netdb.h> */
 #include <netdb.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <time.h>
 #include "is_seqnum.h"
 
 #define BACKLOG 50
 
-int
-main(int argc, char *argv[])
+#define MAX_WORKERS 1024
+#define MAX_EVENTS 64           /* Max. # of events returned by a single
+                                   epoll_wait() call */
+#define ACCEPT_PAUSE_MS 100     /* How long a worker stops accepting
+                                   after running out of resources */
+
+static uint32_t seqNum;         /* Shared by all worker threads */
+
+/* Per-connection state for the event-driven (worker) mode. The request
+   line is accumulated in 'inBuf'; once it is complete, the reply is
+   placed in 'outBuf' and written out, possibly over several EPOLLOUT
+   notifications. */
+
+struct conn {
+    int fd;
+    size_t inLen;               /* Bytes accumulated in 'inBuf' */
+    char inBuf[INT_LEN];
+    size_t outLen;              /* Length of reply in 'outBuf' */
+    size_t outSent;             /* Bytes of reply written so far */
+    char outBuf[INT_LEN];
+};
+
+/* Create a listening socket for PORT_NUM. If 'reusePort' is true, then
+   SO_REUSEPORT is set, so that several sockets (one per worker thread)
+   can be bound to the same port. */
+
+static int
+createListener(Boolean reusePort)
 {
-    uint32_t seqNum;
-    char reqLenStr[INT_LEN];            /* Length of requested sequence */
-    char seqNumStr[INT_LEN];            /* Start of granted sequence */
-    struct sockaddr_storage claddr;
-    int lfd, cfd, optval, reqLen;
-    socklen_t addrlen;
     struct addrinfo hints;
     struct addrinfo *result, *rp;
-#define ADDRSTRLEN (NI_MAXHOST + NI_MAXSERV + 10)
-    char addrStr[ADDRSTRLEN];
-    char host[NI_MAXHOST];
-    char service[NI_MAXSERV];
-
-    if (argc > 1 && strcmp(argv[1], "--help") == 0)
-        usageErr("%s [init-seq-num]\n", argv[0]);
-
-    seqNum = (argc > 1) ? getInt(argv[1], 0, "init-seq-num") : 0;
-
-    /* Ignore the SIGPIPE signal, so that we find out about broken connection
-       errors via a failure from write(). */
-
-    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)    errExit("signal");
+    int lfd, optval;
 
     /* Call getaddrinfo() to obtain a list of addresses that
        we can try binding to */
@@ -81,6 +103,10 @@ main(int argc, char *argv[])
                 == -1)
              errExit("setsockopt");
 
+        if (reusePort && setsockopt(lfd, SOL_SOCKET, SO_REUSEPORT,
+                                    &optval, sizeof(optval)) == -1)
+             errExit("setsockopt-SO_REUSEPORT");
+
         if (bind(lfd, rp->ai_addr, rp->ai_addrlen) == 0)
             break;                      /* Success */
 
@@ -97,6 +123,310 @@ main(int argc, char *argv[])
 
     freeaddrinfo(result);
 
+    return lfd;
+}
+
+static void
+closeConn(struct conn *c)
+{
+    /* Closing the fd also removes it from the epoll interest list */
+
+    if (close(c->fd) == -1)
+        errMsg("close");
+    free(c);
+}
+
+/* Try to write the remainder of the reply for 'c'. Returns 1 if the
+   reply has been completely sent, 0 if the socket buffer is full (the
+   caller should wait for EPOLLOUT), or -1 on error. */
+
+static int
+flushReply(struct conn *c)
+{
+    ssize_t numWritten;
+
+    while (c->outSent < c->outLen) {
+        numWritten = write(c->fd, c->outBuf + c->outSent,
+                           c->outLen - c->outSent);
+        if (numWritten == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        c->outSent += numWritten;
+    }
+    return 1;
+}
+
+/* Handle input on a client connection. Returns 1 if the connection
+   should stay open (more data or buffer space is awaited), or 0 if it
+   has been dealt with and should be closed. */
+
+static int
+handleInput(int epfd, struct conn *c)
+{
+    struct epoll_event ev;
+    ssize_t numRead;
+    char *nl;
+    int reqLen, s;
+
+    for (;;) {
+        numRead = read(c->fd, c->inBuf + c->inLen,
+                       sizeof(c->inBuf) - 1 - c->inLen);
+        if (numRead == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 1;               /* Wait for rest of request */
+            return 0;                   /* Failed read; skip request */
+        }
+        if (numRead == 0)
+            return 0;                   /* EOF before complete request */
+
+        c->inLen += numRead;
+        c->inBuf[c->inLen] = '\0';
+
+        /* As with readLine(), an over-long line is truncated, rather
+           than treated as an error */
+
+        nl = memchr(c->inBuf, '\n', c->inLen);
+        if (nl != NULL || c->inLen == sizeof(c->inBuf) - 1)
+            break;
+    }
+
+    reqLen = atoi(c->inBuf);
+    if (reqLen <= 0)                    /* Watch for misbehaving clients */
+        return 0;
+
+    /* Reserve 'reqLen' sequence numbers. The value returned by the
+       fetch-and-add is the start of the granted sequence. */
+
+    snprintf(c->outBuf, INT_LEN, "%u\n",
+             __atomic_fetch_add(&seqNum, (uint32_t) reqLen, __ATOMIC_RELAXED));
+    c->outLen = strlen(c->outBuf);
+    c->outSent = 0;
+
+    s = flushReply(c);
+    if (s != 0)
+        return 0;                       /* Done (or error): close */
+
+    /* Socket buffer is full; wait until it can be written */
+
+    ev.events = EPOLLOUT;
+    ev.data.ptr = c;
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev) == -1)
+        return 0;
+    return 1;
+}
+
+/* Return the current time on the monotonic clock, in milliseconds */
+
+static long long
+msecNow(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void *
+workerFunc(void *arg)
+{
+    struct epoll_event ev;
+    struct epoll_event evlist[MAX_EVENTS];
+    struct conn *c;
+    int lfd, epfd, cfd, ready, j, reserveFd, timeout;
+    long long resumeTime;               /* When to resume accepting, or 0 */
+
+    lfd = createListener(TRUE);
+    if (fcntl(lfd, F_SETFL, fcntl(lfd, F_GETFL) | O_NONBLOCK) == -1)
+        errExit("fcntl");
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1)
+        errExit("epoll_create1");
+
+    /* The listening socket is distinguished by a NULL 'data.ptr' */
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev) == -1)
+        errExit("epoll_ctl");
+
+    /* A spare file descriptor, which is given up when we run out of
+       file descriptors, so that we can accept and close the connection
+       that we can't serve (see below) */
+
+    reserveFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    resumeTime = 0;
+
+    for (;;) {
+        timeout = -1;
+        if (resumeTime != 0) {
+            timeout = resumeTime - msecNow();
+            if (timeout <= 0) {         /* Try accepting again */
+                ev.events = EPOLLIN;
+                ev.data.ptr = NULL;
+                if (epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev) == -1)
+                    errExit("epoll_ctl");
+                resumeTime = 0;
+                timeout = -1;
+            }
+        }
+
+        ready = epoll_wait(epfd, evlist, MAX_EVENTS, timeout);
+        if (ready == -1) {
+            if (errno == EINTR)
+                continue;
+            errExit("epoll_wait");
+        }
+
+        for (j = 0; j < ready; j++) {
+            c = evlist[j].data.ptr;
+
+            if (c == NULL) {            /* New connection(s) */
+                for (;;) {
+                    cfd = accept4(lfd, NULL, NULL,
+                                  SOCK_NONBLOCK | SOCK_CLOEXEC);
+                    if (cfd == -1) {
+                        if (errno != EMFILE && errno != ENFILE &&
+                                errno != ENOBUFS && errno != ENOMEM) {
+                            if (errno != EAGAIN && errno != EWOULDBLOCK &&
+                                    errno != EINTR && errno != ECONNABORTED)
+                                errMsg("accept4");
+                            break;
+                        }
+
+                        /* Out of resources. The listening socket is
+                           level-triggered, so if we just returned to
+                           epoll_wait(), it would report the pending
+                           connection again at once, and we would spin.
+                           Instead, use the spare file descriptor to
+                           accept and close one connection (so that its
+                           client isn't left waiting), and stop watching
+                           the listening socket for a while. */
+
+                        errMsg("accept4 (pausing for %d ms)",
+                               ACCEPT_PAUSE_MS);
+                        if (reserveFd != -1) {
+                            close(reserveFd);
+                            cfd = accept(lfd, NULL, NULL);
+                            if (cfd != -1)
+                                close(cfd);
+                            reserveFd = open("/dev/null",
+                                             O_RDONLY | O_CLOEXEC);
+                        }
+                        if (epoll_ctl(epfd, EPOLL_CTL_DEL, lfd, NULL) == -1)
+                            errExit("epoll_ctl");
+                        resumeTime = msecNow() + ACCEPT_PAUSE_MS;
+                        break;
+                    }
+
+                    c = malloc(sizeof(struct conn));
+                    if (c == NULL)
+                        errExit("malloc");
+                    c->fd = cfd;
+                    c->inLen = 0;
+                    c->outLen = c->outSent = 0;
+
+                    ev.events = EPOLLIN | EPOLLRDHUP;
+                    ev.data.ptr = c;
+                    if (epoll_ctl(epfd, EPOLL_CTL_ADD, cfd, &ev) == -1)
+                        errExit("epoll_ctl");
+                }
+                continue;
+            }
+
+            if (c->outLen > 0) {        /* Reply pending; EPOLLOUT */
+                if (flushReply(c) != 0)
+                    closeConn(c);
+            } else if (handleInput(epfd, c) == 0) {
+                closeConn(c);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static void
+usageError(const char *pname)
+{
+    fprintf(stderr, "Usage: %s [--workers N] [init-seq-num]\n", pname);
+    fprintf(stderr, "    -w, --workers N   Serve clients using N event-loop "
+                    "threads\n");
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+    char reqLenStr[INT_LEN];            /* Length of requested sequence */
+    char seqNumStr[INT_LEN];            /* Start of granted sequence */
+    struct sockaddr_storage claddr;
+    int lfd, cfd, reqLen, opt, s, j;
+    int numWorkers;
+    pthread_t *workers;
+    socklen_t addrlen;
+#define ADDRSTRLEN (NI_MAXHOST + NI_MAXSERV + 10)
+    char addrStr[ADDRSTRLEN];
+    char host[NI_MAXHOST];
+    char service[NI_MAXSERV];
+    static const struct option longOpts[] = {
+        { "workers", required_argument, NULL, 'w' },
+        { "help",    no_argument,       NULL, 'h' },
+        { NULL,      0,                 NULL, 0   }
+    };
+
+    numWorkers = 0;
+    while ((opt = getopt_long(argc, argv, "w:h", longOpts, NULL)) != -1) {
+        switch (opt) {
+        case 'w':
+            numWorkers = getInt(optarg, GN_GT_0, "workers");
+            if (numWorkers > MAX_WORKERS)
+                cmdLineErr("At most %d workers\n", MAX_WORKERS);
+            break;
+        default:
+            usageError(argv[0]);
+        }
+    }
+
+    seqNum = (optind < argc) ? getInt(argv[optind], 0, "init-seq-num") : 0;
+
+    /* Ignore the SIGPIPE signal, so that we find out about broken connection
+       errors via a failure from write(). */
+
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)    errExit("signal");
+
+    if (numWorkers > 0) {
+
+        /* Event-driven mode: each worker creates its own listening socket
+           and epoll instance; the main thread just waits */
+
+        workers = calloc(numWorkers, sizeof(pthread_t));
+        if (workers == NULL)
+            errExit("calloc");
+
+        for (j = 0; j < numWorkers; j++) {
+            s = pthread_create(&workers[j], NULL, workerFunc, NULL);
+            if (s != 0)
+                errExitEN(s, "pthread_create");
+        }
+
+        for (j = 0; j < numWorkers; j++) {
+            s = pthread_join(workers[j], NULL);
+            if (s != 0)
+                errExitEN(s, "pthread_join");
+        }
+
+        exit(EXIT_SUCCESS);
+    }
+
+    lfd = createListener(FALSE);
+
     for (;;) {                  /* Handle clients iteratively */
 
         /* Accept a client connection, obtaining client's address */
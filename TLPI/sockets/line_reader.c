@@ -0,0 +1,176 @@
+/*************************************************************************\
+*                  Copyright (C) Michael Kerrisk, 2020.                   *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU Lesser General Public License as published   *
+* by the Free Software Foundation, either version 3 or (at your option)   *
+* any later version. This program is distributed without any warranty.    *
+* See the files COPYING.lgpl-v3 and COPYING.gpl-v3 for details.           *
+\*************************************************************************/
+
+/* line_reader.c
+
+   A buffered line reader: an alternative to readLine() (which makes one
+   read() call per byte) and readLineBuf() (which copies each character
+   out of a small fixed buffer).
+
+   Input is read in large blocks into a buffer owned by the LineReader.
+   Newlines are located with memchr() (which, in glibc, is vectorized),
+   and lineReaderNext() returns a pointer into the buffer rather than a
+   copy of the line. Thus, the returned line is valid only until the next
+   call to lineReaderNext() or lineReaderFree(), and is not null-terminated.
+
+   The buffer has an initial size of 'bufSize' bytes and, if 'maxSize' is
+   larger than that, it is doubled as necessary (up to 'maxSize') to hold
+   a complete line. A line that is still longer than the buffer is not
+   truncated; instead, it is returned in buffer-sized fragments. Each of
+   these fragments lacks a terminating newline, and 'lr->partial' is set
+   while returning them, so that the caller can tell them apart from the
+   last line of input when that line lacks a newline.
+
+   If 'fd' is nonblocking, lineReaderNext() fails with EAGAIN when no
+   complete line is available; the reader's state is preserved, so that
+   the call can be repeated once more input arrives (e.g., after
+   epoll_wait() reports the descriptor as readable).
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "line_reader.h"
+
+/* Initialize 'lr' to read from 'fd'. If 'bufSize' is 0, LR_DEFAULT_BUF is
+   used. If 'maxSize' is less than the initial size, the buffer is fixed.
+   Returns 0 on success, or -1 on error. */
+
+int
+lineReaderInit(struct LineReader *lr, int fd, size_t bufSize, size_t maxSize)
+{
+    if (bufSize == 0)
+        bufSize = LR_DEFAULT_BUF;
+
+    lr->buf = malloc(bufSize);
+    if (lr->buf == NULL)
+        return -1;
+
+    lr->fd = fd;
+    lr->size = bufSize;
+    lr->maxSize = (maxSize > bufSize) ? maxSize : bufSize;
+    lr->start = lr->end = lr->scanned = 0;
+    lr->eof = 0;
+    lr->partial = 0;
+    return 0;
+}
+
+void
+lineReaderFree(struct LineReader *lr)
+{
+    free(lr->buf);
+    lr->buf = NULL;
+}
+
+/* Make room for more input after 'lr->end': first by moving the
+   unconsumed bytes to the start of the buffer, then by growing the
+   buffer. Returns 0 if there is now free space, 1 if there is not (the
+   buffer is full and has reached 'maxSize'), or -1 on error. */
+
+static int
+makeRoom(struct LineReader *lr)
+{
+    size_t newSize;
+    char *newBuf;
+
+    if (lr->end < lr->size)
+        return 0;
+
+    if (lr->start > 0) {
+        memmove(lr->buf, lr->buf + lr->start, lr->end - lr->start);
+        lr->end -= lr->start;
+        lr->start = 0;
+        return 0;
+    }
+
+    if (lr->size >= lr->maxSize)
+        return 1;
+
+    newSize = (lr->size > lr->maxSize / 2) ? lr->maxSize : lr->size * 2;
+    newBuf = realloc(lr->buf, newSize);
+    if (newBuf == NULL)
+        return -1;
+
+    lr->buf = newBuf;
+    lr->size = newSize;
+    return 0;
+}
+
+/* Consume 'len' bytes from the start of the buffered data, and return
+   them as the next line */
+
+static ssize_t
+takeLine(struct LineReader *lr, size_t len, const char **line)
+{
+    *line = lr->buf + lr->start;
+    lr->start += len;
+    lr->scanned = 0;
+    if (lr->start == lr->end)           /* Buffer empty: rewind */
+        lr->start = lr->end = 0;
+    return (ssize_t) len;
+}
+
+/* Return the next line of input from 'lr'. On success, '*line' points at
+   the line (including its newline, if it has one) and the return value
+   is its length. The return value is 0 at end of input, or -1 on error.
+   For lines longer than the buffer, see the comments at the top of this
+   file. */
+
+ssize_t
+lineReaderNext(struct LineReader *lr, const char **line)
+{
+    ssize_t numRead;
+    size_t avail;
+    char *nl;
+
+    if (lr == NULL || lr->buf == NULL || line == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (;;) {
+
+        /* Search only the bytes not examined by a previous call */
+
+        avail = lr->end - lr->start;
+        nl = memchr(lr->buf + lr->start + lr->scanned, '\n',
+                    avail - lr->scanned);
+        if (nl != NULL) {
+            lr->partial = 0;
+            return takeLine(lr, nl - (lr->buf + lr->start) + 1, line);
+        }
+        lr->scanned = avail;
+
+        if (lr->eof) {                  /* Final line lacks a newline */
+            lr->partial = 0;
+            return (avail == 0) ? 0 : takeLine(lr, avail, line);
+        }
+
+        switch (makeRoom(lr)) {
+        case -1:
+            return -1;
+        case 1:                 /* Buffer is full of a single line:
+                                   hand back a fragment */
+            lr->partial = 1;
+            return takeLine(lr, avail, line);
+        }
+
+        numRead = read(lr->fd, lr->buf + lr->end, lr->size - lr->end);
+        if (numRead == -1) {
+            if (errno == EINTR)
+                continue;               /* Interrupted --> restart read() */
+            return -1;                  /* Includes EAGAIN */
+        }
+
+        if (numRead == 0)
+            lr->eof = 1;
+        lr->end += numRead;
+    }
+}
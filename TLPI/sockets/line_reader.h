@@ -0,0 +1,42 @@
+/*************************************************************************\
+*                  Copyright (C) Michael Kerrisk, 2020.                   *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU Lesser General Public License as published   *
+* by the Free Software Foundation, either version 3 or (at your option)   *
+* any later version. This program is distributed without any warranty.    *
+* See the files COPYING.lgpl-v3 and COPYING.gpl-v3 for details.           *
+\*************************************************************************/
+
+/* line_reader.h
+
+   Header file for line_reader.c.
+*/
+#ifndef LINE_READER_H
+#define LINE_READER_H           /* Prevent accidental double inclusion */
+
+#include <sys/types.h>
+
+#define LR_DEFAULT_BUF 8192
+
+struct LineReader {
+    int     fd;                 /* File descriptor from which to read */
+    char   *buf;                /* Buffered input */
+    size_t  size;               /* Allocated size of 'buf' */
+    size_t  maxSize;            /* Limit to which 'buf' may grow */
+    size_t  start;              /* Offset of first unconsumed byte */
+    size_t  end;                /* Offset just past last buffered byte */
+    size_t  scanned;            /* Bytes from 'start' known to hold no '\n' */
+    int     eof;                /* Nonzero once read() has returned 0 */
+    int     partial;            /* Nonzero if last line returned was a
+                                   fragment of a longer line */
+};
+
+int lineReaderInit(struct LineReader *lr, int fd, size_t bufSize,
+                   size_t maxSize);
+
+void lineReaderFree(struct LineReader *lr);
+
+ssize_t lineReaderNext(struct LineReader *lr, const char **line);
+
+#endif
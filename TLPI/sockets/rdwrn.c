@@ -12,12 +12,21 @@
 
 /* rdwrn.c
 
-   Implementations of readn() and written().
+   Implementations of readn() and written(), plus the vectored variants
+   readvn() and writevn(), and the resumable variants readvnResume() and
+   writevnResume() for use with nonblocking file descriptors.
 */
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <limits.h>
 #include <errno.h>
 #include "rdwrn.h"                      /* Declares readn() and writen() */
 
+#ifndef IOV_MAX
+#define IOV_MAX 16                      /* POSIX minimum (_XOPEN_IOV_MAX) */
+#endif
+
 /* Read 'n' bytes from 'fd' into 'buf', restarting after partial
    reads or interruptions by a signal handlers */
 
@@ -74,3 +83,208 @@ writen(int fd, const void *buffer, size_t n)
     }
     return (ssize_t)totWritten;                  /* Must be 'n' bytes if we get here */
 }
+
+/* Advance past 'n' transferred bytes in the iovec array described by
+   '*iov' and '*iovcnt': skip the iovecs that are now complete, and
+   adjust the first incomplete one to start where the transfer stopped */
+
+static void
+advanceIov(struct iovec **iov, int *iovcnt, size_t n)
+{
+    while (*iovcnt > 0 && n >= (*iov)->iov_len) {
+        n -= (*iov)->iov_len;
+        (*iov)++;
+        (*iovcnt)--;
+    }
+
+    if (*iovcnt > 0) {
+        (*iov)->iov_base = (char *) (*iov)->iov_base + n;
+        (*iov)->iov_len -= n;
+    }
+
+    /* Also drop any zero-length iovecs, so that "*iovcnt == 0" means
+       that the transfer is complete */
+
+    while (*iovcnt > 0 && (*iov)->iov_len == 0) {
+        (*iov)++;
+        (*iovcnt)--;
+    }
+}
+
+static size_t
+iovTotal(const struct iovec *iov, int iovcnt)
+{
+    size_t total;
+    int j;
+
+    total = 0;
+    for (j = 0; j < iovcnt; j++)
+        total += iov[j].iov_len;
+    return total;
+}
+
+/* Perform one readv() or writev(), passing at most IOV_MAX iovecs */
+
+static ssize_t
+doIo(int fd, const struct iovec *iov, int iovcnt, int isWrite)
+{
+    if (iovcnt > IOV_MAX)
+        iovcnt = IOV_MAX;
+    return isWrite ? writev(fd, iov, iovcnt) : readv(fd, iov, iovcnt);
+}
+
+/* Common code for readvn() and writevn(). The caller's iovec array is
+   not modified: a private copy is made if the first transfer is partial
+   (which, in the common case, it isn't). */
+
+static ssize_t
+rwvn(int fd, const struct iovec *iov, int iovcnt, int isWrite)
+{
+    struct iovec *copy, *cur;
+    ssize_t numXfer;
+    size_t totXfer;
+    int savedErrno;
+
+    if (iovcnt < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    copy = NULL;
+    cur = (struct iovec *) iov;         /* Not modified until copied */
+    totXfer = 0;
+
+    for (;;) {
+        while (iovcnt > 0 && cur->iov_len == 0) {
+            cur++;
+            iovcnt--;
+        }
+        if (iovcnt == 0)
+            break;
+
+        numXfer = doIo(fd, cur, iovcnt, isWrite);
+
+        /* For writes, as in writen(), a return of 0 should never happen,
+           but we don't want to loop forever if it does. For reads, 0
+           means EOF. */
+
+        if (numXfer == 0) {
+            if (isWrite) {
+                numXfer = -1;
+                errno = EIO;
+            } else {
+                break;
+            }
+        }
+        if (numXfer == -1) {
+            if (errno == EINTR)
+                continue;               /* Interrupted --> restart */
+            savedErrno = errno;
+            free(copy);
+            errno = savedErrno;
+            return -1;
+        }
+
+        totXfer += (size_t) numXfer;
+
+        if (copy == NULL && (size_t) numXfer < iovTotal(cur, iovcnt)) {
+            copy = malloc(iovcnt * sizeof(struct iovec));
+            if (copy == NULL)           /* Can't continue, but some bytes */
+                return (ssize_t) totXfer;       /* have been transferred */
+            memcpy(copy, cur, iovcnt * sizeof(struct iovec));
+            cur = copy;
+        }
+
+        if (copy == NULL)
+            break;                      /* Everything transferred at once */
+
+        advanceIov(&cur, &iovcnt, (size_t) numXfer);
+    }
+
+    free(copy);
+    return (ssize_t) totXfer;
+}
+
+/* Read into the buffers described by 'iov' until they are all full,
+   restarting after partial reads or interruptions by a signal handler.
+   As with readn(), the return value is less than the total size of the
+   buffers only if end-of-file was reached. */
+
+ssize_t
+readvn(int fd, const struct iovec *iov, int iovcnt)
+{
+    return rwvn(fd, iov, iovcnt, 0);
+}
+
+/* Write all of the buffers described by 'iov', restarting after partial
+   writes or interruptions by a signal handler */
+
+ssize_t
+writevn(int fd, const struct iovec *iov, int iovcnt)
+{
+    return rwvn(fd, iov, iovcnt, 1);
+}
+
+/* Prepare 'prog' for a resumable transfer of the buffers in 'iov' */
+
+void
+iovProgressInit(struct IovProgress *prog, struct iovec *iov, int iovcnt)
+{
+    prog->iov = iov;
+    prog->iovcnt = iovcnt;
+    prog->done = 0;
+    advanceIov(&prog->iov, &prog->iovcnt, 0);   /* Skip empty iovecs */
+}
+
+/* Common code for readvnResume() and writevnResume() */
+
+static ssize_t
+rwvnResume(int fd, struct IovProgress *prog, int isWrite)
+{
+    ssize_t numXfer;
+
+    while (prog->iovcnt > 0) {
+        numXfer = doIo(fd, prog->iov, prog->iovcnt, isWrite);
+
+        if (numXfer == 0) {
+            if (!isWrite)
+                break;                  /* EOF */
+            numXfer = -1;
+            errno = EIO;
+        }
+        if (numXfer == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;                  /* Includes EAGAIN */
+        }
+
+        prog->done += (size_t) numXfer;
+        advanceIov(&prog->iov, &prog->iovcnt, (size_t) numXfer);
+    }
+
+    return (ssize_t) prog->done;
+}
+
+/* Continue reading into the buffers recorded in 'prog'. Returns the
+   total number of bytes read (over all calls) once the buffers are full
+   or end-of-file is reached. If 'fd' is nonblocking and no more input is
+   available, -1 is returned with errno set to EAGAIN; the progress so
+   far is recorded in 'prog', and the call should be repeated when 'fd'
+   becomes readable. */
+
+ssize_t
+readvnResume(int fd, struct IovProgress *prog)
+{
+    return rwvnResume(fd, prog, 0);
+}
+
+/* Continue writing the buffers recorded in 'prog'. Returns the total
+   number of bytes written once everything has been written, or -1 on
+   error. As with readvnResume(), EAGAIN means "call again when 'fd' is
+   writable". */
+
+ssize_t
+writevnResume(int fd, struct IovProgress *prog)
+{
+    return rwvnResume(fd, prog, 1);
+}
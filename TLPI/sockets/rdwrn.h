@@ -18,9 +18,30 @@
 #define RDWRN_H
 
 #include <sys/types.h>
+#include <sys/uio.h>
 
 ssize_t readn(int fd, void *buf, size_t len);
 
 ssize_t writen(int fd, const void *buf, size_t len);
 
+ssize_t readvn(int fd, const struct iovec *iov, int iovcnt);
+
+ssize_t writevn(int fd, const struct iovec *iov, int iovcnt);
+
+/* Progress of a resumable (nonblocking) vectored transfer. The iovec
+   array passed to iovProgressInit() is updated in place as data is
+   transferred, so it must remain valid until the transfer completes. */
+
+struct IovProgress {
+    struct iovec *iov;          /* First iovec not yet fully transferred */
+    int     iovcnt;             /* Number of iovecs remaining */
+    size_t  done;               /* Total bytes transferred so far */
+};
+
+void iovProgressInit(struct IovProgress *prog, struct iovec *iov, int iovcnt);
+
+ssize_t readvnResume(int fd, struct IovProgress *prog);
+
+ssize_t writevnResume(int fd, struct IovProgress *prog);
+
 #endif
@@ -0,0 +1,189 @@
+/*************************************************************************\
+*                  Copyright (C) Michael Kerrisk, 2020.                   *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU General Public License as published by the   *
+* Free Software Foundation, either version 3 or (at your option) any      *
+* later version. This program is distributed without any warranty.  See   *
+* the file COPYING.gpl-v3 for details.                                    *
+\*************************************************************************/
+
+/* Supplementary program for Chapter 59 */
+
+/* read_line_bench.c
+
+   Compare the speed of three ways of reading lines from a file descriptor:
+
+   readLine()        One read() call per byte (read_line.c)
+   readLineBuf()     Blocks of RL_MAX_BUF bytes, copied out character by
+                     character (read_line_buf.c)
+   lineReaderNext()  Large blocks, memchr() to find the newline, and no
+                     copying (line_reader.c)
+
+   Usage: read_line_bench [-n num-lines] [-l line-len] [-b buf-size] [file]
+
+   A file containing 'num-lines' lines, each 'line-len' bytes long
+   (including the newline), is created (by default, in a temporary file
+   that is removed afterward), and then read with each of the methods in
+   turn. For each method, the elapsed time, lines/s, and MB/s are shown.
+   'buf-size' is the initial buffer size for lineReaderNext().
+
+   The number of lines counted by each method is also displayed, as a
+   check. Note that readLine() and readLineBuf() are given a buffer of
+   'line-len' + 1 bytes, so that no lines are truncated.
+*/
+#include <fcntl.h>
+#include <time.h>
+#include "read_line.h"
+#include "read_line_buf.h"
+#include "line_reader.h"
+#include "tlpi_hdr.h"
+
+static double
+timeNow(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        errExit("clock_gettime");
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+createFile(const char *path, long numLines, int lineLen)
+{
+    char *line;
+    long j;
+    int fd, k;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd == -1)
+        errExit("open-%s", path);
+
+    line = malloc(lineLen);
+    if (line == NULL)
+        errExit("malloc");
+    for (k = 0; k < lineLen - 1; k++)
+        line[k] = 'a' + k % 26;
+    line[lineLen - 1] = '\n';
+
+    for (j = 0; j < numLines; j++)
+        if (write(fd, line, lineLen) != lineLen)
+            fatal("write to %s failed", path);
+
+    free(line);
+    if (close(fd) == -1)
+        errExit("close");
+}
+
+static void
+report(const char *name, long lines, long bytes, double elapsed)
+{
+    printf("%-16s %10ld %9.3f %12.0f %10.1f\n", name, lines, elapsed,
+            lines / elapsed, bytes / elapsed / 1e6);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct ReadLineBuf rlbuf;
+    struct LineReader lr;
+    char tmpPath[] = "/tmp/read_line_bench.XXXXXX";
+    const char *path, *line;
+    char *buf;
+    long numLines, lines, bytes;
+    int lineLen, bufSize, fd, opt;
+    ssize_t len;
+    double start;
+
+    numLines = 100000;
+    lineLen = 80;
+    bufSize = 0;
+    while ((opt = getopt(argc, argv, "n:l:b:")) != -1) {
+        switch (opt) {
+        case 'n': numLines = getLong(optarg, GN_GT_0, "num-lines");    break;
+        case 'l': lineLen = getInt(optarg, GN_GT_0, "line-len");       break;
+        case 'b': bufSize = getInt(optarg, GN_GT_0, "buf-size");       break;
+        default:
+            usageErr("%s [-n num-lines] [-l line-len] [-b buf-size] "
+                     "[file]\n", argv[0]);
+        }
+    }
+
+    if (optind < argc) {
+        path = argv[optind];
+    } else {
+        fd = mkstemp(tmpPath);
+        if (fd == -1)
+            errExit("mkstemp");
+        close(fd);
+        path = tmpPath;
+    }
+
+    createFile(path, numLines, lineLen);
+
+    buf = malloc(lineLen + 1);
+    if (buf == NULL)
+        errExit("malloc");
+
+    printf("%-16s %10s %9s %12s %10s\n",
+            "method", "lines", "secs", "lines/s", "MB/s");
+
+    /* readLine() */
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        errExit("open");
+    lines = bytes = 0;
+    start = timeNow();
+    while ((len = readLine(fd, buf, lineLen + 1)) > 0) {
+        lines++;
+        bytes += len;
+    }
+    if (len == -1)
+        errExit("readLine");
+    report("readLine", lines, bytes, timeNow() - start);
+    close(fd);
+
+    /* readLineBuf() */
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        errExit("open");
+    readLineBufInit(fd, &rlbuf);
+    lines = bytes = 0;
+    start = timeNow();
+    while ((len = readLineBuf(&rlbuf, buf, lineLen + 1)) > 0) {
+        lines++;
+        bytes += len;
+    }
+    if (len == -1)
+        errExit("readLineBuf");
+    report("readLineBuf", lines, bytes, timeNow() - start);
+    close(fd);
+
+    /* lineReaderNext() */
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        errExit("open");
+    if (lineReaderInit(&lr, fd, bufSize, 0) == -1)
+        errExit("lineReaderInit");
+    lines = bytes = 0;
+    start = timeNow();
+    while ((len = lineReaderNext(&lr, &line)) > 0) {
+        if (!lr.partial)                /* Count a long line only once */
+            lines++;
+        bytes += len;
+    }
+    if (len == -1)
+        errExit("lineReaderNext");
+    report("lineReaderNext", lines, bytes, timeNow() - start);
+    lineReaderFree(&lr);
+    close(fd);
+
+    free(buf);
+    if (path == tmpPath)
+        unlink(tmpPath);
+    exit(EXIT_SUCCESS);
+}
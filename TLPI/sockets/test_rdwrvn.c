@@ -0,0 +1,265 @@
+/*************************************************************************\
+*                  Copyright (C) Michael Kerrisk, 2020.                   *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU General Public License as published by the   *
+* Free Software Foundation, either version 3 or (at your option) any      *
+* later version. This program is distributed without any warranty.  See   *
+* the file COPYING.gpl-v3 for details.                                    *
+\*************************************************************************/
+
+/* Supplementary program for Chapter 61 */
+
+/* test_rdwrvn.c
+
+   Test our readvn()/writevn() and readvnResume()/writevnResume()
+   functions by passing data through a socketpair whose buffers have been
+   made small, so that reads and writes are frequently partial.
+
+   Part 1: a child process writes a message with writevn() using many
+   small iovecs of assorted sizes (including some of length 0), while the
+   parent reads it with readvn() using a differently shaped iovec array.
+   In the other direction, the parent writes the message in small pieces
+   with write(), so that the child's readvn() sees many short reads.
+
+   Part 2: both ends are made nonblocking, and a single-threaded loop
+   uses poll() to drive writevnResume() on one end and readvnResume() on
+   the other, as an epoll- or poll-based server would.
+
+   In each case, the received data is compared with what was sent. The
+   program reports the number of times a transfer had to be resumed, and
+   exits with a failure status if any check fails.
+
+   Usage: test_rdwrvn [msg-size]
+*/
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <poll.h>
+#include "rdwrn.h"
+#include "tlpi_hdr.h"
+
+#define SOCK_BUF 4096           /* Requested SO_SNDBUF/SO_RCVBUF */
+#define PIECE 7                 /* Size of pieces written by write() */
+
+static struct iovec *sendIov, *recvIov;  /* Room for 2 * msg-size + 2
+                                           iovecs: always enough, since
+                                           at most every other iovec is
+                                           empty */
+
+/* Carve 'buf' into iovecs whose sizes cycle through the values in
+   'sizes' (a zero-terminated list, which may contain 0-length entries
+   marked by -1). Returns the number of iovecs. */
+
+static int
+buildIov(struct iovec *iov, char *buf, size_t len, const int *sizes)
+{
+    size_t off, n;
+    int cnt, k;
+
+    cnt = 0;
+    k = 0;
+    for (off = 0; off < len; cnt++) {
+        n = (sizes[k] == -1) ? 0 : (size_t) sizes[k];
+        if (n > len - off)
+            n = len - off;
+        iov[cnt].iov_base = buf + off;
+        iov[cnt].iov_len = n;
+        off += n;
+        k = (sizes[k + 1] == 0) ? 0 : k + 1;
+    }
+
+    return cnt;
+}
+
+static void
+fillPattern(char *buf, size_t len)
+{
+    size_t j;
+
+    for (j = 0; j < len; j++)
+        buf[j] = (char) (j * 31 + j / 251);
+}
+
+static void
+check(const char *what, const char *expected, const char *got, size_t len)
+{
+    if (memcmp(expected, got, len) != 0)
+        fatal("%s: received data does not match", what);
+    printf("%s: OK\n", what);
+}
+
+static void
+shrinkBuffers(int fd)
+{
+    int optval = SOCK_BUF;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &optval, sizeof(optval)) == -1)
+        errExit("setsockopt-SO_SNDBUF");
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &optval, sizeof(optval)) == -1)
+        errExit("setsockopt-SO_RCVBUF");
+}
+
+static void
+testBlocking(char *msg, char *in, size_t len)
+{
+    static const int wrSizes[] = { 1, 13, -1, 4000, 3, 777, -1, 64, 0 };
+    static const int rdSizes[] = { 5000, 2, 311, -1, 9, 0 };
+    int sv[2], wrCnt, rdCnt, status;
+    ssize_t numXfer;
+    size_t off, n;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+        errExit("socketpair");
+    shrinkBuffers(sv[0]);
+    shrinkBuffers(sv[1]);
+
+    switch (fork()) {
+    case -1:
+        errExit("fork");
+
+    case 0:             /* Child: writevn() the message, then readvn() it */
+        close(sv[0]);
+
+        wrCnt = buildIov(sendIov, msg, len, wrSizes);
+        numXfer = writevn(sv[1], sendIov, wrCnt);
+        if (numXfer != (ssize_t) len)
+            fatal("writevn returned %ld (expected %ld)",
+                    (long) numXfer, (long) len);
+
+        memset(in, 0, len);
+        rdCnt = buildIov(recvIov, in, len, rdSizes);
+        numXfer = readvn(sv[1], recvIov, rdCnt);
+        if (numXfer != (ssize_t) len)
+            fatal("readvn (short reads) returned %ld (expected %ld)",
+                    (long) numXfer, (long) len);
+        check("readvn with short reads", msg, in, len);
+
+        /* After the parent closes its end, readvn() should report EOF */
+
+        numXfer = readvn(sv[1], recvIov, rdCnt);
+        if (numXfer != 0)
+            fatal("readvn at EOF returned %ld", (long) numXfer);
+
+        _exit(EXIT_SUCCESS);
+
+    default:            /* Parent: readvn() the message, write it back */
+        close(sv[1]);
+
+        memset(in, 0, len);
+        rdCnt = buildIov(recvIov, in, len, rdSizes);
+        numXfer = readvn(sv[0], recvIov, rdCnt);
+        if (numXfer != (ssize_t) len)
+            fatal("readvn returned %ld (expected %ld)",
+                    (long) numXfer, (long) len);
+        check("writevn/readvn with partial transfers", msg, in, len);
+
+        for (off = 0; off < len; off += n) {
+            n = (len - off < PIECE) ? len - off : PIECE;
+            if (write(sv[0], msg + off, n) != (ssize_t) n)
+                errExit("write");
+        }
+        close(sv[0]);
+
+        if (wait(&status) == -1)
+            errExit("wait");
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            fatal("child failed");
+    }
+}
+
+static void
+testNonblocking(char *msg, char *in, size_t len)
+{
+    static const int wrSizes[] = { 3, 1000, -1, 17, 0 };
+    static const int rdSizes[] = { 100, 1, 2500, 0 };
+    struct IovProgress wrProg, rdProg;
+    struct pollfd pfd[2];
+    int sv[2], j, wrDone, rdDone;
+    long wrResumes, rdResumes;
+    ssize_t s;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+        errExit("socketpair");
+    shrinkBuffers(sv[0]);
+    shrinkBuffers(sv[1]);
+    for (j = 0; j < 2; j++)
+        if (fcntl(sv[j], F_SETFL, fcntl(sv[j], F_GETFL) | O_NONBLOCK) == -1)
+            errExit("fcntl");
+
+    memset(in, 0, len);
+    iovProgressInit(&wrProg, sendIov, buildIov(sendIov, msg, len, wrSizes));
+    iovProgressInit(&rdProg, recvIov, buildIov(recvIov, in, len, rdSizes));
+
+    wrDone = rdDone = 0;
+    wrResumes = rdResumes = 0;
+    while (!rdDone) {
+        if (!wrDone) {
+            s = writevnResume(sv[0], &wrProg);
+            if (s == -1 && errno != EAGAIN)
+                errExit("writevnResume");
+            if (s == -1)
+                wrResumes++;
+            else
+                wrDone = 1;
+        }
+
+        s = readvnResume(sv[1], &rdProg);
+        if (s == -1 && errno != EAGAIN)
+            errExit("readvnResume");
+        if (s == -1)
+            rdResumes++;
+        else
+            rdDone = 1;
+
+        if (rdDone)
+            break;
+
+        /* Wait until at least one side can make progress */
+
+        pfd[0].fd = sv[0];
+        pfd[0].events = wrDone ? 0 : POLLOUT;
+        pfd[1].fd = sv[1];
+        pfd[1].events = POLLIN;
+        if (poll(pfd, 2, -1) == -1)
+            errExit("poll");
+    }
+
+    if (rdProg.done != len || wrProg.done != len)
+        fatal("Transferred %ld/%ld bytes (expected %ld)",
+                (long) wrProg.done, (long) rdProg.done, (long) len);
+
+    printf("nonblocking: writer resumed %ld times, reader resumed %ld times\n",
+            wrResumes, rdResumes);
+    check("writevnResume/readvnResume", msg, in, len);
+
+    close(sv[0]);
+    close(sv[1]);
+}
+
+int
+main(int argc, char *argv[])
+{
+    char *msg, *in;
+    size_t len;
+
+    if (argc > 1 && strcmp(argv[1], "--help") == 0)
+        usageErr("%s [msg-size]\n", argv[0]);
+
+    len = (argc > 1) ? getInt(argv[1], GN_GT_0, "msg-size") : 1000000;
+
+    setbuf(stdout, NULL);       /* Child's output must not be lost on _exit() */
+
+    msg = malloc(len);
+    in = malloc(len);
+    sendIov = calloc(2 * len + 2, sizeof(struct iovec));
+    recvIov = calloc(2 * len + 2, sizeof(struct iovec));
+    if (msg == NULL || in == NULL || sendIov == NULL || recvIov == NULL)
+        errExit("malloc");
+    fillPattern(msg, len);
+
+    testBlocking(msg, in, len);
+    testNonblocking(msg, in, len);
+
+    exit(EXIT_SUCCESS);
+}
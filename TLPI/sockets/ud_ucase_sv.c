@@ -15,19 +15,125 @@
    A server that uses a UNIX domain datagram socket to receive datagrams,
    convert their contents to uppercase, and then return them to the senders.
 
-   See also ud_ucase_cl.c.
+   Usage: ud_ucase_sv [-q] [-b batch-size]
+
+   By default, one recvfrom() and one sendto() call are made per datagram.
+   With "-b", up to 'batch-size' datagrams are received with a single
+   recvmmsg() call and returned with a single sendmmsg() call, using a
+   preallocated set of mmsghdr/iovec slots. "-q" suppresses the message
+   that is otherwise printed for each datagram.
+
+   See also ud_ucase_cl.c and dgram_blast_cl.c.
 */
+#define _GNU_SOURCE             /* To get recvmmsg() and sendmmsg() */
 #include "ud_ucase.h"
 
+#define MAX_BATCH 1024
+
+static Boolean quiet = FALSE;
+
+/* Slots for batched I/O. The sender's address is recorded alongside each
+   datagram, so that the same mmsghdr array can be passed to sendmmsg(). */
+
+static struct mmsghdr msgs[MAX_BATCH];
+static struct iovec iovs[MAX_BATCH];
+static struct sockaddr_un addrs[MAX_BATCH];
+static char bufs[MAX_BATCH][BUF_SIZE];
+
+static void
+resetSlots(int batch)
+{
+    int j;
+
+    for (j = 0; j < batch; j++) {
+        iovs[j].iov_base = bufs[j];
+        iovs[j].iov_len = BUF_SIZE;
+        msgs[j].msg_hdr.msg_name = &addrs[j];
+        msgs[j].msg_hdr.msg_namelen = sizeof(struct sockaddr_un);
+        msgs[j].msg_hdr.msg_iov = &iovs[j];
+        msgs[j].msg_hdr.msg_iovlen = 1;
+        msgs[j].msg_hdr.msg_control = NULL;
+        msgs[j].msg_hdr.msg_controllen = 0;
+        msgs[j].msg_hdr.msg_flags = 0;
+    }
+}
+
+/* Receive messages in batches, convert to uppercase, and return them */
+
+static void
+serveBatched(int sfd, int batch)
+{
+    int numRecv, numSent, j, k, s;
+
+    for (;;) {
+        resetSlots(batch);
+
+        /* MSG_WAITFORONE: block for the first datagram only, then
+           take whatever else is already queued */
+
+        numRecv = recvmmsg(sfd, msgs, batch, MSG_WAITFORONE, NULL);
+        if (numRecv == -1) {
+            if (errno == EINTR)
+                continue;
+            errExit("recvmmsg");
+        }
+
+        for (j = 0; j < numRecv; j++) {
+            if (!quiet)
+                printf("Server received %ld bytes from %s\n",
+                        (long) msgs[j].msg_len, addrs[j].sun_path);
+
+            for (k = 0; k < msgs[j].msg_len; k++)
+                bufs[j][k] = toupper((unsigned char) bufs[j][k]);
+            iovs[j].iov_len = msgs[j].msg_len;
+        }
+
+        /* sendmmsg() may send fewer than the requested number of
+           datagrams. A client that has gone away (ECONNREFUSED or
+           ENOENT) should not take the server down, so on error we
+           report and skip the failing datagram. */
+
+        for (numSent = 0; numSent < numRecv; numSent += s) {
+            s = sendmmsg(sfd, &msgs[numSent], numRecv - numSent, 0);
+            if (s == -1) {
+                errMsg("sendmmsg");
+                s = 1;
+            }
+        }
+    }
+}
+
+static void
+usageError(const char *pname)
+{
+    fprintf(stderr, "Usage: %s [-q] [-b batch-size]\n", pname);
+    fprintf(stderr, "    -q   Don't print a message for each datagram\n");
+    fprintf(stderr, "    -b   Use recvmmsg()/sendmmsg() with batches of up "
+                    "to 'batch-size' (max %d)\n", MAX_BATCH);
+    exit(EXIT_FAILURE);
+}
+
 int
 main(int argc, char *argv[])
 {
     struct sockaddr_un svaddr, claddr;
-    int sfd, j;
+    int sfd, j, opt, batch;
     ssize_t numBytes;
     socklen_t len;
     char buf[BUF_SIZE];
 
+    batch = 0;
+    while ((opt = getopt(argc, argv, "qb:")) != -1) {
+        switch (opt) {
+        case 'q': quiet = TRUE;                                     break;
+        case 'b': batch = getInt(optarg, GN_GT_0, "batch-size");    break;
+        default:  usageError(argv[0]);
+        }
+    }
+
+    if (batch > MAX_BATCH)
+        usageError(argv[0]);
+
     sfd = socket(AF_UNIX, SOCK_DGRAM, 0);       /* Create server socket */
     if (sfd == -1)
         errExit("socket");
@@ -50,6 +156,9 @@ main(int argc, char *argv[])
     if (bind(sfd, (struct sockaddr *) &svaddr, sizeof(struct sockaddr_un)) == -1)
         errExit("bind");
 
+    if (batch > 0)
+        serveBatched(sfd, batch);       /* Doesn't return */
+
     /* Receive messages, convert to uppercase, and return to client */
 
     for (;;) {
@@ -59,8 +168,9 @@ main(int argc, char *argv[])
         if (numBytes == -1)
             errExit("recvfrom");
 
-        printf("Server received %ld bytes from %s\n", (long) numBytes,
-                claddr.sun_path);
+        if (!quiet)
+            printf("Server received %ld bytes from %s\n", (long) numBytes,
+                    claddr.sun_path);
 
         for (j = 0; j < numBytes; j++)
             buf[j] = toupper((unsigned char) buf[j]);
@@ -27,7 +27,7 @@
 #define SERVER_KEY 0x1aaaaaa1           /* Key for server's message queue */
 
 struct requestMsg {                     /* Requests (client to server) */
-    long mtype;                         /* Unused */
+    long mtype;                         /* One of REQ_MT_* values below */
     int  clientId;                      /* ID of client's message queue */
     char pathname[PATH_MAX];            /* File to be returned */
 };
@@ -39,6 +39,23 @@ struct requestMsg {                     /* Requests (client to server) */
 #define REQ_MSG_SIZE (offsetof(struct requestMsg, pathname) - \
                       offsetof(struct requestMsg, clientId) + PATH_MAX)
 
+/* Types for request messages sent from client to server. These select
+   how the file contents are delivered. The original client sets 'mtype'
+   to 1, and so still receives the contents in a series of messages. */
+
+#define REQ_MT_MSG      1               /* In RESP_MT_DATA messages */
+#define REQ_MT_FD       2               /* As an open file descriptor, sent
+                                           on the client's UNIX domain
+                                           socket (CLIENT_SOCK_PATH) */
+#define REQ_MT_SHM      3               /* In a POSIX shared memory object
+                                           (CLIENT_SHM_NAME) */
+
+/* Names of the client's socket and shared memory object; the '%d' is
+   replaced by the client's message queue identifier */
+
+#define CLIENT_SOCK_PATH "/tmp/svmsg_file_cl.%d"
+#define CLIENT_SHM_NAME  "/svmsg_file_cl.%d"
+
 #define RESP_MSG_SIZE 8192
 
 struct responseMsg {                    /* Responses (server to client) */
@@ -51,3 +68,7 @@ struct responseMsg {                    /* Responses (server to client) */
 #define RESP_MT_FAILURE 1               /* File couldn't be opened */
 #define RESP_MT_DATA    2               /* Message contains file data */
 #define RESP_MT_END     3               /* File data complete */
+#define RESP_MT_FD      4               /* File descriptor has been sent
+                                           on client's socket */
+#define RESP_MT_SHM     5               /* File contents have been placed
+                                           in shared memory object */
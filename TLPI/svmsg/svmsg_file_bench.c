@@ -0,0 +1,216 @@
+/*************************************************************************\
+*                  Copyright (C) Michael Kerrisk, 2020.                   *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU General Public License as published by the   *
+* Free Software Foundation, either version 3 or (at your option) any      *
+* later version. This program is distributed without any warranty.  See   *
+* the file COPYING.gpl-v3 for details.                                    *
+\*************************************************************************/
+
+/* Supplementary program for Chapter 46 */
+
+/* svmsg_file_bench.c
+
+   Compare the throughput of the three ways in which svmsg_file_server.c
+   can deliver a file to svmsg_file_client.c: in messages ('msg'), as a
+   file descriptor ('fd'), and in POSIX shared memory ('shm').
+
+   Usage: svmsg_file_bench [-M max-MiB] [-t total-MiB]
+
+   This program starts its own instance of svmsg_file_server (so no other
+   instance may be running), and then, for each of a range of file sizes
+   from 1 KiB up to 'max-MiB' (default: 1024), creates a file of that size
+   and runs svmsg_file_client in each mode. The client requests the file
+   repeatedly, until about 'total-MiB' (default: 256) have been transferred
+   (but at least once, and at most 1000 times). The throughput in MB/s is
+   shown for each combination. The figures include the cost of starting
+   the client, which is significant only for small files.
+
+   The 'shm' mode needs as much free space in /dev/shm as the largest file.
+
+   The server and client programs are looked for in the same directory as
+   this program.
+*/
+#include <sys/wait.h>
+#include <libgen.h>
+#include <time.h>
+#include "svmsg_file.h"
+
+static char progDir[PATH_MAX];
+
+static double
+timeNow(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        errExit("clock_gettime");
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+createFile(const char *path, long long size)
+{
+    char buf[65536];
+    long long done;
+    size_t n;
+    int fd;
+
+    for (size_t j = 0; j < sizeof(buf); j++)
+        buf[j] = 'a' + j % 26;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd == -1)
+        errExit("open-%s", path);
+
+    for (done = 0; done < size; done += n) {
+        n = (size - done < (long long) sizeof(buf)) ?
+                size - done : sizeof(buf);
+        if (write(fd, buf, n) != (ssize_t) n)
+            fatal("write to %s failed", path);
+    }
+
+    if (close(fd) == -1)
+        errExit("close");
+}
+
+/* Create a child that runs the program 'argv[0]' (in 'progDir'), with
+   its standard output redirected to /dev/null */
+
+static pid_t
+spawn(char *argv[])
+{
+    char path[PATH_MAX];
+    pid_t pid;
+    int fd;
+
+    pid = fork();
+    if (pid == -1)
+        errExit("fork");
+    if (pid != 0)
+        return pid;
+
+    fd = open("/dev/null", O_WRONLY);
+    if (fd == -1 || dup2(fd, STDOUT_FILENO) == -1)
+        errExit("open/dup2-/dev/null");
+
+    if (snprintf(path, sizeof(path), "%s/%s", progDir, argv[0]) >=
+            (int) sizeof(path))
+        _exit(127);
+    execv(path, argv);
+    errExit("execv-%s", path);
+}
+
+/* Run the client in mode 'mode', requesting 'path' 'reps' times.
+   Returns the elapsed time, or -1 if the client failed. */
+
+static double
+runClient(const char *mode, const char *path, int reps)
+{
+    char repsArg[32];
+    char *argv[7];
+    double start;
+    int status;
+    pid_t pid;
+
+    snprintf(repsArg, sizeof(repsArg), "%d", reps);
+    argv[0] = "svmsg_file_client";
+    argv[1] = "-m";
+    argv[2] = (char *) mode;
+    argv[3] = "-n";
+    argv[4] = repsArg;
+    argv[5] = (char *) path;
+    argv[6] = NULL;
+
+    start = timeNow();
+    pid = spawn(argv);
+    if (waitpid(pid, &status, 0) == -1)
+        errExit("waitpid");
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return -1;
+    return timeNow() - start;
+}
+
+int
+main(int argc, char *argv[])
+{
+    static const char *modes[] = { "msg", "fd", "shm" };
+    char path[PATH_MAX], argv0[PATH_MAX];
+    char *serverArgv[] = { "svmsg_file_server", NULL };
+    long long size, maxSize, total;
+    int opt, reps, serverId;
+    double secs;
+    pid_t serverPid;
+
+    maxSize = 1024LL * 1024 * 1024;
+    total = 256LL * 1024 * 1024;
+
+    while ((opt = getopt(argc, argv, "M:t:")) != -1) {
+        switch (opt) {
+        case 'M': maxSize = getLong(optarg, GN_GT_0, "max-MiB") << 20;   break;
+        case 't': total = getLong(optarg, GN_GT_0, "total-MiB") << 20;   break;
+        default:  usageErr("%s [-M max-MiB] [-t total-MiB]\n", argv[0]);
+        }
+    }
+
+    snprintf(argv0, sizeof(argv0), "%s", argv[0]);
+    snprintf(progDir, sizeof(progDir), "%s", dirname(argv0));
+
+    /* Start the server, and wait until it has created its queue */
+
+    if (msgget(SERVER_KEY, 0) != -1)
+        fatal("server queue already exists; is svmsg_file_server running?");
+
+    serverPid = spawn(serverArgv);
+
+    while ((serverId = msgget(SERVER_KEY, 0)) == -1) {
+        if (waitpid(serverPid, NULL, WNOHANG) == serverPid)
+            fatal("svmsg_file_server failed to start");
+        usleep(1000);
+    }
+
+    snprintf(path, sizeof(path), "/tmp/svmsg_file_bench.%ld", (long) getpid());
+
+    printf("%10s %6s", "Size", "Reps");
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+        printf(" %9s", modes[m]);
+    printf("   (MB/s)\n");
+
+    for (size = 1024; size <= maxSize; size *= 16) {
+        createFile(path, size);
+
+        reps = total / size;
+        reps = (reps < 1) ? 1 : (reps > 1000) ? 1000 : reps;
+
+        if (size < 1024 * 1024)
+            printf("%8lldKB %6d", size / 1024, reps);
+        else
+            printf("%8lldMB %6d", size / (1024 * 1024), reps);
+
+        for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+            secs = runClient(modes[m], path, reps);
+            if (secs < 0)
+                printf(" %9s", "failed");
+            else
+                printf(" %9.1f", size * reps / secs / 1e6);
+            fflush(stdout);
+        }
+        printf("\n");
+
+        if (unlink(path) == -1)
+            errExit("unlink");
+    }
+
+    /* The server doesn't remove its queue when killed, so we do that */
+
+    if (kill(serverPid, SIGTERM) == -1)
+        errExit("kill");
+    if (waitpid(serverPid, NULL, 0) == -1)
+        errExit("waitpid");
+    if (msgctl(serverId, IPC_RMID, NULL) == -1)
+        errExit("msgctl");
+
+    exit(EXIT_SUCCESS);
+}
@@ -17,30 +17,178 @@
    file contents via a series of messages sent back by the server. Display
    the total number of bytes and messages received. The server and client
    communicate using System V message queues.
+
+   Usage: svmsg_file_client [-m msg|fd|shm] [-n reps] pathname
+
+   The -m option selects how the server delivers the file contents (see
+   svmsg_file_server.c): 'msg' (the default) in a series of messages;
+   'fd' as an open file descriptor, which we read() from; or 'shm' in a
+   POSIX shared memory object, which we map and then touch every page
+   of. With -n, the file is requested 'reps' times (as is done by
+   svmsg_file_bench.c).
 */
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include "scm_functions.h"
 #include "svmsg_file.h"
 
+#define FD_READ_BUF_SIZE (1024 * 1024)
+
 static int clientId;
+static int sockFd = -1;                 /* Socket for receiving FDs */
+static char sockPath[sizeof(((struct sockaddr_un *) 0)->sun_path)];
 
 static void
 removeQueue(void)
 {
+    if (sockFd != -1)
+        unlink(sockPath);
+
     if (msgctl(clientId, IPC_RMID, NULL) == -1)
         errExit("msgctl");
 }
 
+/* Create and bind the datagram socket on which the server sends us
+   file descriptors */
+
+static void
+createFdSocket(void)
+{
+    struct sockaddr_un addr;
+
+    sockFd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (sockFd == -1)
+        errExit("socket");
+
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+    snprintf(sockPath, sizeof(sockPath), CLIENT_SOCK_PATH, clientId);
+    strcpy(addr.sun_path, sockPath);
+
+    if (unlink(sockPath) == -1 && errno != ENOENT)
+        errExit("unlink-%s", sockPath);
+    if (bind(sockFd, (struct sockaddr *) &addr,
+             sizeof(struct sockaddr_un)) == -1)
+        errExit("bind");
+}
+
+/* Read the entire contents of a file descriptor received from the
+   server. Returns the number of bytes read. */
+
+static ssize_t
+readFromFd(void)
+{
+    static char *buf = NULL;
+    ssize_t numRead, totBytes;
+    int fd;
+
+    if (buf == NULL) {
+        buf = malloc(FD_READ_BUF_SIZE);
+        if (buf == NULL)
+            errExit("malloc");
+    }
+
+    fd = recvfd(sockFd);
+    if (fd == -1)
+        errExit("recvfd");
+
+    totBytes = 0;
+    while ((numRead = read(fd, buf, FD_READ_BUF_SIZE)) > 0)
+        totBytes += numRead;
+    if (numRead == -1)
+        errExit("read");
+
+    if (close(fd) == -1)
+        errExit("close");
+
+    return totBytes;
+}
+
+/* Map the shared memory object filled by the server, and touch each of
+   its pages. Returns the size of the object. */
+
+static ssize_t
+readFromShm(void)
+{
+    char name[NAME_MAX];
+    struct stat sb;
+    volatile char *addr;
+    char sum;
+    long pageSize;
+    int fd;
+
+    snprintf(name, sizeof(name), CLIENT_SHM_NAME, clientId);
+
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1)
+        errExit("shm_open");
+
+    /* We are the only user of the object, so we can remove its name now */
+
+    if (shm_unlink(name) == -1)
+        errExit("shm_unlink");
+
+    if (fstat(fd, &sb) == -1)
+        errExit("fstat");
+
+    if (sb.st_size > 0) {
+        addr = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED)
+            errExit("mmap");
+
+        pageSize = sysconf(_SC_PAGESIZE);
+        sum = 0;
+        for (off_t j = 0; j < sb.st_size; j += pageSize)
+            sum += addr[j];
+        (void) sum;
+
+        if (munmap((void *) addr, sb.st_size) == -1)
+            errExit("munmap");
+    }
+
+    if (close(fd) == -1)
+        errExit("close");
+
+    return sb.st_size;
+}
+
 int
 main(int argc, char *argv[])
 {
     struct requestMsg req;
     struct responseMsg resp;
-    int serverId, numMsgs;
+    int serverId, numMsgs, opt, reps;
+    long reqType;
     ssize_t msgLen, totBytes;
 
-    if (argc != 2 || strcmp(argv[1], "--help") == 0)
-        usageErr("%s pathname\n", argv[0]);
+    reqType = REQ_MT_MSG;
+    reps = 1;
+
+    while ((opt = getopt(argc, argv, "m:n:")) != -1) {
+        switch (opt) {
+        case 'm':
+            if (strcmp(optarg, "msg") == 0)
+                reqType = REQ_MT_MSG;
+            else if (strcmp(optarg, "fd") == 0)
+                reqType = REQ_MT_FD;
+            else if (strcmp(optarg, "shm") == 0)
+                reqType = REQ_MT_SHM;
+            else
+                cmdLineErr("bad mode: %s\n", optarg);
+            break;
+        case 'n':
+            reps = getInt(optarg, GN_GT_0, "reps");
+            break;
+        default:
+            usageErr("%s [-m msg|fd|shm] [-n reps] pathname\n", argv[0]);
+        }
+    }
+
+    if (optind != argc - 1)
+        usageErr("%s [-m msg|fd|shm] [-n reps] pathname\n", argv[0]);
 
-    if (strlen(argv[1]) > sizeof(req.pathname) - 1)
+    if (strlen(argv[optind]) > sizeof(req.pathname) - 1)
         cmdLineErr("pathname too long (max: %ld bytes)\n",
                 (long) sizeof(req.pathname) - 1);
 
@@ -57,38 +205,59 @@ main(int argc, char *argv[])
     if (atexit(removeQueue) != 0)
         errExit("atexit");
 
-    /* Send message asking for file named in argv[1] */
+    if (reqType == REQ_MT_FD)
+        createFdSocket();
 
-    req.mtype = 1;                      /* Any type will do */
-    req.clientId = clientId;
-    strncpy(req.pathname, argv[1], sizeof(req.pathname) - 1);
-    req.pathname[sizeof(req.pathname) - 1] = '\0';
-                                        /* Ensure string is terminated */
+    totBytes = 0;
+    numMsgs = 0;
 
-    if (msgsnd(serverId, &req, REQ_MSG_SIZE, 0) == -1)
-        errExit("msgsnd");
+    for (int r = 0; r < reps; r++) {
 
-    /* Get first response, which may be failure notification */
+        /* Send message asking for file named in argv[optind] */
 
-    msgLen = msgrcv(clientId, &resp, RESP_MSG_SIZE, 0, 0);
-    if (msgLen == -1)
-        errExit("msgrcv");
+        req.mtype = reqType;
+        req.clientId = clientId;
+        strncpy(req.pathname, argv[optind], sizeof(req.pathname) - 1);
+        req.pathname[sizeof(req.pathname) - 1] = '\0';
+                                        /* Ensure string is terminated */
 
-    if (resp.mtype == RESP_MT_FAILURE) {
-        printf("%s\n", resp.data);      /* Display msg from server */
-        exit(EXIT_FAILURE);
-    }
+        if (msgsnd(serverId, &req, REQ_MSG_SIZE, 0) == -1)
+            errExit("msgsnd");
 
-    /* File was opened successfully by server; process messages
-       (including the one already received) containing file data */
+        /* Get first response, which may be failure notification */
 
-    totBytes = msgLen;                  /* Count first message */
-    for (numMsgs = 1; resp.mtype == RESP_MT_DATA; numMsgs++) {
         msgLen = msgrcv(clientId, &resp, RESP_MSG_SIZE, 0, 0);
         if (msgLen == -1)
             errExit("msgrcv");
 
-        totBytes += msgLen;
+        if (resp.mtype == RESP_MT_FAILURE) {
+            printf("%s\n", resp.data);  /* Display msg from server */
+            exit(EXIT_FAILURE);
+        }
+
+        if (resp.mtype == RESP_MT_FD) {
+            totBytes += readFromFd();
+            numMsgs++;
+            continue;
+        }
+
+        if (resp.mtype == RESP_MT_SHM) {
+            totBytes += readFromShm();
+            numMsgs++;
+            continue;
+        }
+
+        /* File was opened successfully by server; process messages
+           (including the one already received) containing file data */
+
+        totBytes += msgLen;             /* Count first message */
+        for (numMsgs++; resp.mtype == RESP_MT_DATA; numMsgs++) {
+            msgLen = msgrcv(clientId, &resp, RESP_MSG_SIZE, 0, 0);
+            if (msgLen == -1)
+                errExit("msgrcv");
+
+            totBytes += msgLen;
+        }
     }
 
     printf("Received %ld bytes (%d messages)\n", (long) totBytes, numMsgs);
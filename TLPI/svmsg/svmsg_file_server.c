@@ -27,7 +27,27 @@
 
    This program operates as a concurrent server, forking a new child process to
    handle each client request while the parent waits for further client requests.
+
+   Sending the file contents in messages means that every byte is copied
+   twice by the kernel, and the transfer is throttled by the 'msg_qbytes'
+   limit of the client's queue. So, the request type ('mtype') also allows
+   the client to ask for one of two alternatives (see svmsg_file.h):
+
+   REQ_MT_FD    The server sends an open file descriptor for the file, as
+                SCM_RIGHTS ancillary data on a UNIX domain datagram socket
+                bound by the client, and then a RESP_MT_FD message. The
+                client can then read() or mmap() the file itself.
+
+   REQ_MT_SHM   The server reads the file into a POSIX shared memory object,
+                and then sends a RESP_MT_SHM message. The client maps the
+                object (and unlinks it).
+
+   In either case, failures are reported with a RESP_MT_FAILURE message.
 */
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include "scm_functions.h"
 #include "svmsg_file.h"
 
 static void             /* SIGCHLD handler */
@@ -41,20 +61,21 @@ grimReaper(int sig)
     errno = savedErrno;
 }
 
-static void             /* Executed in child process: serve a single client */
-serveRequest(const struct requestMsg *req)
+static void             /* Send a failure response containing 'text' */
+sendFailure(const struct requestMsg *req, const char *text)
 {
-    int fd;
-    ssize_t numRead;
     struct responseMsg resp;
 
-    fd = open(req->pathname, O_RDONLY);
-    if (fd == -1) {                     /* Open failed: send error text */
-        resp.mtype = RESP_MT_FAILURE;
-        snprintf(resp.data, sizeof(resp.data), "%s", "Couldn't open");
-        msgsnd(req->clientId, &resp, strlen(resp.data) + 1, 0);
-        exit(EXIT_FAILURE);             /* and terminate */
-    }
+    resp.mtype = RESP_MT_FAILURE;
+    snprintf(resp.data, sizeof(resp.data), "%s", text);
+    msgsnd(req->clientId, &resp, strlen(resp.data) + 1, 0);
+}
+
+static void             /* Send file contents in a series of messages */
+sendFileMsgs(const struct requestMsg *req, int fd)
+{
+    ssize_t numRead;
+    struct responseMsg resp;
 
     /* Transmit file contents in messages with type RESP_MT_DATA. We don't
        diagnose read() and msgsnd() errors since we can't notify client. */
@@ -70,6 +91,122 @@ serveRequest(const struct requestMsg *req)
     msgsnd(req->clientId, &resp, 0, 0);         /* Zero-length mtext */
 }
 
+static void             /* Pass file descriptor to client's socket */
+sendFileFd(const struct requestMsg *req, int fd)
+{
+    struct sockaddr_un addr;
+    struct responseMsg resp;
+    int sfd;
+
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), CLIENT_SOCK_PATH,
+             req->clientId);
+
+    sfd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (sfd == -1 ||
+            connect(sfd, (struct sockaddr *) &addr,
+                    sizeof(struct sockaddr_un)) == -1 ||
+            sendfd(sfd, fd) == -1) {
+        sendFailure(req, "Couldn't send file descriptor");
+        return;
+    }
+
+    /* The descriptor is already queued on the client's socket by the
+       time the client sees this message */
+
+    resp.mtype = RESP_MT_FD;
+    msgsnd(req->clientId, &resp, 0, 0);
+}
+
+/* Copy 'size' bytes from 'fd' into the shared memory object 'shmFd'.
+   We read the file straight into the mapped object, so that each byte
+   is copied just once. Returns 0 on success, or -1 on error. */
+
+static int
+fillShm(int shmFd, int fd, off_t size)
+{
+    ssize_t numRead;
+    size_t done;
+    char *addr;
+
+    if (ftruncate(shmFd, size) == -1)
+        return -1;
+    if (size == 0)
+        return 0;
+
+    addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shmFd, 0);
+    if (addr == MAP_FAILED)
+        return -1;
+
+    for (done = 0; done < (size_t) size; done += numRead) {
+        numRead = read(fd, addr + done, size - done);
+        if (numRead == -1) {
+            munmap(addr, size);
+            return -1;
+        }
+        if (numRead == 0)               /* File was truncated; the client */
+            break;                      /* sees zeros beyond this point */
+    }
+
+    return munmap(addr, size);
+}
+
+static void             /* Copy file into a POSIX shared memory object */
+sendFileShm(const struct requestMsg *req, int fd)
+{
+    char name[NAME_MAX];
+    struct responseMsg resp;
+    struct stat sb;
+    int shmFd;
+
+    if (fstat(fd, &sb) == -1) {
+        sendFailure(req, "Couldn't stat file");
+        return;
+    }
+
+    snprintf(name, sizeof(name), CLIENT_SHM_NAME, req->clientId);
+
+    shmFd = shm_open(name, O_RDWR | O_CREAT | O_EXCL,
+                     S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (shmFd == -1) {
+        sendFailure(req, "Couldn't create shared memory object");
+        return;
+    }
+
+    if (fillShm(shmFd, fd, sb.st_size) == -1) {
+        close(shmFd);
+        shm_unlink(name);
+        sendFailure(req, "Couldn't fill shared memory object");
+        return;
+    }
+
+    close(shmFd);
+
+    /* The client unlinks the object once it has mapped it */
+
+    resp.mtype = RESP_MT_SHM;
+    msgsnd(req->clientId, &resp, 0, 0);
+}
+
+static void             /* Executed in child process: serve a single client */
+serveRequest(const struct requestMsg *req)
+{
+    int fd;
+
+    fd = open(req->pathname, O_RDONLY);
+    if (fd == -1) {                     /* Open failed: send error text */
+        sendFailure(req, "Couldn't open");
+        exit(EXIT_FAILURE);             /* and terminate */
+    }
+
+    switch (req->mtype) {
+    case REQ_MT_FD:     sendFileFd(req, fd);    break;
+    case REQ_MT_SHM:    sendFileShm(req, fd);   break;
+    default:            sendFileMsgs(req, fd);  break;
+    }
+}
+
 int
 main(int argc, char *argv[])
 {
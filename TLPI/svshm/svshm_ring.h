@@ -0,0 +1,123 @@
+/*************************************************************************\
+*                  Copyright (C) Michael Kerrisk, 2020.                   *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU General Public License as published by the   *
+* Free Software Foundation, either version 3 or (at your option) any      *
+* later version. This program is distributed without any warranty.  See   *
+* the file COPYING.gpl-v3 for details.                                    *
+\*************************************************************************/
+
+/* Supplementary program for Chapter 48 */
+
+/*  svshm_ring.h
+
+   Header file used by the svshm_ring_reader.c and svshm_ring_writer.c
+   programs.
+
+   Rather than passing a single buffer back and forth under the control of
+   a pair of semaphores (as svshm_xfr_writer.c and svshm_xfr_reader.c do),
+   these programs divide the shared memory segment into a ring of 'nslots'
+   slots. The segment header contains two free-running counters: 'head'
+   (the number of slots that the writer has filled) and 'tail' (the number
+   of slots that the reader has emptied). The n'th transfer uses slot
+   (n % nslots). Since there is just one writer and one reader, each
+   counter is modified by only one process, and no locking is needed: the
+   writer may fill a slot while (head - tail) < nslots, and the reader may
+   empty a slot while head != tail.
+
+   A process blocks, in a futex(FUTEX_WAIT) call, only when the ring is
+   full (the writer) or empty (the reader). Before sleeping, a process
+   sets a 'waiting' flag, so that the other process need make a
+   futex(FUTEX_WAKE) call only when someone is actually asleep. Thus, as
+   long as the ring is neither full nor empty, transfers are made without
+   any system calls other than the read() and write() that move the data.
+*/
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/shm.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <stdint.h>
+#include "tlpi_hdr.h"
+
+#define SHM_RING_KEY 0x1235     /* Key for shared memory segment */
+
+#define OBJ_PERMS (S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP)
+                                /* Permissions for our IPC objects */
+
+#define RING_MAGIC 0x52494e47   /* Set once the writer has initialized
+                                   the segment */
+
+#define RING_CACHE_LINE 64      /* Keep the counters in separate cache
+                                   lines, so that the writer and reader
+                                   don't contend for the same line */
+
+#define RING_DEF_SLOTS 16               /* Default number of slots */
+#define RING_DEF_SLOT_SIZE 65536        /* Default size of each slot */
+
+struct shmring {                /* Header of shared memory segment */
+    uint32_t magic;             /* RING_MAGIC when initialized */
+    uint32_t nslots;            /* Number of slots (a power of 2) */
+    uint32_t slotSize;          /* Bytes of data in each slot */
+    uint32_t dataOffset;        /* Offset of slot data from start
+                                   of segment */
+
+    uint32_t head __attribute__ ((aligned(RING_CACHE_LINE)));
+                                /* Slots filled by writer */
+    uint32_t readerWaiting;     /* Reader is asleep waiting on 'head' */
+
+    uint32_t tail __attribute__ ((aligned(RING_CACHE_LINE)));
+                                /* Slots emptied by reader */
+    uint32_t writerWaiting;     /* Writer is asleep waiting on 'tail' */
+
+    int32_t cnt[] __attribute__ ((aligned(RING_CACHE_LINE)));
+                                /* Number of bytes used in each slot;
+                                   0 marks end of data */
+};
+
+/* Address of the data area of the n'th slot */
+
+#define RING_DATA(ring, n) \
+    ((char *) (ring) + (ring)->dataOffset + \
+     (size_t) ((n) & ((ring)->nslots - 1)) * (ring)->slotSize)
+
+/* Wait until the value of '*counter' differs from 'old'. 'waiting' is
+   the flag that tells the other process that we are (about to go)
+   asleep. */
+
+static inline void
+ringWait(uint32_t *counter, uint32_t *waiting, uint32_t old)
+{
+    while (__atomic_load_n(counter, __ATOMIC_ACQUIRE) == old) {
+
+        /* Set our flag before checking the counter again: either the
+           other process sees the flag after updating the counter (and
+           wakes us), or we see the updated counter here. The kernel
+           also rechecks the counter before putting us to sleep. */
+
+        __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+
+        if (__atomic_load_n(counter, __ATOMIC_SEQ_CST) == old)
+            if (syscall(SYS_futex, counter, FUTEX_WAIT, old,
+                        NULL, NULL, 0) == -1 &&
+                    errno != EAGAIN && errno != EINTR)
+                errExit("futex-FUTEX_WAIT");
+
+        __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+    }
+}
+
+/* Increment '*counter', waking the other process if it is waiting
+   for the counter to change */
+
+static inline void
+ringAdvance(uint32_t *counter, uint32_t *waiting)
+{
+    __atomic_add_fetch(counter, 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST))
+        if (syscall(SYS_futex, counter, FUTEX_WAKE, 1,
+                    NULL, NULL, 0) == -1)
+            errExit("futex-FUTEX_WAKE");
+}
@@ -0,0 +1,76 @@
+/*************************************************************************\
+*                  Copyright (C) Michael Kerrisk, 2020.                   *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU General Public License as published by the   *
+* Free Software Foundation, either version 3 or (at your option) any      *
+* later version. This program is distributed without any warranty.  See   *
+* the file COPYING.gpl-v3 for details.                                    *
+\*************************************************************************/
+
+/* Supplementary program for Chapter 48 */
+
+/* svshm_ring_reader.c
+
+   Read data from the ring in a System V shared memory segment that is
+   filled by svshm_ring_writer.c, and write it to standard output; see
+   svshm_ring.h.
+*/
+#include "svshm_ring.h"
+
+int
+main(int argc, char *argv[])
+{
+    int shmid, xfrs;
+    long long bytes;
+    struct shmring *ring;
+    uint32_t head, tail;
+    int32_t cnt;
+
+    /* Get ID for shared memory created by writer */
+
+    shmid = shmget(SHM_RING_KEY, 0, 0);
+    if (shmid == -1)
+        errExit("shmget");
+
+    /* Attach shared memory read-write, since we update 'tail' */
+
+    ring = shmat(shmid, NULL, 0);
+    if (ring == (void *) -1)
+        errExit("shmat");
+
+    /* The writer may not yet have initialized the segment */
+
+    while (__atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) != RING_MAGIC)
+        usleep(1000);
+
+    /* Transfer blocks of data from the ring to stdout */
+
+    for (xfrs = 0, bytes = 0; ; xfrs++) {
+        tail = ring->tail;              /* Only we modify 'tail' */
+
+        /* If the ring is empty, wait for the writer to fill a slot */
+
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (head == tail)
+            ringWait(&ring->head, &ring->readerWaiting, tail);
+
+        cnt = ring->cnt[tail & (ring->nslots - 1)];
+        if (cnt == 0) {                         /* Writer encountered EOF */
+            ringAdvance(&ring->tail, &ring->writerWaiting);
+            break;
+        }
+        bytes += cnt;
+
+        if (write(STDOUT_FILENO, RING_DATA(ring, tail), cnt) != cnt)
+            fatal("partial/failed write");
+
+        ringAdvance(&ring->tail, &ring->writerWaiting);
+    }
+
+    if (shmdt(ring) == -1)
+        errExit("shmdt");
+
+    fprintf(stderr, "Received %lld bytes (%d xfrs)\n", bytes, xfrs);
+    exit(EXIT_SUCCESS);
+}
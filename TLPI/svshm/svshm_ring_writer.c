@@ -0,0 +1,186 @@
+/*************************************************************************\
+*                  Copyright (C) Michael Kerrisk, 2020.                   *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU General Public License as published by the   *
+* Free Software Foundation, either version 3 or (at your option) any      *
+* later version. This program is distributed without any warranty.  See   *
+* the file COPYING.gpl-v3 for details.                                    *
+\*************************************************************************/
+
+/* Supplementary program for Chapter 48 */
+
+/*  svshm_ring_writer.c
+
+   Read buffers of data from standard input into the slots of a ring
+   in a System V shared memory segment, from which they are copied by
+   svshm_ring_reader.c. See svshm_ring.h for a description of the ring.
+
+   Usage: svshm_ring_writer [-n nslots] [-s slot-size] [-H]
+
+   'nslots' (which must be a power of 2) and 'slot-size' default to
+   RING_DEF_SLOTS and RING_DEF_SLOT_SIZE. The -H option places the segment
+   in huge pages (SHM_HUGETLB); this requires that huge pages have been
+   reserved via /proc/sys/vm/nr_hugepages, and, unless the process is
+   privileged, that its group ID is listed in
+   /proc/sys/vm/hugetlb_shm_group.
+
+   As with svshm_xfr_writer.c, this program must be started before the
+   reader, since it creates the shared memory segment:
+
+        $ svshm_ring_writer < infile &
+        $ svshm_ring_reader > out_file
+*/
+#include "svshm_ring.h"
+
+#define HUGE_PAGE_DEF_SIZE (2 * 1024 * 1024)
+
+/* Return the size of a huge page, as shown in /proc/meminfo */
+
+static size_t
+hugePageSize(void)
+{
+    char line[256];
+    size_t kb;
+    FILE *fp;
+
+    kb = 0;
+    fp = fopen("/proc/meminfo", "r");
+    if (fp != NULL) {
+        while (fgets(line, sizeof(line), fp) != NULL)
+            if (sscanf(line, "Hugepagesize: %zu kB", &kb) == 1)
+                break;
+        fclose(fp);
+    }
+
+    return (kb > 0) ? kb * 1024 : HUGE_PAGE_DEF_SIZE;
+}
+
+static void
+usageError(const char *progName)
+{
+    fprintf(stderr, "Usage: %s [-n nslots] [-s slot-size] [-H] < infile\n",
+            progName);
+    fprintf(stderr, "    -n nslots     Number of slots in ring; a power "
+            "of 2 (default: %d)\n", RING_DEF_SLOTS);
+    fprintf(stderr, "    -s slot-size  Size of each slot (default: %d)\n",
+            RING_DEF_SLOT_SIZE);
+    fprintf(stderr, "    -H            Use huge pages for the shared "
+            "memory segment\n");
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+    int shmid, opt, useHuge, xfrs;
+    long nslots, slotSize;
+    size_t dataOffset, segSize, pageSize;
+    long long bytes;
+    struct shmring *ring;
+    uint32_t head, tail;
+    ssize_t cnt;
+
+    nslots = RING_DEF_SLOTS;
+    slotSize = RING_DEF_SLOT_SIZE;
+    useHuge = 0;
+
+    while ((opt = getopt(argc, argv, "n:s:H")) != -1) {
+        switch (opt) {
+        case 'n': nslots = getLong(optarg, GN_GT_0, "nslots");     break;
+        case 's': slotSize = getLong(optarg, GN_GT_0, "slot-size"); break;
+        case 'H': useHuge = 1;                                      break;
+        default:  usageError(argv[0]);
+        }
+    }
+
+    if (optind != argc)
+        usageError(argv[0]);
+    if ((nslots & (nslots - 1)) != 0 || nslots > 65536)
+        cmdLineErr("nslots must be a power of 2, no greater than 65536\n");
+    if (slotSize > INT32_MAX / 2)
+        cmdLineErr("slot-size is too large\n");
+
+    /* The slot data starts on a page boundary, after the header and the
+       array of slot byte counts. A huge page segment must be a multiple
+       of the huge page size. */
+
+    pageSize = sysconf(_SC_PAGESIZE);
+    dataOffset = sizeof(struct shmring) + nslots * sizeof(int32_t);
+    dataOffset = (dataOffset + pageSize - 1) / pageSize * pageSize;
+    segSize = dataOffset + nslots * slotSize;
+
+    if (useHuge) {
+        pageSize = hugePageSize();
+        segSize = (segSize + pageSize - 1) / pageSize * pageSize;
+    }
+
+    /* Create shared memory; we use IPC_EXCL, since the reader must not
+       attach to a stale segment left by an earlier writer */
+
+    shmid = shmget(SHM_RING_KEY, segSize, IPC_CREAT | IPC_EXCL | OBJ_PERMS |
+                   (useHuge ? SHM_HUGETLB : 0));
+    if (shmid == -1) {
+        if (errno == EEXIST)
+            fatal("shared memory segment with key 0x%x already exists "
+                  "(remove it with svshm_rm)", SHM_RING_KEY);
+        if (useHuge && (errno == ENOMEM || errno == EPERM))
+            fatal("could not create huge page segment; check "
+                  "/proc/sys/vm/nr_hugepages and "
+                  "/proc/sys/vm/hugetlb_shm_group");
+        errExit("shmget");
+    }
+
+    ring = shmat(shmid, NULL, 0);
+    if (ring == (void *) -1)
+        errExit("shmat");
+
+    ring->nslots = nslots;
+    ring->slotSize = slotSize;
+    ring->dataOffset = dataOffset;
+    ring->head = ring->tail = 0;
+    ring->readerWaiting = ring->writerWaiting = 0;
+
+    /* The reader waits until it sees 'magic', so this must be set last */
+
+    __atomic_store_n(&ring->magic, RING_MAGIC, __ATOMIC_RELEASE);
+
+    /* Transfer blocks of data from stdin to the ring. The slot with a
+       count of 0 tells the reader that we hit EOF. */
+
+    for (xfrs = 0, bytes = 0; ; xfrs++, bytes += cnt) {
+        head = ring->head;              /* Only we modify 'head' */
+
+        /* If the ring is full, wait for the reader to empty a slot */
+
+        tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (head - tail == nslots)
+            ringWait(&ring->tail, &ring->writerWaiting, tail);
+
+        cnt = read(STDIN_FILENO, RING_DATA(ring, head), slotSize);
+        if (cnt == -1)
+            errExit("read");
+
+        ring->cnt[head & (nslots - 1)] = cnt;
+        ringAdvance(&ring->head, &ring->readerWaiting);
+
+        if (cnt == 0)
+            break;
+    }
+
+    /* Wait until the reader has emptied every slot (including the one
+       that marks EOF). We then know that the reader has finished, and so
+       we can delete the segment. */
+
+    while ((tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) !=
+            ring->head)
+        ringWait(&ring->tail, &ring->writerWaiting, tail);
+
+    if (shmdt(ring) == -1)
+        errExit("shmdt");
+    if (shmctl(shmid, IPC_RMID, 0) == -1)
+        errExit("shmctl");
+
+    fprintf(stderr, "Sent %lld bytes (%d xfrs)\n", bytes, xfrs);
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,232 @@
+/*************************************************************************\
+*                  Copyright (C) Michael Kerrisk, 2020.                   *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU General Public License as published by the   *
+* Free Software Foundation, either version 3 or (at your option) any      *
+* later version. This program is distributed without any warranty.  See   *
+* the file COPYING.gpl-v3 for details.                                    *
+\*************************************************************************/
+
+/* Supplementary program for Chapter 48 */
+
+/* svshm_xfr_bench.c
+
+   Measure the throughput of the lock-step (svshm_xfr_writer/reader) and
+   ring (svshm_ring_writer/reader) shared memory transfer programs.
+
+   Usage: svshm_xfr_bench [-m MiB] [-H]
+
+   A file of 'MiB' mebibytes (default: 256) is created (in /dev/shm if
+   that directory exists, so that reading the file costs little), and
+   each writer/reader pair is then run with the file as the writer's
+   standard input and /dev/null as the reader's standard output. The
+   elapsed time and the throughput in GB/s are shown for each run. The
+   ring is run with several slot sizes; with -H, the ring is also run
+   with its segment in huge pages.
+
+   The writer and reader programs are looked for in the same directory
+   as this program.
+*/
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <time.h>
+#include "svshm_xfr.h"
+#include "svshm_ring.h"
+
+static char progDir[PATH_MAX];
+
+static double
+timeNow(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        errExit("clock_gettime");
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+createFile(const char *path, long long size)
+{
+    char buf[65536];
+    long long done;
+    size_t n;
+    int fd;
+
+    for (size_t j = 0; j < sizeof(buf); j++)
+        buf[j] = 'a' + j % 26;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd == -1)
+        errExit("open-%s", path);
+
+    for (done = 0; done < size; done += n) {
+        n = (size - done < (long long) sizeof(buf)) ?
+                size - done : sizeof(buf);
+        if (write(fd, buf, n) != (ssize_t) n)
+            fatal("write to %s failed", path);
+    }
+
+    if (close(fd) == -1)
+        errExit("close");
+}
+
+/* Create a child that runs the program 'argv[0]' (in 'progDir'), with
+   its standard input and output redirected to 'inPath' and 'outPath' */
+
+static pid_t
+spawn(char *argv[], const char *inPath, const char *outPath)
+{
+    char path[PATH_MAX];
+    pid_t pid;
+    int fd;
+
+    pid = fork();
+    if (pid == -1)
+        errExit("fork");
+    if (pid != 0)
+        return pid;
+
+    fd = open(inPath, O_RDONLY);
+    if (fd == -1 || dup2(fd, STDIN_FILENO) == -1)
+        errExit("open/dup2-%s", inPath);
+    fd = open(outPath, O_WRONLY);
+    if (fd == -1 || dup2(fd, STDOUT_FILENO) == -1)
+        errExit("open/dup2-%s", outPath);
+
+    /* Silence the "Sent/Received N bytes" messages */
+
+    fd = open("/dev/null", O_WRONLY);
+    if (fd == -1 || dup2(fd, STDERR_FILENO) == -1)
+        _exit(EXIT_FAILURE);
+
+    if (snprintf(path, sizeof(path), "%s/%s", progDir, argv[0]) >=
+            (int) sizeof(path))
+        _exit(127);
+    execv(path, argv);
+    _exit(127);
+}
+
+static int
+reap(pid_t pid)
+{
+    int status;
+
+    if (waitpid(pid, &status, 0) == -1)
+        errExit("waitpid");
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/* Run one writer/reader pair, and report the throughput. The reader is
+   started once the writer has created the shared memory segment with
+   the key 'shmKey'. */
+
+static void
+runPair(const char *label, char *writerArgv[], char *readerArgv[],
+        key_t shmKey, const char *inPath, long long size)
+{
+    pid_t wpid, rpid;
+    double start, secs;
+    int ok;
+
+    start = timeNow();
+
+    wpid = spawn(writerArgv, inPath, "/dev/null");
+
+    while (shmget(shmKey, 0, 0) == -1) {
+        if (waitpid(wpid, NULL, WNOHANG) == wpid) {
+            printf("%-32s writer failed\n", label);
+            return;
+        }
+        usleep(100);
+    }
+
+    rpid = spawn(readerArgv, "/dev/null", "/dev/null");
+
+    ok = reap(rpid);
+    ok = reap(wpid) && ok;
+
+    secs = timeNow() - start;
+
+    if (!ok)
+        printf("%-32s failed\n", label);
+    else
+        printf("%-32s %9.3f %9.2f\n", label, secs, size / secs / 1e9);
+}
+
+static void
+usageError(const char *progName)
+{
+    fprintf(stderr, "Usage: %s [-m MiB] [-H]\n", progName);
+    fprintf(stderr, "    -m MiB  Amount of data to transfer (default: 256)\n");
+    fprintf(stderr, "    -H      Also run the ring with huge pages\n");
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+    char inPath[PATH_MAX], argv0[PATH_MAX], label[64];
+    char *xfrWriter[] = { "svshm_xfr_writer", NULL };
+    char *xfrReader[] = { "svshm_xfr_reader", NULL };
+    char *ringReader[] = { "svshm_ring_reader", NULL };
+    char *ringWriter[7];
+    char slotArg[32];
+    static const long slotSizes[] = { 1024, 4096, 65536, 1024 * 1024 };
+    long long size;
+    int opt, useHuge;
+
+    size = 256LL * 1024 * 1024;
+    useHuge = 0;
+
+    while ((opt = getopt(argc, argv, "m:H")) != -1) {
+        switch (opt) {
+        case 'm': size = getLong(optarg, GN_GT_0, "MiB") << 20;    break;
+        case 'H': useHuge = 1;                                      break;
+        default:  usageError(argv[0]);
+        }
+    }
+
+    if (optind != argc)
+        usageError(argv[0]);
+
+    snprintf(argv0, sizeof(argv0), "%s", argv[0]);
+    snprintf(progDir, sizeof(progDir), "%s", dirname(argv0));
+
+    snprintf(inPath, sizeof(inPath), "%s/svshm_xfr_bench.%ld",
+             (access("/dev/shm", W_OK) == 0) ? "/dev/shm" : "/tmp",
+             (long) getpid());
+    createFile(inPath, size);
+
+    printf("Transferring %lld MiB\n\n", size / (1024 * 1024));
+    printf("%-32s %9s %9s\n", "Method", "Secs", "GB/s");
+
+    snprintf(label, sizeof(label), "lock-step, %d-byte buffer", BUF_SIZE);
+    runPair(label, xfrWriter, xfrReader, SHM_KEY, inPath, size);
+
+    for (size_t j = 0; j < sizeof(slotSizes) / sizeof(slotSizes[0]); j++) {
+        for (int huge = 0; huge <= useHuge; huge++) {
+            snprintf(slotArg, sizeof(slotArg), "%ld", slotSizes[j]);
+            ringWriter[0] = "svshm_ring_writer";
+            ringWriter[1] = "-n";
+            ringWriter[2] = "16";
+            ringWriter[3] = "-s";
+            ringWriter[4] = slotArg;
+            ringWriter[5] = huge ? "-H" : NULL;
+            ringWriter[6] = NULL;
+
+            snprintf(label, sizeof(label), "ring, 16 x %ld bytes%s",
+                     slotSizes[j], huge ? ", huge" : "");
+            runPair(label, ringWriter, ringReader, SHM_RING_KEY,
+                    inPath, size);
+        }
+    }
+
+    if (unlink(inPath) == -1)
+        errExit("unlink");
+
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,780 @@
+/*************************************************************************\
+*                  Copyright (C) Michael Kerrisk, 2020.                   *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU Lesser General Public License as published   *
+* by the Free Software Foundation, either version 3 or (at your option)   *
+* any later version. This program is distributed without any warranty.    *
+* See the files COPYING.lgpl-v3 and COPYING.gpl-v3 for details.           *
+\*************************************************************************/
+
+/* Supplementary program for Chapter 12 */
+
+/* proc_snapshot.c
+
+   A snapshot of the process table, built from the /proc/PID/stat and/or
+   /proc/PID/status files, and cheap to bring up to date.
+
+   psCreate() returns a snapshot object, which holds an O_PATH file
+   descriptor for /proc; psRefresh() brings the snapshot up to date, and
+   psCount() and psGet() return its contents, in order of PID.
+
+   To keep the cost per process low, the files are opened relative to the
+   /proc descriptor with openat(), read with a single pread() into a
+   buffer that is reused for every process, and parsed by a scanner that
+   knows the layout of the files, rather than with stdio and sscanf().
+   The stat file is a single line of fields in a fixed order; the lines
+   of the status file that we need are found by their first character.
+
+   A refresh lists the PIDs in /proc (with getdents64()) and merges the
+   list with the previous snapshot. With PS_STAT, for each process that
+   was already in the snapshot, only the stat file is reread (it holds
+   the fields that change over time). If the process's start time
+   differs from the one recorded, the PID has been reused by a new
+   process; if its command name has changed, it has done an exec(). In
+   either case, and for processes that are new, the status file is read
+   as well (with PS_STATUS). A process that changes its credentials
+   without doing an exec() is thus not noticed, unless PS_REREAD is
+   specified, which makes every refresh read the status file of every
+   process. (Without PS_STAT, there is nothing cheaper to look at, so
+   the status file is always reread.)
+
+   Reading both files of every process costs two opens per process, so
+   a caller that needs only the status fields (as procfs_user_exe.c
+   does) should not specify PS_STAT; a first scan then costs one open
+   per process.
+
+   With PS_KEEP_FDS, the first file that is read for each process (stat,
+   with PS_STAT, else status) is kept open from one refresh to the next,
+   so that rereading it needs just a pread(), not a pathname lookup.
+   (Once a process has terminated, reading the file fails with ESRCH,
+   even if the PID has been reused.) This needs one file descriptor per
+   process, so the caller may need to raise the RLIMIT_NOFILE limit;
+   psRefresh() fails with EMFILE otherwise.
+
+   If 'nthreads' is greater than 1, psRefresh() reads the files of
+   different processes in that many threads.
+*/
+#define _GNU_SOURCE
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "proc_snapshot.h"
+
+#define DIR_BUF_SIZE (64 * 1024)        /* getdents64() buffer */
+#define READ_BUF_SIZE 4096              /* Holds all that we need of the
+                                           stat and status files */
+#define CHUNK 32                        /* Processes claimed at a time by
+                                           a reading thread */
+
+/* A directory entry, as returned by getdents64() */
+
+struct linux_dirent64 {
+    ino64_t        d_ino;
+    off64_t        d_off;
+    unsigned short d_reclen;
+    unsigned char  d_type;
+    char           d_name[];
+};
+
+enum { ENT_KNOWN, ENT_NEW, ENT_GONE };
+
+struct psEntry {
+    struct procInfo info;
+    int keptFd;                 /* With PS_KEEP_FDS, else -1 */
+    int state;                  /* ENT_* */
+};
+
+struct procSnapshot {
+    int procFd;                 /* O_PATH descriptor for /proc */
+    int flags;
+    int nthreads;
+    struct psEntry *ents;       /* Current snapshot, in order of PID */
+    int nents;
+    struct psEntry *newEnts;    /* Built by psRefresh() */
+    int entsSize;               /* Allocated size of both arrays */
+    pid_t *pids;                /* PIDs listed in /proc */
+    int pidsSize;
+    char *dirBuf;
+    char **readBufs;            /* One per thread */
+    int nread;                  /* Number of entries to be read */
+    int nextIdx;                /* Next entry to be claimed by a thread */
+    int error;                  /* errno value, if a refresh failed */
+    struct psStats stats;
+};
+
+/* ---------------------------------------------------------------- */
+/* Scanning the contents of the files */
+
+/* Return the decimal number at '*pp' (which may be negative), and
+   advance '*pp' past the number and the separator that follows it */
+
+static long long
+scanNum(const char **pp, const char *end)
+{
+    const char *p = *pp;
+    unsigned long long v = 0;
+    int neg = 0;
+
+    if (p < end && *p == '-') {
+        neg = 1;
+        p++;
+    }
+    while (p < end && *p >= '0' && *p <= '9')
+        v = v * 10 + (*p++ - '0');
+    if (p < end)
+        p++;
+
+    *pp = p;
+    return neg ? -(long long) v : (long long) v;
+}
+
+/* Skip 'n' space-separated fields */
+
+static void
+skipFields(const char **pp, const char *end, int n)
+{
+    const char *p = *pp;
+
+    while (n > 0 && p < end) {
+        p = memchr(p, ' ', end - p);
+        if (p == NULL) {
+            p = end;
+            break;
+        }
+        p++;
+        n--;
+    }
+    *pp = p;
+}
+
+/* Parse the contents of /proc/PID/stat. Returns 0 on success, or -1 if
+   the contents are not as expected. */
+
+static int
+parseStat(const char *buf, size_t len, struct procInfo *pi)
+{
+    const char *end = buf + len;
+    const char *p, *lp, *rp;
+    size_t clen;
+
+    /* The command name is in parentheses, and may itself contain
+       parentheses, so it ends at the last ')' */
+
+    lp = memchr(buf, '(', len);
+    rp = NULL;
+    for (p = end - 1; p > buf; p--) {
+        if (*p == ')') {
+            rp = p;
+            break;
+        }
+    }
+    if (lp == NULL || rp == NULL || rp < lp || rp + 2 >= end)
+        return -1;
+
+    clen = rp - lp - 1;
+    if (clen >= PS_NAME_LEN)
+        clen = PS_NAME_LEN - 1;
+    memcpy(pi->comm, lp + 1, clen);
+    pi->comm[clen] = '\0';
+
+    p = rp + 2;                         /* Field 3: state */
+    pi->state = *p;
+    p += 2;
+
+    pi->ppid = scanNum(&p, end);        /* Field 4 */
+    skipFields(&p, end, 9);             /* Fields 5 to 13 */
+    pi->utime = scanNum(&p, end);       /* Field 14 */
+    pi->stime = scanNum(&p, end);       /* Field 15 */
+    skipFields(&p, end, 4);             /* Fields 16 to 19 */
+    pi->numThreads = scanNum(&p, end);  /* Field 20 */
+    skipFields(&p, end, 1);             /* Field 21 */
+    pi->startTime = scanNum(&p, end);   /* Field 22 */
+    skipFields(&p, end, 1);             /* Field 23 */
+    pi->rss = scanNum(&p, end);         /* Field 24 */
+
+    return (p < end) ? 0 : -1;
+}
+
+/* Parse the four IDs on a "Uid:" or "Gid:" line ('p' points after the
+   colon) */
+
+static void
+scanIds(const char *p, const char *end, long long ids[4])
+{
+    for (int j = 0; j < 4; j++) {
+        while (p < end && (*p == '\t' || *p == ' '))
+            p++;
+        ids[j] = scanNum(&p, end);
+    }
+}
+
+/* Does the line 'p' (ending at 'eol') start with 'tag'? */
+
+static int
+hasTag(const char *p, const char *eol, const char *tag, size_t tlen)
+{
+    return (size_t) (eol - p) > tlen && memcmp(p, tag, tlen) == 0;
+}
+
+/* Parse the contents of /proc/PID/status. The Uid: and Gid: lines are
+   always parsed; if 'all' is nonzero, so are the lines that give the
+   fields otherwise taken from the stat file. Returns 0 on success, or -1
+   if the lines that we need were not found. */
+
+static int
+parseStatus(const char *buf, size_t len, struct procInfo *pi, int all)
+{
+    const char *end = buf + len;
+    const char *p, *q, *eol;
+    long long ids[4];
+    size_t clen;
+    int found, want;                    /* Bit masks of lines */
+
+    found = 0;
+    want = all ? 077 : 03;
+
+    for (p = buf; p < end && found != want; p = eol + 1) {
+        eol = memchr(p, '\n', end - p);
+        if (eol == NULL)
+            eol = end;
+
+        switch (p[0]) {
+        case 'U':
+            if (hasTag(p, eol, "Uid:", 4)) {
+                scanIds(p + 4, eol, ids);
+                for (int j = 0; j < 4; j++)
+                    pi->uid[j] = ids[j];
+                found |= 01;
+            }
+            break;
+
+        case 'G':
+            if (hasTag(p, eol, "Gid:", 4)) {
+                scanIds(p + 4, eol, ids);
+                for (int j = 0; j < 4; j++)
+                    pi->gid[j] = ids[j];
+                found |= 02;
+            }
+            break;
+
+        case 'N':
+            if (all && hasTag(p, eol, "Name:\t", 6)) {
+                clen = eol - (p + 6);
+                if (clen >= PS_NAME_LEN)
+                    clen = PS_NAME_LEN - 1;
+                memcpy(pi->comm, p + 6, clen);
+                pi->comm[clen] = '\0';
+                found |= 04;
+            }
+            break;
+
+        case 'S':
+            if (all && hasTag(p, eol, "State:\t", 7)) {
+                pi->state = p[7];
+                found |= 010;
+            }
+            break;
+
+        case 'P':
+            if (all && hasTag(p, eol, "PPid:\t", 6)) {
+                q = p + 6;
+                pi->ppid = scanNum(&q, eol);
+                found |= 020;
+            }
+            break;
+
+        case 'T':
+            if (all && hasTag(p, eol, "Threads:\t", 9)) {
+                q = p + 9;
+                pi->numThreads = scanNum(&q, eol);
+                found |= 040;
+            }
+            break;
+        }
+    }
+
+    return ((found & 03) == 03) ? 0 : -1;
+}
+
+/* ---------------------------------------------------------------- */
+/* Reading the files */
+
+/* Open the file "PID/name" relative to the /proc descriptor */
+
+static int
+openProcFile(struct procSnapshot *ps, pid_t pid, const char *name,
+             long *opens)
+{
+    char path[32], digits[16];
+    int n, k;
+
+    n = 0;
+    do {                                /* Convert PID to decimal */
+        digits[n++] = '0' + pid % 10;
+        pid /= 10;
+    } while (pid > 0);
+
+    for (k = 0; k < n; k++)
+        path[k] = digits[n - 1 - k];
+    path[k++] = '/';
+    strcpy(path + k, name);
+
+    (*opens)++;
+    return openat(ps->procFd, path, O_RDONLY | O_CLOEXEC);
+}
+
+/* Read the file "PID/name" into 'buf'. If 'keepFd' is not NULL, it
+   points to a descriptor for the file that is reused if it is open, and
+   in which the descriptor is left open; '*reused' is then set to 1 if a
+   kept descriptor referred to a process that has gone. Returns the
+   number of bytes read, or -1 on error. */
+
+static ssize_t
+readProcFile(struct procSnapshot *ps, pid_t pid, const char *name,
+             int *keepFd, int *reused, char *buf, long *opens)
+{
+    ssize_t n;
+    int fd, savedErrno;
+
+    if (keepFd != NULL && *keepFd >= 0) {
+        n = pread(*keepFd, buf, READ_BUF_SIZE, 0);
+        if (n > 0)
+            return n;
+
+        /* The process that we had open has gone; the PID may have
+           been reused, so try again by name */
+
+        close(*keepFd);
+        *keepFd = -1;
+        *reused = 1;
+    }
+
+    fd = openProcFile(ps, pid, name, opens);
+    if (fd == -1)
+        return -1;
+
+    n = pread(fd, buf, READ_BUF_SIZE, 0);
+    savedErrno = errno;
+
+    if (keepFd != NULL && n > 0) {
+        *keepFd = fd;
+    } else {
+        close(fd);
+        errno = savedErrno;
+    }
+    return n;
+}
+
+/* Is 'err' an error that means the process has gone? */
+
+static int
+processGone(int err)
+{
+    return err == ENOENT || err == ESRCH;
+}
+
+/* Record that entry 'e' could not be read, because of 'n' and errno */
+
+static void
+entryFailed(struct procSnapshot *ps, struct psEntry *e, ssize_t n)
+{
+    if (n == -1 && !processGone(errno))
+        __atomic_store_n(&ps->error, errno, __ATOMIC_RELAXED);
+    e->state = ENT_GONE;
+}
+
+/* Bring entry 'e' up to date; 'buf' is the calling thread's buffer, and
+   'stats' its counts */
+
+static void
+readEntry(struct procSnapshot *ps, struct psEntry *e, char *buf,
+          struct psStats *stats)
+{
+    struct procInfo pi;
+    ssize_t n;
+    int needStatus, reused;
+    int *keepFd = (ps->flags & PS_KEEP_FDS) ? &e->keptFd : NULL;
+
+    pi = e->info;
+    reused = 0;
+
+    if (ps->flags & PS_STAT) {
+        n = readProcFile(ps, pi.pid, "stat", keepFd, &reused, buf,
+                         &stats->opens);
+        if (n <= 0 || parseStat(buf, n, &pi) == -1) {
+            entryFailed(ps, e, n);
+            return;
+        }
+
+        /* Has the PID been reused, or has the process done an exec()? */
+
+        if (e->state == ENT_KNOWN && pi.startTime != e->info.startTime)
+            reused = 1;
+        needStatus = (ps->flags & PS_STATUS) &&
+                     (reused || e->state == ENT_NEW ||
+                      (ps->flags & PS_REREAD) ||
+                      strcmp(pi.comm, e->info.comm) != 0);
+        keepFd = NULL;                  /* Only stat is kept open */
+    } else {
+        needStatus = 1;
+    }
+
+    if (needStatus) {
+        stats->statusReads++;
+        n = readProcFile(ps, pi.pid, "status", keepFd, &reused, buf,
+                         &stats->opens);
+        if (n <= 0 ||
+                parseStatus(buf, n, &pi, !(ps->flags & PS_STAT)) == -1) {
+            entryFailed(ps, e, n);
+            return;
+        }
+    }
+
+    if (reused && e->state == ENT_KNOWN) {
+        stats->removed++;
+        e->state = ENT_NEW;
+    }
+    if (e->state == ENT_NEW)
+        stats->added++;
+    e->info = pi;
+    e->state = ENT_KNOWN;
+}
+
+/* Read entries claimed from 'ps->newEnts' until none remain */
+
+struct readerArg {
+    struct procSnapshot *ps;
+    char *buf;
+    struct psStats stats;
+    pthread_t thread;
+};
+
+static void *
+readEntries(void *arg)
+{
+    struct readerArg *ra = arg;
+    struct procSnapshot *ps = ra->ps;
+    int start, end;
+
+    for (;;) {
+        start = __atomic_fetch_add(&ps->nextIdx, CHUNK, __ATOMIC_RELAXED);
+        if (start >= ps->nread)
+            break;
+        end = start + CHUNK;
+        if (end > ps->nread)
+            end = ps->nread;
+        for (int j = start; j < end; j++)
+            readEntry(ps, &ps->newEnts[j], ra->buf, &ra->stats);
+    }
+
+    return NULL;
+}
+
+/* ---------------------------------------------------------------- */
+
+static int
+cmpPid(const void *a, const void *b)
+{
+    pid_t p1 = *(const pid_t *) a, p2 = *(const pid_t *) b;
+
+    return (p1 > p2) - (p1 < p2);
+}
+
+/* List the PIDs in /proc into 'ps->pids', in ascending order. Returns
+   the number of PIDs, or -1 on error. */
+
+static int
+listPids(struct procSnapshot *ps)
+{
+    struct linux_dirent64 *d;
+    ssize_t nread;
+    pid_t pid, *pids;
+    int fd, npids, sorted, savedErrno;
+    const char *s;
+
+    /* An O_PATH descriptor can't be read, so open /proc again for
+       reading (which is cheap, since it needs no pathname lookup) */
+
+    fd = openat(ps->procFd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+
+    npids = 0;
+    sorted = 1;
+
+    for (;;) {
+        nread = syscall(SYS_getdents64, fd, ps->dirBuf, DIR_BUF_SIZE);
+        if (nread == -1) {
+            savedErrno = errno;
+            close(fd);
+            errno = savedErrno;
+            return -1;
+        }
+        if (nread == 0)
+            break;
+
+        for (char *p = ps->dirBuf; p < ps->dirBuf + nread; p += d->d_reclen) {
+            d = (struct linux_dirent64 *) p;
+
+            pid = 0;
+            for (s = d->d_name; *s >= '0' && *s <= '9'; s++)
+                pid = pid * 10 + (*s - '0');
+            if (*s != '\0' || s == d->d_name)
+                continue;               /* Not a PID */
+
+            if (npids == ps->pidsSize) {
+                pids = realloc(ps->pids, (ps->pidsSize * 2 + 1024) *
+                                         sizeof(pid_t));
+                if (pids == NULL) {
+                    close(fd);
+                    errno = ENOMEM;
+                    return -1;
+                }
+                ps->pids = pids;
+                ps->pidsSize = ps->pidsSize * 2 + 1024;
+            }
+
+            if (npids > 0 && pid < ps->pids[npids - 1])
+                sorted = 0;
+            ps->pids[npids++] = pid;
+        }
+    }
+
+    close(fd);
+
+    if (!sorted)                /* Normally, /proc lists PIDs in order */
+        qsort(ps->pids, npids, sizeof(pid_t), cmpPid);
+
+    return npids;
+}
+
+/* Create a snapshot object; 'flags' is a mask of PS_* values (if it
+   includes neither PS_STAT nor PS_STATUS, PS_STAT is assumed), and
+   'nthreads' the number of threads used by psRefresh(). The snapshot is
+   empty until psRefresh() is called. Returns NULL on error. */
+
+struct procSnapshot *
+psCreate(int flags, int nthreads)
+{
+    struct procSnapshot *ps;
+
+    ps = calloc(1, sizeof(struct procSnapshot));
+    if (ps == NULL)
+        return NULL;
+
+    ps->flags = flags;
+    if (!(flags & (PS_STAT | PS_STATUS)))
+        ps->flags |= PS_STAT;
+    ps->nthreads = (nthreads > 0) ? nthreads : 1;
+
+    ps->procFd = open("/proc", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (ps->procFd == -1) {
+        free(ps);
+        return NULL;
+    }
+
+    ps->dirBuf = malloc(DIR_BUF_SIZE);
+    ps->readBufs = calloc(ps->nthreads, sizeof(char *));
+    if (ps->dirBuf == NULL || ps->readBufs == NULL) {
+        psDestroy(ps);
+        errno = ENOMEM;
+        return NULL;
+    }
+    for (int j = 0; j < ps->nthreads; j++) {
+        ps->readBufs[j] = malloc(READ_BUF_SIZE);
+        if (ps->readBufs[j] == NULL) {
+            psDestroy(ps);
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+
+    return ps;
+}
+
+/* Empty the snapshot, closing any descriptors that it keeps. Preserves
+   'errno'. */
+
+static void
+clearSnapshot(struct procSnapshot *ps)
+{
+    int savedErrno = errno;
+
+    for (int j = 0; j < ps->nents; j++)
+        if (ps->ents[j].keptFd >= 0)
+            close(ps->ents[j].keptFd);
+    ps->nents = 0;
+    ps->stats.procs = 0;
+
+    errno = savedErrno;
+}
+
+/* Bring the snapshot up to date. Returns the number of processes, or -1
+   on error (in which case the snapshot is left empty). */
+
+int
+psRefresh(struct procSnapshot *ps)
+{
+    struct readerArg *ra;
+    struct psEntry *ents;
+    int npids, j, k, n, started;
+
+    npids = listPids(ps);
+    if (npids == -1) {
+        clearSnapshot(ps);
+        return -1;
+    }
+
+    if (npids > ps->entsSize) {
+        ents = realloc(ps->newEnts, npids * sizeof(struct psEntry));
+        if (ents != NULL) {
+            ps->newEnts = ents;
+            ents = realloc(ps->ents, npids * sizeof(struct psEntry));
+        }
+        if (ents == NULL) {
+            errno = ENOMEM;
+            clearSnapshot(ps);
+            return -1;
+        }
+        ps->ents = ents;
+        ps->entsSize = npids;
+    }
+
+    /* Allocated before the merge, which moves the kept descriptors into
+       'newEnts', so that there is nothing to undo if this fails */
+
+    ra = calloc(ps->nthreads, sizeof(struct readerArg));
+    if (ra == NULL) {
+        errno = ENOMEM;
+        clearSnapshot(ps);
+        return -1;
+    }
+
+    /* Merge the list of PIDs with the old snapshot (both are in order
+       of PID) */
+
+    ps->stats.added = ps->stats.removed = 0;
+    ps->stats.statusReads = ps->stats.opens = 0;
+
+    k = 0;
+    for (j = 0; j < npids; j++) {
+        while (k < ps->nents && ps->ents[k].info.pid < ps->pids[j]) {
+            if (ps->ents[k].keptFd >= 0)
+                close(ps->ents[k].keptFd);
+            ps->stats.removed++;
+            k++;
+        }
+
+        if (k < ps->nents && ps->ents[k].info.pid == ps->pids[j]) {
+            ps->newEnts[j] = ps->ents[k++];
+        } else {
+            memset(&ps->newEnts[j], 0, sizeof(struct psEntry));
+            ps->newEnts[j].info.pid = ps->pids[j];
+            ps->newEnts[j].keptFd = -1;
+            ps->newEnts[j].state = ENT_NEW;
+        }
+    }
+    for (; k < ps->nents; k++) {
+        if (ps->ents[k].keptFd >= 0)
+            close(ps->ents[k].keptFd);
+        ps->stats.removed++;
+    }
+
+    /* Read the files, in parallel if so configured */
+
+    ps->nread = npids;
+    ps->nextIdx = 0;
+    ps->error = 0;
+
+    for (j = 0; j < ps->nthreads; j++) {
+        ra[j].ps = ps;
+        ra[j].buf = ps->readBufs[j];
+    }
+
+    started = 1;
+    for (; started < ps->nthreads && npids > CHUNK; started++)
+        if (pthread_create(&ra[started].thread, NULL, readEntries,
+                           &ra[started]) != 0)
+            break;              /* Carry on with the threads we have */
+
+    readEntries(&ra[0]);
+
+    for (j = 1; j < started; j++)
+        pthread_join(ra[j].thread, NULL);
+
+    for (j = 0; j < started; j++) {
+        ps->stats.added += ra[j].stats.added;
+        ps->stats.removed += ra[j].stats.removed;
+        ps->stats.statusReads += ra[j].stats.statusReads;
+        ps->stats.opens += ra[j].stats.opens;
+    }
+    free(ra);
+
+    /* Drop the processes that have gone, and swap the arrays */
+
+    n = 0;
+    for (j = 0; j < npids; j++) {
+        if (ps->newEnts[j].state == ENT_GONE) {
+            if (ps->newEnts[j].keptFd >= 0)
+                close(ps->newEnts[j].keptFd);
+        } else {
+            ps->newEnts[n++] = ps->newEnts[j];
+        }
+    }
+
+    ents = ps->ents;
+    ps->ents = ps->newEnts;
+    ps->newEnts = ents;
+    ps->nents = n;
+    ps->stats.procs = n;
+
+    if (ps->error != 0) {
+        errno = ps->error;
+        clearSnapshot(ps);
+        return -1;
+    }
+
+    return n;
+}
+
+int
+psCount(struct procSnapshot *ps)
+{
+    return ps->nents;
+}
+
+const struct procInfo *
+psGet(struct procSnapshot *ps, int idx)
+{
+    return (idx >= 0 && idx < ps->nents) ? &ps->ents[idx].info : NULL;
+}
+
+/* Return counts for the last refresh */
+
+void
+psGetStats(struct procSnapshot *ps, struct psStats *stats)
+{
+    *stats = ps->stats;
+}
+
+void
+psDestroy(struct procSnapshot *ps)
+{
+    clearSnapshot(ps);
+
+    if (ps->readBufs != NULL)
+        for (int j = 0; j < ps->nthreads; j++)
+            free(ps->readBufs[j]);
+    free(ps->readBufs);
+    free(ps->dirBuf);
+    free(ps->pids);
+    free(ps->ents);
+    free(ps->newEnts);
+    close(ps->procFd);
+    free(ps);
+}
@@ -0,0 +1,77 @@
+/*************************************************************************\
+*                  Copyright (C) Michael Kerrisk, 2020.                   *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU Lesser General Public License as published   *
+* by the Free Software Foundation, either version 3 or (at your option)   *
+* any later version. This program is distributed without any warranty.    *
+* See the files COPYING.lgpl-v3 and COPYING.gpl-v3 for details.           *
+\*************************************************************************/
+
+/* proc_snapshot.h
+
+   Header file for proc_snapshot.c.
+*/
+#ifndef PROC_SNAPSHOT_H
+#define PROC_SNAPSHOT_H         /* Prevent accidental double inclusion */
+
+#include <sys/types.h>
+
+/* Values for 'flags' argument of psCreate() */
+
+#define PS_STATUS       01      /* Fill in fields from /proc/PID/status */
+#define PS_KEEP_FDS     02      /* Keep a file of each process open
+                                   between refreshes */
+#define PS_REREAD       04      /* Reread status of every process at each
+                                   refresh, not just new ones */
+#define PS_STAT         010     /* Fill in fields from /proc/PID/stat */
+
+#define PS_NAME_LEN 64          /* Enough for kernel thread names */
+
+struct procInfo {
+    pid_t pid;
+
+    /* From /proc/PID/stat (with PS_STAT), or else from /proc/PID/status */
+
+    char comm[PS_NAME_LEN];     /* Command name (escaped, if taken from
+                                   status) */
+    char state;                 /* R, S, D, Z, ... */
+    pid_t ppid;
+    long numThreads;
+
+    /* From /proc/PID/stat (with PS_STAT) */
+
+    unsigned long utime;        /* CPU time, in clock ticks */
+    unsigned long stime;
+    unsigned long long startTime;       /* Clock ticks since boot */
+    long rss;                   /* Resident set size, in pages */
+
+    /* From /proc/PID/status (with PS_STATUS) */
+
+    uid_t uid[4];               /* Real, effective, saved, file-system */
+    gid_t gid[4];
+};
+
+struct procSnapshot;
+
+struct psStats {
+    long procs;                 /* Processes in the snapshot */
+    long added;                 /* New since the last refresh */
+    long removed;               /* Gone since the last refresh */
+    long statusReads;           /* Reads of /proc/PID/status */
+    long opens;                 /* Files opened */
+};
+
+struct procSnapshot *psCreate(int flags, int nthreads);
+
+int psRefresh(struct procSnapshot *ps);
+
+int psCount(struct procSnapshot *ps);
+
+const struct procInfo *psGet(struct procSnapshot *ps, int idx);
+
+void psGetStats(struct procSnapshot *ps, struct psStats *stats);
+
+void psDestroy(struct procSnapshot *ps);
+
+#endif
@@ -0,0 +1,269 @@
+/*************************************************************************\
+*                  Copyright (C) Michael Kerrisk, 2020.                   *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU General Public License as published by the   *
+* Free Software Foundation, either version 3 or (at your option) any      *
+* later version. This program is distributed without any warranty.  See   *
+* the file COPYING.gpl-v3 for details.                                    *
+\*************************************************************************/
+
+/* Supplementary program for Chapter 12 */
+
+/* proc_snapshot_bench.c
+
+   Measure the time taken to scan the process table, as the number of
+   processes grows, comparing:
+
+   stdio    the method of procfs_user_exe.c: fopen() each /proc/PID/status
+            file, and read it with fgets() to find the Name: and Uid: lines
+   full     a full scan using proc_snapshot.c (a new PS_STATUS snapshot,
+            refreshed once), with one thread
+   full-jN  the same, with N threads
+   incr     a refresh of an existing PS_STAT | PS_STATUS snapshot, when
+            no processes have changed (so that only stat files are read)
+   incr-fd  the same, with PS_KEEP_FDS
+   sts-fd   a refresh of an existing PS_STATUS | PS_KEEP_FDS snapshot
+            (so that each status file is reread with just a pread())
+
+   Usage: proc_snapshot_bench [-p nprocs,...] [-j nthreads] [-r reps]
+
+   For each 'nprocs' (default: 0,1000,4000), the program makes sure that
+   it has that many idle child processes, in addition to the processes
+   already on the system, and then runs each scan 'reps' (default: 5)
+   times and shows the shortest time, in milliseconds. 'nthreads' defaults
+   to 4. Children are only ever added, so a count smaller than an earlier
+   one runs with the children that already exist.
+*/
+#define _GNU_SOURCE
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <ctype.h>
+#include <signal.h>
+#include <time.h>
+#include "proc_snapshot.h"
+#include "tlpi_hdr.h"
+
+#define MAX_LINE 1000
+#define MAX_COUNTS 16
+
+enum { M_STDIO, M_FULL, M_FULL_J, M_INCR, M_INCR_FD, M_STATUS_FD,
+       NUM_METHODS };
+
+static double
+timeNow(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        errExit("clock_gettime");
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Scan the process table as procfs_user_exe.c does; return the number
+   of processes seen */
+
+static int
+scanStdio(void)
+{
+    DIR *dirp;
+    struct dirent *dp;
+    char path[PATH_MAX], line[MAX_LINE];
+    FILE *fp;
+    int nprocs, got;
+
+    dirp = opendir("/proc");
+    if (dirp == NULL)
+        errExit("opendir");
+
+    nprocs = 0;
+    while ((dp = readdir(dirp)) != NULL) {
+        if (dp->d_type != DT_DIR || !isdigit((unsigned char) dp->d_name[0]))
+            continue;
+
+        snprintf(path, PATH_MAX, "/proc/%s/status", dp->d_name);
+        fp = fopen(path, "r");
+        if (fp == NULL)
+            continue;
+
+        got = 0;
+        while (got != 3 && fgets(line, MAX_LINE, fp) != NULL) {
+            if (strncmp(line, "Name:", 5) == 0)
+                got |= 1;
+            if (strncmp(line, "Uid:", 4) == 0 &&
+                    strtol(line + 4, NULL, 10) >= 0)
+                got |= 2;
+        }
+        fclose(fp);
+
+        if (got == 3)
+            nprocs++;
+    }
+
+    closedir(dirp);
+    return nprocs;
+}
+
+/* Run one scan with method 'm'; 'ps' is the snapshot used for the
+   incremental methods. Returns the number of processes seen. */
+
+static int
+runScan(int m, int nthreads, struct procSnapshot *ps)
+{
+    struct procSnapshot *fresh;
+    int n;
+
+    if (m == M_STDIO)
+        return scanStdio();
+
+    if (m == M_INCR || m == M_INCR_FD || m == M_STATUS_FD) {
+        n = psRefresh(ps);
+        if (n == -1)
+            errExit("psRefresh");
+        return n;
+    }
+
+    fresh = psCreate(PS_STATUS, (m == M_FULL_J) ? nthreads : 1);
+    if (fresh == NULL)
+        errExit("psCreate");
+    n = psRefresh(fresh);
+    if (n == -1)
+        errExit("psRefresh");
+    psDestroy(fresh);
+    return n;
+}
+
+/* Create child processes (which just wait to be killed) until there are
+   at least 'target' of them. Existing children are never removed, so a
+   smaller 'target' than before is a no-op. */
+
+static void
+growChildren(pid_t **children, int *nchildren, int target)
+{
+    pid_t pid;
+
+    if (target <= *nchildren)
+        return;
+
+    *children = realloc(*children, target * sizeof(pid_t));
+    if (*children == NULL)
+        errExit("realloc");
+
+    while (*nchildren < target) {
+        pid = fork();
+        if (pid == -1)
+            errExit("fork");
+        if (pid == 0) {
+            prctl(PR_SET_PDEATHSIG, SIGKILL);
+            for (;;)
+                pause();
+        }
+        (*children)[(*nchildren)++] = pid;
+    }
+}
+
+static int
+parseList(char *list, long *vals, int max, const char *name)
+{
+    int n = 0;
+
+    for (char *tok = strtok(list, ","); tok != NULL && n < max;
+            tok = strtok(NULL, ","))
+        vals[n++] = getLong(tok, GN_NONNEG, name);
+    return n;
+}
+
+int
+main(int argc, char *argv[])
+{
+    char defaultCounts[] = "0,1000,4000";
+    char *countList;
+    long counts[MAX_COUNTS];
+    pid_t *children = NULL;
+    struct procSnapshot *ps[NUM_METHODS] = { NULL };
+    struct rlimit rl;
+    double best[NUM_METHODS], t;
+    int ncounts, nchildren, nthreads, reps, opt, nprocs;
+    char jlabel[16];
+
+    countList = defaultCounts;
+    nthreads = 4;
+    reps = 5;
+
+    while ((opt = getopt(argc, argv, "p:j:r:")) != -1) {
+        switch (opt) {
+        case 'p':
+            countList = optarg;
+            break;
+        case 'j':
+            nthreads = getInt(optarg, GN_GT_0, "nthreads");
+            break;
+        case 'r':
+            reps = getInt(optarg, GN_GT_0, "reps");
+            break;
+        default:
+            usageErr("%s [-p nprocs,...] [-j nthreads] [-r reps]\n",
+                     argv[0]);
+        }
+    }
+
+    ncounts = parseList(countList, counts, MAX_COUNTS, "nprocs");
+
+    /* PS_KEEP_FDS needs a file descriptor per process */
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    snprintf(jlabel, sizeof(jlabel), "full-j%d", nthreads);
+    printf("%7s %9s %9s %9s %9s %9s %9s   (ms)\n", "procs", "stdio",
+           "full", jlabel, "incr", "incr-fd", "sts-fd");
+
+    nchildren = 0;
+    for (int c = 0; c < ncounts; c++) {
+        growChildren(&children, &nchildren, counts[c]);
+
+        /* The incremental snapshots are brought up to date before
+           timing starts */
+
+        ps[M_INCR] = psCreate(PS_STAT | PS_STATUS, 1);
+        ps[M_INCR_FD] = psCreate(PS_STAT | PS_STATUS | PS_KEEP_FDS, 1);
+        ps[M_STATUS_FD] = psCreate(PS_STATUS | PS_KEEP_FDS, 1);
+        for (int m = M_INCR; m <= M_STATUS_FD; m++) {
+            if (ps[m] == NULL)
+                errExit("psCreate");
+            if (psRefresh(ps[m]) == -1)
+                errExit("psRefresh");
+        }
+
+        nprocs = 0;
+        for (int m = 0; m < NUM_METHODS; m++) {
+            best[m] = 1e9;
+            for (int r = 0; r < reps; r++) {
+                t = timeNow();
+                nprocs = runScan(m, nthreads, ps[m]);
+                t = timeNow() - t;
+                if (t < best[m])
+                    best[m] = t;
+            }
+        }
+
+        printf("%7d", nprocs);
+        for (int m = 0; m < NUM_METHODS; m++)
+            printf(" %9.2f", best[m] * 1000);
+        printf("\n");
+
+        for (int m = M_INCR; m <= M_STATUS_FD; m++)
+            psDestroy(ps[m]);
+    }
+
+    for (int j = 0; j < nchildren; j++)
+        kill(children[j], SIGKILL);
+    while (wait(NULL) != -1)
+        continue;
+
+    exit(EXIT_SUCCESS);
+}
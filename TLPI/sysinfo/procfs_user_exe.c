@@ -18,6 +18,12 @@
    processes running under a particular real user ID; for each process,
    the process ID and command that it executes are shown.
 
+   By default, the program reads the files with stdio, as shown below.
+   With "-s", it instead uses the process table snapshot in
+   proc_snapshot.c, which reads each file with a single pread() and
+   parses it without stdio; "-j nthreads" (which implies "-s") reads the
+   files in that many threads.
+
    This program is Linux-specific.
 */
 #define _GNU_SOURCE
@@ -25,11 +31,37 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include <ctype.h>
+#include "proc_snapshot.h"
 #include "ugid_functions.h"
 #include "tlpi_hdr.h"
 
 #define MAX_LINE 1000
 
+/* List the processes whose real user ID is 'checkedUid', using a
+   snapshot of the process table */
+
+static void
+listWithSnapshot(uid_t checkedUid, int nthreads)
+{
+    struct procSnapshot *ps;
+    const struct procInfo *pi;
+
+    ps = psCreate(PS_STATUS, nthreads);
+    if (ps == NULL)
+        errExit("psCreate");
+
+    if (psRefresh(ps) == -1)
+        errExit("psRefresh");
+
+    for (int j = 0; j < psCount(ps); j++) {
+        pi = psGet(ps, j);
+        if (pi->uid[0] == checkedUid)
+            printf("%5ld %s\n", (long) pi->pid, pi->comm);
+    }
+
+    psDestroy(ps);
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -41,13 +73,34 @@ main(int argc, char *argv[])
     char *p;
     uid_t uid, checkedUid;
     Boolean gotName, gotUid;
+    int opt, nthreads;
+
+    nthreads = 0;               /* 0 means: don't use proc_snapshot.c */
+    while ((opt = getopt(argc, argv, "sj:")) != -1) {
+        switch (opt) {
+        case 's':
+            if (nthreads == 0)
+                nthreads = 1;
+            break;
+        case 'j':
+            nthreads = getInt(optarg, GN_GT_0, "nthreads");
+            break;
+        default:
+            usageErr("%s [-s] [-j nthreads] username\n", argv[0]);
+        }
+    }
 
-    if (argc < 2 || strcmp(argv[1], "--help") == 0)
-        usageErr("%s username\n", argv[0]);
+    if (optind >= argc || strcmp(argv[optind], "--help") == 0)
+        usageErr("%s [-s] [-j nthreads] username\n", argv[0]);
 
-    checkedUid = userIdFromName(argv[1]);
+    checkedUid = userIdFromName(argv[optind]);
     if (checkedUid == -1)
-        cmdLineErr("Bad username: %s\n", argv[1]);
+        cmdLineErr("Bad username: %s\n", argv[optind]);
+
+    if (nthreads > 0) {
+        listWithSnapshot(checkedUid, nthreads);
+        exit(EXIT_SUCCESS);
+    }
 
     dirp = opendir("/proc");
     if (dirp == NULL)
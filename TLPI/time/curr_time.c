@@ -12,7 +12,8 @@
 
 /* curr_time.c
 
-   Implement our currTime() function.
+   Implement our currTime() function, and timeNow(), which returns a
+   monotonic time in seconds, for timing intervals.
 */
 #include <time.h>
 #include "curr_time.h"          /* Declares function defined here */
@@ -42,3 +43,17 @@ currTime(const char *format)
 
     return (s == 0) ? NULL : buf;
 }
+
+/* Return the time, in seconds, according to CLOCK_MONOTONIC (so that the
+   difference between two calls is unaffected by changes to the system
+   clock). Returns -1 on error. */
+
+double
+timeNow(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        return -1;
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
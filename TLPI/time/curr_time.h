@@ -23,6 +23,8 @@ extern"C" {
 
 char* currTime(const char* fmt);
 
+double timeNow(void);
+
 #ifdef __cplusplus
 } // extern"C" {
 #endif
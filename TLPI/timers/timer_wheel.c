@@ -0,0 +1,607 @@
+/*************************************************************************\
+*                  Copyright (C) Michael Kerrisk, 2020.                   *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU Lesser General Public License as published   *
+* by the Free Software Foundation, either version 3 or (at your option)   *
+* any later version. This program is distributed without any warranty.    *
+* See the files COPYING.lgpl-v3 and COPYING.gpl-v3 for details.           *
+\*************************************************************************/
+
+/* timer_wheel.c
+
+   A hierarchical timer wheel, which keeps any number of timers (for
+   example, an idle timeout for each of a million network connections)
+   using a single timerfd, rather than a kernel timer (a POSIX timer, as
+   in ptmr_sigev_thread.c, or a timerfd, as in demo_timerfd.c) for each.
+
+   Time is divided into ticks of 'tickNsec' nanoseconds. The wheel has
+   TW_LEVELS levels, each an array of TW_SLOTS lists of timers. A timer
+   that expires within TW_SLOTS ticks is kept in level 0, in the slot for
+   its expiry tick. A timer that expires later is kept in a higher level,
+   where each slot covers TW_SLOTS times as many ticks as a slot in the
+   level below. At each tick, the timers in one slot of level 0 expire;
+   and each time that level 0 has gone all the way round, the timers in
+   the next slot of level 1 are "cascaded", that is, redistributed over
+   level 0 (and likewise for the higher levels). This is the scheme used
+   by the Linux kernel's timers before Linux 4.8, with one change: with
+   many timers, a slot of level 1 can hold so many timers that cascading
+   it all at once delays the tick's expirations by several ticks, so
+   most of each slot is instead cascaded a little at a time during the
+   preceding TW_SLOTS ticks (see cascadeAhead()).
+
+   Setting and cancelling a timer thus take constant time (an insertion
+   into, or removal from, a doubly linked list), and a timer is cascaded
+   at most TW_LEVELS - 1 times. A timer that expires more than
+   2^(TW_BITS * TW_LEVELS) ticks ahead (about 49 days, with 1 ms ticks)
+   is kept in the farthest slot of the top level, and placed again when
+   that slot is cascaded.
+
+   While any timer is set, the timerfd is armed (with TFD_TIMER_ABSTIME)
+   for the next tick that has work to do: the next nonempty slot of level
+   0, or the next cascade, whichever comes first. So a sparsely populated
+   wheel doesn't wake its caller at every tick. When the timerfd becomes
+   readable, the caller calls twProcess(), which processes all of the
+   ticks that have passed, and calls the expiry function with the expired
+   timers, in batches of up to TW_MAX_BATCH timers.
+
+   A timer is set (or cancelled) with a 'struct itimerspec', as for
+   timer_settime() and timerfd_settime(), so that itimerspecFromStr() can
+   be used to specify it. Times are rounded up to whole ticks, so a timer
+   never expires early.
+
+   A wheel is not thread-safe: its timers must be set, cancelled and
+   processed by one thread. A multithreaded program can instead give each
+   thread its own wheel; twThreadWheel() returns the calling thread's
+   wheel, creating it on the first call.
+*/
+#include <sys/timerfd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "timer_wheel.h"
+
+#define TW_BITS 8
+#define TW_SLOTS (1 << TW_BITS)
+#define TW_MASK (TW_SLOTS - 1)
+#define TW_LEVELS 4
+#define TW_MAX_DELTA ((1ULL << (TW_BITS * TW_LEVELS)) - 1)
+
+#define NSEC_PER_SEC 1000000000LL
+
+struct timerWheel {
+    int fd;                     /* timerfd */
+    int armed;                  /* Is 'fd' armed? */
+    unsigned long long armedTick;       /* If so, the tick it is armed for */
+    int processing;             /* Is twProcess() running? */
+    long tickNsec;
+    long long base;             /* CLOCK_MONOTONIC time of tick 0 (ns) */
+    unsigned long long now;     /* Next tick to be processed */
+    twExpireFunc fn;
+    void *arg;
+    struct twStats stats;
+    long l1Count[TW_SLOTS];     /* Timers added to each slot of level 1
+                                   since it was last emptied (cancelled
+                                   timers are not subtracted, so this is
+                                   an upper bound) */
+    int nbatch;
+    struct twTimer *batch[TW_MAX_BATCH];
+    struct twTimer slots[TW_LEVELS][TW_SLOTS];  /* List heads */
+};
+
+static __thread struct timerWheel *threadWheel = NULL;
+
+static long long
+monoNsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* Each slot is a circular doubly linked list, whose head is a dummy
+   timer */
+
+static void
+listInit(struct twTimer *head)
+{
+    head->next = head;
+    head->prev = head;
+}
+
+static void
+listAppend(struct twTimer *head, struct twTimer *t)
+{
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+static void
+listRemove(struct twTimer *t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = NULL;
+    t->prev = NULL;
+}
+
+/* Move the timers in the list 'from' to the list 'to' (whose previous
+   contents are ignored), leaving 'from' empty */
+
+static void
+listMove(struct twTimer *from, struct twTimer *to)
+{
+    if (from->next == from) {
+        listInit(to);
+        return;
+    }
+
+    to->next = from->next;
+    to->prev = from->prev;
+    to->next->prev = to;
+    to->prev->next = to;
+    listInit(from);
+}
+
+/* Link 't' into the slot for its expiry tick */
+
+static void
+insertTimer(struct timerWheel *tw, struct twTimer *t)
+{
+    unsigned long long delta, exp;
+    int level, idx;
+
+    if (t->expires < tw->now) {         /* Overdue; expire at next tick */
+        listAppend(&tw->slots[0][tw->now & TW_MASK], t);
+        return;
+    }
+
+    exp = t->expires;
+    delta = exp - tw->now;
+    if (delta > TW_MAX_DELTA) {
+        delta = TW_MAX_DELTA;
+        exp = tw->now + TW_MAX_DELTA;
+    }
+
+    for (level = 0; level < TW_LEVELS - 1; level++)
+        if (delta < 1ULL << (TW_BITS * (level + 1)))
+            break;
+
+    idx = (exp >> (TW_BITS * level)) & TW_MASK;
+    listAppend(&tw->slots[level][idx], t);
+    if (level == 1)
+        tw->l1Count[idx]++;
+}
+
+/* Return the first tick, starting at tw->now, at which there is work to
+   do: a nonempty slot in level 0, or a cascade */
+
+static unsigned long long
+nextTick(const struct timerWheel *tw)
+{
+    unsigned long long tick;
+    const struct twTimer *head;
+
+    for (tick = tw->now; ; tick++) {
+        head = &tw->slots[0][tick & TW_MASK];
+        if ((tick & TW_MASK) == 0 || head->next != head)
+            return tick;
+    }
+}
+
+/* Arm the timerfd to expire at the start of 'tick' */
+
+static int
+armAt(struct timerWheel *tw, unsigned long long tick)
+{
+    struct itimerspec its;
+    long long when;
+
+    when = tw->base + (long long) tick * tw->tickNsec;
+    its.it_value.tv_sec = when / NSEC_PER_SEC;
+    its.it_value.tv_nsec = when % NSEC_PER_SEC;
+    its.it_interval.tv_sec = 0;
+    its.it_interval.tv_nsec = 0;
+
+    if (timerfd_settime(tw->fd, TFD_TIMER_ABSTIME, &its, NULL) == -1)
+        return -1;
+
+    tw->armed = 1;
+    tw->armedTick = tick;
+    return 0;
+}
+
+/* Arm the timerfd for the next tick with work to do, or disarm it if no
+   timers are set */
+
+static int
+rearm(struct timerWheel *tw)
+{
+    struct itimerspec its;
+
+    if (tw->stats.active > 0)
+        return armAt(tw, nextTick(tw));
+
+    if (!tw->armed)
+        return 0;
+
+    memset(&its, 0, sizeof(its));
+    if (timerfd_settime(tw->fd, 0, &its, NULL) == -1)
+        return -1;
+    tw->armed = 0;
+    return 0;
+}
+
+/* Pass the timers collected in tw->batch to the expiry function */
+
+static void
+flushBatch(struct timerWheel *tw)
+{
+    int n;
+
+    if (tw->nbatch == 0)
+        return;
+
+    n = tw->nbatch;
+    tw->nbatch = 0;
+    tw->stats.batches++;
+    tw->fn(tw->batch, n, tw->arg);
+}
+
+/* Redistribute the timers in slot 'idx' of 'level' over the levels
+   below */
+
+static void
+cascade(struct timerWheel *tw, int level, int idx)
+{
+    struct twTimer work, *t;
+    long n;
+
+    listMove(&tw->slots[level][idx], &work);
+
+    for (n = 0; work.next != &work; n++) {
+        t = work.next;
+        listRemove(t);
+        insertTimer(tw, t);
+    }
+
+    tw->stats.cascaded += n;
+}
+
+/* Move some of the timers in the slot of level 1 that holds the timers
+   for the block of TW_SLOTS ticks numbered 'block' (the block after the
+   current one) to their slots in level 0, so that the cascade at the
+   start of that block (which would delay the expiry of that tick's
+   timers) has less to do. The work is paced so that the slot would be
+   emptied by the middle of the rest of the current block. A slot in
+   level 0 thus holds timers for the current block and for the next
+   block; runTick() leaves the latter in place. */
+
+static void
+cascadeAhead(struct timerWheel *tw, unsigned long long block)
+{
+    struct twTimer *head, *t;
+    long n, max;
+    int idx, ticksLeft;
+
+    idx = block & TW_MASK;
+    head = &tw->slots[1][idx];
+    if (head->next == head) {
+        tw->l1Count[idx] = 0;
+        return;
+    }
+
+    ticksLeft = TW_SLOTS - (tw->now & TW_MASK);
+    max = 2 * tw->l1Count[idx] / ticksLeft + 16;
+
+    for (n = 0; n < max && head->next != head; n++) {
+        t = head->next;
+        listRemove(t);
+        if ((t->expires >> TW_BITS) == block)
+            listAppend(&tw->slots[0][t->expires & TW_MASK], t);
+        else                            /* Can't happen, but be safe */
+            insertTimer(tw, t);
+    }
+
+    tw->l1Count[idx] = (n < tw->l1Count[idx]) ? tw->l1Count[idx] - n : 0;
+    tw->stats.cascaded += n;
+}
+
+/* Process tick tw->now: cascade, if level 0 has gone round, and then
+   expire the timers in the current slot of level 0 */
+
+static void
+runTick(struct timerWheel *tw)
+{
+    struct twTimer work, *t;
+    unsigned long long block;
+    int idx, level;
+
+    block = tw->now >> TW_BITS;
+    idx = tw->now & TW_MASK;
+
+    if (idx == 0) {
+
+        /* Cascade whatever cascadeAhead() did not move during the last
+           block, and then, if level 1 has gone round, the higher levels */
+
+        for (level = 1; level < TW_LEVELS; level++) {
+            idx = (tw->now >> (TW_BITS * level)) & TW_MASK;
+            cascade(tw, level, idx);
+            if (level == 1)
+                tw->l1Count[idx] = 0;
+            if (idx != 0)
+                break;
+        }
+        idx = 0;
+    }
+
+    /* Take the slot's timers onto a private list, so that timers that
+       the expiry function sets (and periodic timers that are overdue)
+       go to the next tick's slot, not this one. The expiry function may
+       cancel timers that are still on 'work'. */
+
+    listMove(&tw->slots[0][idx], &work);
+    tw->now++;
+    tw->stats.ticks++;
+
+    while (work.next != &work) {
+        t = work.next;
+        listRemove(t);
+
+        if (t->expires >= tw->now) {    /* Due in the next block */
+            listAppend(&tw->slots[0][idx], t);
+            continue;
+        }
+
+        if (t->interval > 0) {
+            t->expires += t->interval;
+            insertTimer(tw, t);
+        } else {
+            tw->stats.active--;
+        }
+
+        tw->stats.expired++;
+        tw->batch[tw->nbatch++] = t;
+        if (tw->nbatch == TW_MAX_BATCH)
+            flushBatch(tw);
+    }
+
+    flushBatch(tw);
+
+    cascadeAhead(tw, block + 1);
+}
+
+/* Create a wheel with ticks of 'tickNsec' nanoseconds, which calls 'fn'
+   with expired timers, passing it 'arg'. Returns a pointer to the wheel,
+   or NULL on error. */
+
+struct timerWheel *
+twCreate(long tickNsec, twExpireFunc fn, void *arg)
+{
+    struct timerWheel *tw;
+
+    if (tickNsec <= 0 || fn == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    tw = calloc(1, sizeof(struct timerWheel));
+    if (tw == NULL)
+        return NULL;
+
+    tw->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (tw->fd == -1) {
+        free(tw);
+        return NULL;
+    }
+
+    for (int level = 0; level < TW_LEVELS; level++)
+        for (int j = 0; j < TW_SLOTS; j++)
+            listInit(&tw->slots[level][j]);
+
+    tw->tickNsec = tickNsec;
+    tw->base = monoNsec();
+    tw->fn = fn;
+    tw->arg = arg;
+
+    return tw;
+}
+
+/* Return the calling thread's wheel, creating it (with twCreate()) on the
+   first call; the arguments are ignored on later calls. Returns NULL if
+   the wheel can't be created. */
+
+struct timerWheel *
+twThreadWheel(long tickNsec, twExpireFunc fn, void *arg)
+{
+    if (threadWheel == NULL)
+        threadWheel = twCreate(tickNsec, fn, arg);
+    return threadWheel;
+}
+
+/* Destroy a wheel. Any timers that are still set are simply forgotten
+   (they belong to the caller). */
+
+void
+twDestroy(struct timerWheel *tw)
+{
+    if (tw == threadWheel)
+        threadWheel = NULL;
+
+    close(tw->fd);
+    free(tw);
+}
+
+/* Return the wheel's timerfd, which becomes readable when twProcess()
+   should be called */
+
+int
+twFd(const struct timerWheel *tw)
+{
+    return tw->fd;
+}
+
+void
+twInitTimer(struct twTimer *t, void *data)
+{
+    t->next = NULL;
+    t->prev = NULL;
+    t->expires = 0;
+    t->interval = 0;
+    t->data = data;
+}
+
+int
+twIsActive(const struct twTimer *t)
+{
+    return t->next != NULL;
+}
+
+/* Set timer 't' to expire after its->it_value, and then (if
+   its->it_interval is nonzero) periodically, as for timer_settime(). If
+   the timer is already set, its previous setting is replaced; if
+   its->it_value is zero, the timer is cancelled. Returns 0 on success,
+   or -1 on error. */
+
+int
+twSetTime(struct timerWheel *tw, struct twTimer *t,
+          const struct itimerspec *its)
+{
+    long long value, interval, now;
+    unsigned long long tick;
+
+    if (its->it_value.tv_sec < 0 || its->it_value.tv_nsec < 0 ||
+            its->it_value.tv_nsec >= NSEC_PER_SEC ||
+            its->it_interval.tv_sec < 0 || its->it_interval.tv_nsec < 0 ||
+            its->it_interval.tv_nsec >= NSEC_PER_SEC) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    value = its->it_value.tv_sec * NSEC_PER_SEC + its->it_value.tv_nsec;
+    interval = its->it_interval.tv_sec * NSEC_PER_SEC +
+               its->it_interval.tv_nsec;
+
+    if (twIsActive(t)) {
+        listRemove(t);
+        tw->stats.active--;
+        if (value == 0)
+            tw->stats.cancelled++;
+    }
+
+    if (value == 0)
+        return 0;
+
+    now = monoNsec() - tw->base;
+
+    /* If no timers are set, the wheel may not have been processed for a
+       long time; skip the ticks that have passed */
+
+    if (tw->stats.active == 0 && !tw->processing &&
+            tw->now < (unsigned long long) (now / tw->tickNsec))
+        tw->now = now / tw->tickNsec;
+
+    t->expires = (now + value + tw->tickNsec - 1) / tw->tickNsec;
+    t->interval = (interval + tw->tickNsec - 1) / tw->tickNsec;
+
+    insertTimer(tw, t);
+    tw->stats.active++;
+    tw->stats.added++;
+
+    /* Arm the timerfd earlier, if necessary (only a timer in level 0 can
+       expire before the tick for which the timerfd is armed, and then
+       nextTick() finds it). While twProcess() is running, it rearms the
+       timerfd when it has done. */
+
+    tick = (t->expires > tw->now) ? t->expires : tw->now;
+    if (!tw->processing && (!tw->armed || tick < tw->armedTick))
+        return armAt(tw, nextTick(tw));
+
+    return 0;
+}
+
+/* Cancel timer 't', if it is set */
+
+void
+twCancel(struct timerWheel *tw, struct twTimer *t)
+{
+    if (!twIsActive(t))
+        return;
+
+    listRemove(t);
+    tw->stats.active--;
+    tw->stats.cancelled++;
+
+    /* The timerfd is left armed; if it expires when no timers are due,
+       twProcess() just finds nothing to do */
+}
+
+/* Return the time (on the CLOCK_MONOTONIC clock, in nanoseconds) at which
+   timer 't' expires, or next expires. For a periodic timer that is passed
+   to the expiry function, this is already the time of its next expiry. */
+
+long long
+twExpiryNsec(const struct timerWheel *tw, const struct twTimer *t)
+{
+    return tw->base + (long long) t->expires * tw->tickNsec;
+}
+
+/* Process all of the ticks that have passed, calling the expiry function
+   for the timers that have expired, and rearm the timerfd. The expiry
+   function must not call twProcess(). Returns the number of expirations,
+   or -1 on error. */
+
+int
+twProcess(struct timerWheel *tw)
+{
+    uint64_t numExp;
+    unsigned long long target, tick;
+    long long expired;
+
+    if (read(tw->fd, &numExp, sizeof(numExp)) == -1) {
+        if (errno != EAGAIN)
+            return -1;
+    } else {
+        tw->armed = 0;                  /* The (one-shot) timer expired */
+    }
+
+    target = (monoNsec() - tw->base) / tw->tickNsec;
+    expired = tw->stats.expired;
+    tw->processing = 1;
+
+    while (tw->now <= target) {
+        if (tw->stats.active == 0) {
+            tw->now = target + 1;
+            break;
+        }
+
+        /* The ticks before nextTick() have nothing to do */
+
+        tick = nextTick(tw);
+        if (tick > target) {
+            tw->now = target + 1;
+            break;
+        }
+        tw->now = tick;
+        runTick(tw);
+    }
+
+    tw->processing = 0;
+
+    if (rearm(tw) == -1)
+        return -1;
+
+    return tw->stats.expired - expired;
+}
+
+void
+twGetStats(const struct timerWheel *tw, struct twStats *stats)
+{
+    *stats = tw->stats;
+}
@@ -0,0 +1,78 @@
+/*************************************************************************\
+*                  Copyright (C) Michael Kerrisk, 2020.                   *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU Lesser General Public License as published   *
+* by the Free Software Foundation, either version 3 or (at your option)   *
+* any later version. This program is distributed without any warranty.    *
+* See the files COPYING.lgpl-v3 and COPYING.gpl-v3 for details.           *
+\*************************************************************************/
+
+/* timer_wheel.h
+
+   Header file for timer_wheel.c.
+*/
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H           /* Prevent accidental double inclusion */
+
+#include <time.h>
+
+#define TW_MAX_BATCH 1024       /* Most timers passed to one call of the
+                                   expiry function */
+
+/* A timer. The caller allocates it (typically inside some larger
+   structure, such as one describing a connection), and initializes it
+   with twInitTimer(); the wheel only links it into its lists, so adding
+   and cancelling a timer never allocates memory. */
+
+struct twTimer {
+    struct twTimer *next;       /* In a wheel slot; NULL if not active */
+    struct twTimer *prev;
+    unsigned long long expires; /* Tick at which the timer expires */
+    unsigned long long interval;        /* Ticks; 0 for a one-shot timer */
+    void *data;                 /* For use by the caller */
+};
+
+/* Called with up to TW_MAX_BATCH timers that expired in the same tick.
+   By the time of the call, one-shot timers are no longer active (and
+   so can be set again), and periodic timers have been set to expire
+   again (and can be cancelled). */
+
+typedef void (*twExpireFunc)(struct twTimer *expired[], int n, void *arg);
+
+struct timerWheel;              /* Opaque */
+
+struct twStats {
+    long long active;           /* Timers now set */
+    long long added;            /* Calls to twSetTime() that set a timer */
+    long long cancelled;        /* Timers cancelled before expiring */
+    long long expired;          /* Expirations */
+    long long cascaded;         /* Timers moved to a lower level */
+    long long ticks;            /* Ticks processed */
+    long long batches;          /* Calls to the expiry function */
+};
+
+struct timerWheel *twCreate(long tickNsec, twExpireFunc fn, void *arg);
+
+struct timerWheel *twThreadWheel(long tickNsec, twExpireFunc fn, void *arg);
+
+void twDestroy(struct timerWheel *tw);
+
+int twFd(const struct timerWheel *tw);
+
+void twInitTimer(struct twTimer *t, void *data);
+
+int twSetTime(struct timerWheel *tw, struct twTimer *t,
+              const struct itimerspec *its);
+
+void twCancel(struct timerWheel *tw, struct twTimer *t);
+
+int twIsActive(const struct twTimer *t);
+
+long long twExpiryNsec(const struct timerWheel *tw, const struct twTimer *t);
+
+int twProcess(struct timerWheel *tw);
+
+void twGetStats(const struct timerWheel *tw, struct twStats *stats);
+
+#endif
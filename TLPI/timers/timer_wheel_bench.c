@@ -0,0 +1,413 @@
+/*************************************************************************\
+*                  Copyright (C) Michael Kerrisk, 2020.                   *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU General Public License as published by the   *
+* Free Software Foundation, either version 3 or (at your option) any      *
+* later version. This program is distributed without any warranty.  See   *
+* the file COPYING.gpl-v3 for details.                                    *
+\*************************************************************************/
+
+/* Supplementary program for Chapter 23 */
+
+/* timer_wheel_bench.c
+
+   Measure the performance of the timer wheel in timer_wheel.c with a
+   large number of timers.
+
+   Usage: timer_wheel_bench [-n ntimers] [-j nthreads] [-r tick]
+                            [-t value[:interval]] [-d secs]
+
+   The program sets 'ntimers' (default: 1000000) timers, each to expire
+   at a random time between 0 and 'value' (default: 2 seconds) from now,
+   and (if 'interval' is given) periodically thereafter. It then cancels
+   all of the timers, and sets them again (with new random times), in
+   order to measure the rates at which timers can be set and cancelled.
+   Finally, it waits (with poll() on the wheel's timerfd) for the timers
+   to expire: until all have expired, or, for periodic timers, for 'secs'
+   seconds (default: 5).
+
+   'tick' is the length of a wheel tick (default: 1 millisecond). 'tick'
+   and the timer setting are given in the form accepted by
+   itimerspecFromStr(), "secs[/nsecs][:secs[/nsecs]]"; for example, "-r
+   0/100000" for a tick of 100 microseconds, or "-t 30:30" for timers
+   that first expire within 30 seconds, and every 30 seconds after that.
+
+   With -j, the timers are divided among 'nthreads' threads, each of which
+   uses its own wheel (obtained with twThreadWheel()). Rates are totals
+   over all threads.
+
+   For each expiration, the program measures how late the expiry function
+   was called, relative to the time at which the timer expired (that is,
+   the end of the tick in which the timer was due), and displays the
+   distribution of these times. Because of the rounding to ticks, the
+   expiry function is called up to one tick later than requested.
+*/
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include "itimerspec_from_str.h"
+#include "timer_wheel.h"
+#include "tlpi_hdr.h"
+
+struct threadArg {
+    pthread_t tid;
+    long ntimers;
+    struct twTimer *timers;
+    unsigned long long seed;
+
+    long long *late;            /* Lateness of each expiration (ns); once
+                                   'maxLate' samples are taken, the oldest
+                                   are overwritten */
+    long nlate;
+    long maxLate;
+
+    double addSecs;             /* Times taken by each phase */
+    double cancelSecs;
+    double readdSecs;
+    double expireSecs;
+    double busySecs;            /* Time spent in twProcess() */
+    struct twStats stats;
+};
+
+static long tickNsec;
+static struct itimerspec timerSpec;
+static double duration;
+static pthread_barrier_t barrier;
+
+static double
+timeNow(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        errExit("clock_gettime");
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long long
+nsecNow(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        errExit("clock_gettime");
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static unsigned long long
+nextRandom(unsigned long long *seed)    /* xorshift64 */
+{
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 7;
+    *seed ^= *seed << 17;
+    return *seed;
+}
+
+/* Set 'its' to expire at a random time in (0, timerSpec.it_value] */
+
+static void
+randomSpec(struct threadArg *ta, struct itimerspec *its)
+{
+    long long span, value;
+
+    span = timerSpec.it_value.tv_sec * 1000000000LL +
+           timerSpec.it_value.tv_nsec;
+    value = 1 + nextRandom(&ta->seed) % span;
+
+    its->it_value.tv_sec = value / 1000000000;
+    its->it_value.tv_nsec = value % 1000000000;
+    its->it_interval = timerSpec.it_interval;
+}
+
+/* Expiry function for the wheel; records how late each timer is */
+
+static void
+expireFunc(struct twTimer *expired[], int n, void *arg)
+{
+    struct threadArg *ta = arg;
+    struct timerWheel *tw;
+    long long now, due;
+
+    tw = twThreadWheel(0, NULL, NULL);
+    now = nsecNow();
+
+    for (int j = 0; j < n; j++) {
+        due = twExpiryNsec(tw, expired[j]);
+        if (expired[j]->interval > 0)   /* Already advanced */
+            due -= (long long) expired[j]->interval * tickNsec;
+        ta->late[ta->nlate++ % ta->maxLate] = now - due;
+    }
+}
+
+/* Wait up to 'timeout' milliseconds for the wheel's timerfd to become
+   readable, and if it does, process the wheel. The time spent in
+   twProcess() is added to ta->busySecs, and returned. */
+
+static double
+serviceWheel(struct threadArg *ta, struct timerWheel *tw, int timeout)
+{
+    struct pollfd pfd;
+    double t;
+    int ready;
+
+    pfd.fd = twFd(tw);
+    pfd.events = POLLIN;
+
+    ready = poll(&pfd, 1, timeout);
+    if (ready == -1)
+        errExit("poll");
+    if (ready == 0)
+        return 0;
+
+    t = timeNow();
+    if (twProcess(tw) == -1)
+        errExit("twProcess");
+    t = timeNow() - t;
+
+    ta->busySecs += t;
+    return t;
+}
+
+static void *
+threadFunc(void *arg)
+{
+    struct threadArg *ta = arg;
+    struct timerWheel *tw;
+    struct itimerspec its;
+    double start, end, t, busy;
+    int timeout;
+
+    tw = twThreadWheel(tickNsec, expireFunc, ta);
+    if (tw == NULL)
+        errExit("twThreadWheel");
+
+    for (long j = 0; j < ta->ntimers; j++)
+        twInitTimer(&ta->timers[j], NULL);
+
+    /* Set all timers */
+
+    pthread_barrier_wait(&barrier);
+    start = timeNow();
+    for (long j = 0; j < ta->ntimers; j++) {
+        randomSpec(ta, &its);
+        if (twSetTime(tw, &ta->timers[j], &its) == -1)
+            errExit("twSetTime");
+    }
+    ta->addSecs = timeNow() - start;
+
+    /* Cancel them all */
+
+    pthread_barrier_wait(&barrier);
+    start = timeNow();
+    for (long j = 0; j < ta->ntimers; j++)
+        twCancel(tw, &ta->timers[j]);
+    ta->cancelSecs = timeNow() - start;
+
+    /* And set them again. Some of the timers expire while this is going
+       on, so, as an event loop would, we process the wheel from time to
+       time (and don't count the time taken to do so). */
+
+    pthread_barrier_wait(&barrier);
+    start = timeNow();
+    busy = 0;
+    for (long j = 0; j < ta->ntimers; j++) {
+        randomSpec(ta, &its);
+        if (twSetTime(tw, &ta->timers[j], &its) == -1)
+            errExit("twSetTime");
+        if (j % 1024 == 1023)
+            busy += serviceWheel(ta, tw, 0);
+    }
+    ta->readdSecs = timeNow() - start - busy;
+
+    /* Wait for the timers to expire */
+
+    start = timeNow();
+    end = start + duration;
+
+    for (;;) {
+        twGetStats(tw, &ta->stats);
+        if (ta->stats.active == 0)
+            break;
+
+        if (timerSpec.it_interval.tv_sec != 0 ||
+                timerSpec.it_interval.tv_nsec != 0) {
+            t = timeNow();
+            if (t >= end)
+                break;
+            timeout = (end - t) * 1000 + 1;
+        } else {
+            timeout = -1;
+        }
+
+        serviceWheel(ta, tw, timeout);
+    }
+    ta->expireSecs = timeNow() - start;
+
+    twGetStats(tw, &ta->stats);
+    twDestroy(tw);
+    return NULL;
+}
+
+static int
+cmpLongLong(const void *a, const void *b)
+{
+    long long x = *(const long long *) a, y = *(const long long *) b;
+
+    return (x > y) - (x < y);
+}
+
+static void
+usageError(const char *progName)
+{
+    fprintf(stderr, "Usage: %s [-n ntimers] [-j nthreads] [-r tick] "
+            "[-t value[:interval]] [-d secs]\n", progName);
+    fprintf(stderr, "\t-n Number of timers (default: 1000000)\n");
+    fprintf(stderr, "\t-j Number of threads, each with its own wheel "
+            "(default: 1)\n");
+    fprintf(stderr, "\t-r Length of a tick (default: 0/1000000)\n");
+    fprintf(stderr, "\t-t Timers expire randomly within 'value', then "
+            "every 'interval'\n\t   (default: 2)\n");
+    fprintf(stderr, "\t-d Run periodic timers for 'secs' seconds "
+            "(default: 5)\n");
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct threadArg *targs;
+    struct itimerspec tickSpec;
+    struct twStats total;
+    long ntimers, nlate, n;
+    long long *late;
+    int nthreads, opt, s;
+    double addSecs, cancelSecs, readdSecs, expireSecs, busySecs;
+
+    ntimers = 1000000;
+    nthreads = 1;
+    tickNsec = 1000000;
+    duration = 5;
+    timerSpec.it_value.tv_sec = 2;
+
+    while ((opt = getopt(argc, argv, "n:j:r:t:d:")) != -1) {
+        switch (opt) {
+        case 'n':
+            ntimers = getLong(optarg, GN_GT_0, "ntimers");
+            break;
+        case 'j':
+            nthreads = getInt(optarg, GN_GT_0, "nthreads");
+            break;
+        case 'r':
+            itimerspecFromStr(optarg, &tickSpec);
+            tickNsec = tickSpec.it_value.tv_sec * 1000000000L +
+                       tickSpec.it_value.tv_nsec;
+            if (tickNsec <= 0)
+                cmdLineErr("Bad tick: %s\n", optarg);
+            break;
+        case 't':
+            itimerspecFromStr(optarg, &timerSpec);
+            if (timerSpec.it_value.tv_sec == 0 &&
+                    timerSpec.it_value.tv_nsec == 0)
+                cmdLineErr("Bad timer setting: %s\n", optarg);
+            break;
+        case 'd':
+            duration = getInt(optarg, GN_GT_0, "secs");
+            break;
+        default:
+            usageError(argv[0]);
+        }
+    }
+
+    if (optind < argc)
+        usageError(argv[0]);
+
+    targs = calloc(nthreads, sizeof(struct threadArg));
+    if (targs == NULL)
+        errExit("calloc");
+
+    s = pthread_barrier_init(&barrier, NULL, nthreads);
+    if (s != 0)
+        errExitEN(s, "pthread_barrier_init");
+
+    for (int j = 0; j < nthreads; j++) {
+        targs[j].ntimers = ntimers / nthreads +
+                           (j < ntimers % nthreads ? 1 : 0);
+        targs[j].timers = calloc(targs[j].ntimers, sizeof(struct twTimer));
+        targs[j].maxLate = (targs[j].ntimers > 0) ? targs[j].ntimers : 1;
+        targs[j].late = calloc(targs[j].maxLate, sizeof(long long));
+        if (targs[j].timers == NULL || targs[j].late == NULL)
+            errExit("calloc");
+        targs[j].seed = 0x9e3779b97f4a7c15ULL * (j + 1);
+
+        s = pthread_create(&targs[j].tid, NULL, threadFunc, &targs[j]);
+        if (s != 0)
+            errExitEN(s, "pthread_create");
+    }
+
+    /* Gather the results. Each phase's rate is computed using the time
+       taken by the slowest thread. */
+
+    memset(&total, 0, sizeof(total));
+    addSecs = cancelSecs = readdSecs = expireSecs = busySecs = 0;
+    nlate = 0;
+    for (int j = 0; j < nthreads; j++) {
+        s = pthread_join(targs[j].tid, NULL);
+        if (s != 0)
+            errExitEN(s, "pthread_join");
+
+        addSecs = max(addSecs, targs[j].addSecs);
+        cancelSecs = max(cancelSecs, targs[j].cancelSecs);
+        readdSecs = max(readdSecs, targs[j].readdSecs);
+        expireSecs = max(expireSecs, targs[j].expireSecs);
+        busySecs = max(busySecs, targs[j].busySecs);
+        total.added += targs[j].stats.added;
+        total.cancelled += targs[j].stats.cancelled;
+        total.expired += targs[j].stats.expired;
+        total.cascaded += targs[j].stats.cascaded;
+        total.ticks += targs[j].stats.ticks;
+        total.batches += targs[j].stats.batches;
+        nlate += min(targs[j].nlate, targs[j].maxLate);
+    }
+
+    printf("%ld timers, %d thread(s); tick %ld ns\n",
+           ntimers, nthreads, tickNsec);
+    printf("%-8s %10s %9s %12s\n", "phase", "ops", "secs", "ops/sec");
+    printf("%-8s %10ld %9.3f %12.0f\n", "set", ntimers, addSecs,
+           ntimers / addSecs);
+    printf("%-8s %10ld %9.3f %12.0f\n", "cancel", ntimers, cancelSecs,
+           ntimers / cancelSecs);
+    printf("%-8s %10ld %9.3f %12.0f\n", "reset", ntimers, readdSecs,
+           ntimers / readdSecs);
+    printf("%-8s %10lld %9.3f %12.0f   (%.0f per busy sec)\n", "expire",
+           total.expired, expireSecs, total.expired / expireSecs,
+           (busySecs > 0) ? total.expired / busySecs : 0.0);
+    printf("Ticks processed: %lld; expiry batches: %lld (%.1f timers "
+           "per batch); cascades: %lld\n", total.ticks, total.batches,
+           (total.batches > 0) ? (double) total.expired / total.batches :
+           0.0, total.cascaded);
+
+    /* Display the distribution of lateness */
+
+    late = malloc(max(nlate, 1) * sizeof(long long));
+    if (late == NULL)
+        errExit("malloc");
+    n = 0;
+    for (int j = 0; j < nthreads; j++) {
+        long cnt = min(targs[j].nlate, targs[j].maxLate);
+
+        memcpy(late + n, targs[j].late, cnt * sizeof(long long));
+        n += cnt;
+    }
+
+    if (n > 0) {
+        qsort(late, n, sizeof(long long), cmpLongLong);
+        printf("Lateness (usecs): min %.1f; median %.1f; 99%% %.1f; "
+               "99.9%% %.1f; max %.1f\n", late[0] / 1e3, late[n / 2] / 1e3,
+               late[n * 99 / 100] / 1e3, late[n * 999 / 1000] / 1e3,
+               late[n - 1] / 1e3);
+    }
+
+    exit(EXIT_SUCCESS);
+}